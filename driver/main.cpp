@@ -9,10 +9,13 @@
 #endif
 
 #include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
 
 #include <nod/DiscBase.hpp>
 #include <nod/DiscGCN.hpp>
+#include <nod/DiscStore.hpp>
 #include <nod/DiscWii.hpp>
+#include <nod/WBFS.hpp>
 #include <nod/nod.hpp>
 #include "../lib/Util.hpp"
 
@@ -24,9 +27,52 @@ static void printHelp() {
     "  nodtool makewii [options] <fsroot-in> [<image-out>]\n"
     "  nodtool mergegcn [options] <fsroot-in> <image-in> [<image-out>]\n"
     "  nodtool mergewii [options] <fsroot-in> <image-in> [<image-out>]\n"
+    "  nodtool replace <image> <fst-path> <file-in>\n"
+    "  nodtool convert [options] <image-in> <image-out>\n"
+    "  nodtool wbfslist <wbfs-in>\n"
+    "  nodtool wbfsadd <wbfs> <image-in>...\n"
+    "  nodtool wbfsremove <wbfs> <game-id>...\n"
+    "  nodtool storeadd <store-dir> <image-in>...\n"
+    "  nodtool storelist <store-dir>\n"
+    "  nodtool storeget <store-dir> <name> <image-out>\n"
     "Options:\n"
     "  -f         Force (extract only)\n"
-    "  -v         Verbose details (extract only).\n");
+    "  -v         Verbose details (extract only).\n"
+    "  -i         Incremental rebuild of an existing image (makewii/mergewii only).\n"
+    "  -j <n>     Number of threads writing the image (make/merge only, default: all cores).\n"
+    "  -d         Store byte-identical files once (make/merge only).\n"
+    "  -p <file>  Place files in the order of an access profile (make/merge only).\n"
+    "  -n         Dry run: print the planned layout without writing (make/merge only).\n"
+    "  -l         Keep the source layout and copy unchanged groups verbatim (mergewii only).\n"
+    "  -u         Lay files out upward from the FST so the image is written front to back\n"
+    "             instead of from the end of the disc (makegcn/mergegcn only).\n"
+    "  -s         Stream the image front to back, e.g. into a pipe (make/merge only).\n"
+    "             Implied when <image-out> is '-' (stdout).\n"
+    "  -c         Write a CISO image that leaves unused blocks out (make/merge only).\n"
+    "  -w         Write a WBFS image that stores only the written blocks (makewii/mergewii/convert).\n"
+    "  -e         Write Wii VC NFS files; <image-out> names the first, e.g. content/hif_000000.nfs\n"
+    "             (makewii/mergewii only).\n"
+    "  -z <MiB>   Split ISO or WBFS output into pieces of <MiB> MiB, e.g. 4095 for FAT32 (make/merge/convert).\n"
+    "             <image-out> names the first piece: game.part0.iso or game.wbfs.\n"
+    "  -r <file>  Apply extra DOL/REL signature patches from a rules file (make/merge/replace).\n"
+    "             One rule per line: <name> <signature-hex> <replacement-hex>, '\?\?' keeps a byte.\n");
+}
+
+static void printPlan(const nod::PartitionBuildPlan& plan) {
+  fmt::print("DOL  0x{:09X} 0x{:08X}\n", plan.m_dolOffset, plan.m_dolSize);
+  fmt::print("FST  0x{:09X} 0x{:08X}\n", plan.m_fstOffset, plan.m_fstSize);
+  fmt::print("User 0x{:09X} 0x{:09X}\n", plan.m_userStart, plan.m_userEnd);
+  if (plan.m_groupCount)
+    fmt::print("Groups {}\n", plan.m_groupCount);
+  for (const nod::PartitionBuildPlan::File& f : plan.m_files)
+    fmt::print("  0x{:09X} 0x{:08X} {}\n", f.m_offset, f.m_dataSize, f.m_name);
+  if (plan.m_profiledFiles)
+    fmt::print("Profile-ordered {} files\n", plan.m_profiledFiles);
+  if (plan.m_dedupFiles)
+    fmt::print("Deduplicated {} files ({} bytes)\n", plan.m_dedupFiles, plan.m_dedupBytes);
+  if (plan.m_dirtyGroups)
+    fmt::print("Rebuilt groups {} of {}\n", plan.m_dirtyGroups, plan.m_groupCount);
+  fmt::print("Required size: {} bytes\n", plan.m_discSize);
 }
 
 #if _MSC_VER
@@ -42,6 +88,19 @@ int main(int argc, char* argv[]) {
   int argidx = 1;
   std::string errand;
   bool verbose = false;
+  bool incremental = false;
+  bool dryRun = false;
+  bool dedup = false;
+  bool preserveLayout = false;
+  bool streaming = false;
+  bool ciso = false;
+  bool wbfs = false;
+  bool nfs = false;
+  bool sequentialLayout = false;
+  std::string profilePath;
+  std::string rulesPath;
+  size_t threadCount = 0;
+  uint64_t splitSize = 0;
   nod::ExtractionContext ctx = {true, [&](std::string_view str, float c) {
                                   if (verbose)
                                     fmt::print(stderr, "Current node: {}, Extraction {:g}% Complete\n", str,
@@ -56,6 +115,58 @@ int main(int argc, char* argv[]) {
       verbose = true;
       ++argidx;
       continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-i")) {
+      incremental = true;
+      ++argidx;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-j") && argidx + 1 < argc) {
+      threadCount = strtoul(argv[argidx + 1], nullptr, 10);
+      argidx += 2;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-d")) {
+      dedup = true;
+      ++argidx;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-z") && argidx + 1 < argc) {
+      splitSize = strtoull(argv[argidx + 1], nullptr, 10) << 20;
+      argidx += 2;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-p") && argidx + 1 < argc) {
+      profilePath = argv[argidx + 1];
+      argidx += 2;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-r") && argidx + 1 < argc) {
+      rulesPath = argv[argidx + 1];
+      argidx += 2;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-l")) {
+      preserveLayout = true;
+      ++argidx;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-u")) {
+      sequentialLayout = true;
+      ++argidx;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-s")) {
+      streaming = true;
+      ++argidx;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-c")) {
+      ciso = true;
+      ++argidx;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-w")) {
+      wbfs = true;
+      ++argidx;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-e")) {
+      nfs = true;
+      ++argidx;
+      continue;
+    } else if (!nod::StrCaseCmp(argv[argidx], "-n")) {
+      dryRun = true;
+      ++argidx;
+      continue;
     } else if (errand.empty()) {
       errand = argv[argidx];
       ++argidx;
@@ -70,13 +181,23 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  /* Progress and logging move to stderr when the image itself goes to stdout */
+  FILE* progOut = stdout;
+  auto streamTo = [&](const std::string& imageOut) {
+    if (imageOut != "-")
+      return;
+    streaming = true;
+    progOut = stderr;
+    spdlog::set_default_logger(spdlog::stderr_color_mt("nodtool"));
+  };
+
   auto progFunc = [&](float prog, std::string_view name, size_t bytes) {
-    fmt::print("\r                                                                      ");
+    fmt::print(progOut, "\r                                                                      ");
     if (bytes != SIZE_MAX)
-      fmt::print("\r{:g}% {} {} B", prog * 100.f, name, bytes);
+      fmt::print(progOut, "\r{:g}% {} {} B", prog * 100.f, name, bytes);
     else
-      fmt::print("\r{:g}% {}", prog * 100.f, name);
-    fflush(stdout);
+      fmt::print(progOut, "\r{:g}% {}", prog * 100.f, name);
+    fflush(progOut);
   };
 
   if (errand == "extract") {
@@ -106,11 +227,11 @@ int main(int argc, char* argv[]) {
 
     nod::Mkdir(dirOut.c_str(), 0755);
 
-    nod::IPartition* dataPart = disc->getDataPartition();
-    if (!dataPart)
+    if (!disc->getDataPartition())
       return 1;
 
-    if (!dataPart->extractToDirectory(dirOut, ctx))
+    /* Wii update and channel partitions land next to DATA so that makewii can rebuild all of them */
+    if (!disc->extractToDirectory(dirOut, ctx))
       return 1;
   } else if (errand == "makegcn") {
     std::string fsrootIn;
@@ -131,6 +252,7 @@ int main(int argc, char* argv[]) {
     }
     if (imageOut.empty())
       imageOut = fsrootIn + ".gcm";
+    streamTo(imageOut);
 
     /* Pre-validate path */
     nod::Sstat theStat;
@@ -139,15 +261,33 @@ int main(int argc, char* argv[]) {
       return 1;
     }
 
-    if (!nod::DiscBuilderGCN::CalculateTotalSizeRequired(fsrootIn))
-      return 1;
-
     nod::EBuildResult ret;
 
     nod::DiscBuilderGCN b(imageOut, progFunc);
+    b.setLayout(sequentialLayout ? nod::GCNLayout::Sequential : nod::GCNLayout::EndOfDisc);
+    b.setDeduplicate(dedup);
+    if (!profilePath.empty() && !b.loadAccessProfile(profilePath))
+      return 1;
+    if (!rulesPath.empty() && !b.loadPatchRules(rulesPath))
+      return 1;
+    if (dryRun) {
+      const nod::PartitionBuildPlan* plan = b.planFromDirectory(fsrootIn);
+      if (!plan)
+        return 1;
+      printPlan(*plan);
+      return 0;
+    }
+    /* Sized with the settings above, e.g. deduplication can make a tree fit */
+    if (!b.calculateTotalSizeRequired(fsrootIn))
+      return 1;
+    b.setThreadCount(threadCount);
+    b.setStreaming(streaming);
+    b.setCISO(ciso);
+    if (splitSize && !b.setSplitSize(splitSize))
+      return 1;
     ret = b.buildFromDirectory(fsrootIn);
 
-    fmt::print("\n");
+    fmt::print(progOut, "\n");
     if (ret != nod::EBuildResult::Success)
       return 1;
   } else if (errand == "makewii") {
@@ -169,6 +309,7 @@ int main(int argc, char* argv[]) {
     }
     if (imageOut.empty())
       imageOut = fsrootIn + ".iso";
+    streamTo(imageOut);
 
     /* Pre-validate path */
     nod::Sstat theStat;
@@ -177,16 +318,41 @@ int main(int argc, char* argv[]) {
       return 1;
     }
 
-    bool dual = false;
-    if (!nod::DiscBuilderWii::CalculateTotalSizeRequired(fsrootIn, dual))
-      return 1;
-
     nod::EBuildResult ret;
 
-    nod::DiscBuilderWii b(imageOut, dual, progFunc);
+    nod::DiscBuilderWii b(imageOut, false, progFunc);
+    b.setDeduplicate(dedup);
+    if (!profilePath.empty() && !b.loadAccessProfile(profilePath))
+      return 1;
+    if (!rulesPath.empty() && !b.loadPatchRules(rulesPath))
+      return 1;
+    if (dryRun) {
+      const nod::PartitionBuildPlan* plan = b.planFromDirectory(fsrootIn);
+      if (!plan)
+        return 1;
+      printPlan(*plan);
+      return 0;
+    }
+    /* Sized with the settings above, e.g. deduplication can keep a tree on one layer */
+    bool dual = false;
+    if (!b.calculateTotalSizeRequired(fsrootIn, dual))
+      return 1;
+    b.setDualLayer(dual);
+    b.setThreadCount(threadCount);
+    b.setStreaming(streaming);
+    b.setCISO(ciso);
+    if (splitSize && !b.setSplitSize(splitSize))
+      return 1;
+    b.setWBFS(wbfs);
+    b.setNFS(nfs);
+    /* A plain build rewrites the image, so a cache left by an earlier -i build goes stale */
+    if (incremental)
+      b.setGroupCachePath(imageOut + ".gcache");
+    else
+      std::remove((imageOut + ".gcache").c_str());
     ret = b.buildFromDirectory(fsrootIn);
 
-    fmt::print("\n");
+    fmt::print(progOut, "\n");
     if (ret != nod::EBuildResult::Success)
       return 1;
   } else if (errand == "mergegcn") {
@@ -213,6 +379,7 @@ int main(int argc, char* argv[]) {
     }
     if (imageOut.empty())
       imageOut = fsrootIn + ".gcm";
+    streamTo(imageOut);
 
     /* Pre-validate paths */
     nod::Sstat theStat;
@@ -236,15 +403,33 @@ int main(int argc, char* argv[]) {
       return 1;
     }
 
-    if (!nod::DiscMergerGCN::CalculateTotalSizeRequired(static_cast<nod::DiscGCN&>(*disc), fsrootIn))
-      return 1;
-
     nod::EBuildResult ret;
 
     nod::DiscMergerGCN b(imageOut, static_cast<nod::DiscGCN&>(*disc), progFunc);
+    b.setLayout(sequentialLayout ? nod::GCNLayout::Sequential : nod::GCNLayout::EndOfDisc);
+    b.setDeduplicate(dedup);
+    if (!profilePath.empty() && !b.loadAccessProfile(profilePath))
+      return 1;
+    if (!rulesPath.empty() && !b.loadPatchRules(rulesPath))
+      return 1;
+    if (dryRun) {
+      const nod::PartitionBuildPlan* plan = b.planFromDirectory(fsrootIn);
+      if (!plan)
+        return 1;
+      printPlan(*plan);
+      return 0;
+    }
+    /* Sized with the settings above, e.g. deduplication can make a tree fit */
+    if (!b.calculateTotalSizeRequired(fsrootIn))
+      return 1;
+    b.setThreadCount(threadCount);
+    b.setStreaming(streaming);
+    b.setCISO(ciso);
+    if (splitSize && !b.setSplitSize(splitSize))
+      return 1;
     ret = b.mergeFromDirectory(fsrootIn);
 
-    fmt::print("\n");
+    fmt::print(progOut, "\n");
     if (ret != nod::EBuildResult::Success)
       return 1;
   } else if (errand == "mergewii") {
@@ -271,6 +456,7 @@ int main(int argc, char* argv[]) {
     }
     if (imageOut.empty())
       imageOut = fsrootIn + ".iso";
+    streamTo(imageOut);
 
     /* Pre-validate paths */
     nod::Sstat theStat;
@@ -294,18 +480,174 @@ int main(int argc, char* argv[]) {
       return 1;
     }
 
-    bool dual = false;
-    if (!nod::DiscMergerWii::CalculateTotalSizeRequired(static_cast<nod::DiscWii&>(*disc), fsrootIn, dual))
-      return 1;
-
     nod::EBuildResult ret;
 
-    nod::DiscMergerWii b(imageOut, static_cast<nod::DiscWii&>(*disc), dual, progFunc);
+    nod::DiscMergerWii b(imageOut, static_cast<nod::DiscWii&>(*disc), false, progFunc);
+    b.setPreserveLayout(preserveLayout);
+    b.setDeduplicate(dedup);
+    if (!profilePath.empty() && !b.loadAccessProfile(profilePath))
+      return 1;
+    if (!rulesPath.empty() && !b.loadPatchRules(rulesPath))
+      return 1;
+    if (dryRun) {
+      const nod::PartitionBuildPlan* plan = b.planFromDirectory(fsrootIn);
+      if (!plan)
+        return 1;
+      printPlan(*plan);
+      return 0;
+    }
+    /* Sized with the settings above, e.g. deduplication can keep a tree on one layer */
+    bool dual = false;
+    if (!b.calculateTotalSizeRequired(fsrootIn, dual))
+      return 1;
+    b.setDualLayer(dual);
+    b.setThreadCount(threadCount);
+    b.setStreaming(streaming);
+    b.setCISO(ciso);
+    if (splitSize && !b.setSplitSize(splitSize))
+      return 1;
+    b.setWBFS(wbfs);
+    b.setNFS(nfs);
+    /* A plain build rewrites the image, so a cache left by an earlier -i build goes stale */
+    if (incremental)
+      b.setGroupCachePath(imageOut + ".gcache");
+    else
+      std::remove((imageOut + ".gcache").c_str());
     ret = b.mergeFromDirectory(fsrootIn);
 
-    fmt::print("\n");
+    fmt::print(progOut, "\n");
     if (ret != nod::EBuildResult::Success)
       return 1;
+  } else if (errand == "replace") {
+    if (argc - argidx != 3) {
+      printHelp();
+      return 1;
+    }
+    std::string image = argv[argidx];
+    std::string fstPath = argv[argidx + 1];
+    std::string fileIn = argv[argidx + 2];
+
+    bool isWii;
+    std::unique_ptr<nod::DiscBase> disc = nod::OpenDiscFromImage(image, isWii);
+    if (!disc) {
+      spdlog::error("unable to open image {}", image);
+      return 1;
+    }
+
+    nod::PatchEngine patches;
+    if (!rulesPath.empty() && !patches.loadRules(rulesPath))
+      return 1;
+
+    nod::IPartition* dataPart = disc->getDataPartition();
+    if (!dataPart || !dataPart->replaceFile(fstPath, fileIn, patches))
+      return 1;
+
+    /* Replaced groups no longer match an incremental rebuild's cache */
+    if (isWii)
+      std::remove((image + ".gcache").c_str());
+  } else if (errand == "convert") {
+    if (argc - argidx != 2) {
+      printHelp();
+      return 1;
+    }
+    std::string imageOut = argv[argidx + 1];
+    std::unique_ptr<nod::DiscBase> disc = nod::OpenDiscFromImage(argv[argidx]);
+    if (!disc)
+      return 1;
+
+    /* Sectors are copied as stored, so the output keeps the source's encryption and signatures */
+    if (!disc->writeRawImage(imageOut, wbfs, splitSize, progFunc))
+      return 1;
+    fmt::print(progOut, "\n");
+  } else if (errand == "wbfslist") {
+    if (argc - argidx != 1) {
+      printHelp();
+      return 1;
+    }
+    std::unique_ptr<nod::WBFSContainer> container = nod::OpenWBFSContainer(argv[argidx]);
+    if (!container)
+      return 1;
+    for (const nod::WBFSContainer::Disc& disc : container->getDiscs())
+      fmt::print("{:3} {} {:6} MiB  {}\n", disc.m_slot, disc.m_gameId,
+                 disc.m_blockCount * container->getBlockSize() / (1024 * 1024), disc.m_title);
+    fmt::print("{} of {} slots used\n", container->getDiscs().size(), container->getSlotCount());
+    uint32_t freeBlocks = container->getFreeBlockCount();
+    if (freeBlocks != UINT32_MAX)
+      fmt::print("{} MiB free\n", freeBlocks * container->getBlockSize() / (1024 * 1024));
+    return 0;
+  } else if (errand == "wbfsadd" || errand == "wbfsremove") {
+    if (argc - argidx < 2) {
+      printHelp();
+      return 1;
+    }
+    std::unique_ptr<nod::WBFSContainer> container = nod::OpenWBFSContainer(argv[argidx++]);
+    if (!container)
+      return 1;
+    /* Every disc in the batch lands in one metadata commit; a failure leaves the container untouched */
+    for (; argidx < argc; ++argidx) {
+      if (errand == "wbfsremove") {
+        if (!container->removeDisc(argv[argidx]))
+          return 1;
+        continue;
+      }
+      bool isWii;
+      std::unique_ptr<nod::DiscBase> disc = nod::OpenDiscFromImage(argv[argidx], isWii);
+      if (!disc) {
+        spdlog::error("unable to open image {}", argv[argidx]);
+        return 1;
+      }
+      if (!isWii) {
+        spdlog::error("'{}' is not a Wii image", argv[argidx]);
+        return 1;
+      }
+      if (!container->addDisc(*disc))
+        return 1;
+    }
+    if (!container->commit())
+      return 1;
+  } else if (errand == "storeadd") {
+    if (argc - argidx < 2) {
+      printHelp();
+      return 1;
+    }
+    std::unique_ptr<nod::DiscStore> store = nod::OpenDiscStore(argv[argidx++]);
+    if (!store)
+      return 1;
+    /* Images are named after their file, without directory or extension */
+    for (; argidx < argc; ++argidx) {
+      std::string_view path = argv[argidx];
+      path = path.substr(path.find_last_of("/\\") + 1);
+      std::string name(path.substr(0, path.rfind('.')));
+      std::unique_ptr<nod::DiscBase> disc = nod::OpenDiscFromImage(argv[argidx]);
+      if (!disc)
+        return 1;
+      uint64_t packedBefore = store->getPackedBytes();
+      if (!store->addImage(*disc, name, progFunc))
+        return 1;
+      fmt::print(progOut, "\n");
+      fmt::print("{}: {} new bytes stored\n", name, store->getPackedBytes() - packedBefore);
+    }
+  } else if (errand == "storelist") {
+    if (argc - argidx != 1) {
+      printHelp();
+      return 1;
+    }
+    std::unique_ptr<nod::DiscStore> store = nod::OpenDiscStore(argv[argidx]);
+    if (!store)
+      return 1;
+    for (const std::string& name : store->getImageNames())
+      fmt::print("{}\n", name);
+    fmt::print("{} MiB in packs\n", store->getPackedBytes() / (1024 * 1024));
+    return 0;
+  } else if (errand == "storeget") {
+    if (argc - argidx != 3) {
+      printHelp();
+      return 1;
+    }
+    std::unique_ptr<nod::DiscStore> store = nod::OpenDiscStore(argv[argidx]);
+    if (!store || !store->writeImage(argv[argidx + 1], argv[argidx + 2], progFunc))
+      return 1;
+    fmt::print(progOut, "\n");
   } else {
     printHelp();
     return 1;
@@ -1,17 +1,24 @@
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "nod/IDiscIO.hpp"
 #include "nod/IFileIO.hpp"
 #include "nod/OSUTF.h"
 #include "nod/Endian.hpp"
+#include "nod/PatchEngine.hpp"
 
 namespace nod {
 
@@ -39,6 +46,7 @@ public:
   uint32_t getNameOffset() const { return SBig(typeAndNameOffset) & 0xffffff; }
   uint32_t getOffset() const { return SBig(offset); }
   uint32_t getLength() const { return SBig(length); }
+  void setOffset(uint32_t off) { offset = SBig(off); }
   void incrementLength() {
     uint32_t orig = SBig(length);
     ++orig;
@@ -190,6 +198,7 @@ public:
   Kind getKind() const { return m_kind; }
   std::string_view getName() const { return m_name; }
   uint64_t size() const { return m_discLength; }
+  uint64_t getDiscOffset() const { return m_discOffset; }
   std::unique_ptr<IPartReadStream> beginReadStream(uint64_t offset = 0) const;
   std::unique_ptr<uint8_t[]> getBuf() const;
   std::vector<Node>::iterator rawBegin() const { return m_childrenBegin; }
@@ -291,6 +300,7 @@ public:
   IPartition(const DiscBase& parent, PartitionKind kind, bool isWii, uint64_t offset)
   : m_parent(parent), m_kind(kind), m_offset(offset), m_isWii(isWii) {}
   virtual uint64_t normalizeOffset(uint64_t anOffset) const { return anOffset; }
+  virtual uint32_t packOffset(uint64_t anOffset) const { return uint32_t(anOffset); }
   PartitionKind getKind() const { return m_kind; }
   bool isWii() const { return m_isWii; }
   uint64_t getDiscOffset() const { return m_offset; }
@@ -334,6 +344,28 @@ public:
   const BI2Header& getBI2() const { return m_bi2Header; }
   virtual bool extractCryptoFiles(std::string_view path, const ExtractionContext& ctx) const { return true; }
   bool extractSysFiles(std::string_view path, const ExtractionContext& ctx) const;
+
+  /* Rewrites partition data inside the existing image (raw images only).
+   * Wii partitions re-hash and re-encrypt each touched group, then refresh H3 and the TMD on finish. */
+  virtual std::unique_ptr<IPartPatchStream> beginPatchStream(uint64_t offset) = 0;
+  /* End of the partition's data area; nothing is relocated past it */
+  virtual uint64_t getDataEnd() const = 0;
+
+  /* Disc byte ranges [begin, end) this partition occupies: its headers plus the system files
+   * and every FST file. Wii ranges are widened to whole encrypted sectors. Unsorted, may overlap. */
+  virtual void getUsedDiscRanges(std::vector<std::pair<uint64_t, uint64_t>>& rangesOut) const = 0;
+
+  /* Partition-data ranges holding the boot files, DOL, FST and every FST file */
+  void getUsedDataRanges(std::vector<std::pair<uint64_t, uint64_t>>& rangesOut) const;
+
+  /* Where a Wii partition's encrypted data area lies on disc and the title key it is encrypted
+   * with; false for partitions stored in the clear */
+  virtual bool getDataCrypto(uint64_t& dataOffOut, uint64_t& dataSzOut, uint8_t keyOut[16]) const { return false; }
+
+  /* Replaces one FST file (e.g. "/audio/bgm.brstm") without rebuilding the image.
+   * The file is overwritten in place when it fits its extent, otherwise it moves to free space.
+   * Executables are run through patches on the way in. */
+  bool replaceFile(std::string_view fstPath, std::string_view srcPath, const PatchEngine& patches = PatchEngine());
 };
 
 class DiscBase {
@@ -350,6 +382,7 @@ public:
 
   const Header& getHeader() const { return m_header; }
   const IDiscIO& getDiscIO() const { return *m_discIO; }
+  const std::vector<std::unique_ptr<IPartition>>& getPartitions() const { return m_partitions; }
   size_t getPartitionNodeCount(size_t partition = 0) const {
     if (partition >= m_partitions.size()) {
       return -1;
@@ -371,14 +404,59 @@ public:
     return nullptr;
   }
 
-  void extractToDirectory(std::string_view path, const ExtractionContext& ctx) {
-    for (std::unique_ptr<IPartition>& part : m_partitions)
-      part->extractToDirectory(path, ctx);
-  }
+  /* Extracts every partition, each on its own thread */
+  bool extractToDirectory(std::string_view path, const ExtractionContext& ctx);
+
+  /* Disc byte ranges holding the disc header and everything any partition can reach.
+   * Whatever lies outside them (padding, junk, unused space) can be dropped or zeroed. */
+  void getUsedDiscRanges(std::vector<std::pair<uint64_t, uint64_t>>& rangesOut) const;
+
+  /* Size of the physical disc the image comes from: GameCube, or single- or dual-layer Wii */
+  uint64_t getDiscCapacity() const;
+
+  /* Copies the used disc ranges into a new ISO or WBFS image exactly as stored. Wii partitions
+   * stay encrypted, so the hash tree and signatures come through untouched; unused space is left
+   * zero (holes in an ISO, unallocated blocks in a WBFS). A non-zero splitSize writes pieces. */
+  bool writeRawImage(std::string_view outPath, bool wbfs, uint64_t splitSize = 0,
+                     const FProgress& progressCB = {}) const;
 
   virtual bool extractDiscHeaderFiles(std::string_view path, const ExtractionContext& ctx) const = 0;
 };
 
+/* Complete layout of one partition, computed before any data is written.
+ * Offsets are partition-relative and unpacked (Wii offsets are not shifted). */
+struct PartitionBuildPlan {
+  struct File {
+    std::string m_name;           /* Name reported to the progress callback */
+    std::string m_path;           /* Filesystem source; empty when copied from a source disc */
+    std::string m_fstPath;        /* Location within the FST, e.g. "/audio/bgm.brstm" */
+    const Node* m_node = nullptr; /* Source disc file (merges only) */
+    uint64_t m_offset = 0;
+    uint64_t m_size = 0;          /* Allocated size (32-byte rounded) */
+    uint64_t m_dataSize = 0;      /* Source bytes; the remainder is padded with 0xff */
+    bool m_isExecutable = false;  /* DOL or REL, run through the builder's patch engine */
+  };
+
+  PartitionKind m_kind = PartitionKind::Data;
+  /* Boot DOL first, then every FST file in allocation order.
+   * A file with neither path nor node is the boot DOL of m_sourcePartition. */
+  std::vector<File> m_files;
+  const IPartition* m_sourcePartition = nullptr;
+  uint64_t m_dolOffset = 0;
+  uint64_t m_dolSize = 0;
+  uint64_t m_apploaderSize = 0;
+  uint64_t m_fstOffset = 0;
+  uint64_t m_fstSize = 0;
+  uint64_t m_userStart = 0;
+  uint64_t m_userEnd = 0;
+  uint64_t m_groupCount = 0; /* Wii only: encrypted 2 MiB groups of partition data */
+  uint64_t m_discSize = 0;   /* Disc bytes required by the partition's content */
+  uint64_t m_dedupFiles = 0; /* FST files sharing an earlier file's extent */
+  uint64_t m_dedupBytes = 0; /* Allocation saved by those files */
+  uint64_t m_profiledFiles = 0; /* Files placed by the access profile ahead of directory order */
+  uint64_t m_dirtyGroups = 0;   /* Layout-preserving Wii merges only: groups re-encrypted rather than copied */
+};
+
 class DiscBuilderBase {
   friend class DiscMergerWii;
 
@@ -392,21 +470,72 @@ public:
     std::vector<FSTNode> m_buildNodes;
     std::vector<std::string> m_buildNames;
     size_t m_buildNameOff = 0;
-    virtual uint64_t userAllocate(uint64_t reqSz, IPartWriteStream& ws) = 0;
+    PartitionBuildPlan m_plan;
+
+    /* Content dedup state: plan files indexed by data size, content hashes computed on demand */
+    std::unordered_map<uint64_t, std::vector<size_t>> m_dedupBySize;
+    std::unordered_map<size_t, std::array<uint8_t, 20>> m_dedupHashes;
+    bool hashPlanFile(const PartitionBuildPlan::File& file, std::array<uint8_t, 20>& hashOut);
+
+    /* Reserves planned space for a file; no data is written at this stage */
+    virtual uint64_t userAllocate(uint64_t reqSz) = 0;
+    /* Positions ws at a planned offset within the user area */
+    virtual bool userSeek(IPartWriteStream& ws, uint64_t offset) = 0;
+    /* Whether filesystem sources can be copied into the output without passing through userspace */
+    virtual bool userCopiesFiles() const { return false; }
+    /* Copies source file bytes to ws's position; returns the bytes copied, possibly short */
+    virtual uint64_t userCopyFile(IPartWriteStream& ws, std::string_view path, uint64_t srcOffset, uint64_t length) {
+      return 0;
+    }
+    /* Granularity at which the user area may be split between writer threads */
+    virtual uint64_t writeAlignment() const = 0;
+    /* Whether the user area must be written by one thread in ascending order */
+    virtual bool writesSequentially() const { return m_parent.isStreaming(); }
     virtual uint32_t packOffset(uint64_t offset) const = 0;
 
-    void recursiveBuildNodesPre(std::string_view dirIn);
-    bool recursiveBuildNodes(IPartWriteStream& ws, bool system, std::string_view dirIn);
-
+    /* Files found by traversal, allocated once their placement order is decided */
+    struct PlanQueueEntry {
+      PartitionBuildPlan::File m_file;
+      std::string m_key;
+    };
+    std::vector<PlanQueueEntry> m_planQueue;
+    /* Whether userAllocate hands out descending offsets */
+    virtual bool userAllocatesDownward() const { return false; }
+
+    bool planFile(PartitionBuildPlan::File file, std::string_view key);
+    bool planQueuedFiles();
+    void resetPlan();
+    void finishPlanFST(uint64_t apploaderSz);
+
+    void recursiveBuildNodes(bool system, std::string_view dirIn, std::string_view keyPath);
     bool recursiveBuildFST(std::string_view dirIn, std::function<void(void)> incParents, size_t parentDirIdx);
 
-    void recursiveMergeNodesPre(const Node* nodeIn, std::string_view dirIn);
-    bool recursiveMergeNodes(IPartWriteStream& ws, bool system, const Node* nodeIn, std::string_view dirIn,
-                             std::string_view keyPath);
+    void recursiveMergeNodes(bool system, const Node* nodeIn, std::string_view dirIn, std::string_view keyPath);
     bool recursiveMergeFST(const Node* nodeIn, std::string_view dirIn, std::function<void(void)> incParents,
                            size_t parentDirIdx, std::string_view keyPath);
 
-    static bool RecursiveCalculateTotalSize(uint64_t& totalSz, const Node* nodeIn, std::string_view dirIn);
+    /* Source bytes of a plan entry from a file-relative offset: filesystem, source disc file or source boot DOL */
+    std::unique_ptr<IReadStream> openPlanFile(const PartitionBuildPlan::File& file, uint64_t offset) const;
+    /* Source bytes that must be read to produce file-relative data [lo, hi); executables
+     * need the patch engine's context on both sides so that matches straddling the edges apply */
+    void planFileWindow(const PartitionBuildPlan::File& file, uint64_t lo, uint64_t hi, uint64_t& winLo,
+                        uint64_t& winHi) const;
+    /* Emits data [lo, hi) of a plan entry in ascending order, patching executables on the fly.
+     * read returns consecutive chunks of the planFileWindow range; an empty chunk marks the end. */
+    using PlanChunkReader = std::function<bool(std::vector<uint8_t>&)>;
+    using PlanChunkWriter = std::function<void(uint64_t offset, const uint8_t* data, size_t len)>;
+    bool copyPlanFile(const PartitionBuildPlan::File& file, uint64_t lo, uint64_t hi, const PlanChunkReader& read,
+                      const PlanChunkWriter& write, size_t& patchCount) const;
+
+    /* Writer threads requested from the disc builder, resolved to the hardware concurrency by default */
+    size_t writeThreadCount() const;
+
+    /* Progress reporting under the disc builder's lock, since partitions may be written concurrently */
+    void reportProgress(std::string_view name, size_t bytes);
+    void advanceProgress();
+
+    struct WriteProgress;
+    bool writePlanRange(uint64_t begin, uint64_t end, size_t lookahead, WriteProgress& progress);
 
     void addBuildName(std::string_view str) {
       UTF8ToSJIS nameView(str);
@@ -424,10 +553,15 @@ public:
     PartitionBuilderBase(DiscBuilderBase& parent, PartitionKind kind, bool isWii)
     : m_parent(parent), m_kind(kind), m_isWii(isWii) {}
     virtual std::unique_ptr<IPartWriteStream> beginWriteStream(uint64_t offset) = 0;
-    bool buildFromDirectory(IPartWriteStream& ws, std::string_view dirIn);
-    static std::optional<uint64_t> CalculateTotalSizeBuild(std::string_view dirIn, PartitionKind kind, bool isWii);
-    bool mergeFromDirectory(IPartWriteStream& ws, const IPartition* partIn, std::string_view dirIn);
-    static std::optional<uint64_t> CalculateTotalSizeMerge(const IPartition* partIn, std::string_view dirIn);
+    PartitionKind getKind() const { return m_kind; }
+
+    /* Layout phase: allocates every file and builds the FST without writing anything */
+    bool planFromDirectory(std::string_view dirIn);
+    bool planFromMerge(const IPartition* partIn, std::string_view dirIn);
+    const PartitionBuildPlan& getPlan() const { return m_plan; }
+
+    /* Write phase: fills the planned user area, split across the builder's threads */
+    bool writePlan();
   };
 
 protected:
@@ -435,6 +569,40 @@ protected:
   std::unique_ptr<IFileIO> m_fileIO;
   std::vector<std::unique_ptr<PartitionBuilderBase>> m_partitions;
   int64_t m_discCapacity;
+  size_t m_threadCount = 0;
+  bool m_deduplicate = false;
+  std::unordered_map<std::string, size_t> m_accessRanks;
+  bool m_streaming = false;
+  bool m_ciso = false;
+  bool m_wbfs = false;
+  bool m_nfs = false;
+  uint64_t m_splitSize = 0;
+  bool m_customFileIO = false;
+  PatchEngine m_patchEngine;
+  /* Serializes progress reports from writer and partition threads */
+  std::unique_ptr<std::mutex> m_progressLock = std::make_unique<std::mutex>();
+
+  /* Picks the output backend matching the streaming and container settings, unless the caller
+   * supplied one */
+  void resetFileIO() {
+    if (!m_customFileIO) {
+      if (m_wbfs)
+        m_fileIO = NewWBFSFileIO(m_outPath, m_discCapacity, m_splitSize);
+      else if (m_nfs)
+        m_fileIO = NewNFSFileIO(m_outPath, m_discCapacity);
+      else if (m_ciso)
+        m_fileIO = NewCISOFileIO(m_outPath, m_discCapacity);
+      else if (m_streaming)
+        m_fileIO = NewStreamFileIO(m_outPath, m_discCapacity);
+      else if (m_splitSize)
+        m_fileIO = NewSplitFileIO(m_outPath, m_splitSize, m_discCapacity);
+      else
+        m_fileIO = NewFileIO(m_outPath, m_discCapacity);
+    }
+  }
+
+  /* Sizes a flat output up front; sequential and sparse outputs have nothing to reserve */
+  bool preallocateOutput();
 
 public:
   FProgress m_progressCB;
@@ -463,6 +631,67 @@ public:
   DiscBuilderBase& operator=(DiscBuilderBase&&) = default;
 
   IFileIO& getFileIO() { return *m_fileIO; }
+
+  /* Writes the image through a caller-supplied backend, such as an archival format nod has no
+   * writer for, in place of the one the output settings below would pick. Its traits decide
+   * whether the build streams and which regions are left out, and it is finished with the build. */
+  void setFileIO(std::unique_ptr<IFileIO> fio) {
+    m_customFileIO = true;
+    m_fileIO = std::move(fio);
+    resetFileIO();
+  }
+
+  /* Number of threads filling the planned layout; 0 uses the hardware concurrency */
+  void setThreadCount(size_t count) { m_threadCount = count; }
+
+  /* Stores byte-identical files once, pointing each of their FST entries at the same extent */
+  void setDeduplicate(bool dedup) { m_deduplicate = dedup; }
+
+  /* Emits the image strictly front to back so it can go to a pipe or stdout ("-").
+   * All layout and metadata are computed before the first byte is written. */
+  void setStreaming(bool streaming) {
+    m_streaming = streaming;
+    resetFileIO();
+  }
+  /* Whether the build runs front to back: requested, or forced by an output that only takes
+   * sequential writes (stdout, CISO, NFS) */
+  bool isStreaming() const { return m_streaming || m_fileIO->isSequential(); }
+
+  /* Writes a CISO image that leaves unused blocks out, including the fill past the last
+   * partition. CISO output is always streamed, so it needs no preallocation either. */
+  void setCISO(bool ciso) {
+    m_ciso = ciso;
+    m_wbfs = m_wbfs && !ciso;
+    m_nfs = m_nfs && !ciso;
+    resetFileIO();
+  }
+  bool isCISO() const { return m_ciso; }
+
+  /* Splits raw ISO or WBFS output into pieces of this many bytes (0 disables), e.g. for FAT32
+   * media. The output path names the first piece: "game.part0.iso" or "game.wbfs". */
+  bool setSplitSize(uint64_t splitSize) {
+    if (splitSize && !NewSplitFileIO(m_outPath, splitSize))
+      return false;
+    m_splitSize = splitSize;
+    resetFileIO();
+    return true;
+  }
+  uint64_t getSplitSize() const { return m_splitSize; }
+
+  /* Container outputs store only what is written, so the fill past the last partition is left out */
+  bool isSparseOutput() const { return m_fileIO->isSparse(); }
+
+  /* NFS wraps the whole image in its own encryption, so Wii partitions are stored decrypted */
+  bool isWiiCryptoOutput() const { return m_fileIO->hasWiiCrypto(); }
+
+  /* Places files named by an access profile first, contiguously and in first-access order.
+   * Paths are relative to the partition's files directory (e.g. "audio/bgm.brstm"). */
+  void setAccessProfile(const std::vector<std::string>& orderedPaths);
+  bool loadAccessProfile(std::string_view path);
+
+  /* Signature patches applied to DOL and REL files as they are written; starts with the #001 fix */
+  PatchEngine& getPatchEngine() { return m_patchEngine; }
+  bool loadPatchRules(std::string_view path) { return m_patchEngine.loadRules(path); }
 };
 
 } // namespace nod
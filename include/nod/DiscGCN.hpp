@@ -5,6 +5,12 @@
 namespace nod {
 class DiscBuilderGCN;
 
+/* Where the builder places file data within the 1.4 GB image */
+enum class GCNLayout {
+  EndOfDisc, /* Allocated downward from the end of the disc, as retail discs are mastered */
+  Sequential /* Allocated upward right after the FST, so the image is written in one forward pass */
+};
+
 class DiscGCN : public DiscBase {
   friend class DiscMergerGCN;
   DiscBuilderGCN makeMergeBuilder(std::string_view outPath, FProgress progressCB);
@@ -16,10 +22,17 @@ public:
 
 class DiscBuilderGCN : public DiscBuilderBase {
   friend class DiscMergerGCN;
+  GCNLayout m_layout = GCNLayout::EndOfDisc;
 
 public:
   DiscBuilderGCN(std::string_view outPath, FProgress progressCB);
+  void setLayout(GCNLayout layout) { m_layout = layout; }
+  GCNLayout getLayout() const { return m_layout; }
+  const PartitionBuildPlan* planFromDirectory(std::string_view dirIn);
   EBuildResult buildFromDirectory(std::string_view dirIn);
+  /* Image size the current settings (layout, deduplication, access profile) need for dirIn */
+  std::optional<uint64_t> calculateTotalSizeRequired(std::string_view dirIn);
+  /* Same, for a builder with default settings */
   static std::optional<uint64_t> CalculateTotalSizeRequired(std::string_view dirIn);
 };
 
@@ -29,7 +42,17 @@ class DiscMergerGCN {
 
 public:
   DiscMergerGCN(std::string_view outPath, DiscGCN& sourceDisc, FProgress progressCB);
+  const PartitionBuildPlan* planFromDirectory(std::string_view dirIn);
   EBuildResult mergeFromDirectory(std::string_view dirIn);
+  void setThreadCount(size_t count) { m_builder.setThreadCount(count); }
+  void setDeduplicate(bool dedup) { m_builder.setDeduplicate(dedup); }
+  void setStreaming(bool streaming) { m_builder.setStreaming(streaming); }
+  void setCISO(bool ciso) { m_builder.setCISO(ciso); }
+  bool setSplitSize(uint64_t splitSize) { return m_builder.setSplitSize(splitSize); }
+  void setLayout(GCNLayout layout) { m_builder.setLayout(layout); }
+  bool loadAccessProfile(std::string_view path) { return m_builder.loadAccessProfile(path); }
+  bool loadPatchRules(std::string_view path) { return m_builder.loadPatchRules(path); }
+  std::optional<uint64_t> calculateTotalSizeRequired(std::string_view dirIn);
   static std::optional<uint64_t> CalculateTotalSizeRequired(DiscGCN& sourceDisc, std::string_view dirIn);
 };
 
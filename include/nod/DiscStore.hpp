@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "nod/DiscBase.hpp"
+
+namespace nod {
+
+/**
+ * @brief Directory holding many images with their shared contents stored once
+ *
+ * Images are cut into content-addressed chunks kept in append-only pack files; chunks start at
+ * each FST file's first byte, so a file that regional variants or revisions share is stored once
+ * however it is placed on each disc. Wii partitions are kept decrypted, with their title keys and
+ * every hash block that does not match its data, so the encrypted image comes back bit for bit.
+ *
+ * Each image gets a manifest, images/<name>.nodm, which OpenDiscFromImage opens like any
+ * other image; reads rebuild the disc from the packs on the fly.
+ */
+class DiscStore {
+public:
+  DiscStore(std::string_view dir, bool& err);
+  DiscStore(const DiscStore&) = delete;
+  DiscStore& operator=(const DiscStore&) = delete;
+
+  /* Names of the stored images, sorted */
+  std::vector<std::string> getImageNames() const;
+  std::string getManifestPath(std::string_view name) const;
+  /* Bytes held in pack files, the store's real size apart from manifests */
+  uint64_t getPackedBytes() const { return m_packedBytes; }
+
+  /* Stores a disc under a new name; only chunks the store does not already hold are added */
+  bool addImage(const DiscBase& disc, std::string_view name, const FProgress& progressCB = {});
+  /* Writes a stored image back out whole, as a flat image of the original disc's size */
+  bool writeImage(std::string_view name, std::string_view outPath, const FProgress& progressCB = {}) const;
+
+private:
+  struct Ingest;
+  friend struct Ingest;
+
+  struct ChunkLocation {
+    uint32_t m_pack;
+    uint64_t m_offset;
+    uint32_t m_size;
+  };
+
+  std::string m_dir;
+  std::unordered_map<std::string, ChunkLocation> m_chunks; /* Keyed by raw SHA-1 */
+  uint32_t m_packIdx = 0;
+  uint64_t m_packSize = 0;
+  uint64_t m_packedBytes = 0;
+};
+
+std::unique_ptr<DiscStore> OpenDiscStore(std::string_view dir);
+
+} // namespace nod
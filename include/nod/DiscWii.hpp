@@ -13,10 +13,53 @@ public:
 };
 
 class DiscBuilderWii : public DiscBuilderBase {
+  friend class DiscMergerWii;
+  std::string m_groupCachePath;
+  /* End of the last planned partition */
+  uint64_t m_partitionsEnd = 0;
+  bool loadGroupCache(uint64_t& prevFilledSz);
+  void storeGroupCache(uint64_t filledSz);
+
 public:
   DiscBuilderWii(std::string_view outPath, bool dualLayer, FProgress progressCB);
+  const PartitionBuildPlan* planFromDirectory(std::string_view dirIn);
   EBuildResult buildFromDirectory(std::string_view dirIn);
+  /* Image size the current settings (deduplication, access profile, ...) need for dirIn, and
+   * whether that takes a dual-layer disc; pass the result to setDualLayer before building */
+  std::optional<uint64_t> calculateTotalSizeRequired(std::string_view dirIn, bool& dualLayer);
+  /* Same, for a builder with default settings */
   static std::optional<uint64_t> CalculateTotalSizeRequired(std::string_view dirIn, bool& dualLayer);
+
+  /* Switches the output between single- and dual-layer capacity */
+  void setDualLayer(bool dualLayer) {
+    m_discCapacity = dualLayer ? 0x1FB4E0000 : 0x118240000;
+    resetFileIO();
+  }
+
+  /* Enables incremental rebuilds of an existing output image. Groups whose decrypted content
+   * matches the sidecar cache at this path are left in place instead of being re-encrypted. */
+  void setGroupCachePath(std::string_view path) { m_groupCachePath = path; }
+
+  /* Writes a single-disc WBFS image instead of an ISO. Blocks are allocated only for regions
+   * that are written, so the image takes the partitions' real size and needs no preallocation. */
+  void setWBFS(bool wbfs) {
+    m_wbfs = wbfs;
+    m_ciso = m_ciso && !wbfs;
+    m_nfs = m_nfs && !wbfs;
+    resetFileIO();
+  }
+  bool isWBFS() const { return m_wbfs; }
+
+  /* Writes Wii VC NFS files (hif_000000.nfs, hif_000001.nfs, ...) next to the output path, which
+   * must name the first of them. Only written blocks are stored, and the image is produced front
+   * to back. An existing htk.bin for the title is reused; otherwise a new key goes into htk.bin. */
+  void setNFS(bool nfs) {
+    m_nfs = nfs;
+    m_ciso = m_ciso && !nfs;
+    m_wbfs = m_wbfs && !nfs;
+    resetFileIO();
+  }
+  bool isNFS() const { return m_nfs; }
 };
 
 class DiscMergerWii {
@@ -25,7 +68,23 @@ class DiscMergerWii {
 
 public:
   DiscMergerWii(std::string_view outPath, DiscWii& sourceDisc, bool dualLayer, FProgress progressCB);
+  const PartitionBuildPlan* planFromDirectory(std::string_view dirIn);
   EBuildResult mergeFromDirectory(std::string_view dirIn);
+  void setGroupCachePath(std::string_view path) { m_builder.setGroupCachePath(path); }
+  /* Keeps the source partition's layout: unchanged files stay at their offsets, new or grown files
+   * go to free or trailing space, and groups without modified bytes are copied still encrypted */
+  void setPreserveLayout(bool preserve);
+  void setThreadCount(size_t count) { m_builder.setThreadCount(count); }
+  void setDeduplicate(bool dedup) { m_builder.setDeduplicate(dedup); }
+  void setStreaming(bool streaming) { m_builder.setStreaming(streaming); }
+  void setCISO(bool ciso) { m_builder.setCISO(ciso); }
+  void setWBFS(bool wbfs) { m_builder.setWBFS(wbfs); }
+  bool setSplitSize(uint64_t splitSize) { return m_builder.setSplitSize(splitSize); }
+  void setNFS(bool nfs) { m_builder.setNFS(nfs); }
+  bool loadAccessProfile(std::string_view path) { return m_builder.loadAccessProfile(path); }
+  bool loadPatchRules(std::string_view path) { return m_builder.loadPatchRules(path); }
+  void setDualLayer(bool dualLayer) { m_builder.setDualLayer(dualLayer); }
+  std::optional<uint64_t> calculateTotalSizeRequired(std::string_view dirIn, bool& dualLayer);
   static std::optional<uint64_t> CalculateTotalSizeRequired(DiscWii& sourceDisc, std::string_view dirIn, bool& dualLayer);
 };
 
@@ -41,6 +41,15 @@ struct IPartWriteStream : IWriteStream {
   virtual uint64_t position() const = 0;
 };
 
+struct IPartPatchStream : IPartWriteStream {
+  ~IPartPatchStream() override = default;
+  /* Moves the write position to another partition offset; false once a write has failed */
+  virtual bool seek(uint64_t offset) = 0;
+  /* Stores everything written so far along with any metadata it invalidates.
+   * False if any of it failed to reach the image; later calls return the same result. */
+  virtual bool finish() = 0;
+};
+
 #if NOD_ATHENA
 
 class AthenaPartReadStream : public athena::io::IStreamReader {
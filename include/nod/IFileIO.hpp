@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <string>
 #include <string_view>
 
 #include "nod/IDiscIO.hpp"
@@ -18,7 +19,30 @@ public:
   struct IWriteStream : nod::IWriteStream {
     uint64_t copyFromDisc(IPartReadStream& discio, uint64_t length);
     uint64_t copyFromDisc(IPartReadStream& discio, uint64_t length, const std::function<void(float)>& prog);
+    /* Moves the write position without reopening the file; false when the stream cannot seek */
+    virtual bool seek(uint64_t offset) { return false; }
+    /* Reserves length zeroed bytes at the write position without writing them; the position is unchanged */
+    virtual bool preallocate(uint64_t length) { return false; }
+    /* Copies bytes of another file to the write position inside the kernel, sharing extents where the
+     * filesystem can. Returns the bytes copied, which may be short; the caller copies the rest itself. */
+    virtual uint64_t copyFromFile(std::string_view srcPath, uint64_t srcOffset, uint64_t length) { return 0; }
+    /* Passes over length bytes nothing will read, such as the fill past the last partition.
+     * Flat outputs write them as fillByte; sparse outputs only advance and store nothing. */
+    virtual bool skipUnused(uint64_t length, uint8_t fillByte);
   };
+  /* Whether write streams implement copyFromFile at all */
+  virtual bool supportsCopyFromFile() const { return false; }
+
+  /* Output traits builders plan around. A sequential output only takes writes front to back;
+   * a sparse one stores nothing for regions never written, so it needs no preallocation. */
+  virtual bool isSequential() const { return false; }
+  virtual bool isSparse() const { return false; }
+  /* Whether Wii partitions should arrive encrypted and hashed, as on a disc */
+  virtual bool hasWiiCrypto() const { return true; }
+  /* Writes whatever the output keeps until the end (container headers, block maps, keys) and
+   * reports whether everything reached the disk. Outputs not finished explicitly finish when
+   * destroyed, where a failure can only be logged. */
+  virtual bool finish() { return true; }
   virtual std::unique_ptr<IWriteStream> beginWriteStream() const = 0;
   virtual std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const = 0;
 
@@ -31,4 +55,34 @@ public:
 
 std::unique_ptr<IFileIO> NewFileIO(std::string_view path, int64_t maxWriteSize = -1);
 
+/* Piece idx of a split image: "game.part0.iso" -> "game.part1.iso", "game.wbfs" -> "game.wbf1".
+ * Empty when firstPath does not name the first piece of a split set. */
+std::string SplitPiecePath(std::string_view firstPath, size_t idx);
+
+/* A split image presented as one file. Offsets map to pieces by division, and reads and writes
+ * cross piece boundaries transparently. Writing needs pieceSize; reading with pieceSize 0 takes
+ * it from the pieces on disk. Null when firstPath does not follow a split naming scheme. */
+std::unique_ptr<IFileIO> NewSplitFileIO(std::string_view firstPath, uint64_t pieceSize = 0,
+                                        int64_t maxWriteSize = -1);
+
+/* Opens an image for reading, as a split set when the first piece has a sibling */
+std::unique_ptr<IFileIO> NewImageFileIO(std::string_view path);
+
+/* Front-to-back output to a pipe, FIFO or stdout (path "-"). Write streams may only begin at or
+ * after everything already written; skipped bytes are zero-filled. Nothing can be read back. */
+std::unique_ptr<IFileIO> NewStreamFileIO(std::string_view path, int64_t maxWriteSize = -1);
+
+/* Front-to-back output packed into a CISO image, which stores only the blocks holding
+ * non-zero data. Same write rules as NewStreamFileIO, but the path must be a seekable file. */
+std::unique_ptr<IFileIO> NewCISOFileIO(std::string_view path, int64_t maxWriteSize = -1);
+
+/* Single-disc WBFS output that allocates blocks only for the regions actually written.
+ * Writes may go anywhere and come from several streams at once; the path must be a seekable file.
+ * A non-zero splitSize writes game.wbfs, game.wbf1, ... pieces of that many bytes. */
+std::unique_ptr<IFileIO> NewWBFSFileIO(std::string_view path, int64_t maxWriteSize = -1, uint64_t splitSize = 0);
+
+/* Front-to-back output split into Wii VC NFS files; path names the first, hif_000000.nfs.
+ * Same write rules as NewStreamFileIO. */
+std::unique_ptr<IFileIO> NewNFSFileIO(std::string_view path, int64_t maxWriteSize = -1);
+
 } // namespace nod
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nod {
+
+/**
+ * @brief Byte-signature patcher applied to executables as they stream into an image
+ *
+ * Every rule's signature is compiled into one Aho-Corasick automaton, so a single pass
+ * over the data finds all rules at once. Matching always runs on the original bytes;
+ * where replacements overlap, the match ending later wins.
+ */
+class PatchEngine {
+public:
+  struct Rule {
+    std::string m_name;
+    std::vector<uint8_t> m_signature;
+    std::vector<int16_t> m_replacement; /* Same length as the signature; -1 keeps the original byte */
+  };
+
+  /* Starts with the built-in rule patching out the #001 integrity check in OSInit */
+  PatchEngine();
+
+  bool addRule(Rule rule);
+  void clearRules();
+  /* One rule per line: "<name> <signature-hex> <replacement-hex>"; "??" in the replacement
+   * keeps the original byte and '#' starts a comment */
+  bool loadRules(std::string_view path);
+
+  const std::vector<Rule>& getRules() const { return m_rules; }
+  /* Bytes of context a match may need on either side of a range */
+  size_t getContextSize() const { return m_maxLength ? m_maxLength - 1 : 0; }
+
+  /* Patches one file's data fed in consecutive chunks of any size. The last
+   * getContextSize() bytes are held back until the next feed or finish. */
+  class Scanner {
+    const PatchEngine& m_engine;
+    std::vector<uint8_t> m_pending;
+    uint64_t m_pendingOffset; /* File offset of m_pending[0] */
+    uint64_t m_outOffset;
+    int32_t m_state = 0;
+    size_t m_patchCount = 0;
+
+  public:
+    Scanner(const PatchEngine& engine, uint64_t startOffset = 0)
+    : m_engine(engine), m_pendingOffset(startOffset), m_outOffset(startOffset) {}
+    /* Replaces out with the bytes that can no longer change */
+    void feed(const uint8_t* data, size_t len, std::vector<uint8_t>& out);
+    /* Replaces out with every byte still held back */
+    void finish(std::vector<uint8_t>& out);
+    /* File offset of the first byte placed in out by the last feed or finish */
+    uint64_t getOutOffset() const { return m_outOffset; }
+    size_t getPatchCount() const { return m_patchCount; }
+  };
+
+private:
+  void compile();
+
+  std::vector<Rule> m_rules;
+  size_t m_maxLength = 0;
+  /* Fully expanded transition table; state 0 is the root */
+  std::vector<std::array<int32_t, 256>> m_next;
+  /* Rules whose signature ends at each state, including those reached through failure links */
+  std::vector<std::vector<uint32_t>> m_outputs;
+};
+
+} // namespace nod
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "nod/IDiscIO.hpp"
+#include "nod/IFileIO.hpp"
+
+namespace nod {
+class DiscBase;
+class DiscIOWBFS;
+
+/**
+ * @brief A WBFS partition or file holding any number of Wii discs
+ *
+ * Opening reads the head sector and the info blocks (header copy and wlba_table) of every
+ * occupied disc slot in one pass; disc data is only touched through the IDiscIO objects
+ * handed out by openDisc, which stay valid after the container is gone.
+ *
+ * Discs may be added and removed in batches. Added disc data goes straight into free blocks,
+ * but the head, disc info blocks and free-block bitmap only change on disk at commit(), so an
+ * interrupted batch leaves the container as it was.
+ */
+class WBFSContainer {
+  friend class DiscIOWBFS;
+
+public:
+  struct Disc {
+    uint32_t m_slot;        /* Index in the container's disc table */
+    std::string m_gameId;   /* Six-character ID from the header copy */
+    std::string m_title;
+    uint32_t m_blockCount;  /* WBFS sectors stored for this disc */
+  };
+
+  WBFSContainer(std::string_view path, bool& err);
+
+  const std::vector<Disc>& getDiscs() const { return m_discs; }
+  uint64_t getBlockSize() const { return uint64_t(1) << m_wbfsSecShift; }
+  uint32_t getBlockCount() const { return m_wbfsSecCount; }
+  uint32_t getSlotCount() const { return m_maxDiscs; }
+
+  /* Opens a disc by its position in getDiscs() or by game ID; null when there is no such disc */
+  std::unique_ptr<IDiscIO> openDisc(size_t idx) const;
+  std::unique_ptr<IDiscIO> openDisc(std::string_view gameId) const;
+
+  /* Copies the Wii sectors a disc actually uses into free blocks and gives it a slot */
+  bool addDisc(const DiscBase& disc);
+  /* Frees a disc's slot; its blocks only become free for addDisc after commit() */
+  bool removeDisc(std::string_view gameId);
+  /* Writes the head, changed disc info blocks and free-block bitmap */
+  bool commit();
+  /* Loads the free-block bitmap on first use; UINT32_MAX when it cannot be read */
+  uint32_t getFreeBlockCount();
+
+private:
+  std::string m_path;
+  std::unique_ptr<IFileIO> m_fio;
+  uint32_t m_hdSecShift = 0;
+  uint32_t m_hdSecCount = 0;
+  uint32_t m_wbfsSecShift = 0;
+  uint32_t m_wbfsSecCount = 0;
+  uint32_t m_secsPerDisc = 0;  /* Entries in each wlba_table */
+  uint32_t m_discInfoSize = 0; /* Header copy plus wlba_table, rounded to HD sectors */
+  uint32_t m_maxDiscs = 0;
+  std::vector<uint8_t> m_head;
+  std::vector<uint8_t> m_discInfo; /* Info blocks of slots up to the last occupied one */
+  std::vector<Disc> m_discs;
+  /* Free-block bitmap as stored (bit b - 1 set when block b is free), host-order words */
+  std::vector<uint32_t> m_freeBlocks;
+  /* Blocks of discs removed in this batch, same layout; the on-disk head still refers to them */
+  std::vector<uint32_t> m_pendingFree;
+  std::vector<bool> m_dirtySlots;
+
+  const uint8_t* getDiscInfo(uint32_t slot) const { return m_discInfo.data() + size_t(slot) * m_discInfoSize; }
+  uint8_t* getDiscInfo(uint32_t slot) { return m_discInfo.data() + size_t(slot) * m_discInfoSize; }
+  uint32_t getFreeBlocksLba() const;
+  bool beginEdit();
+  uint16_t allocBlock();
+  static void FreeBlock(std::vector<uint32_t>& bitmap, uint16_t block);
+};
+
+std::unique_ptr<WBFSContainer> OpenWBFSContainer(std::string_view path);
+
+} // namespace nod
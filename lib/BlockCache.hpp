@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace nod {
+
+/**
+ * @brief LRU cache of decoded image blocks shared by every read stream of a disc
+ *
+ * A block is decoded on the first thread that asks for it, or ahead of time by a small
+ * worker pool when a reader streams forward. Concurrent requests for a block wait on the
+ * single decode in flight. Block must expose its decoded bytes as m_data, which is what
+ * counts against the budget.
+ */
+template <typename Block>
+class BlockCache {
+public:
+  using Decoder = std::function<std::shared_ptr<const Block>(uint32_t idx)>;
+
+  BlockCache(uint32_t blockCount, Decoder decoder, size_t budget = 128 * 1024 * 1024)
+  : m_blockCount(blockCount), m_decoder(std::move(decoder)), m_budget(budget) {
+    size_t threadCount = std::min(std::max(size_t(std::thread::hardware_concurrency()), size_t(1)), size_t(8));
+    m_workers.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i)
+      m_workers.emplace_back(&BlockCache::workerProc, this);
+  }
+  ~BlockCache() {
+    {
+      std::lock_guard<std::mutex> lk(m_lock);
+      m_quit = true;
+    }
+    m_workerCv.notify_all();
+    for (std::thread& worker : m_workers)
+      worker.join();
+  }
+  BlockCache(const BlockCache&) = delete;
+  BlockCache& operator=(const BlockCache&) = delete;
+
+  /* Returns a decoded block, decoding it on the calling thread unless a worker already is */
+  std::shared_ptr<const Block> get(uint32_t idx) {
+    std::unique_lock<std::mutex> lk(m_lock);
+    while (true) {
+      auto search = m_cache.find(idx);
+      if (search == m_cache.end()) {
+        m_cache[idx];
+        break;
+      }
+      if (search->second.m_block) {
+        m_lru.splice(m_lru.end(), m_lru, search->second.m_lru);
+        return search->second.m_block;
+      }
+      /* Take it back from the prefetch queue if no worker has claimed it yet */
+      auto queued = std::find(m_queue.begin(), m_queue.end(), idx);
+      if (queued != m_queue.end()) {
+        m_queue.erase(queued);
+        break;
+      }
+      m_readyCv.wait(lk);
+    }
+    lk.unlock();
+    std::shared_ptr<const Block> block = m_decoder(idx);
+    lk.lock();
+    store(idx, block);
+    return block;
+  }
+
+  /* Queues blocks for the worker pool ahead of a sequential reader */
+  void prefetch(uint32_t first, uint32_t count) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    for (uint32_t idx = first; idx < first + count && idx < m_blockCount; ++idx) {
+      if (m_cache.find(idx) != m_cache.end())
+        continue;
+      m_cache[idx];
+      m_queue.push_back(idx);
+    }
+    m_workerCv.notify_all();
+  }
+
+  size_t workerCount() const { return m_workers.size(); }
+  uint32_t blockCount() const { return m_blockCount; }
+
+private:
+  struct Entry {
+    std::shared_ptr<const Block> m_block; /* Null while a thread is decoding it */
+    typename std::list<uint32_t>::iterator m_lru;
+  };
+
+  /* Publishes a decoded block and evicts idle blocks beyond the budget; m_lock must be held */
+  void store(uint32_t idx, std::shared_ptr<const Block> block) {
+    Entry& entry = m_cache[idx];
+    m_cachedBytes += block->m_data.size();
+    entry.m_block = std::move(block);
+    m_lru.push_back(idx);
+    entry.m_lru = std::prev(m_lru.end());
+    for (auto it = m_lru.begin(); it != m_lru.end() && m_cachedBytes > m_budget;) {
+      if (*it == idx) {
+        ++it;
+        continue;
+      }
+      auto found = m_cache.find(*it);
+      m_cachedBytes -= found->second.m_block->m_data.size();
+      m_cache.erase(found);
+      it = m_lru.erase(it);
+    }
+    m_readyCv.notify_all();
+  }
+
+  void workerProc() {
+    std::unique_lock<std::mutex> lk(m_lock);
+    while (true) {
+      m_workerCv.wait(lk, [this]() { return m_quit || !m_queue.empty(); });
+      if (m_quit)
+        return;
+      uint32_t idx = m_queue.front();
+      m_queue.pop_front();
+      lk.unlock();
+      std::shared_ptr<const Block> block = m_decoder(idx);
+      lk.lock();
+      store(idx, std::move(block));
+    }
+  }
+
+  uint32_t m_blockCount;
+  Decoder m_decoder;
+  size_t m_budget;
+
+  std::mutex m_lock;
+  std::condition_variable m_workerCv;
+  std::condition_variable m_readyCv;
+  std::unordered_map<uint32_t, Entry> m_cache;
+  std::list<uint32_t> m_lru;
+  size_t m_cachedBytes = 0;
+  std::deque<uint32_t> m_queue;
+  bool m_quit = false;
+  std::vector<std::thread> m_workers;
+};
+
+} // namespace nod
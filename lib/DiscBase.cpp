@@ -4,39 +4,20 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 #include "nod/DirectoryEnumerator.hpp"
 #include "nod/IFileIO.hpp"
 #include "nod/nod.hpp"
+#include "nod/sha1.h"
+#include "ExtentMap.hpp"
+#include "FilePrefetcher.hpp"
 #include "Util.hpp"
 
 #ifndef _WIN32
 #include <unistd.h>
-#else
-
-#include <spdlog/spdlog.h>
-
-static void* memmem(const void* haystack, size_t hlen, const void* needle, size_t nlen) {
-  int needle_first;
-  const uint8_t* p = static_cast<const uint8_t*>(haystack);
-  size_t plen = hlen;
-
-  if (!nlen)
-    return NULL;
-
-  needle_first = *(unsigned char*)needle;
-
-  while (plen >= nlen && (p = static_cast<const uint8_t*>(memchr(p, needle_first, plen - nlen + 1)))) {
-    if (!memcmp(p, needle, nlen))
-      return (void*)p;
-
-    p++;
-    plen = hlen - (p - static_cast<const uint8_t*>(haystack));
-  }
-
-  return NULL;
-}
 #endif
 
 #include <algorithm>
@@ -198,6 +179,165 @@ bool IPartition::extractToDirectory(std::string_view path, const ExtractionConte
   return m_nodes[0].extractToDirectory(fsPath, ctx);
 }
 
+bool DiscBase::extractToDirectory(std::string_view path, const ExtractionContext& ctx) {
+  if (m_partitions.size() == 1)
+    return m_partitions[0]->extractToDirectory(path, ctx);
+
+  if (Mkdir(path.data(), 0755) && errno != EEXIST) {
+    spdlog::error("unable to mkdir '{}'", path);
+    return false;
+  }
+
+  /* Partitions have separate directories and read streams; only progress reports are shared */
+  std::mutex progressLock;
+  ExtractionContext partCtx = ctx;
+  if (ctx.progressCB) {
+    partCtx.progressCB = [&](std::string_view name, float prog) {
+      std::lock_guard<std::mutex> lk(progressLock);
+      ctx.progressCB(name, prog);
+    };
+  }
+
+  std::vector<uint8_t> succeeded(m_partitions.size());
+  std::vector<std::thread> workers;
+  workers.reserve(m_partitions.size());
+  for (size_t p = 0; p < m_partitions.size(); ++p)
+    workers.emplace_back([&, p]() { succeeded[p] = m_partitions[p]->extractToDirectory(path, partCtx); });
+  for (std::thread& worker : workers)
+    worker.join();
+
+  return std::all_of(succeeded.begin(), succeeded.end(), [](uint8_t ok) { return ok != 0; });
+}
+
+void DiscBase::getUsedDiscRanges(std::vector<std::pair<uint64_t, uint64_t>>& rangesOut) const {
+  /* Wii discs also keep the partition table and region info ahead of the first partition */
+  rangesOut.emplace_back(0, m_header.m_wiiMagic == 0x5D1C9EA3 ? 0x50000 : 0x440);
+  for (const std::unique_ptr<IPartition>& part : m_partitions)
+    part->getUsedDiscRanges(rangesOut);
+}
+
+uint64_t DiscBase::getDiscCapacity() const {
+  if (m_header.m_wiiMagic != 0x5D1C9EA3)
+    return 0x57058000;
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  getUsedDiscRanges(ranges);
+  uint64_t end = 0;
+  for (const auto& range : ranges)
+    end = nod::max(end, range.second);
+  for (const std::unique_ptr<IPartition>& part : m_partitions) {
+    uint64_t dataOff, dataSz;
+    uint8_t key[16];
+    if (part->getDataCrypto(dataOff, dataSz, key))
+      end = nod::max(end, dataOff + dataSz);
+  }
+  return end > 0x118240000 ? 0x1FB4E0000 : 0x118240000;
+}
+
+bool DiscBase::writeRawImage(std::string_view outPath, bool wbfs, uint64_t splitSize,
+                             const FProgress& progressCB) const {
+  const bool isWii = m_header.m_wiiMagic == 0x5D1C9EA3;
+  if (!m_discIO->hasWiiCrypto()) {
+    spdlog::error("this image holds decrypted partitions; rebuild it with makewii or mergewii instead");
+    return false;
+  }
+  if (wbfs && !isWii) {
+    spdlog::error("only Wii discs can be written as WBFS");
+    return false;
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  getUsedDiscRanges(ranges);
+  uint64_t usedEnd = 0;
+  for (const auto& [begin, end] : ranges)
+    usedEnd = nod::max(usedEnd, end);
+
+  /* Images keep the size of the physical disc they came from */
+  const uint64_t discSize = getDiscCapacity();
+  if (usedEnd > discSize) {
+    spdlog::error("used data ends at 0x{:X}, past the 0x{:X}-byte disc", usedEnd, discSize);
+    return false;
+  }
+
+  /* Whole 2 MiB blocks are copied, the unit WBFS stores, so converting back and forth keeps
+   * every byte a WBFS image holds rather than only the sectors the FST reaches */
+  constexpr uint64_t BlockSize = 0x200000;
+  std::sort(ranges.begin(), ranges.end());
+  std::vector<std::pair<uint64_t, uint64_t>> merged;
+  uint64_t totalBytes = 0;
+  for (const auto& [first, last] : ranges) {
+    if (first >= last)
+      continue;
+    uint64_t begin = first / BlockSize * BlockSize;
+    uint64_t end = nod::min(discSize, (last + BlockSize - 1) / BlockSize * BlockSize);
+    if (!merged.empty() && begin <= merged.back().second)
+      merged.back().second = nod::max(merged.back().second, end);
+    else
+      merged.emplace_back(begin, end);
+  }
+  for (const auto& [begin, end] : merged)
+    totalBytes += end - begin;
+
+  std::unique_ptr<IFileIO> fio;
+  if (wbfs)
+    fio = NewWBFSFileIO(outPath, discSize, splitSize);
+  else if (splitSize)
+    fio = NewSplitFileIO(outPath, splitSize, discSize);
+  else
+    fio = NewFileIO(outPath, discSize);
+  std::unique_ptr<IFileIO::IWriteStream> ws = fio ? fio->beginWriteStream() : nullptr;
+  std::unique_ptr<IReadStream> rs = m_discIO->beginReadStream(0);
+  if (!ws || !rs) {
+    spdlog::error("unable to open '{}' for writing", outPath);
+    return false;
+  }
+
+  /* Whole used ranges stream through in large reads; the gaps between them are only seeked over */
+  constexpr uint64_t ChunkSize = 0x800000;
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[ChunkSize]);
+  uint64_t doneBytes = 0;
+  uint64_t writeEnd = 0;
+  for (const auto& [begin, end] : merged) {
+    rs->seek(begin, SEEK_SET);
+    if (!ws->seek(begin)) {
+      spdlog::error("unable to seek in '{}'", outPath);
+      return false;
+    }
+    for (uint64_t pos = begin; pos < end;) {
+      uint64_t thisSz = nod::min(ChunkSize, end - pos);
+      if (rs->read(buf.get(), thisSz) != thisSz) {
+        spdlog::error("unable to read disc at 0x{:X}", pos);
+        return false;
+      }
+      if (ws->write(buf.get(), thisSz) != thisSz) {
+        spdlog::error("unable to write '{}' at 0x{:X}", outPath, pos);
+        return false;
+      }
+      pos += thisSz;
+      doneBytes += thisSz;
+      if (progressCB)
+        progressCB(float(doneBytes) / float(totalBytes), outPath, size_t(doneBytes));
+    }
+    writeEnd = end;
+  }
+
+  /* A flat image runs to the end of the disc even when its tail is unused */
+  const uint8_t zero = 0;
+  if (!wbfs && writeEnd < discSize && (!ws->seek(discSize - 1) || ws->write(&zero, 1) != 1)) {
+    spdlog::error("unable to extend '{}' to 0x{:X} bytes", outPath, discSize);
+    return false;
+  }
+  return true;
+}
+
+void IPartition::getUsedDataRanges(std::vector<std::pair<uint64_t, uint64_t>>& rangesOut) const {
+  rangesOut.emplace_back(0, 0x2440 + m_apploaderSz);
+  rangesOut.emplace_back(m_dolOff, m_dolOff + m_dolSz);
+  rangesOut.emplace_back(m_fstOff, m_fstOff + m_fstSz);
+  for (const Node& node : m_nodes)
+    if (node.getKind() == Node::Kind::File && node.size())
+      rangesOut.emplace_back(node.getDiscOffset(), node.getDiscOffset() + node.size());
+}
+
 bool IPartition::extractSysFiles(std::string_view basePath, const ExtractionContext& ctx) const {
   std::string basePathStr(basePath);
   if (Mkdir((basePathStr + "/sys").c_str(), 0755) && errno != EEXIST) {
@@ -256,17 +396,15 @@ bool IPartition::extractSysFiles(std::string_view basePath, const ExtractionCont
   return true;
 }
 
-static bool IsSystemFile(std::string_view name, bool& isDol) {
-  isDol = false;
+static bool IsSystemFile(std::string_view name, bool& isExecutable) {
+  isExecutable = false;
   if (name.size() < 4)
     return false;
 
-  if (!StrCaseCmp((&*(name.cend() - 4)), ".dol")) {
-    isDol = true;
+  if (!StrCaseCmp((&*(name.cend() - 4)), ".dol") || !StrCaseCmp((&*(name.cend() - 4)), ".rel")) {
+    isExecutable = true;
     return true;
   }
-  if (!StrCaseCmp((&*(name.cend() - 4)), ".rel"))
-    return true;
   if (!StrCaseCmp((&*(name.cend() - 4)), ".rso"))
     return true;
   if (!StrCaseCmp((&*(name.cend() - 4)), ".sel"))
@@ -281,83 +419,255 @@ static bool IsSystemFile(std::string_view name, bool& isDol) {
   return false;
 }
 
-/** Patches out pesky #001 integrity check performed by game's OSInit.
- *  This is required for multi-DOL games, but doesn't harm functionality otherwise */
-static void PatchDOL(std::unique_ptr<uint8_t[]>& buf, size_t sz, bool& patched) {
-  patched = false;
-  uint8_t* found = static_cast<uint8_t*>(memmem(buf.get(), sz,
-                                                "\x3C\x03\xF8\x00\x28\x00\x00\x00\x40\x82\x00\x0C"
-                                                "\x38\x60\x00\x01\x48\x00\x02\x44\x38\x61\x00\x18\x48",
-                                                25));
-  if (found) {
-    found[11] = '\x04';
-    patched = true;
+bool IPartition::replaceFile(std::string_view fstPath, std::string_view srcPath, const PatchEngine& patches) {
+  /* Resolve the FST path one component at a time */
+  const Node* dir = &m_nodes[0];
+  Node* node = nullptr;
+  size_t pos = 0;
+  while (pos < fstPath.size()) {
+    size_t end = fstPath.find('/', pos);
+    if (end == std::string_view::npos)
+      end = fstPath.size();
+    std::string_view comp = fstPath.substr(pos, end - pos);
+    pos = end + 1;
+    if (comp.empty())
+      continue;
+    node = nullptr;
+    if (dir) {
+      for (Node& child : *dir) {
+        if (SJISToUTF8(child.getName()).str() == comp) {
+          node = &child;
+          break;
+        }
+      }
+    }
+    if (!node) {
+      spdlog::error("unable to find '{}' in partition FST", fstPath);
+      return false;
+    }
+    dir = node->getKind() == Node::Kind::Directory ? node : nullptr;
+  }
+  if (!node || node->getKind() != Node::Kind::File) {
+    spdlog::error("'{}' is not a file", fstPath);
+    return false;
+  }
+  size_t nodeIdx = node - m_nodes.data();
+
+  std::unique_ptr<IFileIO> fio = NewFileIO(srcPath);
+  if (!fio->exists()) {
+    spdlog::error("unable to open '{}' for reading", srcPath);
+    return false;
+  }
+  uint64_t newSz = fio->size();
+  if (newSz > UINT32_MAX) {
+    spdlog::error("'{}' is too large for an FST entry", srcPath);
+    return false;
+  }
+
+  /* Every extent still in use once this file lets go of its own */
+  ExtentMap used;
+  used.claim(0, 0x2440 + m_apploaderSz);
+  used.claim(m_dolOff, m_dolSz);
+  used.claim(m_fstOff, m_fstSz);
+  for (const Node& other : m_nodes)
+    if (&other != node && other.m_kind == Node::Kind::File)
+      used.claim(other.m_discOffset, other.m_discLength);
+
+  /* Keep the current extent if nothing else shares it (deduplicated images) and the data fits */
+  uint64_t newOff = node->m_discOffset;
+  uint64_t limit = 0;
+  if (used.isFree(newOff, nod::max(node->m_discLength, uint64_t(1))))
+    limit = used.nextUsed(newOff, getDataEnd());
+  if (newOff + newSz > limit) {
+    /* Relocate into the first gap large enough for the 32-byte aligned file */
+    newOff = used.allocate(ROUND_UP_32(newSz), getDataEnd());
+    if (newOff == UINT64_MAX) {
+      spdlog::error("no free space for '{}' ({} bytes)", fstPath, newSz);
+      return false;
+    }
+    limit = newOff + ROUND_UP_32(newSz);
+  }
+
+  /* Read the FST entry before patching so the read never sees a partly written group */
+  std::unique_ptr<IPartReadStream> fstRs = beginFSTReadStream(nodeIdx * sizeof(FSTNode));
+  FSTNode fstNode(false, 0, 0, 0);
+  if (!fstRs || fstRs->read(&fstNode, sizeof(FSTNode)) != sizeof(FSTNode)) {
+    spdlog::error("unable to read FST entry for '{}'", fstPath);
+    return false;
+  }
+  fstRs.reset();
+
+  /* Data and FST entry go through one stream so the Wii H3/TMD refresh runs once per replace */
+  std::unique_ptr<IFileIO::IReadStream> rs = fio->beginReadStream();
+  std::unique_ptr<IPartPatchStream> ws = beginPatchStream(newOff);
+  if (!rs || !ws)
+    return false;
+
+  bool isExecutable;
+  IsSystemFile(node->getName(), isExecutable);
+  PatchEngine::Scanner scanner(patches);
+  std::vector<uint8_t> buf(0x100000);
+  std::vector<uint8_t> patched;
+  uint64_t rem = newSz;
+  while (rem) {
+    uint64_t thisSz = nod::min(rem, uint64_t(0x100000));
+    if (rs->read(buf.data(), thisSz) != thisSz) {
+      spdlog::error("unable to read '{}'", srcPath);
+      return false;
+    }
+    rem -= thisSz;
+    const uint8_t* out = buf.data();
+    if (isExecutable) {
+      scanner.feed(buf.data(), thisSz, patched);
+      if (!rem) {
+        std::vector<uint8_t> tail;
+        scanner.finish(tail);
+        patched.insert(patched.end(), tail.begin(), tail.end());
+      }
+      out = patched.data();
+      thisSz = patched.size();
+    }
+    if (ws->write(out, thisSz) != thisSz) {
+      spdlog::error("unable to write '{}' into image", fstPath);
+      return false;
+    }
+  }
+
+  /* Pad to the next 32-byte boundary like a fresh build, without crossing into a neighbour */
+  uint64_t padEnd = nod::min(newOff + ROUND_UP_32(newSz), limit);
+  if (padEnd > newOff + newSz) {
+    uint8_t pad[32];
+    memset(pad, 0xff, sizeof(pad));
+    uint64_t padSz = padEnd - (newOff + newSz);
+    if (ws->write(pad, padSz) != padSz) {
+      spdlog::error("unable to write '{}' into image", fstPath);
+      return false;
+    }
+  }
+
+  /* Point the FST entry at the new data, only once the data itself went through */
+  fstNode = FSTNode(false, fstNode.getNameOffset(), packOffset(newOff), uint32_t(newSz));
+  if (!ws->seek(m_fstOff + nodeIdx * sizeof(FSTNode)) || ws->write(&fstNode, sizeof(FSTNode)) != sizeof(FSTNode)) {
+    spdlog::error("unable to update FST entry for '{}'", fstPath);
+    return false;
   }
+  if (!ws->finish()) {
+    spdlog::error("unable to store '{}' in image", fstPath);
+    return false;
+  }
+
+  node->m_discOffset = newOff;
+  node->m_discLength = newSz;
+  return true;
 }
 
-static size_t PatchDOL(IFileIO::IReadStream& in, IPartWriteStream& out, size_t sz, bool& patched) {
-  std::unique_ptr<uint8_t[]> buf(new uint8_t[sz]);
-  sz = in.read(buf.get(), sz);
-  PatchDOL(buf, sz, patched);
-  return out.write(buf.get(), sz);
+bool DiscBuilderBase::PartitionBuilderBase::hashPlanFile(const PartitionBuildPlan::File& file,
+                                                         std::array<uint8_t, 20>& hashOut) {
+  sha1nfo sha;
+  sha1_init(&sha);
+  char buf[0x8000];
+  uint64_t rem = file.m_dataSize;
+  if (file.m_node) {
+    std::unique_ptr<IPartReadStream> rs = file.m_node->beginReadStream();
+    if (!rs)
+      return false;
+    while (rem) {
+      uint64_t rdSz = rs->read(buf, nod::min(uint64_t(0x8000), rem));
+      if (!rdSz)
+        break;
+      sha1_write(&sha, buf, rdSz);
+      rem -= rdSz;
+    }
+  } else {
+    std::unique_ptr<IFileIO::IReadStream> rs = NewFileIO(file.m_path)->beginReadStream();
+    if (!rs)
+      return false;
+    while (rem) {
+      uint64_t rdSz = rs->read(buf, nod::min(uint64_t(0x8000), rem));
+      if (!rdSz)
+        break;
+      sha1_write(&sha, buf, rdSz);
+      rem -= rdSz;
+    }
+  }
+  if (rem) {
+    spdlog::error("unable to read {} for deduplication", file.m_name);
+    return false;
+  }
+
+  memmove(hashOut.data(), sha1_result(&sha), 20);
+  return true;
 }
 
-void DiscBuilderBase::PartitionBuilderBase::recursiveBuildNodesPre(std::string_view filesIn) {
-  DirectoryEnumerator dEnum(filesIn, DirectoryEnumerator::Mode::DirsThenFilesSorted, false, false, true);
-  for (const DirectoryEnumerator::Entry& e : dEnum) {
-    if (e.m_isDir)
-      recursiveBuildNodesPre(e.m_path.c_str());
-    else
-      ++m_parent.m_progressTotal;
+bool DiscBuilderBase::PartitionBuilderBase::planFile(PartitionBuildPlan::File file, std::string_view key) {
+  /* Dedup candidates are matched on size first; content is only hashed once sizes collide */
+  const bool dedup = m_parent.m_deduplicate && !key.empty() && file.m_dataSize;
+  std::array<uint8_t, 20> hash;
+  bool hashed = false;
+  if (dedup) {
+    auto search = m_dedupBySize.find(file.m_dataSize);
+    if (search != m_dedupBySize.cend()) {
+      if (!hashPlanFile(file, hash))
+        return false;
+      hashed = true;
+      for (size_t idx : search->second) {
+        const PartitionBuildPlan::File& cand = m_plan.m_files[idx];
+        if (cand.m_isExecutable != file.m_isExecutable)
+          continue;
+        auto candHash = m_dedupHashes.find(idx);
+        if (candHash == m_dedupHashes.cend()) {
+          std::array<uint8_t, 20> h;
+          if (!hashPlanFile(cand, h))
+            return false;
+          candHash = m_dedupHashes.emplace(idx, h).first;
+        }
+        if (candHash->second == hash) {
+          m_fileOffsetsSizes[std::string(key)] = std::make_pair(cand.m_offset, cand.m_size);
+          ++m_plan.m_dedupFiles;
+          m_plan.m_dedupBytes += cand.m_size;
+          return true;
+        }
+      }
+    }
+  }
+
+  file.m_size = ROUND_UP_32(file.m_dataSize);
+  file.m_offset = userAllocate(file.m_size);
+  if (file.m_offset == UINT64_MAX)
+    return false;
+  if (!key.empty())
+    m_fileOffsetsSizes[std::string(key)] = std::make_pair(file.m_offset, file.m_size);
+  if (dedup) {
+    m_dedupBySize[file.m_dataSize].push_back(m_plan.m_files.size());
+    if (hashed)
+      m_dedupHashes[m_plan.m_files.size()] = hash;
   }
+  m_plan.m_files.push_back(std::move(file));
+  return true;
 }
 
-bool DiscBuilderBase::PartitionBuilderBase::recursiveBuildNodes(IPartWriteStream& ws, bool system,
-                                                                std::string_view filesIn) {
+void DiscBuilderBase::PartitionBuilderBase::recursiveBuildNodes(bool system, std::string_view filesIn,
+                                                                std::string_view keyPath) {
   DirectoryEnumerator dEnum(filesIn, DirectoryEnumerator::Mode::DirsThenFilesSorted, false, false, true);
   for (const DirectoryEnumerator::Entry& e : dEnum) {
+    std::string chKeyPath = std::string(keyPath) + '/' + e.m_name;
     if (e.m_isDir) {
-      if (!recursiveBuildNodes(ws, system, e.m_path.c_str()))
-        return false;
+      recursiveBuildNodes(system, e.m_path.c_str(), chKeyPath);
     } else {
-      bool isDol;
-      bool isSys = IsSystemFile(e.m_name, isDol);
+      bool isExecutable;
+      bool isSys = IsSystemFile(e.m_name, isExecutable);
       if (system ^ isSys)
         continue;
 
-      size_t fileSz = ROUND_UP_32(e.m_fileSz);
-      uint64_t fileOff = userAllocate(fileSz, ws);
-      if (fileOff == UINT64_MAX)
-        return false;
-      m_fileOffsetsSizes[e.m_path] = std::make_pair(fileOff, fileSz);
-      std::unique_ptr<IFileIO::IReadStream> rs = NewFileIO(e.m_path)->beginReadStream();
-      if (!rs)
-        return false;
-      size_t xferSz = 0;
-      if (isDol) {
-        bool patched;
-        xferSz = PatchDOL(*rs, ws, e.m_fileSz, patched);
-        m_parent.m_progressCB(m_parent.getProgressFactor(),
-                              e.m_name + (patched ? " [PATCHED]" : ""), xferSz);
-        ++m_parent.m_progressIdx;
-      } else {
-        char buf[0x8000];
-        while (xferSz < e.m_fileSz) {
-          size_t rdSz = rs->read(buf, nod::min(size_t(0x8000ul), e.m_fileSz - xferSz));
-          if (!rdSz)
-            break;
-          ws.write(buf, rdSz);
-          xferSz += rdSz;
-          m_parent.m_progressCB(m_parent.getProgressFactorMidFile(xferSz, e.m_fileSz), e.m_name, xferSz);
-        }
-        ++m_parent.m_progressIdx;
-      }
-      for (size_t i = 0; i < fileSz - xferSz; ++i)
-        ws.write("\xff", 1);
+      PlanQueueEntry& q = m_planQueue.emplace_back();
+      q.m_file.m_name = e.m_name;
+      q.m_file.m_path = e.m_path;
+      q.m_file.m_fstPath = std::move(chKeyPath);
+      q.m_file.m_dataSize = e.m_fileSz;
+      q.m_file.m_isExecutable = isExecutable;
+      q.m_key = e.m_path;
     }
   }
-
-  return true;
 }
 
 bool DiscBuilderBase::PartitionBuilderBase::recursiveBuildFST(std::string_view filesIn,
@@ -388,51 +698,7 @@ bool DiscBuilderBase::PartitionBuilderBase::recursiveBuildFST(std::string_view f
   return true;
 }
 
-void DiscBuilderBase::PartitionBuilderBase::recursiveMergeNodesPre(const Node* nodeIn, std::string_view dirIn) {
-  /* Build map of existing nodes to write-through later */
-  std::unordered_map<std::string, const Node*> fileNodes;
-  std::unordered_map<std::string, const Node*> dirNodes;
-  if (nodeIn) {
-    fileNodes.reserve(nodeIn->size());
-    dirNodes.reserve(nodeIn->size());
-    for (const Node& ch : *nodeIn) {
-      if (ch.getKind() == Node::Kind::File)
-        fileNodes.insert(std::make_pair(ch.getName(), &ch));
-      else if (ch.getKind() == Node::Kind::Directory)
-        dirNodes.insert(std::make_pair(ch.getName(), &ch));
-    }
-  }
-
-  /* Merge this directory's files */
-  if (!dirIn.empty()) {
-    DirectoryEnumerator dEnum(dirIn, DirectoryEnumerator::Mode::DirsThenFilesSorted, false, false, true);
-    for (const DirectoryEnumerator::Entry& e : dEnum) {
-      UTF8ToSJIS nameView(e.m_name);
-      if (e.m_isDir) {
-        auto search = dirNodes.find(nameView.str());
-        if (search != dirNodes.cend()) {
-          recursiveMergeNodesPre(search->second, e.m_path.c_str());
-          dirNodes.erase(search);
-        } else {
-          recursiveMergeNodesPre(nullptr, e.m_path.c_str());
-        }
-      } else {
-        fileNodes.erase(nameView.str());
-        ++m_parent.m_progressTotal;
-      }
-    }
-  }
-
-  /* Write-through remaining dir nodes */
-  for (const auto& p : dirNodes) {
-    recursiveMergeNodesPre(p.second, {});
-  }
-
-  /* Write-through remaining file nodes */
-  m_parent.m_progressTotal += fileNodes.size();
-}
-
-bool DiscBuilderBase::PartitionBuilderBase::recursiveMergeNodes(IPartWriteStream& ws, bool system, const Node* nodeIn,
+void DiscBuilderBase::PartitionBuilderBase::recursiveMergeNodes(bool system, const Node* nodeIn,
                                                                 std::string_view dirIn, std::string_view keyPath) {
   /* Build map of existing nodes to write-through later */
   std::unordered_map<std::string, const Node*> fileNodes;
@@ -458,50 +724,26 @@ bool DiscBuilderBase::PartitionBuilderBase::recursiveMergeNodes(IPartWriteStream
       if (e.m_isDir) {
         auto search = dirNodes.find(nameView.str());
         if (search != dirNodes.cend()) {
-          if (!recursiveMergeNodes(ws, system, search->second, e.m_path.c_str(), chKeyPath))
-            return false;
+          recursiveMergeNodes(system, search->second, e.m_path.c_str(), chKeyPath);
           dirNodes.erase(search);
         } else {
-          if (!recursiveMergeNodes(ws, system, nullptr, e.m_path.c_str(), chKeyPath))
-            return false;
+          recursiveMergeNodes(system, nullptr, e.m_path.c_str(), chKeyPath);
         }
       } else {
-        bool isDol;
-        bool isSys = IsSystemFile(e.m_name, isDol);
+        bool isExecutable;
+        bool isSys = IsSystemFile(e.m_name, isExecutable);
         if (system ^ isSys)
           continue;
 
         fileNodes.erase(nameView.str());
 
-        size_t fileSz = ROUND_UP_32(e.m_fileSz);
-        uint64_t fileOff = userAllocate(fileSz, ws);
-        if (fileOff == UINT64_MAX)
-          return false;
-        m_fileOffsetsSizes[chKeyPath] = std::make_pair(fileOff, fileSz);
-        std::unique_ptr<IFileIO::IReadStream> rs = NewFileIO(e.m_path)->beginReadStream();
-        if (!rs)
-          return false;
-        size_t xferSz = 0;
-        if (isDol) {
-          bool patched;
-          xferSz = PatchDOL(*rs, ws, e.m_fileSz, patched);
-          m_parent.m_progressCB(m_parent.getProgressFactor(),
-                                e.m_name + (patched ? " [PATCHED]" : ""), xferSz);
-          ++m_parent.m_progressIdx;
-        } else {
-          char buf[0x8000];
-          while (xferSz < e.m_fileSz) {
-            size_t rdSz = rs->read(buf, nod::min(size_t(0x8000ul), e.m_fileSz - xferSz));
-            if (!rdSz)
-              break;
-            ws.write(buf, rdSz);
-            xferSz += rdSz;
-            m_parent.m_progressCB(m_parent.getProgressFactorMidFile(xferSz, e.m_fileSz), e.m_name, xferSz);
-          }
-          ++m_parent.m_progressIdx;
-        }
-        for (size_t i = 0; i < fileSz - xferSz; ++i)
-          ws.write("\xff", 1);
+        PlanQueueEntry& q = m_planQueue.emplace_back();
+        q.m_file.m_name = e.m_name;
+        q.m_file.m_path = e.m_path;
+        q.m_file.m_fstPath = chKeyPath;
+        q.m_file.m_dataSize = e.m_fileSz;
+        q.m_file.m_isExecutable = isExecutable;
+        q.m_key = std::move(chKeyPath);
       }
     }
   }
@@ -510,8 +752,7 @@ bool DiscBuilderBase::PartitionBuilderBase::recursiveMergeNodes(IPartWriteStream
   for (const auto& p : dirNodes) {
     SJISToUTF8 sysName(p.second->getName());
     std::string chKeyPath = std::string(keyPath) + '/' + sysName.str();
-    if (!recursiveMergeNodes(ws, system, p.second, {}, chKeyPath))
-      return false;
+    recursiveMergeNodes(system, p.second, {}, chKeyPath);
   }
 
   /* Write-through remaining file nodes */
@@ -520,47 +761,19 @@ bool DiscBuilderBase::PartitionBuilderBase::recursiveMergeNodes(IPartWriteStream
     SJISToUTF8 sysName(ch.getName());
     std::string chKeyPath = std::string(keyPath) + '/' + sysName.str();
 
-    bool isDol;
-    bool isSys = IsSystemFile(ch.getName(), isDol);
+    bool isExecutable;
+    bool isSys = IsSystemFile(ch.getName(), isExecutable);
     if (system ^ isSys)
       continue;
 
-    size_t fileSz = ROUND_UP_32(ch.size());
-    uint64_t fileOff = userAllocate(fileSz, ws);
-    if (fileOff == UINT64_MAX)
-      return false;
-    m_fileOffsetsSizes[chKeyPath] = std::make_pair(fileOff, fileSz);
-    std::unique_ptr<IPartReadStream> rs = ch.beginReadStream();
-    if (!rs)
-      return false;
-    size_t xferSz = 0;
-    if (isDol) {
-      xferSz = ch.size();
-      std::unique_ptr<uint8_t[]> dolBuf = ch.getBuf();
-      bool patched;
-      PatchDOL(dolBuf, xferSz, patched);
-      ws.write(dolBuf.get(), xferSz);
-      m_parent.m_progressCB(m_parent.getProgressFactor(),
-                            std::string(ch.getName()) + (patched ? " [PATCHED]" : ""),
-                            xferSz);
-      ++m_parent.m_progressIdx;
-    } else {
-      char buf[0x8000];
-      while (xferSz < ch.size()) {
-        size_t rdSz = rs->read(buf, nod::min(size_t(0x8000), size_t(ch.size() - xferSz)));
-        if (!rdSz)
-          break;
-        ws.write(buf, rdSz);
-        xferSz += rdSz;
-        m_parent.m_progressCB(m_parent.getProgressFactorMidFile(xferSz, ch.size()), ch.getName(), xferSz);
-      }
-      ++m_parent.m_progressIdx;
-    }
-    for (size_t i = 0; i < fileSz - xferSz; ++i)
-      ws.write("\xff", 1);
+    PlanQueueEntry& q = m_planQueue.emplace_back();
+    q.m_file.m_name = ch.getName();
+    q.m_file.m_node = &ch;
+    q.m_file.m_fstPath = chKeyPath;
+    q.m_file.m_dataSize = ch.size();
+    q.m_file.m_isExecutable = isExecutable;
+    q.m_key = std::move(chKeyPath);
   }
-
-  return true;
 }
 
 bool DiscBuilderBase::PartitionBuilderBase::recursiveMergeFST(const Node* nodeIn, std::string_view dirIn,
@@ -656,141 +869,116 @@ bool DiscBuilderBase::PartitionBuilderBase::recursiveMergeFST(const Node* nodeIn
   return true;
 }
 
-bool DiscBuilderBase::PartitionBuilderBase::RecursiveCalculateTotalSize(uint64_t& totalSz, const Node* nodeIn,
-                                                                        std::string_view dirIn) {
-  /* Build map of existing nodes to write-through later */
-  std::unordered_map<std::string, const Node*> fileNodes;
-  std::unordered_map<std::string, const Node*> dirNodes;
-  if (nodeIn) {
-    fileNodes.reserve(nodeIn->size());
-    dirNodes.reserve(nodeIn->size());
-    for (const Node& ch : *nodeIn) {
-      if (ch.getKind() == Node::Kind::File)
-        fileNodes.insert(std::make_pair(ch.getName(), &ch));
-      else if (ch.getKind() == Node::Kind::Directory)
-        dirNodes.insert(std::make_pair(ch.getName(), &ch));
-    }
+bool DiscBuilderBase::PartitionBuilderBase::planQueuedFiles() {
+  std::vector<size_t> order(m_planQueue.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+
+  if (!m_parent.m_accessRanks.empty()) {
+    /* Profiled files lead in first-access order so co-accessed files sit together;
+     * everything else keeps directory order behind them */
+    auto rankOf = [&](size_t idx) {
+      auto search = m_parent.m_accessRanks.find(m_planQueue[idx].m_file.m_fstPath);
+      return search != m_parent.m_accessRanks.cend() ? search->second : SIZE_MAX;
+    };
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return rankOf(a) < rankOf(b); });
+    size_t profiled = 0;
+    while (profiled < order.size() && rankOf(order[profiled]) != SIZE_MAX)
+      ++profiled;
+    m_plan.m_profiledFiles = profiled;
+
+    /* Downward allocators place the first file highest; reverse so accesses still ascend */
+    if (userAllocatesDownward())
+      std::reverse(order.begin(), order.begin() + profiled);
   }
 
-  /* Merge this directory's files */
-  if (!dirIn.empty()) {
-    DirectoryEnumerator dEnum(dirIn, DirectoryEnumerator::Mode::DirsThenFilesSorted, false, false, true);
-    for (const DirectoryEnumerator::Entry& e : dEnum) {
-      UTF8ToSJIS nameView(e.m_name);
-
-      if (e.m_isDir) {
-        auto search = dirNodes.find(nameView.str());
-        if (search != dirNodes.cend()) {
-          if (!RecursiveCalculateTotalSize(totalSz, search->second, e.m_path))
-            return false;
-          dirNodes.erase(search);
-        } else {
-          if (!RecursiveCalculateTotalSize(totalSz, nullptr, e.m_path))
-            return false;
-        }
-      } else {
-        fileNodes.erase(nameView.str());
-        totalSz += ROUND_UP_32(e.m_fileSz);
-      }
-    }
-  }
-
-  /* Write-through remaining dir nodes */
-  for (const auto& p : dirNodes) {
-    if (!RecursiveCalculateTotalSize(totalSz, p.second, {}))
+  for (size_t idx : order) {
+    PlanQueueEntry& q = m_planQueue[idx];
+    if (!planFile(std::move(q.m_file), q.m_key))
       return false;
   }
+  m_planQueue.clear();
+  return true;
+}
 
-  /* Write-through remaining file nodes */
-  for (const auto& p : fileNodes) {
-    const Node& ch = *p.second;
-    totalSz += ROUND_UP_32(ch.size());
-  }
+void DiscBuilderBase::PartitionBuilderBase::resetPlan() {
+  m_fileOffsetsSizes.clear();
+  m_buildNodes.clear();
+  m_buildNames.clear();
+  m_buildNameOff = 0;
+  m_dedupBySize.clear();
+  m_dedupHashes.clear();
+  m_planQueue.clear();
+  m_plan = PartitionBuildPlan();
+  m_plan.m_kind = m_kind;
 
-  return true;
+  /* Add root node */
+  m_buildNodes.emplace_back(true, uint32_t(m_buildNameOff), 0, 1);
+  addBuildName("<root>");
 }
 
-bool DiscBuilderBase::PartitionBuilderBase::buildFromDirectory(IPartWriteStream& ws, std::string_view dirIn) {
+void DiscBuilderBase::PartitionBuilderBase::finishPlanFST(uint64_t apploaderSz) {
+  const PartitionBuildPlan::File& dol = m_plan.m_files.front();
+  m_dolOffset = dol.m_offset;
+  m_dolSize = dol.m_size;
+  m_plan.m_dolOffset = m_dolOffset;
+  m_plan.m_dolSize = m_dolSize;
+  m_plan.m_apploaderSize = apploaderSz;
+  m_plan.m_fstOffset = 0x2440 + ROUND_UP_32(apploaderSz);
+  m_plan.m_fstSize = ROUND_UP_32(sizeof(FSTNode) * m_buildNodes.size() + m_buildNameOff);
+}
+
+bool DiscBuilderBase::PartitionBuilderBase::planFromDirectory(std::string_view dirIn) {
   if (dirIn.empty()) {
-    spdlog::error("all arguments must be supplied to buildFromDirectory()");
+    spdlog::error("all arguments must be supplied to planFromDirectory()");
     return false;
   }
 
   std::string dirStr(dirIn);
   std::string basePath = m_isWii ? dirStr + "/" + getKindString(m_kind) : dirStr;
   std::string dolIn = basePath + "/sys/main.dol";
+  std::string apploaderIn = basePath + "/sys/apploader.img";
   std::string filesIn = basePath + "/files";
 
-  /* 1st pass - Tally up total progress steps */
-  m_parent.m_progressTotal += 2; /* Prep and DOL */
-  recursiveBuildNodesPre(filesIn);
-
-  /* Clear file */
-  m_parent.m_progressCB(m_parent.getProgressFactor(), "Preparing output image", -1);
-  ++m_parent.m_progressIdx;
+  resetPlan();
 
-  /* Add root node */
-  m_buildNodes.emplace_back(true, uint32_t(m_buildNameOff), 0, 1);
-  addBuildName("<root>");
+  Sstat apploaderStat;
+  if (Stat(apploaderIn.c_str(), &apploaderStat)) {
+    spdlog::error("unable to stat {}", apploaderIn);
+    return false;
+  }
 
-  /* Write Boot DOL first (first thing seeked to after Apploader) */
+  /* Boot DOL goes first (first thing seeked to after Apploader) */
   {
     Sstat dolStat;
     if (Stat(dolIn.c_str(), &dolStat)) {
       spdlog::error("unable to stat {}", dolIn);
       return false;
     }
-    size_t fileSz = ROUND_UP_32(dolStat.st_size);
-    uint64_t fileOff = userAllocate(fileSz, ws);
-    if (fileOff == UINT64_MAX)
-      return false;
-    m_dolOffset = fileOff;
-    m_dolSize = fileSz;
-    std::unique_ptr<IFileIO::IReadStream> rs = NewFileIO(dolIn)->beginReadStream();
-    if (!rs)
+    PartitionBuildPlan::File file;
+    file.m_name = dolIn;
+    file.m_path = dolIn;
+    file.m_dataSize = dolStat.st_size;
+    file.m_isExecutable = true;
+    if (!planFile(std::move(file), {}))
       return false;
-    bool patched;
-    size_t xferSz = PatchDOL(*rs, ws, dolStat.st_size, patched);
-    m_parent.m_progressCB(m_parent.getProgressFactor(), dolIn + (patched ? " [PATCHED]" : ""),
-                          xferSz);
-    ++m_parent.m_progressIdx;
-    for (size_t i = 0; i < fileSz - xferSz; ++i)
-      ws.write("\xff", 1);
   }
 
   /* Gather files in root directory */
-  if (!recursiveBuildNodes(ws, true, filesIn))
-    return false;
-  if (!recursiveBuildNodes(ws, false, filesIn))
+  recursiveBuildNodes(true, filesIn, {});
+  recursiveBuildNodes(false, filesIn, {});
+  if (!planQueuedFiles())
     return false;
   if (!recursiveBuildFST(filesIn, [&]() { m_buildNodes[0].incrementLength(); }, 0))
     return false;
 
+  finishPlanFST(apploaderStat.st_size);
   return true;
 }
 
-std::optional<uint64_t> DiscBuilderBase::PartitionBuilderBase::CalculateTotalSizeBuild(std::string_view dirIn,
-                                                                                       PartitionKind kind, bool isWii) {
-  std::string dirStr(dirIn);
-  std::string basePath = isWii ? dirStr + "/" + getKindString(kind) : dirStr;
-  std::string dolIn = basePath + "/sys/main.dol";
-  std::string filesIn = basePath + "/files";
-
-  Sstat dolStat;
-  if (Stat(dolIn.c_str(), &dolStat)) {
-    spdlog::error("unable to stat {}", dolIn);
-    return std::nullopt;
-  }
-  uint64_t totalSz = ROUND_UP_32(dolStat.st_size);
-  if (!RecursiveCalculateTotalSize(totalSz, nullptr, filesIn))
-    return std::nullopt;
-  return totalSz;
-}
-
-bool DiscBuilderBase::PartitionBuilderBase::mergeFromDirectory(IPartWriteStream& ws, const IPartition* partIn,
-                                                               std::string_view dirIn) {
+bool DiscBuilderBase::PartitionBuilderBase::planFromMerge(const IPartition* partIn, std::string_view dirIn) {
   if (dirIn.empty()) {
-    spdlog::error("all arguments must be supplied to mergeFromDirectory()");
+    spdlog::error("all arguments must be supplied to planFromMerge()");
     return false;
   }
 
@@ -798,61 +986,362 @@ bool DiscBuilderBase::PartitionBuilderBase::mergeFromDirectory(IPartWriteStream&
   std::string basePath = m_isWii ? dirStr + "/" + getKindString(m_kind) : dirStr;
   std::string filesIn = basePath + "/files";
 
-  /* 1st pass - Tally up total progress steps */
-  m_parent.m_progressTotal += 2; /* Prep and DOL */
-  recursiveMergeNodesPre(&partIn->getFSTRoot(), filesIn);
+  resetPlan();
+  m_plan.m_sourcePartition = partIn;
 
-  /* Clear file */
-  m_parent.m_progressCB(m_parent.getProgressFactor(), "Preparing output image", -1);
-  ++m_parent.m_progressIdx;
-
-  /* Add root node */
-  m_buildNodes.emplace_back(true, uint32_t(m_buildNameOff), 0, 1);
-  addBuildName("<root>");
-
-  /* Write Boot DOL first (first thing seeked to after Apploader) */
+  /* Boot DOL goes first (first thing seeked to after Apploader) */
   {
-    size_t xferSz = partIn->getDOLSize();
-    size_t fileSz = ROUND_UP_32(xferSz);
-    uint64_t fileOff = userAllocate(fileSz, ws);
-    if (fileOff == UINT64_MAX)
+    PartitionBuildPlan::File file;
+    file.m_name = "<boot-dol>";
+    file.m_dataSize = partIn->getDOLSize();
+    file.m_isExecutable = true;
+    if (!planFile(std::move(file), {}))
       return false;
-    m_dolOffset = fileOff;
-    m_dolSize = fileSz;
-    std::unique_ptr<uint8_t[]> dolBuf = partIn->getDOLBuf();
-    bool patched;
-    PatchDOL(dolBuf, xferSz, patched);
-    ws.write(dolBuf.get(), xferSz);
-    m_parent.m_progressCB(m_parent.getProgressFactor(),
-                          std::string("<boot-dol>") + (patched ? " [PATCHED]" : ""),
-                          xferSz);
-    ++m_parent.m_progressIdx;
-    for (size_t i = 0; i < fileSz - xferSz; ++i)
-      ws.write("\xff", 1);
   }
 
   /* Gather files in root directory */
   std::string keyPath;
-  if (!recursiveMergeNodes(ws, true, &partIn->getFSTRoot(), filesIn, keyPath))
-    return false;
-  if (!recursiveMergeNodes(ws, false, &partIn->getFSTRoot(), filesIn, keyPath))
+  recursiveMergeNodes(true, &partIn->getFSTRoot(), filesIn, keyPath);
+  recursiveMergeNodes(false, &partIn->getFSTRoot(), filesIn, keyPath);
+  if (!planQueuedFiles())
     return false;
   if (!recursiveMergeFST(&partIn->getFSTRoot(), filesIn, [&]() { m_buildNodes[0].incrementLength(); }, 0, keyPath))
     return false;
 
+  finishPlanFST(partIn->getApploaderSize());
   return true;
 }
 
-std::optional<uint64_t> DiscBuilderBase::PartitionBuilderBase::CalculateTotalSizeMerge(const IPartition* partIn,
-                                                                                       std::string_view dirIn) {
-  std::string dirStr(dirIn);
-  std::string basePath = partIn->isWii() ? dirStr + "/" + getKindString(partIn->getKind()) : dirStr;
-  std::string filesIn = basePath + "/files";
+std::unique_ptr<IReadStream> DiscBuilderBase::PartitionBuilderBase::openPlanFile(const PartitionBuildPlan::File& file,
+                                                                               uint64_t offset) const {
+  if (file.m_node)
+    return file.m_node->beginReadStream(offset);
+  if (!file.m_path.empty())
+    return NewFileIO(file.m_path)->beginReadStream(offset);
+  return m_plan.m_sourcePartition->beginDOLReadStream(offset);
+}
+
+void DiscBuilderBase::PartitionBuilderBase::planFileWindow(const PartitionBuildPlan::File& file, uint64_t lo,
+                                                           uint64_t hi, uint64_t& winLo, uint64_t& winHi) const {
+  winLo = lo;
+  winHi = hi;
+  if (!file.m_isExecutable || hi <= lo)
+    return;
+  const uint64_t context = m_parent.m_patchEngine.getContextSize();
+  winLo = lo > context ? lo - context : 0;
+  winHi = nod::min(hi + context, file.m_dataSize);
+}
+
+bool DiscBuilderBase::PartitionBuilderBase::copyPlanFile(const PartitionBuildPlan::File& file, uint64_t lo,
+                                                         uint64_t hi, const PlanChunkReader& read,
+                                                         const PlanChunkWriter& write, size_t& patchCount) const {
+  uint64_t winLo, winHi;
+  planFileWindow(file, lo, hi, winLo, winHi);
+
+  /* Only the requested part of the window is emitted; the rest is matching context */
+  auto emit = [&](uint64_t off, const uint8_t* data, size_t len) {
+    uint64_t from = nod::max(off, lo);
+    uint64_t to = nod::min(off + len, hi);
+    if (to > from)
+      write(from, data + (from - off), to - from);
+  };
+
+  std::optional<PatchEngine::Scanner> scanner;
+  if (file.m_isExecutable)
+    scanner.emplace(m_parent.m_patchEngine, winLo);
+  std::vector<uint8_t> chunk;
+  std::vector<uint8_t> patched;
+  uint64_t pos = winLo;
+  while (pos < winHi) {
+    if (!read(chunk))
+      return false;
+    if (chunk.empty())
+      break;
+    if (scanner) {
+      scanner->feed(chunk.data(), chunk.size(), patched);
+      emit(scanner->getOutOffset(), patched.data(), patched.size());
+    } else {
+      emit(pos, chunk.data(), chunk.size());
+    }
+    pos += chunk.size();
+  }
+  if (scanner) {
+    scanner->finish(patched);
+    emit(scanner->getOutOffset(), patched.data(), patched.size());
+    patchCount = scanner->getPatchCount();
+  } else {
+    patchCount = 0;
+  }
+  return true;
+}
+
+struct DiscBuilderBase::PartitionBuilderBase::WriteProgress {
+  std::mutex& m_lock;
+  bool m_failed = false;
+};
+
+bool DiscBuilderBase::PartitionBuilderBase::writePlanRange(uint64_t begin, uint64_t end, size_t lookahead,
+                                                           WriteProgress& progress) {
+  std::unique_ptr<IPartWriteStream> ws = beginWriteStream(begin);
+  if (!ws)
+    return false;
+
+  /* Files overlapping this range, in ascending disc order so the stream never seeks backwards;
+   * filesystem sources are read ahead */
+  std::vector<const PartitionBuildPlan::File*> files;
+  for (const PartitionBuildPlan::File& f : m_plan.m_files)
+    if (f.m_offset + f.m_size > begin && f.m_offset < end)
+      files.push_back(&f);
+  std::stable_sort(files.begin(), files.end(),
+                   [](const PartitionBuildPlan::File* a, const PartitionBuildPlan::File* b) {
+                     return a->m_offset < b->m_offset;
+                   });
+  const bool copiesFiles = userCopiesFiles();
+  auto copiesDirectly = [&](const PartitionBuildPlan::File& f) {
+    return copiesFiles && !f.m_path.empty() && !f.m_isExecutable;
+  };
+  std::vector<FilePrefetcher::Request> requests;
+  for (const PartitionBuildPlan::File* fp : files) {
+    const PartitionBuildPlan::File& f = *fp;
+    uint64_t lo = nod::max(f.m_offset, begin);
+    uint64_t hi = nod::min(f.m_offset + f.m_dataSize, end);
+    uint64_t winLo, winHi;
+    planFileWindow(f, lo - f.m_offset, hi - f.m_offset, winLo, winHi);
+    if (f.m_path.empty() || copiesDirectly(f) || hi <= lo)
+      requests.push_back({std::string(), 0, 0});
+    else
+      requests.push_back({f.m_path, winLo, winHi - winLo});
+  }
+  FilePrefetcher prefetcher(std::move(requests), lookahead);
+
+  for (size_t idx = 0; idx < files.size(); ++idx) {
+    const PartitionBuildPlan::File& f = *files[idx];
+    const uint64_t lo = nod::max(f.m_offset, begin);
+    const uint64_t hi = nod::min(f.m_offset + f.m_size, end);
+    const uint64_t dataHi = nod::min(f.m_offset + f.m_dataSize, hi);
+    /* Empty files share the next file's offset and have nothing to position for */
+    if (hi > lo && !userSeek(*ws, lo))
+      return false;
+
+    uint64_t pos = lo;
+    if (dataHi > lo && copiesDirectly(f)) {
+      pos += userCopyFile(*ws, f.m_path, lo - f.m_offset, dataHi - lo);
+      std::lock_guard<std::mutex> lk(progress.m_lock);
+      m_parent.m_progressCB(m_parent.getProgressFactorMidFile(pos - f.m_offset, f.m_dataSize), f.m_name,
+                            pos - f.m_offset);
+    }
+    if (dataHi > pos) {
+      /* Disc sources and whatever a direct copy left over are streamed here;
+       * other filesystem sources come from the prefetcher */
+      PlanChunkReader read;
+      std::unique_ptr<IReadStream> rs;
+      uint64_t rem = 0;
+      if (f.m_path.empty() || copiesDirectly(f)) {
+        uint64_t winLo, winHi;
+        planFileWindow(f, pos - f.m_offset, dataHi - f.m_offset, winLo, winHi);
+        rs = openPlanFile(f, winLo);
+        if (!rs)
+          return false;
+        rem = winHi - winLo;
+        read = [&](std::vector<uint8_t>& chunk) {
+          chunk.resize(nod::min(rem, uint64_t(0x8000)));
+          chunk.resize(rs->read(chunk.data(), chunk.size()));
+          rem -= chunk.size();
+          return true;
+        };
+      } else {
+        read = [&](std::vector<uint8_t>& chunk) { return prefetcher.readChunk(idx, chunk); };
+      }
+
+      size_t patchCount;
+      bool ok = copyPlanFile(f, pos - f.m_offset, dataHi - f.m_offset, read,
+                             [&](uint64_t off, const uint8_t* data, size_t len) {
+                               ws->write(data, len);
+                               pos = f.m_offset + off + len;
+                               std::lock_guard<std::mutex> lk(progress.m_lock);
+                               m_parent.m_progressCB(
+                                   m_parent.getProgressFactorMidFile(pos - f.m_offset, f.m_dataSize), f.m_name,
+                                   pos - f.m_offset);
+                             },
+                             patchCount);
+      if (!ok)
+        return false;
+      if (patchCount) {
+        std::lock_guard<std::mutex> lk(progress.m_lock);
+        m_parent.m_progressCB(m_parent.getProgressFactor(), f.m_name + " [PATCHED]", pos - f.m_offset);
+      }
+    }
+
+    for (; pos < hi; ++pos)
+      ws->write("\xff", 1);
+
+    /* A file counts as done in the range holding its last byte */
+    if (f.m_offset + f.m_size <= end) {
+      std::lock_guard<std::mutex> lk(progress.m_lock);
+      ++m_parent.m_progressIdx;
+    }
 
-  uint64_t totalSz = ROUND_UP_32(partIn->getDOLSize());
-  if (!RecursiveCalculateTotalSize(totalSz, &partIn->getFSTRoot(), filesIn))
-    return std::nullopt;
-  return totalSz;
+    std::lock_guard<std::mutex> lk(progress.m_lock);
+    if (progress.m_failed)
+      return false;
+  }
+
+  return userSeek(*ws, end);
+}
+
+size_t DiscBuilderBase::PartitionBuilderBase::writeThreadCount() const {
+  /* Partitions are written concurrently and split the threads between them */
+  size_t total = m_parent.m_threadCount ? m_parent.m_threadCount : nod::max(std::thread::hardware_concurrency(), 1u);
+  return nod::max(total / m_parent.m_partitions.size(), size_t(1));
+}
+
+void DiscBuilderBase::PartitionBuilderBase::reportProgress(std::string_view name, size_t bytes) {
+  std::lock_guard<std::mutex> lk(*m_parent.m_progressLock);
+  m_parent.m_progressCB(m_parent.getProgressFactor(), name, bytes);
+}
+
+void DiscBuilderBase::PartitionBuilderBase::advanceProgress() {
+  std::lock_guard<std::mutex> lk(*m_parent.m_progressLock);
+  ++m_parent.m_progressIdx;
+}
+
+bool DiscBuilderBase::PartitionBuilderBase::writePlan() {
+  {
+    std::lock_guard<std::mutex> lk(*m_parent.m_progressLock);
+    m_parent.m_progressTotal += m_plan.m_files.size() + 1;
+    m_parent.m_progressCB(m_parent.getProgressFactor(), "Preparing output image", -1);
+    ++m_parent.m_progressIdx;
+  }
+
+  /* Every destination offset is known up front, so the user area is cut into
+   * aligned contiguous ranges that are filled concurrently */
+  size_t threadCount = writesSequentially() ? 1 : writeThreadCount();
+  const uint64_t align = writeAlignment();
+  const uint64_t units = (m_plan.m_userEnd - m_plan.m_userStart + align - 1) / align;
+  const size_t rangeCount = size_t(nod::max(uint64_t(1), nod::min(uint64_t(threadCount), units)));
+  const size_t lookahead = nod::max(size_t(8) / rangeCount, size_t(2));
+
+  auto rangeBegin = [&](size_t r) {
+    if (r == rangeCount)
+      return m_plan.m_userEnd;
+    return m_plan.m_userStart + units * r / rangeCount * align;
+  };
+
+  WriteProgress progress{*m_parent.m_progressLock};
+  if (rangeCount == 1)
+    return writePlanRange(m_plan.m_userStart, m_plan.m_userEnd, lookahead, progress);
+
+  std::vector<std::thread> workers;
+  workers.reserve(rangeCount);
+  for (size_t r = 0; r < rangeCount; ++r) {
+    workers.emplace_back([&, r]() {
+      if (!writePlanRange(rangeBegin(r), rangeBegin(r + 1), lookahead, progress)) {
+        std::lock_guard<std::mutex> lk(progress.m_lock);
+        progress.m_failed = true;
+      }
+    });
+  }
+  for (std::thread& worker : workers)
+    worker.join();
+
+  return !progress.m_failed;
+}
+
+static std::string NormalizeProfilePath(std::string_view path) {
+  std::string ret(path);
+  std::replace(ret.begin(), ret.end(), '\\', '/');
+  while (!ret.empty() && (ret.back() == '\r' || ret.back() == ' ' || ret.back() == '\t'))
+    ret.pop_back();
+  if (ret.compare(0, 2, "./") == 0)
+    ret.erase(0, 1);
+  if (ret.compare(0, 6, "files/") == 0)
+    ret.erase(0, 5);
+  else if (ret.compare(0, 7, "/files/") == 0)
+    ret.erase(0, 6);
+  if (ret.empty() || ret.front() != '/')
+    ret.insert(ret.begin(), '/');
+  return ret;
+}
+
+bool DiscBuilderBase::preallocateOutput() {
+  if (isStreaming() || m_fileIO->isSparse())
+    return true;
+  std::unique_ptr<IFileIO::IWriteStream> ws = m_fileIO->beginWriteStream(0);
+  if (!ws)
+    return false;
+  /* Zero-fill by hand only where the file can't be extended directly */
+  if (ws->preallocate(m_discCapacity))
+    return true;
+  std::unique_ptr<uint8_t[]> zeroBytes(new uint8_t[0x100000]());
+  for (uint64_t i = 0; i < uint64_t(m_discCapacity); i += 0x100000) {
+    uint64_t thisSz = nod::min(uint64_t(0x100000), m_discCapacity - i);
+    if (ws->write(zeroBytes.get(), thisSz) != thisSz) {
+      spdlog::error("unable to preallocate image");
+      return false;
+    }
+  }
+  return true;
+}
+
+void DiscBuilderBase::setAccessProfile(const std::vector<std::string>& orderedPaths) {
+  m_accessRanks.clear();
+  for (const std::string& path : orderedPaths)
+    m_accessRanks.emplace(NormalizeProfilePath(path), m_accessRanks.size());
+}
+
+bool DiscBuilderBase::loadAccessProfile(std::string_view path) {
+  std::unique_ptr<IFileIO::IReadStream> rs = NewFileIO(path)->beginReadStream();
+  if (!rs)
+    return false;
+  uint64_t sz = NewFileIO(path)->size();
+  std::string text(sz, '\0');
+  text.resize(rs->read(text.data(), sz));
+
+  /* One access per line: "[<timestamp>] <path>"; '#' starts a comment.
+   * Timestamped lines are ordered by time, untimed lines inherit the previous time. */
+  struct Access {
+    double m_time;
+    std::string m_path;
+  };
+  std::vector<Access> accesses;
+  double lastTime = 0.0;
+  size_t lineBegin = 0;
+  while (lineBegin < text.size()) {
+    size_t lineEnd = text.find('\n', lineBegin);
+    if (lineEnd == std::string::npos)
+      lineEnd = text.size();
+    std::string_view line(text.data() + lineBegin, lineEnd - lineBegin);
+    lineBegin = lineEnd + 1;
+
+    while (!line.empty() && (line.front() == ' ' || line.front() == '\t'))
+      line.remove_prefix(1);
+    if (line.empty() || line.front() == '#' || line.front() == '\r')
+      continue;
+
+    size_t sep = line.find_first_of(" \t");
+    if (sep != std::string_view::npos) {
+      std::string timeStr(line.substr(0, sep));
+      char* end;
+      double time = strtod(timeStr.c_str(), &end);
+      if (end != timeStr.c_str() && *end == '\0') {
+        lastTime = time;
+        line.remove_prefix(sep);
+        while (!line.empty() && (line.front() == ' ' || line.front() == '\t'))
+          line.remove_prefix(1);
+      }
+    }
+    if (!line.empty())
+      accesses.push_back({lastTime, std::string(line)});
+  }
+
+  std::stable_sort(accesses.begin(), accesses.end(),
+                   [](const Access& a, const Access& b) { return a.m_time < b.m_time; });
+  std::vector<std::string> orderedPaths;
+  orderedPaths.reserve(accesses.size());
+  for (Access& a : accesses)
+    orderedPaths.push_back(std::move(a.m_path));
+  setAccessProfile(orderedPaths);
+  return true;
 }
 
 } // namespace nod
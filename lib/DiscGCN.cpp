@@ -116,6 +116,65 @@ public:
 
     return ret;
   }
+
+  class PartPatchStream : public IPartPatchStream {
+    const PartitionGCN& m_parent;
+    std::unique_ptr<IWriteStream> m_dio;
+    uint64_t m_offset;
+    bool m_failed = false;
+
+  public:
+    PartPatchStream(const PartitionGCN& parent, uint64_t offset, bool& err) : m_parent(parent), m_offset(offset) {
+      m_dio = m_parent.m_parent.getDiscIO().beginWriteStream(m_parent.m_offset + offset);
+      if (!m_dio) {
+        spdlog::error("image format does not support in-place writes");
+        err = true;
+      }
+    }
+    void close() override { finish(); }
+    bool finish() override {
+      m_dio.reset();
+      return !m_failed;
+    }
+    bool seek(uint64_t offset) override {
+      if (m_failed || !m_dio)
+        return false;
+      m_dio = m_parent.m_parent.getDiscIO().beginWriteStream(m_parent.m_offset + offset);
+      if (!m_dio) {
+        m_failed = true;
+        return false;
+      }
+      m_offset = offset;
+      return true;
+    }
+    uint64_t position() const override { return m_offset; }
+    uint64_t write(const void* buf, uint64_t length) override {
+      if (!m_dio)
+        return 0;
+      uint64_t ret = m_dio->write(buf, length);
+      if (ret != length)
+        m_failed = true;
+      m_offset += ret;
+      return ret;
+    }
+  };
+
+  std::unique_ptr<IPartPatchStream> beginPatchStream(uint64_t offset) override {
+    bool err = false;
+    auto ret = std::make_unique<PartPatchStream>(*this, offset, err);
+
+    if (err) {
+      return nullptr;
+    }
+
+    return ret;
+  }
+
+  uint64_t getDataEnd() const override { return 0x57058000; }
+
+  void getUsedDiscRanges(std::vector<std::pair<uint64_t, uint64_t>>& rangesOut) const override {
+    getUsedDataRanges(rangesOut);
+  }
 };
 
 DiscGCN::DiscGCN(std::unique_ptr<IDiscIO>&& dio, bool& err) : DiscBase(std::move(dio), err) {
@@ -133,8 +192,14 @@ DiscBuilderGCN DiscGCN::makeMergeBuilder(std::string_view outPath, FProgress pro
 bool DiscGCN::extractDiscHeaderFiles(std::string_view path, const ExtractionContext& ctx) const { return true; }
 
 class PartitionBuilderGCN : public DiscBuilderBase::PartitionBuilderBase {
+  /* End-of-disc layouts count down from the end of the disc; sequential layouts count up from 0
+   * and are moved behind the FST once its size is known */
   uint64_t m_curUser = 0x57058000;
 
+  bool sequentialLayout() const {
+    return static_cast<const DiscBuilderGCN&>(m_parent).getLayout() == GCNLayout::Sequential;
+  }
+
 public:
   class PartWriteStream : public IPartWriteStream {
     const PartitionBuilderGCN& m_parent;
@@ -155,26 +220,62 @@ public:
       m_offset += len;
       return len;
     }
-    void seek(size_t off) {
+    bool seek(uint64_t off) {
       m_offset = off;
+      if (m_fio && m_fio->seek(off))
+        return true;
       m_fio = m_parent.m_parent.getFileIO().beginWriteStream(off);
+      return m_fio != nullptr;
+    }
+    uint64_t copyFromFile(std::string_view path, uint64_t srcOffset, uint64_t length) {
+      uint64_t len = m_fio->copyFromFile(path, srcOffset, length);
+      m_offset += len;
+      return len;
     }
   };
 
   PartitionBuilderGCN(DiscBuilderBase& parent)
   : DiscBuilderBase::PartitionBuilderBase(parent, PartitionKind::Data, false) {}
 
-  uint64_t userAllocate(uint64_t reqSz, IPartWriteStream& ws) override {
+  uint64_t userAllocate(uint64_t reqSz) override {
+    if (sequentialLayout()) {
+      uint64_t ret = m_curUser;
+      m_curUser += reqSz;
+      /* The base is only known once the FST is sized; finishPlan() checks the exact bound.
+       * Reject early only what cannot fit past the smallest base, 0x2440 with no apploader or FST. */
+      if (m_curUser > 0x57058000 - 0x2440) {
+        spdlog::error("user area overflows the disc");
+        return -1;
+      }
+      return ret;
+    }
     m_curUser -= reqSz;
     m_curUser &= 0xfffffffffffffff0;
     if (m_curUser < 0x30000) {
       spdlog::error("user area low mark reached");
       return -1;
     }
-    static_cast<PartWriteStream&>(ws).seek(m_curUser);
     return m_curUser;
   }
 
+  bool userSeek(IPartWriteStream& ws, uint64_t offset) override {
+    PartWriteStream& cws = static_cast<PartWriteStream&>(ws);
+    if (cws.position() != offset)
+      return cws.seek(offset);
+    return true;
+  }
+
+  /* Nothing is hashed or encrypted, so file data can go straight from source to image */
+  bool userCopiesFiles() const override { return !writesSequentially() && m_parent.getFileIO().supportsCopyFromFile(); }
+  uint64_t userCopyFile(IPartWriteStream& ws, std::string_view path, uint64_t srcOffset, uint64_t length) override {
+    return static_cast<PartWriteStream&>(ws).copyFromFile(path, srcOffset, length);
+  }
+
+  bool userAllocatesDownward() const override { return !sequentialLayout(); }
+
+  /* Files are independent regions on GCN; split at a sector-ish granularity */
+  uint64_t writeAlignment() const override { return 0x8000; }
+
   uint32_t packOffset(uint64_t offset) const override { return offset; }
 
   std::unique_ptr<IPartWriteStream> beginWriteStream(uint64_t offset) override {
@@ -192,48 +293,96 @@ public:
   _build(const std::function<bool(IPartWriteStream&, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t)>& headerFunc,
          const std::function<bool(IPartWriteStream&)>& bi2Func,
          const std::function<bool(IPartWriteStream&, size_t&)>& apploaderFunc) {
-    std::unique_ptr<IPartWriteStream> ws = beginWriteStream(0x2440);
+    /* Everything is planned, so the image is emitted front to back: header, apploader and FST, then user area */
+    size_t fstOff = m_plan.m_fstOffset;
+    size_t fstSz = m_plan.m_fstSize;
+    std::unique_ptr<IPartWriteStream> ws = beginWriteStream(0);
+    if (!ws)
+      return false;
+    if (!headerFunc(*ws, m_dolOffset, fstOff, fstSz, m_plan.m_userStart, m_plan.m_userEnd - m_plan.m_userStart))
+      return false;
+    if (!bi2Func(*ws))
+      return false;
+
+    ws = beginWriteStream(0x2440);
     if (!ws)
       return false;
     size_t xferSz = 0;
     if (!apploaderFunc(*ws, xferSz))
       return false;
 
-    size_t fstOff = ROUND_UP_32(xferSz);
-    size_t fstSz = sizeof(FSTNode) * m_buildNodes.size();
-    for (size_t i = 0; i < fstOff - xferSz; ++i)
+    size_t fstOffRel = fstOff - 0x2440;
+    if (xferSz > fstOffRel) {
+      spdlog::error("apploader unexpectedly flows into FST");
+      return false;
+    }
+    for (size_t i = 0; i < fstOffRel - xferSz; ++i)
       ws->write("\xff", 1);
-    fstOff += 0x2440;
-    ws->write(m_buildNodes.data(), fstSz);
+    ws->write(m_buildNodes.data(), sizeof(FSTNode) * m_buildNodes.size());
     for (const std::string& str : m_buildNames)
       ws->write(str.data(), str.size() + 1);
-    fstSz += m_buildNameOff;
-    fstSz = ROUND_UP_32(fstSz);
+    ws.reset();
 
-    if (fstOff + fstSz >= m_curUser) {
-      spdlog::error("FST flows into user area (one or the other is too big)");
+    if (!writePlan())
       return false;
-    }
 
-    ws = beginWriteStream(0);
-    if (!ws)
-      return false;
-    if (!headerFunc(*ws, m_dolOffset, fstOff, fstSz, m_curUser, 0x57058000 - m_curUser))
-      return false;
-    if (!bi2Func(*ws))
-      return false;
+    /* A sequential layout ends short of the disc; streamed images are zero-filled out to full size */
+    if (m_parent.isStreaming() && m_plan.m_userEnd < 0x57058000)
+      return beginWriteStream(0x57058000) != nullptr;
+    return true;
+  }
 
+  /* Moves a sequential plan from its provisional base of 0 to just behind the FST */
+  void relocatePlan(uint64_t base) {
+    for (PartitionBuildPlan::File& f : m_plan.m_files)
+      f.m_offset += base;
+    for (FSTNode& node : m_buildNodes)
+      if (!node.isDir())
+        node.setOffset(uint32_t(node.getOffset() + base));
+    for (auto& [key, offSize] : m_fileOffsetsSizes)
+      offSize.first += base;
+    m_dolOffset += base;
+    m_plan.m_dolOffset = m_dolOffset;
+  }
+
+  bool finishPlan() {
+    if (sequentialLayout()) {
+      const uint64_t base = ROUND_UP_32(m_plan.m_fstOffset + m_plan.m_fstSize);
+      if (base + m_curUser > 0x57058000) {
+        spdlog::error("user area overflows the disc");
+        return false;
+      }
+      relocatePlan(base);
+      m_plan.m_userStart = base;
+      m_plan.m_userEnd = base + m_curUser;
+      m_plan.m_discSize = m_plan.m_userEnd;
+      return true;
+    }
+    m_plan.m_userStart = m_curUser;
+    m_plan.m_userEnd = 0x57058000;
+    if (m_plan.m_fstOffset + m_plan.m_fstSize >= m_curUser) {
+      spdlog::error("FST flows into user area (one or the other is too big)");
+      return false;
+    }
+    m_plan.m_discSize = m_plan.m_fstOffset + m_plan.m_fstSize + (0x57058000 - m_curUser);
     return true;
   }
 
-  bool buildFromDirectory(std::string_view dirIn) {
-    std::unique_ptr<IPartWriteStream> ws = beginWriteStream(0);
-    if (!ws)
+  bool planFromDirectory(std::string_view dirIn) {
+    m_curUser = sequentialLayout() ? 0 : 0x57058000;
+    if (!DiscBuilderBase::PartitionBuilderBase::planFromDirectory(dirIn))
       return false;
-    bool result = DiscBuilderBase::PartitionBuilderBase::buildFromDirectory(*ws, dirIn);
-    if (!result)
+    return finishPlan();
+  }
+
+  bool planFromMerge(const PartitionGCN* partIn, std::string_view dirIn) {
+    m_curUser = sequentialLayout() ? 0 : 0x57058000;
+    if (!DiscBuilderBase::PartitionBuilderBase::planFromMerge(partIn, dirIn))
       return false;
+    return finishPlan();
+  }
 
+  bool buildFromDirectory(std::string_view dirIn) {
     std::string dirStr(dirIn);
 
     /* Check Apploader */
@@ -297,7 +446,7 @@ public:
               break;
             ws.write(buf, rdSz);
             xferSz += rdSz;
-            if (0x2440 + xferSz >= m_curUser) {
+            if (0x2440 + xferSz >= m_plan.m_userStart) {
               spdlog::error("apploader flows into user area (one or the other is too big)");
               return false;
             }
@@ -308,14 +457,7 @@ public:
         });
   }
 
-  bool mergeFromDirectory(const PartitionGCN* partIn, std::string_view dirIn) {
-    std::unique_ptr<IPartWriteStream> ws = beginWriteStream(0);
-    if (!ws)
-      return false;
-    bool result = DiscBuilderBase::PartitionBuilderBase::mergeFromDirectory(*ws, partIn, dirIn);
-    if (!result)
-      return false;
-
+  bool mergeFromDirectory(const PartitionGCN* partIn) {
     return _build(
         [partIn](IPartWriteStream& ws, uint32_t dolOff, uint32_t fstOff, uint32_t fstSz, uint32_t userOff,
                  uint32_t userSz) -> bool {
@@ -339,7 +481,7 @@ public:
           std::string apploaderName("<apploader>");
           ws.write(apploaderBuf.get(), apploaderSz);
           xferSz += apploaderSz;
-          if (0x2440 + xferSz >= m_curUser) {
+          if (0x2440 + xferSz >= m_plan.m_userStart) {
             spdlog::error("apploader flows into user area (one or the other is too big)");
             return false;
           }
@@ -350,39 +492,40 @@ public:
   }
 };
 
+const PartitionBuildPlan* DiscBuilderGCN::planFromDirectory(std::string_view dirIn) {
+  PartitionBuilderGCN& pb = static_cast<PartitionBuilderGCN&>(*m_partitions[0]);
+  return pb.planFromDirectory(dirIn) ? &pb.getPlan() : nullptr;
+}
+
 EBuildResult DiscBuilderGCN::buildFromDirectory(std::string_view dirIn) {
+  if (!planFromDirectory(dirIn))
+    return EBuildResult::Failed;
   if (!m_fileIO->beginWriteStream())
     return EBuildResult::Failed;
-  if (!CheckFreeSpace(m_outPath.c_str(), 0x57058000)) {
+  if (!isStreaming() && !m_fileIO->isSparse() && !CheckFreeSpace(m_outPath.c_str(), 0x57058000)) {
     spdlog::error("not enough free disk space for {}", m_outPath);
     return EBuildResult::DiskFull;
   }
   m_progressCB(getProgressFactor(), "Preallocating image", -1);
   ++m_progressIdx;
-  {
-    auto ws = m_fileIO->beginWriteStream(0);
-    if (!ws)
-      return EBuildResult::Failed;
-    char zeroBytes[1024] = {};
-    for (uint64_t i = 0; i < 0x57058000; i += 1024)
-      ws->write(zeroBytes, 1024);
-  }
+  if (!preallocateOutput())
+    return EBuildResult::Failed;
 
   PartitionBuilderGCN& pb = static_cast<PartitionBuilderGCN&>(*m_partitions[0]);
-  return pb.buildFromDirectory(dirIn) ? EBuildResult::Success : EBuildResult::Failed;
+  if (!pb.buildFromDirectory(dirIn) || !m_fileIO->finish())
+    return EBuildResult::Failed;
+  return EBuildResult::Success;
 }
 
-std::optional<uint64_t> DiscBuilderGCN::CalculateTotalSizeRequired(std::string_view dirIn) {
-  std::optional<uint64_t> sz =
-      DiscBuilderBase::PartitionBuilderBase::CalculateTotalSizeBuild(dirIn, PartitionKind::Data, false);
-  if (!sz)
-    return sz;
-  *sz += 0x30000;
-  if (sz > 0x57058000) {
-    spdlog::error("disc capacity exceeded [{} / {}]", *sz, 0x57058000);
+std::optional<uint64_t> DiscBuilderGCN::calculateTotalSizeRequired(std::string_view dirIn) {
+  const PartitionBuildPlan* plan = planFromDirectory(dirIn);
+  if (!plan)
     return std::nullopt;
-  }
-  return sz;
+  return plan->m_discSize;
+}
+
+std::optional<uint64_t> DiscBuilderGCN::CalculateTotalSizeRequired(std::string_view dirIn) {
+  return DiscBuilderGCN({}, FProgress{}).calculateTotalSizeRequired(dirIn);
 }
 
 DiscBuilderGCN::DiscBuilderGCN(std::string_view outPath, FProgress progressCB)
@@ -393,41 +536,43 @@ DiscBuilderGCN::DiscBuilderGCN(std::string_view outPath, FProgress progressCB)
 DiscMergerGCN::DiscMergerGCN(std::string_view outPath, DiscGCN& sourceDisc, FProgress progressCB)
 : m_sourceDisc(sourceDisc), m_builder(sourceDisc.makeMergeBuilder(outPath, progressCB)) {}
 
+const PartitionBuildPlan* DiscMergerGCN::planFromDirectory(std::string_view dirIn) {
+  PartitionBuilderGCN& pb = static_cast<PartitionBuilderGCN&>(*m_builder.m_partitions[0]);
+  return pb.planFromMerge(static_cast<PartitionGCN*>(m_sourceDisc.getDataPartition()), dirIn) ? &pb.getPlan()
+                                                                                              : nullptr;
+}
+
 EBuildResult DiscMergerGCN::mergeFromDirectory(std::string_view dirIn) {
+  if (!planFromDirectory(dirIn))
+    return EBuildResult::Failed;
   if (!m_builder.getFileIO().beginWriteStream())
     return EBuildResult::Failed;
-  if (!CheckFreeSpace(m_builder.m_outPath.c_str(), 0x57058000)) {
+  if (!m_builder.isStreaming() && !m_builder.m_fileIO->isSparse() &&
+      !CheckFreeSpace(m_builder.m_outPath.c_str(), 0x57058000)) {
     spdlog::error("not enough free disk space for {}", m_builder.m_outPath);
     return EBuildResult::DiskFull;
   }
   m_builder.m_progressCB(m_builder.getProgressFactor(), "Preallocating image", -1);
   ++m_builder.m_progressIdx;
-  {
-    auto ws = m_builder.m_fileIO->beginWriteStream(0);
-    if (!ws)
-      return EBuildResult::Failed;
-    char zeroBytes[1024] = {};
-    for (uint64_t i = 0; i < 0x57058000; i += 1024)
-      ws->write(zeroBytes, 1024);
-  }
+  if (!m_builder.preallocateOutput())
+    return EBuildResult::Failed;
 
   PartitionBuilderGCN& pb = static_cast<PartitionBuilderGCN&>(*m_builder.m_partitions[0]);
-  return pb.mergeFromDirectory(static_cast<PartitionGCN*>(m_sourceDisc.getDataPartition()), dirIn)
-             ? EBuildResult::Success
-             : EBuildResult::Failed;
+  if (!pb.mergeFromDirectory(static_cast<PartitionGCN*>(m_sourceDisc.getDataPartition())) ||
+      !m_builder.m_fileIO->finish())
+    return EBuildResult::Failed;
+  return EBuildResult::Success;
 }
 
-std::optional<uint64_t> DiscMergerGCN::CalculateTotalSizeRequired(DiscGCN& sourceDisc, std::string_view dirIn) {
-  std::optional<uint64_t> sz =
-      DiscBuilderBase::PartitionBuilderBase::CalculateTotalSizeMerge(sourceDisc.getDataPartition(), dirIn);
-  if (!sz)
-    return std::nullopt;
-  *sz += 0x30000;
-  if (sz > 0x57058000) {
-    spdlog::error("disc capacity exceeded [{} / {}]", *sz, 0x57058000);
+std::optional<uint64_t> DiscMergerGCN::calculateTotalSizeRequired(std::string_view dirIn) {
+  const PartitionBuildPlan* plan = planFromDirectory(dirIn);
+  if (!plan)
     return std::nullopt;
-  }
-  return sz;
+  return plan->m_discSize;
+}
+
+std::optional<uint64_t> DiscMergerGCN::CalculateTotalSizeRequired(DiscGCN& sourceDisc, std::string_view dirIn) {
+  return DiscMergerGCN({}, sourceDisc, FProgress{}).calculateTotalSizeRequired(dirIn);
 }
 
 } // namespace nod
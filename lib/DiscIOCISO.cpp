@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "nod/IDiscIO.hpp"
+#include "nod/IFileIO.hpp"
+#include "nod/Endian.hpp"
+#include "Util.hpp"
+
+#include <spdlog/spdlog.h>
+
+namespace nod {
+
+/*
+ * CISO is a block-map image: a 0x8000-byte header holds the magic, the little-endian
+ * block size and one byte per block flagging whether it is stored. Stored blocks follow
+ * in disc order; unstored blocks read as zeros.
+ */
+
+static constexpr uint32_t CISOHeaderSize = 0x8000;
+static constexpr uint32_t CISOMapSize = CISOHeaderSize - 8;
+static constexpr uint32_t CISODefaultBlockSize = 0x200000;
+
+class DiscIOCISO : public IDiscIO {
+  std::unique_ptr<IFileIO> m_fio;
+  uint32_t m_blockSize = 0;
+  /* Stored block number of each disc block, or UINT32_MAX when it is not stored */
+  std::vector<uint32_t> m_blockIndex;
+
+public:
+  DiscIOCISO(std::string_view path, bool& err) : m_fio(NewFileIO(path)) {
+    std::unique_ptr<IFileIO::IReadStream> rs = m_fio->beginReadStream();
+    if (!rs) {
+      err = true;
+      return;
+    }
+    std::unique_ptr<uint8_t[]> header(new uint8_t[CISOHeaderSize]);
+    if (rs->read(header.get(), CISOHeaderSize) != CISOHeaderSize || memcmp(header.get(), "CISO", 4)) {
+      spdlog::error("unable to read CISO header from '{}'", path);
+      err = true;
+      return;
+    }
+    m_blockSize = SLittle(*reinterpret_cast<uint32_t*>(header.get() + 4));
+    if (m_blockSize < 0x8000 || (m_blockSize & (m_blockSize - 1))) {
+      spdlog::error("invalid CISO block size 0x{:x} in '{}'", m_blockSize, path);
+      err = true;
+      return;
+    }
+
+    /* Trailing unstored blocks are left out of the index; reads past it are zeros too */
+    uint32_t blockCount = CISOMapSize;
+    while (blockCount && !header[8 + blockCount - 1])
+      --blockCount;
+    m_blockIndex.resize(blockCount);
+    uint32_t stored = 0;
+    for (uint32_t i = 0; i < blockCount; ++i)
+      m_blockIndex[i] = header[8 + i] ? stored++ : UINT32_MAX;
+  }
+
+  class ReadStream : public IReadStream {
+    friend class DiscIOCISO;
+    const DiscIOCISO& m_parent;
+    std::unique_ptr<IFileIO::IReadStream> m_rs;
+    uint64_t m_offset;
+    uint64_t m_filePos = UINT64_MAX;
+
+    ReadStream(const DiscIOCISO& parent, uint64_t offset, bool& err) : m_parent(parent), m_offset(offset) {
+      m_rs = m_parent.m_fio->beginReadStream();
+      if (!m_rs)
+        err = true;
+    }
+
+  public:
+    uint64_t read(void* buf, uint64_t length) override {
+      uint8_t* dst = (uint8_t*)buf;
+      const uint64_t blockSize = m_parent.m_blockSize;
+      while (length) {
+        uint64_t block = m_offset / blockSize;
+        uint64_t inBlock = m_offset % blockSize;
+        uint64_t thisSz = nod::min(length, blockSize - inBlock);
+        uint32_t stored = block < m_parent.m_blockIndex.size() ? m_parent.m_blockIndex[block] : UINT32_MAX;
+        if (stored == UINT32_MAX) {
+          memset(dst, 0, thisSz);
+        } else {
+          uint64_t filePos = CISOHeaderSize + stored * blockSize + inBlock;
+          if (filePos != m_filePos)
+            m_rs->seek(filePos, SEEK_SET);
+          uint64_t rdSz = m_rs->read(dst, thisSz);
+          m_filePos = filePos + rdSz;
+          if (rdSz != thisSz) {
+            m_filePos = UINT64_MAX;
+            m_offset += rdSz;
+            return dst + rdSz - (uint8_t*)buf;
+          }
+        }
+        dst += thisSz;
+        length -= thisSz;
+        m_offset += thisSz;
+      }
+      return dst - (uint8_t*)buf;
+    }
+    uint64_t position() const override { return m_offset; }
+    void seek(int64_t offset, int whence) override {
+      if (whence == SEEK_SET)
+        m_offset = offset;
+      else if (whence == SEEK_CUR)
+        m_offset += offset;
+    }
+  };
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override {
+    bool err = false;
+    auto ret = std::unique_ptr<IReadStream>(new ReadStream(*this, offset, err));
+    if (err)
+      return {};
+    return ret;
+  }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override { return {}; }
+};
+
+std::unique_ptr<IDiscIO> NewDiscIOCISO(std::string_view path) {
+  bool err = false;
+  auto ret = std::make_unique<DiscIOCISO>(path, err);
+  if (err)
+    return {};
+  return ret;
+}
+
+/* Front-to-back CISO output. Blocks are buffered one at a time and stored only when they
+ * hold a non-zero byte; skipped ranges cost no I/O. The block map is written on close. */
+class FileIOCISO : public IFileIO {
+  struct Sink {
+    std::string m_path;
+    FILE* m_fp = nullptr;
+    uint64_t m_pos = 0;
+    uint32_t m_blockSize = CISODefaultBlockSize;
+    std::unique_ptr<uint8_t[]> m_block;
+    std::unique_ptr<uint8_t[]> m_map;
+    bool m_failed = false;
+
+    bool flushBlock() {
+      uint64_t block = m_pos / m_blockSize - 1;
+      if (block >= CISOMapSize) {
+        spdlog::error("'{}' exceeds the {} blocks a CISO map can hold", m_path, CISOMapSize);
+        m_failed = true;
+        return false;
+      }
+      uint8_t* end = m_block.get() + m_blockSize;
+      bool used = std::find_if(m_block.get(), end, [](uint8_t b) { return b != 0; }) != end;
+      if (used) {
+        if (fwrite(m_block.get(), 1, m_blockSize, m_fp) != m_blockSize) {
+          spdlog::error("unable to write to '{}'", m_path);
+          m_failed = true;
+          return false;
+        }
+        m_map[block] = 1;
+      }
+      memset(m_block.get(), 0, m_blockSize);
+      return true;
+    }
+
+    /* Appends data (or zeros when data is null) at the cursor */
+    uint64_t append(const uint8_t* data, uint64_t length) {
+      uint64_t done = 0;
+      while (done < length) {
+        uint64_t inBlock = m_pos % m_blockSize;
+        /* Whole zero blocks are skipped without touching the buffer */
+        if (!data && inBlock == 0 && length - done >= m_blockSize) {
+          uint64_t skip = (length - done) / m_blockSize * m_blockSize;
+          m_pos += skip;
+          done += skip;
+          continue;
+        }
+        uint64_t thisSz = nod::min(length - done, m_blockSize - inBlock);
+        if (data)
+          memcpy(m_block.get() + inBlock, data + done, thisSz);
+        m_pos += thisSz;
+        done += thisSz;
+        if (m_pos % m_blockSize == 0 && !flushBlock())
+          return done - thisSz;
+      }
+      return done;
+    }
+  };
+  std::unique_ptr<Sink> m_sink;
+  int64_t m_maxWriteSize;
+
+  bool open() const {
+    if (m_sink->m_fp)
+      return !m_sink->m_failed;
+    if (m_sink->m_path == "-") {
+      spdlog::error("CISO output needs a seekable file, not stdout");
+      return false;
+    }
+    m_sink->m_fp = Fopen(m_sink->m_path.c_str(), "wb");
+    if (!m_sink->m_fp) {
+      spdlog::error("unable to open '{}' for writing", m_sink->m_path);
+      return false;
+    }
+    m_sink->m_block.reset(new uint8_t[m_sink->m_blockSize]());
+    m_sink->m_map.reset(new uint8_t[CISOMapSize]());
+    /* Room for the header, which is only final once every block is known */
+    if (FSeek(m_sink->m_fp, CISOHeaderSize, SEEK_SET)) {
+      spdlog::error("unable to seek '{}'", m_sink->m_path);
+      m_sink->m_failed = true;
+      return false;
+    }
+    return true;
+  }
+
+public:
+  FileIOCISO(std::string_view path, int64_t maxWriteSize)
+  : m_sink(std::make_unique<Sink>()), m_maxWriteSize(maxWriteSize) {
+    m_sink->m_path = path;
+    while (maxWriteSize > 0 && uint64_t(maxWriteSize) > uint64_t(m_sink->m_blockSize) * CISOMapSize)
+      m_sink->m_blockSize *= 2;
+  }
+  ~FileIOCISO() override { finish(); }
+
+  bool exists() override { return m_sink->m_fp != nullptr; }
+  uint64_t size() override { return m_sink->m_pos; }
+  bool isSequential() const override { return true; }
+  bool isSparse() const override { return true; }
+
+  bool finish() override {
+    Sink& sink = *m_sink;
+    if (!sink.m_fp)
+      return true;
+    bool ok = !sink.m_failed;
+    if (ok && sink.m_pos % sink.m_blockSize) {
+      sink.m_pos += sink.m_blockSize - sink.m_pos % sink.m_blockSize;
+      ok = sink.flushBlock();
+    }
+    uint8_t header[8] = {'C', 'I', 'S', 'O'};
+    uint32_t blockSize = SLittle(sink.m_blockSize);
+    memcpy(header + 4, &blockSize, 4);
+    if (FSeek(sink.m_fp, 0, SEEK_SET) || fwrite(header, 1, 8, sink.m_fp) != 8 ||
+        fwrite(sink.m_map.get(), 1, CISOMapSize, sink.m_fp) != CISOMapSize) {
+      spdlog::error("unable to write CISO header to '{}'", sink.m_path);
+      ok = false;
+    }
+    ok = fclose(sink.m_fp) == 0 && ok;
+    sink.m_fp = nullptr;
+    return ok;
+  }
+
+  struct WriteStream : public IFileIO::IWriteStream {
+    Sink& m_sink;
+    int64_t m_maxWriteSize;
+    WriteStream(Sink& sink, int64_t maxWriteSize) : m_sink(sink), m_maxWriteSize(maxWriteSize) {}
+    uint64_t write(const void* buf, uint64_t length) override {
+      if (m_maxWriteSize >= 0 && m_sink.m_pos + length > uint64_t(m_maxWriteSize)) {
+        spdlog::error("write operation exceeds file's {}-byte limit", m_maxWriteSize);
+        return 0;
+      }
+      if (m_sink.m_failed)
+        return 0;
+      return m_sink.append((const uint8_t*)buf, length);
+    }
+    bool skipUnused(uint64_t length, uint8_t fillByte) override {
+      return !m_sink.m_failed && m_sink.append(nullptr, length) == length;
+    }
+  };
+
+  std::unique_ptr<IWriteStream> beginWriteStream() const override {
+    if (!open())
+      return {};
+    return std::make_unique<WriteStream>(*m_sink, m_maxWriteSize);
+  }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override {
+    if (!open())
+      return {};
+    if (offset < m_sink->m_pos) {
+      spdlog::error("unable to seek '{}' back to 0x{:X}; 0x{:X} bytes were already written", m_sink->m_path, offset,
+                    m_sink->m_pos);
+      return {};
+    }
+    const uint64_t skip = offset - m_sink->m_pos;
+    if (m_sink->append(nullptr, skip) != skip)
+      return {};
+    return std::make_unique<WriteStream>(*m_sink, m_maxWriteSize);
+  }
+
+  std::unique_ptr<IReadStream> beginReadStream() const override {
+    spdlog::error("CISO output '{}' cannot be read back while it is written", m_sink->m_path);
+    return {};
+  }
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override { return beginReadStream(); }
+};
+
+std::unique_ptr<IFileIO> NewCISOFileIO(std::string_view path, int64_t maxWriteSize) {
+  return std::make_unique<FileIOCISO>(path, maxWriteSize);
+}
+
+} // namespace nod
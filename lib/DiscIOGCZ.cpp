@@ -0,0 +1,244 @@
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "nod/IDiscIO.hpp"
+#include "nod/IFileIO.hpp"
+#include "nod/Endian.hpp"
+#include "BlockCache.hpp"
+#include "Util.hpp"
+
+#ifndef NOD_HAS_ZLIB
+#define NOD_HAS_ZLIB 0
+#endif
+
+#if NOD_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+#include <spdlog/spdlog.h>
+
+namespace nod {
+
+/*
+ * GCZ splits the disc into fixed-size blocks compressed independently with zlib. A 32-byte
+ * little-endian header is followed by a u64 file offset per block (top bit set when the
+ * block is stored uncompressed), an Adler-32 per stored block, then the block data.
+ */
+
+static constexpr uint32_t GCZMagic = 0xB10BC001;
+static constexpr uint32_t GCZHeaderSize = 32;
+static constexpr uint64_t GCZUncompressedFlag = 1ull << 63;
+
+static uint32_t Adler32(const uint8_t* data, size_t len) {
+#if NOD_HAS_ZLIB
+  uint32_t adler = uint32_t(adler32(0, nullptr, 0));
+  while (len) {
+    uInt thisSz = uInt(nod::min(len, size_t(0x40000000)));
+    adler = uint32_t(adler32(adler, data, thisSz));
+    data += thisSz;
+    len -= thisSz;
+  }
+  return adler;
+#else
+  uint32_t a = 1, b = 0;
+  while (len) {
+    /* Largest run that cannot overflow b before the modulo */
+    size_t thisSz = nod::min(len, size_t(5552));
+    for (size_t i = 0; i < thisSz; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += thisSz;
+    len -= thisSz;
+  }
+  return b << 16 | a;
+#endif
+}
+
+class DiscIOGCZ : public IDiscIO {
+  std::unique_ptr<IFileIO> m_fio;
+  uint64_t m_compressedSize = 0;
+  uint64_t m_dataSize = 0;
+  uint32_t m_blockSize = 0;
+  uint64_t m_dataOffset = 0;
+  std::vector<uint64_t> m_blockPointers;
+  std::vector<uint32_t> m_hashes;
+
+  struct Block {
+    std::vector<uint8_t> m_data;
+    bool m_ok = false;
+  };
+
+  /* Decompressed blocks shared by every read stream; declared last so its workers stop first */
+  mutable std::unique_ptr<BlockCache<Block>> m_cache;
+
+  bool readFile(uint64_t offset, void* buf, size_t length) const {
+    std::unique_ptr<IFileIO::IReadStream> rs = m_fio->beginReadStream(offset);
+    return rs && rs->read(buf, length) == length;
+  }
+
+  std::shared_ptr<const Block> decodeBlock(uint32_t idx) const {
+    auto block = std::make_shared<Block>();
+    const uint64_t ptr = m_blockPointers[idx];
+    const uint64_t start = ptr & ~GCZUncompressedFlag;
+    const uint64_t end =
+        idx + 1 < m_blockPointers.size() ? m_blockPointers[idx + 1] & ~GCZUncompressedFlag : m_compressedSize;
+    const uint64_t outSz = nod::min(uint64_t(m_blockSize), m_dataSize - uint64_t(idx) * m_blockSize);
+    if (end < start || end - start > m_blockSize + 0x10000ull) {
+      spdlog::error("invalid GCZ block pointer for block {}", idx);
+      return block;
+    }
+
+    std::vector<uint8_t> stored(end - start);
+    if (!readFile(m_dataOffset + start, stored.data(), stored.size())) {
+      spdlog::error("unable to read GCZ block {}", idx);
+      return block;
+    }
+    if (Adler32(stored.data(), stored.size()) != m_hashes[idx]) {
+      spdlog::error("GCZ block {} fails its checksum", idx);
+      return block;
+    }
+
+    if (ptr & GCZUncompressedFlag) {
+      if (stored.size() < outSz) {
+        spdlog::error("truncated GCZ block {}", idx);
+        return block;
+      }
+      stored.resize(outSz);
+      block->m_data = std::move(stored);
+      block->m_ok = true;
+      return block;
+    }
+
+#if NOD_HAS_ZLIB
+    /* Writers may compress a zero-padded final block, so inflate a whole block and trim */
+    block->m_data.resize(m_blockSize);
+    z_stream strm = {};
+    if (inflateInit(&strm) != Z_OK) {
+      spdlog::error("unable to initialize zlib");
+      return block;
+    }
+    strm.next_in = stored.data();
+    strm.avail_in = uInt(stored.size());
+    strm.next_out = block->m_data.data();
+    strm.avail_out = m_blockSize;
+    int ret = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END || strm.total_out < outSz) {
+      spdlog::error("unable to decompress GCZ block {}", idx);
+      return block;
+    }
+    block->m_data.resize(outSz);
+    block->m_ok = true;
+#else
+    spdlog::error("GCZ block {} is zlib-compressed, which this build does not support", idx);
+#endif
+    return block;
+  }
+
+public:
+  DiscIOGCZ(std::string_view path, bool& err) : m_fio(NewFileIO(path)) {
+    uint8_t header[GCZHeaderSize];
+    if (!readFile(0, header, sizeof(header)) || SLittle(*reinterpret_cast<uint32_t*>(header)) != GCZMagic) {
+      spdlog::error("unable to read GCZ header from '{}'", path);
+      err = true;
+      return;
+    }
+    m_compressedSize = SLittle(*reinterpret_cast<uint64_t*>(header + 8));
+    m_dataSize = SLittle(*reinterpret_cast<uint64_t*>(header + 16));
+    m_blockSize = SLittle(*reinterpret_cast<uint32_t*>(header + 24));
+    uint32_t blockCount = SLittle(*reinterpret_cast<uint32_t*>(header + 28));
+    if (!m_blockSize || uint64_t(blockCount) * m_blockSize < m_dataSize ||
+        uint64_t(blockCount - 1) * m_blockSize >= m_dataSize) {
+      spdlog::error("invalid GCZ geometry in '{}'", path);
+      err = true;
+      return;
+    }
+
+    /* Both tables are read once; nothing but block data is touched afterwards */
+    m_blockPointers.resize(blockCount);
+    m_hashes.resize(blockCount);
+    if (!readFile(GCZHeaderSize, m_blockPointers.data(), blockCount * 8ull) ||
+        !readFile(GCZHeaderSize + blockCount * 8ull, m_hashes.data(), blockCount * 4ull)) {
+      spdlog::error("unable to read GCZ block tables from '{}'", path);
+      err = true;
+      return;
+    }
+    for (uint64_t& ptr : m_blockPointers)
+      ptr = SLittle(ptr);
+    for (uint32_t& hash : m_hashes)
+      hash = SLittle(hash);
+    m_dataOffset = GCZHeaderSize + blockCount * 12ull;
+
+    m_cache = std::make_unique<BlockCache<Block>>(blockCount, [this](uint32_t idx) { return decodeBlock(idx); });
+  }
+
+  class ReadStream : public IReadStream {
+    friend class DiscIOGCZ;
+    const DiscIOGCZ& m_parent;
+    uint64_t m_offset;
+
+    /* Last block used and the one before it, to recognize forward streaming */
+    uint32_t m_blockIdx = UINT32_MAX;
+    uint32_t m_prevBlockIdx = UINT32_MAX;
+    std::shared_ptr<const Block> m_block;
+
+    ReadStream(const DiscIOGCZ& parent, uint64_t offset) : m_parent(parent), m_offset(offset) {}
+
+    const Block& useBlock(uint32_t idx) {
+      if (idx != m_blockIdx) {
+        if (idx == m_prevBlockIdx + 1 || idx == m_blockIdx + 1)
+          m_parent.m_cache->prefetch(idx + 1, uint32_t(m_parent.m_cache->workerCount()));
+        m_prevBlockIdx = m_blockIdx;
+        m_block = m_parent.m_cache->get(idx);
+        m_blockIdx = idx;
+      }
+      return *m_block;
+    }
+
+  public:
+    uint64_t read(void* buf, uint64_t length) override {
+      uint8_t* dst = (uint8_t*)buf;
+      uint64_t rem = nod::min(length, m_parent.m_dataSize - nod::min(m_parent.m_dataSize, m_offset));
+      while (rem) {
+        const Block& block = useBlock(uint32_t(m_offset / m_parent.m_blockSize));
+        uint64_t inBlock = m_offset % m_parent.m_blockSize;
+        if (!block.m_ok || inBlock >= block.m_data.size())
+          break;
+        uint64_t thisSz = nod::min(rem, block.m_data.size() - inBlock);
+        memcpy(dst, block.m_data.data() + inBlock, thisSz);
+        dst += thisSz;
+        rem -= thisSz;
+        m_offset += thisSz;
+      }
+      return dst - (uint8_t*)buf;
+    }
+    uint64_t position() const override { return m_offset; }
+    void seek(int64_t offset, int whence) override {
+      if (whence == SEEK_SET)
+        m_offset = offset;
+      else if (whence == SEEK_CUR)
+        m_offset += offset;
+    }
+  };
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override {
+    return std::unique_ptr<IReadStream>(new ReadStream(*this, offset));
+  }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override { return {}; }
+};
+
+std::unique_ptr<IDiscIO> NewDiscIOGCZ(std::string_view path) {
+  bool err = false;
+  auto ret = std::make_unique<DiscIOGCZ>(path, err);
+  if (err)
+    return {};
+  return ret;
+}
+
+} // namespace nod
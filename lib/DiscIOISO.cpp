@@ -9,7 +9,7 @@ class DiscIOISO : public IDiscIO {
   std::unique_ptr<IFileIO> m_fio;
 
 public:
-  DiscIOISO(std::string_view fpin) : m_fio(NewFileIO(fpin)) {}
+  DiscIOISO(std::string_view fpin) : m_fio(NewImageFileIO(fpin)) {}
 
   class ReadStream : public IReadStream {
     friend class DiscIOISO;
@@ -1,7 +1,20 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
 #include "nod/IDiscIO.hpp"
 #include "nod/IFileIO.hpp"
 #include "nod/aes.hpp"
 #include "nod/Endian.hpp"
+#include "BlockCache.hpp"
 #include "Util.hpp"
 
 #include <spdlog/spdlog.h>
@@ -14,6 +27,30 @@ namespace nod {
  * It logically stores a standard Wii disc image with partitions.
  */
 
+/* Checks an NFS file name (hif_XXXXXX.nfs) and returns its directory with the trailing slash */
+static bool SplitNFSPath(std::string_view fpin, std::string& dirOut) {
+  using SignedSize = std::make_signed<std::string::size_type>::type;
+  const auto dotPos = SignedSize(fpin.rfind('.'));
+  const auto slashPos = SignedSize(fpin.find_last_of("/\\"));
+  if (fpin.size() <= 4 || dotPos == -1 || dotPos <= slashPos || fpin.compare(slashPos + 1, 4, "hif_") ||
+      fpin.compare(dotPos, fpin.size() - dotPos, ".nfs")) {
+    spdlog::error("'{}' must begin with 'hif_' and end with '.nfs' to be accepted as an NFS image", fpin);
+    return false;
+  }
+  dirOut.assign(fpin.begin(), fpin.begin() + slashPos + 1);
+  return true;
+}
+
+/* The title key lives in the title's code directory, or next to the hif files */
+static std::unique_ptr<IFileIO::IReadStream> OpenNFSKey(const std::string& dir) {
+  for (const std::string& path : {dir + "../code/htk.bin", dir + "htk.bin"}) {
+    std::unique_ptr<IFileIO> fio = NewFileIO(path);
+    if (fio->exists())
+      return fio->beginReadStream();
+  }
+  return {};
+}
+
 class DiscIONFS : public IDiscIO {
   std::vector<std::unique_ptr<IFileIO>> files;
 
@@ -39,47 +76,99 @@ class DiscIONFS : public IDiscIO {
            uint64_t(0xFA00000);
   }
 
-  struct FBO {
-    uint32_t file, block, lblock, offset;
+  /* Mapped logical block ranges sorted by start, each with its first physical block */
+  struct LBARange {
+    uint32_t startBlock, numBlocks, physicalBlock;
   };
+  std::vector<LBARange> m_lbaIndex;
+
+  /* Physical block of a logical block, or UINT32_MAX when it is not stored and reads as zeros */
+  uint32_t logicalToPhysical(uint64_t lblock) const {
+    auto it = std::upper_bound(m_lbaIndex.begin(), m_lbaIndex.end(), lblock,
+                               [](uint64_t block, const LBARange& range) { return block < range.startBlock; });
+    if (it == m_lbaIndex.begin())
+      return UINT32_MAX;
+    --it;
+    if (lblock - it->startBlock >= it->numBlocks)
+      return UINT32_MAX;
+    return it->physicalBlock + uint32_t(lblock - it->startBlock);
+  }
 
-  FBO logicalToFBO(uint64_t offset) const {
-    auto blockAndRemBytes = nod::div(offset, uint64_t(0x8000)); /* 32768 bytes per block */
-    uint32_t block = UINT32_MAX;
-    for (uint32_t i = 0, physicalBlock = 0; i < nfsHead.lbaRangeCount; ++i) {
-      const auto& range = nfsHead.lbaRanges[i];
-      if (blockAndRemBytes.quot >= range.startBlock && blockAndRemBytes.quot - range.startBlock < range.numBlocks) {
-        block = physicalBlock + (blockAndRemBytes.quot - range.startBlock);
-        break;
+  /* Blocks are decrypted in batches on the block cache's workers, ahead of sequential readers */
+  static constexpr uint32_t BlocksPerBatch = 16;
+  static constexpr uint32_t BatchSize = BlocksPerBatch * 0x8000;
+
+  struct Batch {
+    std::vector<uint8_t> m_data;
+    bool m_ok = false;
+  };
+
+  /* Physical blocks are laid end to end across the hif files after the first file's header */
+  bool readPhysical(uint32_t physicalBlock, uint32_t count, uint8_t* buf) const {
+    uint64_t offset = 0x200 + uint64_t(physicalBlock) * 0x8000;
+    uint64_t rem = uint64_t(count) * 0x8000;
+    while (rem) {
+      auto fileAndOff = nod::div(offset, uint64_t(0xFA00000));
+      if (fileAndOff.quot >= files.size()) {
+        spdlog::error("Out of bounds NFS file access");
+        return false;
       }
-      physicalBlock += range.numBlocks;
+      uint64_t thisSz = nod::min(rem, uint64_t(0xFA00000) - fileAndOff.rem);
+      auto rs = files[fileAndOff.quot]->beginReadStream(fileAndOff.rem);
+      if (!rs || rs->read(buf, thisSz) != thisSz) {
+        spdlog::error("Unable to read NFS block {}", physicalBlock);
+        return false;
+      }
+      buf += thisSz;
+      offset += thisSz;
+      rem -= thisSz;
     }
-    /* This offset has no physical mapping, read zeroes */
-    if (block == UINT32_MAX)
-      return {UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX};
-    auto fileAndRemBlocks = nod::div(block, uint32_t(8000)); /* 8000 blocks per file */
-    return {uint32_t(fileAndRemBlocks.quot), uint32_t(fileAndRemBlocks.rem), uint32_t(blockAndRemBytes.quot),
-            uint32_t(blockAndRemBytes.rem)};
+    return true;
   }
 
+  std::shared_ptr<const Batch> decodeBatch(uint32_t idx) const {
+    auto batch = std::make_shared<Batch>();
+    batch->m_data.resize(BatchSize);
+    std::vector<uint8_t> encBuf(BatchSize);
+    std::unique_ptr<IAES> aes = NewAES();
+    aes->setKey(key);
+    const uint64_t firstBlock = uint64_t(idx) * BlocksPerBatch;
+    for (uint32_t i = 0; i < BlocksPerBatch;) {
+      uint32_t physicalBlock = logicalToPhysical(firstBlock + i);
+      if (physicalBlock == UINT32_MAX) {
+        ++i;
+        continue;
+      }
+      /* Stored blocks of one range are physically contiguous and read together */
+      uint32_t count = 1;
+      while (i + count < BlocksPerBatch && logicalToPhysical(firstBlock + i + count) == physicalBlock + count)
+        ++count;
+      if (!readPhysical(physicalBlock, count, encBuf.data() + i * 0x8000))
+        return batch;
+      for (uint32_t b = i; b < i + count; ++b) {
+        const uint32_t ivBuf[] = {0, 0, 0, SBig(uint32_t(firstBlock + b))};
+        aes->decrypt((const uint8_t*)ivBuf, encBuf.data() + b * 0x8000, batch->m_data.data() + b * 0x8000, 0x8000);
+      }
+      i += count;
+    }
+    batch->m_ok = true;
+    return batch;
+  }
+
+  /* Declared last so its workers stop before anything they use goes away */
+  mutable std::unique_ptr<BlockCache<Batch>> m_cache;
+
 public:
   DiscIONFS(std::string_view fpin, bool& err) {
     /* Validate file path format */
-    using SignedSize = std::make_signed<std::string::size_type>::type;
-    const auto dotPos = SignedSize(fpin.rfind('.'));
-    const auto slashPos = SignedSize(fpin.find_last_of("/\\"));
-    if (fpin.size() <= 4 || dotPos == -1 || dotPos <= slashPos || fpin.compare(slashPos + 1, 4, "hif_") ||
-        fpin.compare(dotPos, fpin.size() - dotPos, ".nfs")) {
-      spdlog::error("'{}' must begin with 'hif_' and end with '.nfs' to be accepted as an NFS image", fpin);
+    std::string dir;
+    if (!SplitNFSPath(fpin, dir)) {
       err = true;
       return;
     }
 
     /* Load key file */
-    const std::string dir(fpin.begin(), fpin.begin() + slashPos + 1);
-    auto keyFile = NewFileIO(dir + "../code/htk.bin")->beginReadStream();
-    if (!keyFile)
-      keyFile = NewFileIO(dir + "htk.bin")->beginReadStream();
+    auto keyFile = OpenNFSKey(dir);
     if (!keyFile) {
       spdlog::error("Unable to open '{}../code/htk.bin' or '{}htk.bin'", dir, dir);
       err = true;
@@ -117,6 +206,16 @@ public:
       range.numBlocks = SBig(range.numBlocks);
     }
 
+    m_lbaIndex.reserve(nfsHead.lbaRangeCount);
+    for (uint32_t i = 0, physicalBlock = 0; i < nfsHead.lbaRangeCount; ++i) {
+      const auto& range = nfsHead.lbaRanges[i];
+      if (range.numBlocks)
+        m_lbaIndex.push_back({range.startBlock, range.numBlocks, physicalBlock});
+      physicalBlock += range.numBlocks;
+    }
+    std::sort(m_lbaIndex.begin(), m_lbaIndex.end(),
+              [](const LBARange& a, const LBARange& b) { return a.startBlock < b.startBlock; });
+
     /* Ensure remaining files exist */
     const uint32_t numFiles = calculateNumFiles();
     files.reserve(numFiles);
@@ -129,109 +228,56 @@ public:
         return;
       }
     }
+
+    uint64_t logicalEnd = 0;
+    for (const LBARange& range : m_lbaIndex)
+      logicalEnd = nod::max(logicalEnd, uint64_t(range.startBlock) + range.numBlocks);
+    m_cache = std::make_unique<BlockCache<Batch>>(uint32_t((logicalEnd + BlocksPerBatch - 1) / BlocksPerBatch),
+                                                  [this](uint32_t idx) { return decodeBatch(idx); });
   }
 
   class ReadStream : public IReadStream {
     friend class DiscIONFS;
     const DiscIONFS& m_parent;
-    std::unique_ptr<IReadStream> m_rs;
-    std::unique_ptr<IAES> m_aes;
-
-    /* Physical address - all UINT32_MAX indicates logical zero block */
-    DiscIONFS::FBO m_physAddr;
-
-    /* Logical address */
     uint64_t m_offset;
 
-    /* Active file stream and its offset as set in the system.
-     * Block is typically one ahead of the presently decrypted block. */
-    uint32_t m_curFile = UINT32_MAX;
-    uint32_t m_curBlock = UINT32_MAX;
-
-    ReadStream(const DiscIONFS& parent, uint64_t offset, bool& err)
-    : m_parent(parent)
-    , m_aes(NewAES())
-    , m_physAddr({UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX})
-    , m_offset(offset) {
-      m_aes->setKey(m_parent.key);
-      setLogicalAddr(offset);
-    }
+    /* Last batch used and the one before it, to recognize forward streaming */
+    uint32_t m_batchIdx = UINT32_MAX;
+    uint32_t m_prevBatchIdx = UINT32_MAX;
+    std::shared_ptr<const Batch> m_batch;
 
-    uint8_t m_encBuf[0x8000] = {};
-    uint8_t m_decBuf[0x8000] = {};
+    ReadStream(const DiscIONFS& parent, uint64_t offset) : m_parent(parent), m_offset(offset) {}
 
-    void setCurFile(uint32_t curFile) {
-      if (curFile >= m_parent.files.size()) {
-        spdlog::error("Out of bounds NFS file access");
-        return;
+    const Batch& useBatch(uint32_t idx) {
+      if (idx != m_batchIdx) {
+        if (idx == m_prevBatchIdx + 1 || idx == m_batchIdx + 1)
+          m_parent.m_cache->prefetch(idx + 1, uint32_t(m_parent.m_cache->workerCount()));
+        m_prevBatchIdx = m_batchIdx;
+        m_batch = m_parent.m_cache->get(idx);
+        m_batchIdx = idx;
       }
-      m_curFile = curFile;
-      m_curBlock = UINT32_MAX;
-      m_rs = m_parent.files[m_curFile]->beginReadStream();
+      return *m_batch;
     }
 
-    void setCurBlock(uint32_t curBlock) {
-      m_curBlock = curBlock;
-      m_rs->seek(m_curBlock * 0x8000 + 0x200);
-    }
-
-    void setPhysicalAddr(DiscIONFS::FBO physAddr) {
-      /* If we're just changing the offset, nothing else needs to be done */
-      if (m_physAddr.file == physAddr.file && m_physAddr.block == physAddr.block) {
-        m_physAddr.offset = physAddr.offset;
-        return;
-      }
-      m_physAddr = physAddr;
-
-      /* Set logical zero block */
-      if (m_physAddr.file == UINT32_MAX) {
-        memset(m_decBuf, 0, 0x8000);
-        return;
-      }
-
-      /* Make necessary file and block current with system */
-      if (m_physAddr.file != m_curFile)
-        setCurFile(m_physAddr.file);
-      if (m_physAddr.block != m_curBlock)
-        setCurBlock(m_physAddr.block);
-
-      /* Read block, handling 0x200 overlap case */
-      if (m_physAddr.block == 7999) {
-        m_rs->read(m_encBuf, 0x7E00);
-        setCurFile(m_curFile + 1);
-        m_rs->read(m_encBuf + 0x7E00, 0x200);
-        m_curBlock = 0;
-      } else {
-        m_rs->read(m_encBuf, 0x8000);
-        ++m_curBlock;
-      }
-
-      /* Decrypt */
-      const uint32_t ivBuf[] = {0, 0, 0, SBig(m_physAddr.lblock)};
-      m_aes->decrypt((const uint8_t*)ivBuf, m_encBuf, m_decBuf, 0x8000);
-    }
-
-    void setLogicalAddr(uint64_t addr) { setPhysicalAddr(m_parent.logicalToFBO(m_offset)); }
-
   public:
     uint64_t read(void* buf, uint64_t length) override {
-      uint64_t rem = length;
       uint8_t* dst = (uint8_t*)buf;
-
-      /* Perform reads on block boundaries */
-      while (rem) {
-        uint64_t readSize = rem;
-        uint32_t blockOffset = (m_physAddr.offset == UINT32_MAX) ? 0 : m_physAddr.offset;
-        if (readSize + blockOffset > 0x8000)
-          readSize = 0x8000 - blockOffset;
-
-        memmove(dst, m_decBuf + blockOffset, readSize);
-        dst += readSize;
-        rem -= readSize;
-        m_offset += readSize;
-        setLogicalAddr(m_offset);
+      while (length) {
+        auto batchAndRem = nod::div(m_offset, uint64_t(BatchSize));
+        uint64_t thisSz = nod::min(length, BatchSize - batchAndRem.rem);
+        /* Nothing is stored past the last mapped block */
+        if (batchAndRem.quot >= m_parent.m_cache->blockCount()) {
+          memset(dst, 0, thisSz);
+        } else {
+          const Batch& batch = useBatch(uint32_t(batchAndRem.quot));
+          if (!batch.m_ok)
+            break;
+          memmove(dst, batch.m_data.data() + batchAndRem.rem, thisSz);
+        }
+        dst += thisSz;
+        length -= thisSz;
+        m_offset += thisSz;
       }
-
       return dst - (uint8_t*)buf;
     }
     uint64_t position() const override { return m_offset; }
@@ -240,20 +286,11 @@ public:
         m_offset = offset;
       else if (whence == SEEK_CUR)
         m_offset += offset;
-      else
-        return;
-      setLogicalAddr(m_offset);
     }
   };
 
   std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override {
-    bool err = false;
-    auto ret = std::unique_ptr<IReadStream>(new ReadStream(*this, offset, err));
-
-    if (err)
-      return {};
-
-    return ret;
+    return std::unique_ptr<IReadStream>(new ReadStream(*this, offset));
   }
 
   std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override { return {}; }
@@ -269,4 +306,332 @@ std::unique_ptr<IDiscIO> NewDiscIONFS(std::string_view path) {
   return ret;
 }
 
+/* Front-to-back NFS output. Every 32 KiB block touched by a write is stored; skipped blocks start
+ * a new LBA range until the header's 61 are used up, after which gaps are stored as zeros.
+ * Full batches of blocks are encrypted on a small worker pool while the writer keeps filling the
+ * next one; at most two batches per worker are in flight before the writer waits. */
+class FileIONFS : public IFileIO {
+  static constexpr uint32_t BlocksPerBatch = 64;
+  static constexpr uint64_t FileSize = 0xFA00000; /* 8000 blocks per hif file */
+  static constexpr uint32_t MaxRanges = 61;
+
+  struct Batch {
+    std::vector<uint8_t> m_data;
+    std::vector<uint32_t> m_lblocks; /* Logical block of each stored block, which seeds its IV */
+    enum class State { Queued, Encrypting, Encrypted } m_state = State::Queued;
+  };
+
+  struct Sink {
+    std::string m_path;
+    std::string m_dir;
+    uint8_t m_key[16];
+    bool m_newKey = false;
+    std::vector<FILE*> m_files;
+    uint64_t m_physPos = 0x200; /* The first file starts with the header */
+    uint64_t m_pos = 0;
+    std::unique_ptr<uint8_t[]> m_block;
+    bool m_blockUsed = false;
+    std::vector<std::pair<uint32_t, uint32_t>> m_ranges;
+    std::unique_ptr<Batch> m_batch;
+    bool m_failed = false;
+    bool m_opened = false;
+    bool m_finished = false;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<std::unique_ptr<Batch>> m_inFlight; /* In output order */
+    bool m_quit = false;
+    std::vector<std::thread> m_workers;
+
+    ~Sink() {
+      {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_quit = true;
+      }
+      m_cv.notify_all();
+      for (std::thread& worker : m_workers)
+        worker.join();
+      for (FILE* fp : m_files)
+        fclose(fp);
+    }
+
+    void workerProc() {
+      std::unique_ptr<IAES> aes = NewAES();
+      aes->setKey(m_key);
+      std::unique_lock<std::mutex> lk(m_lock);
+      while (true) {
+        Batch* batch = nullptr;
+        m_cv.wait(lk, [&]() {
+          for (std::unique_ptr<Batch>& b : m_inFlight) {
+            if (b->m_state == Batch::State::Queued) {
+              batch = b.get();
+              return true;
+            }
+          }
+          return m_quit;
+        });
+        if (!batch)
+          return;
+        batch->m_state = Batch::State::Encrypting;
+        lk.unlock();
+        for (size_t i = 0; i < batch->m_lblocks.size(); ++i) {
+          const uint32_t ivBuf[] = {0, 0, 0, SBig(batch->m_lblocks[i])};
+          uint8_t* ptr = batch->m_data.data() + i * 0x8000;
+          aes->encrypt((const uint8_t*)ivBuf, ptr, ptr, 0x8000);
+        }
+        lk.lock();
+        batch->m_state = Batch::State::Encrypted;
+        m_cv.notify_all();
+      }
+    }
+
+    /* Appends encrypted blocks at the physical cursor, opening hif files as it crosses into them */
+    bool writePhysical(const uint8_t* data, uint64_t length) {
+      while (length) {
+        auto fileAndOff = nod::div(m_physPos, FileSize);
+        if (fileAndOff.quot == m_files.size()) {
+          std::string path = fmt::format("{}hif_{:06}.nfs", m_dir, m_files.size());
+          FILE* fp = Fopen(path.c_str(), "wb");
+          if (!fp) {
+            spdlog::error("unable to open '{}' for writing", path);
+            return false;
+          }
+          m_files.push_back(fp);
+          if (fileAndOff.quot == 0 && FSeek(fp, 0x200, SEEK_SET))
+            return false;
+        }
+        uint64_t thisSz = nod::min(length, FileSize - fileAndOff.rem);
+        if (fwrite(data, 1, thisSz, m_files.back()) != thisSz) {
+          spdlog::error("unable to write to '{}'", m_path);
+          return false;
+        }
+        data += thisSz;
+        length -= thisSz;
+        m_physPos += thisSz;
+      }
+      return true;
+    }
+
+    /* Writes encrypted batches from the front of the pipeline; waits until fewer than limit remain */
+    bool drain(size_t limit) {
+      std::unique_lock<std::mutex> lk(m_lock);
+      while (!m_inFlight.empty()) {
+        if (m_inFlight.front()->m_state == Batch::State::Encrypted) {
+          std::unique_ptr<Batch> batch = std::move(m_inFlight.front());
+          m_inFlight.pop_front();
+          lk.unlock();
+          if (!writePhysical(batch->m_data.data(), batch->m_data.size())) {
+            m_failed = true;
+            return false;
+          }
+          lk.lock();
+        } else if (m_inFlight.size() >= limit) {
+          m_cv.wait(lk);
+        } else {
+          break;
+        }
+      }
+      return true;
+    }
+
+    bool submitBatch() {
+      if (!m_batch || m_batch->m_lblocks.empty())
+        return true;
+      {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_inFlight.push_back(std::move(m_batch));
+      }
+      m_cv.notify_all();
+      return drain(m_workers.size() * 2);
+    }
+
+    bool storeBlock(uint32_t lblock, const uint8_t* data) {
+      if (!m_batch) {
+        m_batch = std::make_unique<Batch>();
+        m_batch->m_data.reserve(BlocksPerBatch * 0x8000);
+      }
+      m_batch->m_data.insert(m_batch->m_data.end(), data, data + 0x8000);
+      m_batch->m_lblocks.push_back(lblock);
+      return m_batch->m_lblocks.size() < BlocksPerBatch || submitBatch();
+    }
+
+    bool emitBlock(uint32_t lblock) {
+      if (m_ranges.empty() || lblock != m_ranges.back().first + m_ranges.back().second) {
+        if (m_ranges.size() < MaxRanges) {
+          m_ranges.emplace_back(lblock, 0);
+        } else {
+          static const uint8_t zeroBlock[0x8000] = {};
+          for (uint32_t b = m_ranges.back().first + m_ranges.back().second; b < lblock; ++b, ++m_ranges.back().second)
+            if (!storeBlock(b, zeroBlock))
+              return false;
+        }
+      }
+      ++m_ranges.back().second;
+      return storeBlock(lblock, m_block.get());
+    }
+
+    /* Appends data (or skips when data is null) at the cursor */
+    uint64_t append(const uint8_t* data, uint64_t length) {
+      uint64_t done = 0;
+      while (done < length && !m_failed) {
+        uint64_t inBlock = m_pos % 0x8000;
+        uint64_t thisSz = nod::min(length - done, 0x8000 - inBlock);
+        if (data) {
+          memcpy(m_block.get() + inBlock, data + done, thisSz);
+          m_blockUsed = true;
+        } else if (!m_blockUsed) {
+          /* Untouched blocks are left out entirely */
+          thisSz = length - done;
+        }
+        m_pos += thisSz;
+        done += thisSz;
+        if (m_pos % 0x8000 == 0 && m_blockUsed) {
+          if (!emitBlock(uint32_t(m_pos / 0x8000 - 1))) {
+            m_failed = true;
+            return done - thisSz;
+          }
+          memset(m_block.get(), 0, 0x8000);
+          m_blockUsed = false;
+        }
+      }
+      return done;
+    }
+
+    bool close() {
+      bool ok = !m_failed;
+      if (ok && m_blockUsed)
+        ok = emitBlock(uint32_t(m_pos / 0x8000));
+      ok = ok && submitBatch() && drain(1);
+
+      struct {
+        char magic[4] = {'E', 'G', 'G', 'S'};
+        uint32_t version = SBig(uint32_t(1));
+        uint32_t unknown[2] = {};
+        uint32_t lbaRangeCount = 0;
+        uint32_t lbaRanges[MaxRanges][2] = {};
+        char endMagic[4] = {'S', 'G', 'G', 'E'};
+      } head;
+      static_assert(sizeof(head) == 0x200, "NFS header must be 0x200 bytes");
+      head.lbaRangeCount = SBig(uint32_t(m_ranges.size()));
+      for (size_t i = 0; i < m_ranges.size(); ++i) {
+        head.lbaRanges[i][0] = SBig(m_ranges[i].first);
+        head.lbaRanges[i][1] = SBig(m_ranges[i].second);
+      }
+      ok = ok && !m_files.empty() && !FSeek(m_files.front(), 0, SEEK_SET) &&
+           fwrite(&head, 1, sizeof(head), m_files.front()) == sizeof(head);
+      for (FILE* fp : m_files)
+        ok = fclose(fp) == 0 && ok;
+      m_files.clear();
+
+      if (ok && m_newKey) {
+        auto ws = NewFileIO(m_dir + "htk.bin")->beginWriteStream();
+        ok = ws && ws->write(m_key, 16) == 16;
+      }
+      if (!ok)
+        spdlog::error("unable to finish NFS image '{}'", m_path);
+      return ok;
+    }
+  };
+  std::unique_ptr<Sink> m_sink;
+  int64_t m_maxWriteSize;
+
+  bool open() const {
+    Sink& sink = *m_sink;
+    if (sink.m_opened)
+      return !sink.m_failed && !sink.m_finished;
+    if (!SplitNFSPath(sink.m_path, sink.m_dir))
+      return false;
+
+    /* Repackaging keeps the title's key; otherwise a fresh one goes next to the hif files */
+    auto keyFile = OpenNFSKey(sink.m_dir);
+    if (keyFile) {
+      if (keyFile->read(sink.m_key, 16) != 16) {
+        spdlog::error("Unable to read NFS key for '{}'", sink.m_path);
+        return false;
+      }
+    } else {
+      std::random_device rd;
+      for (uint8_t& b : sink.m_key)
+        b = uint8_t(rd());
+      sink.m_newKey = true;
+    }
+
+    sink.m_block.reset(new uint8_t[0x8000]());
+    size_t threadCount = nod::min(nod::max(size_t(std::thread::hardware_concurrency()), size_t(1)), size_t(8));
+    for (size_t i = 0; i < threadCount; ++i)
+      sink.m_workers.emplace_back(&Sink::workerProc, &sink);
+    sink.m_opened = true;
+    return true;
+  }
+
+public:
+  FileIONFS(std::string_view path, int64_t maxWriteSize)
+  : m_sink(std::make_unique<Sink>()), m_maxWriteSize(maxWriteSize) {
+    m_sink->m_path = path;
+  }
+  ~FileIONFS() override { finish(); }
+
+  bool exists() override { return m_sink->m_opened; }
+  uint64_t size() override { return m_sink->m_pos; }
+  bool isSequential() const override { return true; }
+  bool isSparse() const override { return true; }
+  bool hasWiiCrypto() const override { return false; }
+
+  bool finish() override {
+    if (!m_sink->m_opened || m_sink->m_finished)
+      return true;
+    m_sink->m_finished = true;
+    return m_sink->close();
+  }
+
+  struct WriteStream : public IFileIO::IWriteStream {
+    Sink& m_sink;
+    int64_t m_maxWriteSize;
+    WriteStream(Sink& sink, int64_t maxWriteSize) : m_sink(sink), m_maxWriteSize(maxWriteSize) {}
+    uint64_t write(const void* buf, uint64_t length) override {
+      if (m_maxWriteSize >= 0 && m_sink.m_pos + length > uint64_t(m_maxWriteSize)) {
+        spdlog::error("write operation exceeds file's {}-byte limit", m_maxWriteSize);
+        return 0;
+      }
+      if (m_sink.m_failed)
+        return 0;
+      return m_sink.append((const uint8_t*)buf, length);
+    }
+    bool skipUnused(uint64_t length, uint8_t fillByte) override {
+      return !m_sink.m_failed && m_sink.append(nullptr, length) == length;
+    }
+  };
+
+  std::unique_ptr<IWriteStream> beginWriteStream() const override {
+    if (!open())
+      return {};
+    return std::make_unique<WriteStream>(*m_sink, m_maxWriteSize);
+  }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override {
+    if (!open())
+      return {};
+    if (offset < m_sink->m_pos) {
+      spdlog::error("unable to seek '{}' back to 0x{:X}; 0x{:X} bytes were already written", m_sink->m_path, offset,
+                    m_sink->m_pos);
+      return {};
+    }
+    const uint64_t skip = offset - m_sink->m_pos;
+    if (m_sink->append(nullptr, skip) != skip)
+      return {};
+    return std::make_unique<WriteStream>(*m_sink, m_maxWriteSize);
+  }
+
+  std::unique_ptr<IReadStream> beginReadStream() const override {
+    spdlog::error("NFS output '{}' cannot be read back while it is written", m_sink->m_path);
+    return {};
+  }
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override { return beginReadStream(); }
+};
+
+std::unique_ptr<IFileIO> NewNFSFileIO(std::string_view path, int64_t maxWriteSize) {
+  return std::make_unique<FileIONFS>(path, maxWriteSize);
+}
+
 } // namespace nod
\ No newline at end of file
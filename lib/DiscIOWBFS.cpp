@@ -1,161 +1,340 @@
-#include <cinttypes>
+#include <algorithm>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "nod/IDiscIO.hpp"
 #include "nod/IFileIO.hpp"
+#include "nod/DiscBase.hpp"
 #include "nod/Endian.hpp"
+#include "nod/WBFS.hpp"
 #include "Util.hpp"
 
 #include <spdlog/spdlog.h>
 
 namespace nod {
 
-#define ALIGN_LBA(x) (((x) + p->hd_sec_sz - 1) & (~(p->hd_sec_sz - 1)))
+/* Wii sectors addressed by every wlba_table, enough for a dual-layer disc */
+static constexpr uint32_t WBFSWiiSectorsPerDisc = 143432 * 2;
 
-static uint8_t size_to_shift(uint32_t size) {
-  uint8_t ret = 0;
-  while (size) {
-    ret++;
-    size >>= 1;
+WBFSContainer::WBFSContainer(std::string_view path, bool& err) : m_path(path), m_fio(NewImageFileIO(path)) {
+  std::unique_ptr<IFileIO::IReadStream> rs = m_fio->beginReadStream();
+  uint8_t probe[12];
+  if (!rs || rs->read(probe, sizeof(probe)) != sizeof(probe) || memcmp(probe, "WBFS", 4)) {
+    spdlog::error("'{}' is not a WBFS container", path);
+    err = true;
+    return;
+  }
+  m_hdSecShift = probe[8];
+  m_wbfsSecShift = probe[9];
+  m_hdSecCount = SBig(*reinterpret_cast<uint32_t*>(probe + 4));
+  if (m_hdSecShift < 9 || m_hdSecShift > 12 || m_wbfsSecShift < 15 || m_wbfsSecShift > 30) {
+    spdlog::error("invalid WBFS sector sizes in '{}'", path);
+    err = true;
+    return;
+  }
+
+  /* Geometry as libwbfs derives it, so containers from other tools line up exactly */
+  const uint32_t hdSecSize = 1u << m_hdSecShift;
+  const uint64_t wiiSecCount = uint64_t(m_hdSecCount / 0x8000) * hdSecSize;
+  m_wbfsSecCount = uint32_t(wiiSecCount >> (m_wbfsSecShift - 15));
+  m_secsPerDisc = WBFSWiiSectorsPerDisc >> (m_wbfsSecShift - 15);
+  m_discInfoSize = (0x100 + m_secsPerDisc * 2 + hdSecSize - 1) & ~(hdSecSize - 1);
+  const uint32_t freeBlksLba = getFreeBlocksLba();
+  if (!freeBlksLba || m_wbfsSecCount > 0x10000) {
+    spdlog::error("invalid WBFS geometry in '{}'", path);
+    err = true;
+    return;
+  }
+  m_maxDiscs = nod::min((freeBlksLba - 1) / (m_discInfoSize >> m_hdSecShift), hdSecSize - 12);
+
+  m_head.resize(hdSecSize);
+  rs->seek(0, SEEK_SET);
+  if (rs->read(m_head.data(), hdSecSize) != hdSecSize) {
+    spdlog::error("unable to read WBFS head from '{}'", path);
+    err = true;
+    return;
+  }
+
+  /* Info blocks sit back to back after the head; one read covers every occupied slot */
+  uint32_t slotEnd = 0;
+  for (uint32_t i = 0; i < m_maxDiscs; ++i)
+    if (m_head[12 + i])
+      slotEnd = i + 1;
+  m_discInfo.resize(size_t(slotEnd) * m_discInfoSize);
+  if (slotEnd && rs->read(m_discInfo.data(), m_discInfo.size()) != m_discInfo.size()) {
+    spdlog::error("unable to read WBFS disc table from '{}'", path);
+    err = true;
+    return;
+  }
+
+  for (uint32_t slot = 0; slot < slotEnd; ++slot) {
+    if (!m_head[12 + slot])
+      continue;
+    const uint8_t* info = getDiscInfo(slot);
+    Disc disc;
+    disc.m_slot = slot;
+    disc.m_gameId.assign(reinterpret_cast<const char*>(info), 6);
+    const char* title = reinterpret_cast<const char*>(info + 0x20);
+    disc.m_title.assign(title, strnlen(title, 0x40));
+    disc.m_blockCount = 0;
+    for (uint32_t i = 0; i < m_secsPerDisc; ++i)
+      if (info[0x100 + i * 2] || info[0x101 + i * 2])
+        ++disc.m_blockCount;
+    m_discs.push_back(std::move(disc));
   }
-  return ret - 1;
 }
 
-class DiscIOWBFS : public IDiscIO {
-  std::unique_ptr<IFileIO> m_fio;
+uint32_t WBFSContainer::getFreeBlocksLba() const {
+  /* The bitmap fills the tail of the first WBFS sector */
+  return ((1u << m_wbfsSecShift) - m_wbfsSecCount / 8) >> m_hdSecShift;
+}
 
-  struct WBFSHead {
-    uint32_t magic;
-    // parameters copied in the partition for easy dumping, and bug reports
-    uint32_t n_hd_sec;     // total number of hd_sec in this partition
-    uint8_t hd_sec_sz_s;   // sector size in this partition
-    uint8_t wbfs_sec_sz_s; // size of a wbfs sec
-    uint8_t padding3[2];
-    uint8_t disc_table[0]; // size depends on hd sector size
-  };
-  std::unique_ptr<uint8_t[]> wbfsHead;
+bool WBFSContainer::beginEdit() {
+  if (!m_freeBlocks.empty())
+    return true;
+  const uint32_t hdSecSize = 1u << m_hdSecShift;
+  const size_t bitmapSz = (m_wbfsSecCount / 8 + hdSecSize - 1) & ~size_t(hdSecSize - 1);
+  std::vector<uint32_t> bitmap(bitmapSz / 4);
+  std::unique_ptr<IFileIO::IReadStream> rs = m_fio->beginReadStream(uint64_t(getFreeBlocksLba()) << m_hdSecShift);
+  if (!rs || rs->read(bitmap.data(), bitmapSz) != bitmapSz) {
+    spdlog::error("unable to read WBFS free-block bitmap from '{}'", m_path);
+    return false;
+  }
+  bitmap.resize(m_wbfsSecCount / 32);
+  for (uint32_t& word : bitmap)
+    word = SBig(word);
+  m_freeBlocks = std::move(bitmap);
+  m_pendingFree.assign(m_freeBlocks.size(), 0);
+  m_discInfo.resize(size_t(m_maxDiscs) * m_discInfoSize);
+  m_dirtySlots.assign(m_maxDiscs, false);
+  return true;
+}
 
-  struct WBFSDiscInfo {
-    uint8_t disc_header_copy[0x100];
-    uint16_t wlba_table[0];
-  };
-  std::unique_ptr<uint8_t[]> wbfsDiscInfo;
-
-  struct WBFS {
-    /* hdsectors, the size of the sector provided by the hosting hard drive */
-    uint32_t hd_sec_sz;
-    uint8_t hd_sec_sz_s; // the power of two of the last number
-    uint32_t n_hd_sec;   // the number of hd sector in the wbfs partition
-
-    /* standard wii sector (0x8000 bytes) */
-    uint32_t wii_sec_sz;
-    uint8_t wii_sec_sz_s;
-    uint32_t n_wii_sec;
-    uint32_t n_wii_sec_per_disc;
-
-    /* The size of a wbfs sector */
-    uint32_t wbfs_sec_sz;
-    uint32_t wbfs_sec_sz_s;
-    uint16_t n_wbfs_sec;          // this must fit in 16 bit!
-    uint16_t n_wbfs_sec_per_disc; // size of the lookup table
-
-    uint32_t part_lba;
-
-    uint16_t max_disc;
-    uint32_t freeblks_lba;
-    uint32_t* freeblks;
-    uint16_t disc_info_sz;
-
-    uint32_t n_disc_open;
-
-  } wbfs;
-
-  static int _wbfsReadSector(IFileIO::IReadStream& rs, uint32_t lba, uint32_t count, void* buf) {
-    uint64_t off = lba;
-    off *= 512ULL;
-    rs.seek(off, SEEK_SET);
-    if (rs.read(buf, count * 512ULL) != count * 512ULL) {
-      spdlog::error("error reading disc");
-      return 1;
+uint16_t WBFSContainer::allocBlock() {
+  for (size_t i = 0; i < m_freeBlocks.size(); ++i) {
+    if (!m_freeBlocks[i])
+      continue;
+    for (uint32_t j = 0; j < 32; ++j) {
+      uint32_t block = uint32_t(i) * 32 + j + 1;
+      if (block >= m_wbfsSecCount)
+        return 0;
+      if (m_freeBlocks[i] & (1u << j)) {
+        m_freeBlocks[i] &= ~(1u << j);
+        return uint16_t(block);
+      }
     }
-    return 0;
   }
+  return 0;
+}
 
-public:
-  DiscIOWBFS(std::string_view fpin) : m_fio(NewFileIO(fpin)) {
-    /* Temporary file handle to read LBA table */
-    std::unique_ptr<IFileIO::IReadStream> rs = m_fio->beginReadStream();
-    if (!rs)
-      return;
-
-    WBFS* p = &wbfs;
-    WBFSHead tmpHead;
-    if (rs->read(&tmpHead, sizeof(tmpHead)) != sizeof(tmpHead)) {
-      spdlog::error("unable to read WBFS head");
-      return;
-    }
-    unsigned hd_sector_size = 1 << tmpHead.hd_sec_sz_s;
-    unsigned num_hd_sector = SBig(tmpHead.n_hd_sec);
-
-    wbfsHead.reset(new uint8_t[hd_sector_size]);
-    WBFSHead* head = (WBFSHead*)wbfsHead.get();
-    rs->seek(0, SEEK_SET);
-    if (rs->read(head, hd_sector_size) != hd_sector_size) {
-      spdlog::error("unable to read WBFS head");
-      return;
+void WBFSContainer::FreeBlock(std::vector<uint32_t>& bitmap, uint16_t block) {
+  if (block && (block - 1u) / 32 < bitmap.size())
+    bitmap[(block - 1u) / 32] |= 1u << ((block - 1u) % 32);
+}
+
+uint32_t WBFSContainer::getFreeBlockCount() {
+  if (!beginEdit())
+    return UINT32_MAX;
+  uint32_t count = 0;
+  for (uint32_t word : m_freeBlocks)
+    for (; word; word &= word - 1)
+      ++count;
+  return count;
+}
+
+bool WBFSContainer::addDisc(const DiscBase& disc) {
+  const Header& header = disc.getHeader();
+  if (header.m_wiiMagic != 0x5D1C9EA3) {
+    spdlog::error("only Wii discs can be added to WBFS container '{}'", m_path);
+    return false;
+  }
+  std::string gameId(header.m_gameID, 6);
+  for (const Disc& existing : m_discs) {
+    if (existing.m_gameId == gameId) {
+      spdlog::error("'{}' already holds {}", m_path, gameId);
+      return false;
     }
+  }
+  if (!beginEdit())
+    return false;
+  uint32_t slot = 0;
+  while (slot < m_maxDiscs && m_head[12 + slot])
+    ++slot;
+  if (slot == m_maxDiscs) {
+    spdlog::error("no free disc slot in '{}'", m_path);
+    return false;
+  }
 
-    // constants, but put here for consistancy
-    p->wii_sec_sz = 0x8000;
-    p->wii_sec_sz_s = size_to_shift(0x8000);
-    p->n_wii_sec = (num_hd_sector / 0x8000) * hd_sector_size;
-    p->n_wii_sec_per_disc = 143432 * 2; // support for double layers discs..
-    p->part_lba = 0;
-    if (_wbfsReadSector(*rs, p->part_lba, 1, head))
-      return;
-    if (hd_sector_size && head->hd_sec_sz_s != size_to_shift(hd_sector_size)) {
-      spdlog::error("hd sector size doesn't match");
-      return;
+  /* Wii sectors reachable from the disc's structures; everything else is left out */
+  const uint32_t wiiSecsPerBlock = 1u << (m_wbfsSecShift - 15);
+  std::vector<bool> usedSecs(size_t(m_secsPerDisc) * wiiSecsPerBlock);
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  disc.getUsedDiscRanges(ranges);
+  for (const auto& [begin, end] : ranges) {
+    uint64_t endSec = nod::min(uint64_t(usedSecs.size()), (end + 0x7FFF) / 0x8000);
+    for (uint64_t sec = begin / 0x8000; sec < endSec; ++sec)
+      usedSecs[sec] = true;
+  }
+
+  uint8_t* info = getDiscInfo(slot);
+  memset(info, 0, m_discInfoSize);
+  std::unique_ptr<IReadStream> rs = disc.getDiscIO().beginReadStream(0);
+  std::unique_ptr<IFileIO::IWriteStream> ws = m_fio->beginWriteStream(0);
+  if (!rs || !ws || rs->read(info, 0x100) != 0x100) {
+    spdlog::error("unable to add {} to '{}'", gameId, m_path);
+    return false;
+  }
+
+  const uint64_t blockSize = getBlockSize();
+  std::vector<uint8_t> buf(blockSize);
+  std::vector<uint16_t> allocated;
+  auto rollBack = [&]() {
+    for (uint16_t block : allocated)
+      FreeBlock(m_freeBlocks, block);
+    memset(info, 0, m_discInfoSize);
+    return false;
+  };
+  for (uint32_t i = 0; i < m_secsPerDisc; ++i) {
+    const size_t firstSec = size_t(i) * wiiSecsPerBlock;
+    bool used = false;
+    for (uint32_t s = 0; s < wiiSecsPerBlock && !used; ++s)
+      used = usedSecs[firstSec + s];
+    if (!used)
+      continue;
+    uint16_t block = allocBlock();
+    if (!block) {
+      spdlog::error("'{}' has no room left for {}", m_path, gameId);
+      return rollBack();
+    }
+    allocated.push_back(block);
+
+    /* Runs of used sectors are read as one; unused sectors in the block are zeroed */
+    memset(buf.data(), 0, blockSize);
+    for (uint32_t s = 0; s < wiiSecsPerBlock;) {
+      if (!usedSecs[firstSec + s]) {
+        ++s;
+        continue;
+      }
+      uint32_t runEnd = s;
+      while (runEnd < wiiSecsPerBlock && usedSecs[firstSec + runEnd])
+        ++runEnd;
+      rs->seek((uint64_t(firstSec) + s) * 0x8000, SEEK_SET);
+      if (rs->read(buf.data() + s * 0x8000, (runEnd - s) * 0x8000ull) != (runEnd - s) * 0x8000ull) {
+        spdlog::error("unable to read {} at 0x{:x}", gameId, (uint64_t(firstSec) + s) * 0x8000);
+        return rollBack();
+      }
+      s = runEnd;
     }
-    if (num_hd_sector && head->n_hd_sec != SBig(num_hd_sector)) {
-      spdlog::error("hd num sector doesn't match");
-      return;
+    if (!ws->seek(uint64_t(block) << m_wbfsSecShift) || ws->write(buf.data(), blockSize) != blockSize) {
+      spdlog::error("unable to write to '{}'", m_path);
+      return rollBack();
     }
-    p->hd_sec_sz = 1 << head->hd_sec_sz_s;
-    p->hd_sec_sz_s = head->hd_sec_sz_s;
-    p->n_hd_sec = SBig(head->n_hd_sec);
+    uint16_t wlba = SBig(block);
+    memcpy(info + 0x100 + i * 2, &wlba, 2);
+  }
+
+  m_head[12 + slot] = 1;
+  m_dirtySlots[slot] = true;
+  Disc entry;
+  entry.m_slot = slot;
+  entry.m_gameId = std::move(gameId);
+  entry.m_title.assign(header.m_gameTitle, strnlen(header.m_gameTitle, sizeof(header.m_gameTitle)));
+  entry.m_blockCount = uint32_t(allocated.size());
+  m_discs.insert(std::find_if(m_discs.begin(), m_discs.end(), [&](const Disc& d) { return d.m_slot > slot; }),
+                 std::move(entry));
+  return true;
+}
 
-    p->n_wii_sec = (p->n_hd_sec / p->wii_sec_sz) * (p->hd_sec_sz);
+bool WBFSContainer::removeDisc(std::string_view gameId) {
+  auto it = std::find_if(m_discs.begin(), m_discs.end(), [&](const Disc& d) { return d.m_gameId == gameId; });
+  if (it == m_discs.end()) {
+    spdlog::error("'{}' holds no disc with ID {}", m_path, gameId);
+    return false;
+  }
+  if (!beginEdit())
+    return false;
+  /* Until commit() the disc is still listed on disk, so its blocks must keep their data */
+  uint8_t* info = getDiscInfo(it->m_slot);
+  for (uint32_t i = 0; i < m_secsPerDisc; ++i)
+    FreeBlock(m_pendingFree, SBig(*reinterpret_cast<const uint16_t*>(info + 0x100 + i * 2)));
+  memset(info, 0, m_discInfoSize);
+  m_head[12 + it->m_slot] = 0;
+  m_dirtySlots[it->m_slot] = true;
+  m_discs.erase(it);
+  return true;
+}
 
-    p->wbfs_sec_sz_s = head->wbfs_sec_sz_s;
-    p->wbfs_sec_sz = 1 << p->wbfs_sec_sz_s;
-    p->n_wbfs_sec = p->n_wii_sec >> (p->wbfs_sec_sz_s - p->wii_sec_sz_s);
-    p->n_wbfs_sec_per_disc = p->n_wii_sec_per_disc >> (p->wbfs_sec_sz_s - p->wii_sec_sz_s);
-    p->disc_info_sz = ALIGN_LBA(uint16_t(sizeof(WBFSDiscInfo)) + p->n_wbfs_sec_per_disc * 2);
+bool WBFSContainer::commit() {
+  if (m_freeBlocks.empty())
+    return true;
+  std::unique_ptr<IFileIO::IWriteStream> ws = m_fio->beginWriteStream(0);
+  if (!ws)
+    return false;
+  bool ok = ws->write(m_head.data(), m_head.size()) == m_head.size();
+  const uint64_t discInfoBase = m_head.size();
+  for (uint32_t slot = 0; ok && slot < m_maxDiscs; ++slot) {
+    if (!m_dirtySlots[slot])
+      continue;
+    ok = ws->seek(discInfoBase + uint64_t(slot) * m_discInfoSize) &&
+         ws->write(getDiscInfo(slot), m_discInfoSize) == m_discInfoSize;
+  }
+  std::vector<uint32_t> bitmap(m_freeBlocks.size());
+  for (size_t i = 0; i < bitmap.size(); ++i)
+    bitmap[i] = SBig(m_freeBlocks[i] | m_pendingFree[i]);
+  ok = ok && ws->seek(uint64_t(getFreeBlocksLba()) << m_hdSecShift) &&
+       ws->write(bitmap.data(), bitmap.size() * 4) == bitmap.size() * 4;
+  if (!ok) {
+    spdlog::error("unable to write WBFS metadata to '{}'", m_path);
+    return false;
+  }
+  m_dirtySlots.assign(m_maxDiscs, false);
+  for (size_t i = 0; i < m_freeBlocks.size(); ++i)
+    m_freeBlocks[i] |= m_pendingFree[i];
+  m_pendingFree.assign(m_freeBlocks.size(), 0);
+  return true;
+}
 
-    p->freeblks_lba = (p->wbfs_sec_sz - p->n_wbfs_sec / 8) >> p->hd_sec_sz_s;
+std::unique_ptr<WBFSContainer> OpenWBFSContainer(std::string_view path) {
+  bool err = false;
+  auto ret = std::make_unique<WBFSContainer>(path, err);
+  if (err)
+    return {};
+  return ret;
+}
 
-    p->freeblks = 0; // will alloc and read only if needed
-    p->max_disc = (p->freeblks_lba - 1) / (p->disc_info_sz >> p->hd_sec_sz_s);
-    if (p->max_disc > p->hd_sec_sz - sizeof(WBFSHead))
-      p->max_disc = p->hd_sec_sz - sizeof(WBFSHead);
+class DiscIOWBFS : public IDiscIO {
+  std::unique_ptr<IFileIO> m_fio;
 
-    p->n_disc_open = 0;
+  /* Disc byte range backed by physically contiguous WBFS sectors (or by none of them) */
+  struct Extent {
+    uint64_t m_offset;
+    uint64_t m_size;
+    uint64_t m_filePos; /* UINT64_MAX when the range is not stored */
+  };
+  std::vector<Extent> m_extents;
 
-    int disc_info_sz_lba = p->disc_info_sz >> p->hd_sec_sz_s;
-    if (head->disc_table[0]) {
-      wbfsDiscInfo.reset(new uint8_t[p->disc_info_sz]);
-      if (!wbfsDiscInfo) {
-        spdlog::error("allocating memory");
-        return;
+public:
+  /* Folds the slot's wlba_table into the fewest extents so reads need one seek per physical run */
+  DiscIOWBFS(const WBFSContainer& container, uint32_t slot) : m_fio(NewImageFileIO(container.m_path)) {
+    const uint8_t* wlbaTable = container.getDiscInfo(slot) + 0x100;
+    const uint64_t secSize = container.getBlockSize();
+    for (uint32_t i = 0; i < container.m_secsPerDisc; ++i) {
+      uint16_t iwlba = SBig(*reinterpret_cast<const uint16_t*>(wlbaTable + i * 2));
+      uint64_t filePos = iwlba ? uint64_t(iwlba) << container.m_wbfsSecShift : UINT64_MAX;
+      if (!m_extents.empty()) {
+        Extent& last = m_extents.back();
+        if (filePos == UINT64_MAX ? last.m_filePos == UINT64_MAX
+                                  : last.m_filePos != UINT64_MAX && last.m_filePos + last.m_size == filePos) {
+          last.m_size += secSize;
+          continue;
+        }
       }
-      if (_wbfsReadSector(*rs, p->part_lba + 1, disc_info_sz_lba, wbfsDiscInfo.get()))
-        return;
-      p->n_disc_open++;
-      // for(i=0;i<p->n_wbfs_sec_per_disc;i++)
-      //    printf("%d,",wbfs_ntohs(d->header->wlba_table[i]));
+      m_extents.push_back({uint64_t(i) * secSize, secSize, filePos});
     }
   }
 
@@ -164,95 +343,51 @@ public:
     const DiscIOWBFS& m_parent;
     std::unique_ptr<IFileIO::IReadStream> fp;
     uint64_t m_offset;
-    std::unique_ptr<uint8_t[]> m_tmpBuffer;
+    uint64_t m_filePos = UINT64_MAX;
 
     ReadStream(const DiscIOWBFS& parent, std::unique_ptr<IFileIO::IReadStream>&& fpin, uint64_t offset, bool& err)
-    : m_parent(parent), fp(std::move(fpin)), m_offset(offset), m_tmpBuffer(new uint8_t[parent.wbfs.hd_sec_sz]) {
+    : m_parent(parent), fp(std::move(fpin)), m_offset(offset) {
       if (!fp)
         err = true;
     }
 
-    int wbfsReadSector(uint32_t lba, uint32_t count, void* buf) {
-      return DiscIOWBFS::_wbfsReadSector(*fp, lba, count, buf);
-    }
-
-    int wbfsDiscRead(uint32_t offset, uint8_t* data, uint64_t len) {
-      const WBFS* p = &m_parent.wbfs;
-      const WBFSDiscInfo* d = (WBFSDiscInfo*)m_parent.wbfsDiscInfo.get();
-      uint16_t wlba = offset >> (p->wbfs_sec_sz_s - 2);
-      uint32_t iwlba_shift = p->wbfs_sec_sz_s - p->hd_sec_sz_s;
-      uint32_t lba_mask = (p->wbfs_sec_sz - 1) >> (p->hd_sec_sz_s);
-      uint64_t lba = (offset >> (p->hd_sec_sz_s - 2)) & lba_mask;
-      uint64_t off = offset & ((p->hd_sec_sz >> 2) - 1);
-      uint16_t iwlba = SBig(d->wlba_table[wlba]);
-      uint64_t len_copied;
-      int err = 0;
-      uint8_t* ptr = data;
-      if (!iwlba)
-        return 1;
-      if (off) {
-        off *= 4;
-        err = wbfsReadSector(p->part_lba + (iwlba << iwlba_shift) + lba, 1, m_tmpBuffer.get());
-        if (err)
-          return err;
-        len_copied = p->hd_sec_sz - off;
-        if (len < len_copied)
-          len_copied = len;
-        memcpy(ptr, m_tmpBuffer.get() + off, len_copied);
-        len -= len_copied;
-        ptr += len_copied;
-        lba++;
-        if (lba > lba_mask && len) {
-          lba = 0;
-          iwlba = SBig(d->wlba_table[++wlba]);
-          if (!iwlba)
-            return 1;
-        }
-      }
-      while (len >= p->hd_sec_sz) {
-        uint32_t nlb = len >> (p->hd_sec_sz_s);
-
-        if (lba + nlb > p->wbfs_sec_sz) // dont cross wbfs sectors..
-          nlb = p->wbfs_sec_sz - lba;
-        err = wbfsReadSector(p->part_lba + (iwlba << iwlba_shift) + lba, nlb, ptr);
-        if (err)
-          return err;
-        len -= nlb << p->hd_sec_sz_s;
-        ptr += nlb << p->hd_sec_sz_s;
-        lba += nlb;
-        if (lba > lba_mask && len) {
-          lba = 0;
-          iwlba = SBig(d->wlba_table[++wlba]);
-          if (!iwlba)
-            return 1;
-        }
-      }
-      if (len) {
-        err = wbfsReadSector(p->part_lba + (iwlba << iwlba_shift) + lba, 1, m_tmpBuffer.get());
-        if (err)
-          return err;
-        memcpy(ptr, m_tmpBuffer.get(), len);
-      }
-      return 0;
-    }
-
   public:
     uint64_t read(void* buf, uint64_t length) override {
-      uint8_t extra[4];
-      uint64_t rem_offset = m_offset % 4;
-      if (rem_offset) {
-        uint64_t rem_rem = 4 - rem_offset;
-        if (wbfsDiscRead((uint32_t)(m_offset / 4), extra, 4))
-          return 0;
-        memcpy(buf, extra + rem_offset, rem_rem);
-        if (wbfsDiscRead((uint32_t)(m_offset / 4 + 1), (uint8_t*)buf + rem_rem, length - rem_rem))
-          return 0;
-      } else {
-        if (wbfsDiscRead((uint32_t)(m_offset / 4), (uint8_t*)buf, length))
-          return 0;
+      const std::vector<Extent>& extents = m_parent.m_extents;
+      uint8_t* dst = (uint8_t*)buf;
+      auto it = std::upper_bound(extents.begin(), extents.end(), m_offset,
+                                 [](uint64_t off, const Extent& ext) { return off < ext.m_offset; });
+      if (it == extents.begin())
+        return 0;
+      --it;
+      while (length && it != extents.end()) {
+        uint64_t inExt = m_offset - it->m_offset;
+        if (inExt >= it->m_size) {
+          ++it;
+          continue;
+        }
+        uint64_t thisSz = nod::min(length, it->m_size - inExt);
+        if (it->m_filePos == UINT64_MAX) {
+          /* Blocks left out of the image read as zeros */
+          memset(dst, 0, thisSz);
+        } else {
+          uint64_t filePos = it->m_filePos + inExt;
+          if (filePos != m_filePos)
+            fp->seek(filePos, SEEK_SET);
+          uint64_t rdSz = fp->read(dst, thisSz);
+          m_filePos = filePos + rdSz;
+          if (rdSz != thisSz) {
+            spdlog::error("error reading disc");
+            m_filePos = UINT64_MAX;
+            m_offset += rdSz;
+            return dst + rdSz - (uint8_t*)buf;
+          }
+        }
+        dst += thisSz;
+        length -= thisSz;
+        m_offset += thisSz;
       }
-      m_offset += length;
-      return length;
+      return dst - (uint8_t*)buf;
     }
     uint64_t position() const override { return m_offset; }
     void seek(int64_t offset, int whence) override {
@@ -276,6 +411,219 @@ public:
   std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override { return {}; }
 };
 
-std::unique_ptr<IDiscIO> NewDiscIOWBFS(std::string_view path) { return std::make_unique<DiscIOWBFS>(path); }
+std::unique_ptr<IDiscIO> WBFSContainer::openDisc(size_t idx) const {
+  if (idx >= m_discs.size()) {
+    spdlog::error("'{}' holds no disc #{}", m_path, idx);
+    return {};
+  }
+  return std::make_unique<DiscIOWBFS>(*this, m_discs[idx].m_slot);
+}
+
+std::unique_ptr<IDiscIO> WBFSContainer::openDisc(std::string_view gameId) const {
+  for (size_t i = 0; i < m_discs.size(); ++i)
+    if (m_discs[i].m_gameId == gameId)
+      return openDisc(i);
+  spdlog::error("'{}' holds no disc with ID {}", m_path, gameId);
+  return {};
+}
+
+/* Plain image opening takes the first disc a container holds */
+std::unique_ptr<IDiscIO> NewDiscIOWBFS(std::string_view path) {
+  std::unique_ptr<WBFSContainer> container = OpenWBFSContainer(path);
+  if (!container)
+    return {};
+  if (container->getDiscs().empty()) {
+    spdlog::error("WBFS container '{}' holds no discs", path);
+    return {};
+  }
+  return container->openDisc(size_t(0));
+}
+
+/* Geometry of WBFS output: 512-byte HD sectors and 2 MiB WBFS sectors, with room for one
+ * dual-layer disc plus the header block, rounded up to whole free-block bitmap words */
+static constexpr uint32_t WBFSOutHdSectorShift = 9;
+static constexpr uint32_t WBFSOutSectorShift = 21;
+static constexpr uint64_t WBFSOutSectorSize = 1ull << WBFSOutSectorShift;
+static constexpr uint32_t WBFSOutSectorsPerDisc = WBFSWiiSectorsPerDisc >> (WBFSOutSectorShift - 15);
+static constexpr uint32_t WBFSOutSectorCount = (WBFSOutSectorsPerDisc + 1 + 31) / 32 * 32;
+
+/* Single-disc WBFS output. Each WBFS sector of the disc gets the next free block the first
+ * time it is written, so regions that are never written (such as the fill past the last
+ * partition) take no space. Writes may arrive in any order and from several threads.
+ * The header, disc info and free-block bitmap are written on close. */
+class FileIOWBFS : public IFileIO {
+  struct Sink {
+    std::string m_path;
+    uint64_t m_splitSize = 0;
+    std::unique_ptr<IFileIO> m_out;
+    std::unique_ptr<IFileIO::IWriteStream> m_ws;
+    std::mutex m_lock;
+    uint64_t m_filePos = UINT64_MAX;
+    uint64_t m_fileEnd = 0;
+    uint8_t m_discHead[0x100] = {};
+    std::vector<uint16_t> m_wlba = std::vector<uint16_t>(WBFSOutSectorsPerDisc); /* 0 while unwritten */
+    uint16_t m_nextBlock = 1;
+    uint64_t m_size = 0;
+    bool m_failed = false;
+
+    uint64_t write(uint64_t offset, const uint8_t* data, uint64_t length) {
+      std::lock_guard<std::mutex> lk(m_lock);
+      if (m_failed)
+        return 0;
+      if (offset < sizeof(m_discHead))
+        memcpy(m_discHead + offset, data, nod::min(length, sizeof(m_discHead) - offset));
+      uint64_t done = 0;
+      while (done < length) {
+        uint64_t pos = offset + done;
+        uint64_t sec = pos >> WBFSOutSectorShift;
+        uint64_t inSec = pos & (WBFSOutSectorSize - 1);
+        uint64_t thisSz = nod::min(length - done, WBFSOutSectorSize - inSec);
+        if (sec >= m_wlba.size()) {
+          spdlog::error("'{}' exceeds the largest disc WBFS can hold", m_path);
+          m_failed = true;
+          break;
+        }
+        if (!m_wlba[sec])
+          m_wlba[sec] = m_nextBlock++;
+        uint64_t filePos = uint64_t(m_wlba[sec]) << WBFSOutSectorShift | inSec;
+        if ((filePos != m_filePos && !m_ws->seek(filePos)) || m_ws->write(data + done, thisSz) != thisSz) {
+          spdlog::error("unable to write to '{}'", m_path);
+          m_failed = true;
+          m_filePos = UINT64_MAX;
+          break;
+        }
+        m_filePos = filePos + thisSz;
+        m_fileEnd = nod::max(m_fileEnd, m_filePos);
+        done += thisSz;
+      }
+      m_size = nod::max(m_size, offset + done);
+      return done;
+    }
+
+    bool close() {
+      const uint32_t discInfoSz = (0x100 + WBFSOutSectorsPerDisc * 2 + 511) & ~511u;
+      const uint32_t freeBlksSz = WBFSOutSectorCount / 8;
+      const uint64_t freeBlksOff =
+          ((WBFSOutSectorSize - freeBlksSz) >> WBFSOutHdSectorShift) << WBFSOutHdSectorShift;
+      std::vector<uint8_t> block0(WBFSOutSectorSize);
+      uint8_t* head = block0.data();
+      memcpy(head, "WBFS", 4);
+      uint32_t hdSecCount = SBig(WBFSOutSectorCount << (WBFSOutSectorShift - WBFSOutHdSectorShift));
+      memcpy(head + 4, &hdSecCount, 4);
+      head[8] = WBFSOutHdSectorShift;
+      head[9] = WBFSOutSectorShift;
+      head[12] = 1; /* Disc table: slot 0 in use */
+
+      uint8_t* discInfo = head + (1 << WBFSOutHdSectorShift);
+      memcpy(discInfo, m_discHead, sizeof(m_discHead));
+      for (size_t i = 0; i < m_wlba.size(); ++i) {
+        uint16_t wlba = SBig(m_wlba[i]);
+        memcpy(discInfo + 0x100 + i * 2, &wlba, 2);
+      }
+
+      /* Bit (b - 1) flags block b as free; block 0 holds this header */
+      for (uint32_t b = m_nextBlock; b < WBFSOutSectorCount; ++b)
+        head[freeBlksOff + (b - 1) / 32 * 4 + 3 - (b - 1) % 32 / 8] |= 1 << ((b - 1) % 8);
+
+      /* Everything but the header, disc info and bitmap in block 0 stays zero */
+      const size_t headSz = (1 << WBFSOutHdSectorShift) + discInfoSz;
+      const size_t freeBlksAligned = size_t(WBFSOutSectorSize - freeBlksOff);
+      bool ok = !m_failed && m_ws->seek(0) && m_ws->write(head, headSz) == headSz && m_ws->seek(freeBlksOff) &&
+                m_ws->write(head + freeBlksOff, freeBlksAligned) == freeBlksAligned;
+
+      /* The file ends with the last allocated block; extend it if that block's tail was never written */
+      const uint64_t fileSz = uint64_t(m_nextBlock) << WBFSOutSectorShift;
+      const uint8_t zero = 0;
+      if (ok && m_fileEnd < fileSz)
+        ok = m_ws->seek(fileSz - 1) && m_ws->write(&zero, 1) == 1;
+      m_ws.reset();
+      if (!ok)
+        spdlog::error("unable to finish WBFS image '{}'", m_path);
+      return ok;
+    }
+  };
+  std::unique_ptr<Sink> m_sink;
+  int64_t m_maxWriteSize;
+
+  bool open() const {
+    if (m_sink->m_ws)
+      return !m_sink->m_failed;
+    if (m_sink->m_path == "-") {
+      spdlog::error("WBFS output needs a seekable file, not stdout");
+      return false;
+    }
+    m_sink->m_out =
+        m_sink->m_splitSize ? NewSplitFileIO(m_sink->m_path, m_sink->m_splitSize) : NewFileIO(m_sink->m_path);
+    if (m_sink->m_out)
+      m_sink->m_ws = m_sink->m_out->beginWriteStream();
+    if (!m_sink->m_ws) {
+      spdlog::error("unable to open '{}' for writing", m_sink->m_path);
+      return false;
+    }
+    return true;
+  }
+
+public:
+  FileIOWBFS(std::string_view path, int64_t maxWriteSize, uint64_t splitSize)
+  : m_sink(std::make_unique<Sink>()), m_maxWriteSize(maxWriteSize) {
+    m_sink->m_path = path;
+    m_sink->m_splitSize = splitSize;
+  }
+  ~FileIOWBFS() override { finish(); }
+
+  bool exists() override { return m_sink->m_ws != nullptr; }
+  uint64_t size() override { return m_sink->m_size; }
+  bool isSparse() const override { return true; }
+
+  bool finish() override {
+    if (!m_sink->m_ws)
+      return true;
+    return m_sink->close();
+  }
+
+  struct WriteStream : public IFileIO::IWriteStream {
+    Sink& m_sink;
+    uint64_t m_offset;
+    int64_t m_maxWriteSize;
+    WriteStream(Sink& sink, uint64_t offset, int64_t maxWriteSize)
+    : m_sink(sink), m_offset(offset), m_maxWriteSize(maxWriteSize) {}
+    uint64_t write(const void* buf, uint64_t length) override {
+      if (m_maxWriteSize >= 0 && m_offset + length > uint64_t(m_maxWriteSize)) {
+        spdlog::error("write operation exceeds file's {}-byte limit", m_maxWriteSize);
+        return 0;
+      }
+      uint64_t done = m_sink.write(m_offset, (const uint8_t*)buf, length);
+      m_offset += done;
+      return done;
+    }
+    bool seek(uint64_t offset) override {
+      m_offset = offset;
+      return true;
+    }
+    bool skipUnused(uint64_t length, uint8_t fillByte) override {
+      m_offset += length;
+      return true;
+    }
+  };
+
+  std::unique_ptr<IWriteStream> beginWriteStream() const override { return beginWriteStream(0); }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override {
+    if (!open())
+      return {};
+    return std::make_unique<WriteStream>(*m_sink, offset, m_maxWriteSize);
+  }
+
+  std::unique_ptr<IReadStream> beginReadStream() const override {
+    spdlog::error("WBFS output '{}' cannot be read back while it is written", m_sink->m_path);
+    return {};
+  }
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override { return beginReadStream(); }
+};
+
+std::unique_ptr<IFileIO> NewWBFSFileIO(std::string_view path, int64_t maxWriteSize, uint64_t splitSize) {
+  return std::make_unique<FileIOWBFS>(path, maxWriteSize, splitSize);
+}
 
 } // namespace nod
@@ -0,0 +1,790 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "nod/IDiscIO.hpp"
+#include "nod/IFileIO.hpp"
+#include "nod/aes.hpp"
+#include "nod/Endian.hpp"
+#include "BlockCache.hpp"
+#include "DiscWiiHash.hpp"
+#include "Util.hpp"
+
+#ifndef NOD_HAS_BZIP2
+#define NOD_HAS_BZIP2 0
+#endif
+#ifndef NOD_HAS_LZMA
+#define NOD_HAS_LZMA 0
+#endif
+#ifndef NOD_HAS_ZSTD
+#define NOD_HAS_ZSTD 0
+#endif
+
+#if NOD_HAS_BZIP2
+#include <bzlib.h>
+#endif
+#if NOD_HAS_LZMA
+#include <lzma.h>
+#endif
+#if NOD_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+#include <spdlog/spdlog.h>
+
+namespace nod {
+
+/*
+ * WIA and RVZ are Dolphin's compressed image formats. The disc is cut into raw regions
+ * (stored as-is) and Wii partition data regions (stored decrypted, without the hash area);
+ * both are split into fixed-size chunks that compress independently. RVZ additionally
+ * replaces runs of the disc's pseudo-random junk fill with the seed that generates them.
+ * Reads rebuild the exact original image, including hashes and encryption.
+ */
+
+enum class WIACompression : uint32_t { None, Purge, Bzip2, LZMA, LZMA2, Zstd };
+
+static uint16_t Get16(const uint8_t* ptr) {
+  uint16_t val;
+  memcpy(&val, ptr, 2);
+  return SBig(val);
+}
+
+static uint32_t Get32(const uint8_t* ptr) {
+  uint32_t val;
+  memcpy(&val, ptr, 4);
+  return SBig(val);
+}
+
+static uint64_t Get64(const uint8_t* ptr) {
+  uint64_t val;
+  memcpy(&val, ptr, 8);
+  return SBig(val);
+}
+
+/* Generator of the junk data filling unused disc space, seeded per 0x8000-byte block */
+class LaggedFibonacci {
+  static constexpr size_t K = 521;
+  static constexpr size_t J = 32;
+  uint32_t m_buffer[K];
+  size_t m_position = 0;
+
+  void forward() {
+    for (size_t i = 0; i < J; ++i)
+      m_buffer[i] ^= m_buffer[i + K - J];
+    for (size_t i = J; i < K; ++i)
+      m_buffer[i] ^= m_buffer[i - J];
+  }
+
+public:
+  static constexpr size_t SeedSize = 17;
+
+  /* Seed words are big-endian as stored in RVZ */
+  void setSeed(const uint8_t* seed) {
+    m_position = 0;
+    for (size_t i = 0; i < SeedSize; ++i)
+      m_buffer[i] = Get32(seed + i * 4);
+    for (size_t i = SeedSize; i < K; ++i)
+      m_buffer[i] = (m_buffer[i - 17] << 23) ^ (m_buffer[i - 16] >> 9) ^ m_buffer[i - 1];
+    /* Fold the output shift into the state so bytes can be copied straight out */
+    for (uint32_t& x : m_buffer)
+      x = SBig((x & 0xFF00FFFF) | ((x >> 2) & 0x00FF0000));
+    for (int i = 0; i < 4; ++i)
+      forward();
+  }
+
+  void skip(size_t count) {
+    m_position += count;
+    while (m_position >= sizeof(m_buffer)) {
+      forward();
+      m_position -= sizeof(m_buffer);
+    }
+  }
+
+  void getBytes(uint8_t* out, size_t count) {
+    while (count) {
+      size_t len = nod::min(count, sizeof(m_buffer) - m_position);
+      memcpy(out, (uint8_t*)m_buffer + m_position, len);
+      m_position += len;
+      out += len;
+      count -= len;
+      if (m_position == sizeof(m_buffer)) {
+        forward();
+        m_position = 0;
+      }
+    }
+  }
+};
+
+/* Purge stores {offset, size, data} segments of non-zero bytes followed by a SHA-1 */
+static bool PurgeExpand(const uint8_t* in, size_t inSz, size_t outSz, std::vector<uint8_t>& out) {
+  out.assign(outSz, 0);
+  if (inSz < 20)
+    return false;
+  const uint8_t* end = in + inSz - 20;
+  while (in < end) {
+    if (end - in < 8)
+      return false;
+    uint32_t off = Get32(in);
+    uint32_t sz = Get32(in + 4);
+    in += 8;
+    if (uint64_t(end - in) < sz || uint64_t(off) + sz > outSz)
+      return false;
+    memcpy(out.data() + off, in, sz);
+    in += sz;
+  }
+  return true;
+}
+
+/* Codec parameters from the WIA header; decompresses one self-contained stream */
+struct WIACodec {
+  WIACompression m_method = WIACompression::None;
+  uint8_t m_props[7] = {};
+  uint8_t m_propsLen = 0;
+
+  bool supported() const {
+    switch (m_method) {
+    case WIACompression::None:
+    case WIACompression::Purge:
+      return true;
+    case WIACompression::Bzip2:
+      return NOD_HAS_BZIP2;
+    case WIACompression::LZMA:
+    case WIACompression::LZMA2:
+      return NOD_HAS_LZMA;
+    case WIACompression::Zstd:
+      return NOD_HAS_ZSTD;
+    }
+    return false;
+  }
+
+  /* Decodes all of in; purge needs the expected output size, the others grow out as needed */
+  bool decompress(const uint8_t* in, size_t inSz, size_t expectSz, std::vector<uint8_t>& out) const {
+    out.clear();
+    switch (m_method) {
+    case WIACompression::None:
+      out.assign(in, in + inSz);
+      return true;
+    case WIACompression::Purge:
+      return PurgeExpand(in, inSz, expectSz, out);
+#if NOD_HAS_BZIP2
+    case WIACompression::Bzip2: {
+      bz_stream strm = {};
+      if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+        return false;
+      strm.next_in = (char*)in;
+      strm.avail_in = unsigned(inSz);
+      int ret = BZ_OK;
+      while (ret == BZ_OK) {
+        size_t done = out.size();
+        out.resize(nod::max(done * 2, expectSz + 0x10000));
+        strm.next_out = (char*)out.data() + done;
+        strm.avail_out = unsigned(out.size() - done);
+        ret = BZ2_bzDecompress(&strm);
+        out.resize(out.size() - strm.avail_out);
+        if (ret == BZ_OK && !strm.avail_in && strm.avail_out)
+          break;
+      }
+      BZ2_bzDecompressEnd(&strm);
+      return ret == BZ_OK || ret == BZ_STREAM_END;
+    }
+#endif
+#if NOD_HAS_LZMA
+    case WIACompression::LZMA:
+    case WIACompression::LZMA2: {
+      lzma_filter filters[2] = {};
+      filters[0].id = m_method == WIACompression::LZMA ? LZMA_FILTER_LZMA1 : LZMA_FILTER_LZMA2;
+      filters[1].id = LZMA_VLI_UNKNOWN;
+      if (lzma_properties_decode(&filters[0], nullptr, m_props, m_propsLen) != LZMA_OK)
+        return false;
+      lzma_stream strm = LZMA_STREAM_INIT;
+      lzma_ret ret = lzma_raw_decoder(&strm, filters);
+      free(filters[0].options);
+      if (ret != LZMA_OK)
+        return false;
+      strm.next_in = in;
+      strm.avail_in = inSz;
+      while (ret == LZMA_OK) {
+        size_t done = out.size();
+        out.resize(nod::max(done * 2, expectSz + 0x10000));
+        strm.next_out = out.data() + done;
+        strm.avail_out = out.size() - done;
+        ret = lzma_code(&strm, LZMA_RUN);
+        out.resize(out.size() - strm.avail_out);
+        /* Streams written without an end marker simply run out of input */
+        if (ret == LZMA_OK && !strm.avail_in && strm.avail_out)
+          break;
+      }
+      lzma_end(&strm);
+      return ret == LZMA_OK || ret == LZMA_STREAM_END;
+    }
+#endif
+#if NOD_HAS_ZSTD
+    case WIACompression::Zstd: {
+      ZSTD_DStream* strm = ZSTD_createDStream();
+      if (!strm)
+        return false;
+      ZSTD_inBuffer inBuf = {in, inSz, 0};
+      size_t ret;
+      while (true) {
+        size_t done = out.size();
+        out.resize(nod::max(done * 2, expectSz + 0x10000));
+        ZSTD_outBuffer outBuf = {out.data() + done, out.size() - done, 0};
+        ret = ZSTD_decompressStream(strm, &outBuf, &inBuf);
+        out.resize(done + outBuf.pos);
+        if (ZSTD_isError(ret) || !ret || (inBuf.pos == inBuf.size && outBuf.pos < outBuf.size))
+          break;
+      }
+      ZSTD_freeDStream(strm);
+      return !ZSTD_isError(ret);
+    }
+#endif
+    default:
+      return false;
+    }
+  }
+};
+
+class DiscIOWIA : public IDiscIO {
+  std::unique_ptr<IFileIO> m_fio;
+  bool m_rvz = false;
+  uint64_t m_isoSize = 0;
+  uint32_t m_chunkSize = 0;
+  WIACodec m_codec;
+  uint8_t m_discHead[0x80];
+
+  /* Raw region aligned down to its first 0x8000-byte sector */
+  struct RawRegion {
+    uint64_t m_offset;
+    uint64_t m_size;
+    uint32_t m_groupIndex;
+    uint32_t m_groupCount;
+  };
+  std::vector<RawRegion> m_raw;
+
+  struct PartitionData {
+    uint32_t m_firstSector;
+    uint32_t m_sectorCount;
+    uint32_t m_groupIndex;
+    uint32_t m_groupCount;
+  };
+  struct Partition {
+    uint8_t m_key[16];
+    PartitionData m_data[2];
+    uint32_t m_firstSector; /* Groups of 64 sectors are counted from here */
+    uint32_t m_endSector;
+  };
+  std::vector<Partition> m_parts;
+
+  /* Everything needed to decode one chunk without looking at the tables again */
+  struct Group {
+    uint64_t m_fileOffset;
+    uint32_t m_storedSize;
+    bool m_compressed;
+    uint32_t m_packedSize;
+    uint32_t m_dataSize;        /* Decoded size */
+    uint64_t m_junkOffset;      /* Offset of the chunk's first byte in junk-generator terms */
+    uint32_t m_exceptionLists;  /* One per 64 sectors covered; 0 for raw data */
+  };
+  std::vector<Group> m_groups;
+
+  struct HashException {
+    uint16_t m_offset;
+    uint8_t m_hash[20];
+  };
+  struct Chunk {
+    std::vector<uint8_t> m_data;
+    std::vector<std::vector<HashException>> m_exceptions;
+    bool m_ok = false;
+  };
+
+  /* Decoded chunks shared by every read stream; declared last so its workers stop first */
+  mutable std::unique_ptr<BlockCache<Chunk>> m_cache;
+
+  bool readFile(uint64_t offset, void* buf, size_t length) const {
+    std::unique_ptr<IFileIO::IReadStream> rs = m_fio->beginReadStream(offset);
+    return rs && rs->read(buf, length) == length;
+  }
+
+  bool readTable(uint64_t offset, uint32_t storedSize, size_t entrySize, size_t count,
+                 std::vector<uint8_t>& out) const {
+    std::vector<uint8_t> stored(storedSize);
+    if (!readFile(offset, stored.data(), storedSize) ||
+        !m_codec.decompress(stored.data(), storedSize, entrySize * count, out) || out.size() < entrySize * count) {
+      spdlog::error("unable to read WIA table at 0x{:x}", offset);
+      return false;
+    }
+    return true;
+  }
+
+  /* Lists are u16 count + {u16 offset, u8 hash[20]} entries */
+  static bool ParseExceptions(const uint8_t* data, size_t size, size_t& pos, Chunk& chunk, uint32_t lists) {
+    chunk.m_exceptions.resize(lists);
+    for (uint32_t l = 0; l < lists; ++l) {
+      if (size - pos < 2)
+        return false;
+      uint16_t count = Get16(data + pos);
+      pos += 2;
+      if (size - pos < count * 22ull)
+        return false;
+      std::vector<HashException>& list = chunk.m_exceptions[l];
+      list.resize(count);
+      for (HashException& exc : list) {
+        exc.m_offset = Get16(data + pos);
+        memcpy(exc.m_hash, data + pos + 2, 20);
+        pos += 22;
+      }
+    }
+    return true;
+  }
+
+  /* RVZ packing: u32 sizes, each followed by literal bytes or (top bit set) a junk seed */
+  static bool Unpack(const uint8_t* data, size_t size, uint64_t junkOffset, std::vector<uint8_t>& out) {
+    size_t outSz = out.size();
+    size_t written = 0;
+    size_t pos = 0;
+    LaggedFibonacci lfg;
+    while (written < outSz) {
+      if (size - pos < 4)
+        return false;
+      uint32_t runSz = Get32(data + pos);
+      pos += 4;
+      bool junk = runSz & 0x80000000;
+      runSz &= 0x7FFFFFFF;
+      if (runSz > outSz - written)
+        return false;
+      if (junk) {
+        if (size - pos < LaggedFibonacci::SeedSize * 4)
+          return false;
+        lfg.setSeed(data + pos);
+        pos += LaggedFibonacci::SeedSize * 4;
+        lfg.skip((junkOffset + written) % 0x8000);
+        lfg.getBytes(out.data() + written, runSz);
+      } else {
+        if (size - pos < runSz)
+          return false;
+        memcpy(out.data() + written, data + pos, runSz);
+        pos += runSz;
+      }
+      written += runSz;
+    }
+    return true;
+  }
+
+  std::shared_ptr<const Chunk> decodeChunk(uint32_t idx) const {
+    const Group& group = m_groups[idx];
+    auto chunk = std::make_shared<Chunk>();
+    chunk->m_exceptions.resize(group.m_exceptionLists);
+    if (!group.m_storedSize) {
+      chunk->m_data.assign(group.m_dataSize, 0);
+      chunk->m_ok = true;
+      return chunk;
+    }
+
+    std::vector<uint8_t> stored(group.m_storedSize);
+    if (!readFile(group.m_fileOffset, stored.data(), stored.size())) {
+      spdlog::error("unable to read WIA group {}", idx);
+      return chunk;
+    }
+
+    /* Uncompressed RVZ groups are laid out like WIA's 'none' method */
+    WIACodec codec = m_codec;
+    if (m_rvz && !group.m_compressed)
+      codec.m_method = WIACompression::None;
+
+    std::vector<uint8_t> payload;
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+    if (codec.m_method == WIACompression::None || codec.m_method == WIACompression::Purge) {
+      /* Exception lists precede the payload uncompressed and 4-byte aligned */
+      if (!ParseExceptions(stored.data(), stored.size(), pos, *chunk, group.m_exceptionLists)) {
+        spdlog::error("bad hash exceptions in WIA group {}", idx);
+        return chunk;
+      }
+      if (group.m_exceptionLists)
+        pos = (pos + 3) & ~size_t(3);
+      if (codec.m_method == WIACompression::Purge) {
+        if (pos > stored.size() || !codec.decompress(stored.data() + pos, stored.size() - pos, group.m_dataSize, payload)) {
+          spdlog::error("unable to decompress WIA group {}", idx);
+          return chunk;
+        }
+        data = payload.data();
+        size = payload.size();
+        pos = 0;
+      } else {
+        data = stored.data();
+        size = stored.size();
+      }
+    } else {
+      if (!codec.decompress(stored.data(), stored.size(), group.m_dataSize, payload) ||
+          !ParseExceptions(payload.data(), payload.size(), pos, *chunk, group.m_exceptionLists)) {
+        spdlog::error("unable to decompress WIA group {}", idx);
+        return chunk;
+      }
+      data = payload.data();
+      size = payload.size();
+    }
+    if (pos > size) {
+      spdlog::error("truncated WIA group {}", idx);
+      return chunk;
+    }
+
+    chunk->m_data.resize(group.m_dataSize);
+    if (m_rvz && group.m_packedSize) {
+      if (!Unpack(data + pos, size - pos, group.m_junkOffset, chunk->m_data)) {
+        spdlog::error("bad RVZ packing in group {}", idx);
+        return chunk;
+      }
+    } else {
+      if (size - pos < group.m_dataSize) {
+        spdlog::error("truncated WIA group {}", idx);
+        return chunk;
+      }
+      memcpy(chunk->m_data.data(), data + pos, group.m_dataSize);
+    }
+    chunk->m_ok = true;
+    return chunk;
+  }
+
+public:
+  DiscIOWIA(std::string_view path, bool& err) : m_fio(NewFileIO(path)) {
+    uint8_t head1[0x48];
+    if (!readFile(0, head1, sizeof(head1))) {
+      spdlog::error("unable to read WIA header from '{}'", path);
+      err = true;
+      return;
+    }
+    m_rvz = !memcmp(head1, "RVZ\x01", 4);
+    if (!m_rvz && memcmp(head1, "WIA\x01", 4)) {
+      spdlog::error("'{}' is not a WIA or RVZ image", path);
+      err = true;
+      return;
+    }
+    uint32_t head2Sz = Get32(head1 + 0xC);
+    m_isoSize = Get64(head1 + 0x24);
+    std::vector<uint8_t> head2(nod::max(head2Sz, uint32_t(0xDC)));
+    if (head2Sz < 0xDC || !readFile(sizeof(head1), head2.data(), head2Sz)) {
+      spdlog::error("unable to read WIA disc header from '{}'", path);
+      err = true;
+      return;
+    }
+
+    m_codec.m_method = WIACompression(Get32(&head2[0x4]));
+    m_chunkSize = Get32(&head2[0xC]);
+    memcpy(m_discHead, &head2[0x10], 0x80);
+    m_codec.m_propsLen = nod::min(head2[0xD4], uint8_t(7));
+    memcpy(m_codec.m_props, &head2[0xD5], 7);
+    if (m_codec.m_method > WIACompression::Zstd || !m_codec.supported()) {
+      spdlog::error("'{}' uses compression method {}, which this build does not support", path,
+                    uint32_t(m_codec.m_method));
+      err = true;
+      return;
+    }
+    if (!m_chunkSize || m_chunkSize % 0x8000) {
+      spdlog::error("invalid WIA chunk size 0x{:x}", m_chunkSize);
+      err = true;
+      return;
+    }
+
+    /* Group table */
+    uint32_t groupCount = Get32(&head2[0xC4]);
+    const size_t groupEntrySz = m_rvz ? 12 : 8;
+    std::vector<uint8_t> table;
+    if (!readTable(Get64(&head2[0xC8]), Get32(&head2[0xD0]), groupEntrySz, groupCount, table)) {
+      err = true;
+      return;
+    }
+    m_groups.resize(groupCount);
+    for (uint32_t i = 0; i < groupCount; ++i) {
+      const uint8_t* ent = &table[i * groupEntrySz];
+      Group& group = m_groups[i];
+      group.m_fileOffset = uint64_t(Get32(ent)) << 2;
+      uint32_t sz = Get32(ent + 4);
+      group.m_compressed = !m_rvz || (sz & 0x80000000);
+      group.m_storedSize = m_rvz ? sz & 0x7FFFFFFF : sz;
+      group.m_packedSize = m_rvz ? Get32(ent + 8) : 0;
+      group.m_dataSize = 0;
+      group.m_junkOffset = 0;
+      group.m_exceptionLists = 0;
+    }
+
+    auto assignGroups = [&](uint32_t first, uint32_t count, uint64_t dataSize, uint32_t chunkSize,
+                            uint64_t junkOffset, uint32_t exceptionLists) {
+      if (uint64_t(first) + count > groupCount || (dataSize + chunkSize - 1) / chunkSize > count) {
+        spdlog::error("WIA region references groups beyond the group table");
+        return false;
+      }
+      for (uint32_t i = 0; i < count; ++i) {
+        Group& group = m_groups[first + i];
+        group.m_dataSize = uint32_t(nod::min(uint64_t(chunkSize), dataSize - nod::min(dataSize, uint64_t(i) * chunkSize)));
+        group.m_junkOffset = junkOffset + uint64_t(i) * chunkSize;
+        group.m_exceptionLists = exceptionLists;
+      }
+      return true;
+    };
+
+    /* Partition table (never compressed) */
+    uint32_t partCount = Get32(&head2[0x90]);
+    uint32_t partEntrySz = Get32(&head2[0x94]);
+    if (partCount) {
+      if (partEntrySz < 0x30) {
+        spdlog::error("invalid WIA partition entry size {}", partEntrySz);
+        err = true;
+        return;
+      }
+      table.resize(size_t(partCount) * partEntrySz);
+      if (!readFile(Get64(&head2[0x98]), table.data(), table.size())) {
+        spdlog::error("unable to read WIA partition table");
+        err = true;
+        return;
+      }
+    }
+    const uint32_t dataChunkSize = m_chunkSize / 0x8000 * 0x7C00;
+    const uint32_t exceptionLists = nod::max(uint32_t(1), m_chunkSize / 0x200000);
+    m_parts.resize(partCount);
+    for (uint32_t p = 0; p < partCount; ++p) {
+      const uint8_t* ent = &table[size_t(p) * partEntrySz];
+      Partition& part = m_parts[p];
+      memcpy(part.m_key, ent, 16);
+      part.m_firstSector = UINT32_MAX;
+      part.m_endSector = 0;
+      for (int d = 0; d < 2; ++d) {
+        PartitionData& pd = part.m_data[d];
+        pd.m_firstSector = Get32(ent + 16 + d * 16);
+        pd.m_sectorCount = Get32(ent + 20 + d * 16);
+        pd.m_groupIndex = Get32(ent + 24 + d * 16);
+        pd.m_groupCount = Get32(ent + 28 + d * 16);
+        if (pd.m_sectorCount) {
+          part.m_firstSector = nod::min(part.m_firstSector, pd.m_firstSector);
+          part.m_endSector = nod::max(part.m_endSector, pd.m_firstSector + pd.m_sectorCount);
+        }
+      }
+      for (const PartitionData& pd : part.m_data) {
+        if (!pd.m_sectorCount)
+          continue;
+        uint64_t junkOffset = uint64_t(pd.m_firstSector - part.m_firstSector) * 0x7C00;
+        if (!assignGroups(pd.m_groupIndex, pd.m_groupCount, uint64_t(pd.m_sectorCount) * 0x7C00, dataChunkSize,
+                          junkOffset, exceptionLists)) {
+          err = true;
+          return;
+        }
+      }
+    }
+
+    /* Raw data table */
+    uint32_t rawCount = Get32(&head2[0xB4]);
+    if (!readTable(Get64(&head2[0xB8]), Get32(&head2[0xC0]), 24, rawCount, table)) {
+      err = true;
+      return;
+    }
+    m_raw.resize(rawCount);
+    for (uint32_t i = 0; i < rawCount; ++i) {
+      const uint8_t* ent = &table[i * 24];
+      RawRegion& raw = m_raw[i];
+      uint64_t off = Get64(ent);
+      uint64_t skipped = off % 0x8000;
+      raw.m_offset = off - skipped;
+      raw.m_size = Get64(ent + 8) + skipped;
+      raw.m_groupIndex = Get32(ent + 16);
+      raw.m_groupCount = Get32(ent + 20);
+      if (!assignGroups(raw.m_groupIndex, raw.m_groupCount, raw.m_size, m_chunkSize, raw.m_offset, 0)) {
+        err = true;
+        return;
+      }
+    }
+    std::sort(m_raw.begin(), m_raw.end(),
+              [](const RawRegion& a, const RawRegion& b) { return a.m_offset < b.m_offset; });
+
+    m_cache = std::make_unique<BlockCache<Chunk>>(groupCount, [this](uint32_t idx) { return decodeChunk(idx); });
+  }
+
+  class ReadStream : public IReadStream {
+    friend class DiscIOWIA;
+    const DiscIOWIA& m_parent;
+    uint64_t m_offset;
+    std::unique_ptr<IAES> m_aes;
+    size_t m_aesPart = SIZE_MAX;
+
+    /* Last chunk used and the group rebuilt from it */
+    uint32_t m_chunkIdx = UINT32_MAX;
+    std::shared_ptr<const Chunk> m_chunk;
+    uint32_t m_prevChunkIdx = UINT32_MAX;
+    size_t m_groupPart = SIZE_MAX;
+    uint32_t m_groupSector = UINT32_MAX;
+    std::unique_ptr<char[]> m_group;
+    bool m_groupOk = false;
+
+    ReadStream(const DiscIOWIA& parent, uint64_t offset) : m_parent(parent), m_offset(offset) {}
+
+    const std::shared_ptr<const Chunk>& useChunk(uint32_t idx) {
+      if (idx != m_chunkIdx) {
+        /* Streaming forward through consecutive chunks keeps the pool busy ahead of us */
+        if (idx == m_prevChunkIdx + 1 || idx == m_chunkIdx + 1)
+          m_parent.m_cache->prefetch(idx + 1, uint32_t(m_parent.m_cache->workerCount()));
+        m_prevChunkIdx = m_chunkIdx;
+        m_chunk = m_parent.m_cache->get(idx);
+        m_chunkIdx = idx;
+      }
+      return m_chunk;
+    }
+
+    /* Reconstructs the encrypted group of 64 sectors starting at groupSector */
+    bool buildGroup(size_t p, uint32_t groupSector) {
+      const Partition& part = m_parent.m_parts[p];
+      const uint32_t dataChunkSize = m_parent.m_chunkSize / 0x8000 * 0x7C00;
+      const uint32_t sectorsPerChunk = m_parent.m_chunkSize / 0x8000;
+      if (!m_group)
+        m_group.reset(new char[0x200000]);
+      memset(m_group.get(), 0, 0x200000);
+
+      struct UsedChunk {
+        std::shared_ptr<const Chunk> m_chunk;
+        uint32_t m_firstSector;
+      };
+      std::vector<UsedChunk> used;
+      for (uint32_t b = 0; b < 64; ++b) {
+        uint32_t sector = groupSector + b;
+        for (const PartitionData& pd : part.m_data) {
+          if (sector < pd.m_firstSector || sector - pd.m_firstSector >= pd.m_sectorCount)
+            continue;
+          uint64_t dataOff = uint64_t(sector - pd.m_firstSector) * 0x7C00;
+          uint32_t chunkInPd = uint32_t(dataOff / dataChunkSize);
+          uint32_t idx = pd.m_groupIndex + chunkInPd;
+          if (chunkInPd >= pd.m_groupCount)
+            return false;
+          const Chunk& chunk = *useChunk(idx);
+          if (!chunk.m_ok)
+            return false;
+          uint64_t inChunk = dataOff % dataChunkSize;
+          size_t len = size_t(nod::min(uint64_t(0x7C00), chunk.m_data.size() - nod::min(uint64_t(chunk.m_data.size()), inChunk)));
+          memcpy(m_group.get() + b * 0x8000 + 0x400, chunk.m_data.data() + inChunk, len);
+          if (used.empty() || used.back().m_chunk != m_chunk)
+            used.push_back({m_chunk, pd.m_firstSector + chunkInPd * sectorsPerChunk});
+          break;
+        }
+      }
+
+      uint8_t h3[20];
+      HashGroup(m_group.get(), h3);
+
+      /* Hash exceptions restore hashes that did not match the data (e.g. on modified discs) */
+      for (const UsedChunk& uc : used) {
+        const Chunk& chunk = *uc.m_chunk;
+        for (size_t l = 0; l < chunk.m_exceptions.size(); ++l) {
+          uint32_t listSector = uc.m_firstSector + uint32_t(l) * 64;
+          for (const HashException& exc : chunk.m_exceptions[l]) {
+            uint32_t sector = listSector + exc.m_offset / 0x400;
+            uint32_t inBlock = exc.m_offset % 0x400;
+            if (sector < groupSector || sector - groupSector >= 64 || inBlock + 20 > 0x400)
+              continue;
+            memcpy(m_group.get() + (sector - groupSector) * 0x8000 + inBlock, exc.m_hash, 20);
+          }
+        }
+      }
+
+      if (m_aesPart != p) {
+        if (!m_aes)
+          m_aes = NewAES();
+        m_aes->setKey(part.m_key);
+        m_aesPart = p;
+      }
+      EncryptGroup(*m_aes, m_group.get());
+      return true;
+    }
+
+  public:
+    uint64_t read(void* buf, uint64_t length) override {
+      uint8_t* dst = (uint8_t*)buf;
+      uint64_t rem = nod::min(length, m_parent.m_isoSize - nod::min(m_parent.m_isoSize, m_offset));
+      while (rem) {
+        uint64_t thisSz = rem;
+        const uint32_t sector = uint32_t(m_offset / 0x8000);
+
+        size_t p = 0;
+        for (; p < m_parent.m_parts.size(); ++p) {
+          const Partition& part = m_parent.m_parts[p];
+          if (sector >= part.m_firstSector && sector < part.m_endSector)
+            break;
+        }
+
+        if (m_offset < 0x80) {
+          thisSz = nod::min(thisSz, 0x80 - m_offset);
+          memcpy(dst, m_parent.m_discHead + m_offset, thisSz);
+        } else if (p < m_parent.m_parts.size()) {
+          const Partition& part = m_parent.m_parts[p];
+          uint32_t groupSector = part.m_firstSector + (sector - part.m_firstSector) / 64 * 64;
+          if (p != m_groupPart || groupSector != m_groupSector) {
+            m_groupOk = buildGroup(p, groupSector);
+            m_groupPart = p;
+            m_groupSector = groupSector;
+          }
+          if (!m_groupOk) {
+            spdlog::error("unable to rebuild Wii group at 0x{:x}", uint64_t(groupSector) * 0x8000);
+            break;
+          }
+          uint64_t groupOff = uint64_t(groupSector) * 0x8000;
+          uint64_t groupEnd = nod::min(groupOff + 0x200000, uint64_t(part.m_endSector) * 0x8000);
+          thisSz = nod::min(thisSz, groupEnd - m_offset);
+          memcpy(dst, m_group.get() + (m_offset - groupOff), thisSz);
+        } else {
+          /* Raw regions stop where the next partition's data begins */
+          uint64_t nextPart = UINT64_MAX;
+          for (const Partition& part : m_parent.m_parts)
+            if (uint64_t(part.m_firstSector) * 0x8000 > m_offset)
+              nextPart = nod::min(nextPart, uint64_t(part.m_firstSector) * 0x8000);
+          thisSz = nod::min(thisSz, nextPart - m_offset);
+
+          auto it = std::upper_bound(m_parent.m_raw.begin(), m_parent.m_raw.end(), m_offset,
+                                     [](uint64_t off, const RawRegion& raw) { return off < raw.m_offset; });
+          if (it != m_parent.m_raw.begin() && m_offset - std::prev(it)->m_offset < std::prev(it)->m_size) {
+            const RawRegion& raw = *std::prev(it);
+            uint64_t inRaw = m_offset - raw.m_offset;
+            uint32_t chunkInRaw = uint32_t(inRaw / m_parent.m_chunkSize);
+            const Chunk& chunk = *useChunk(raw.m_groupIndex + chunkInRaw);
+            uint64_t inChunk = inRaw % m_parent.m_chunkSize;
+            if (!chunk.m_ok || inChunk >= chunk.m_data.size())
+              break;
+            thisSz = nod::min(thisSz, chunk.m_data.size() - inChunk);
+            memcpy(dst, chunk.m_data.data() + inChunk, thisSz);
+          } else {
+            /* Gap between regions reads as zeros */
+            if (it != m_parent.m_raw.end())
+              thisSz = nod::min(thisSz, it->m_offset - m_offset);
+            memset(dst, 0, thisSz);
+          }
+        }
+
+        dst += thisSz;
+        rem -= thisSz;
+        m_offset += thisSz;
+      }
+      return dst - (uint8_t*)buf;
+    }
+    uint64_t position() const override { return m_offset; }
+    void seek(int64_t offset, int whence) override {
+      if (whence == SEEK_SET)
+        m_offset = offset;
+      else if (whence == SEEK_CUR)
+        m_offset += offset;
+    }
+  };
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override {
+    return std::unique_ptr<IReadStream>(new ReadStream(*this, offset));
+  }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override { return {}; }
+};
+
+std::unique_ptr<IDiscIO> NewDiscIOWIA(std::string_view path) {
+  bool err = false;
+  auto ret = std::make_unique<DiscIOWIA>(path, err);
+  if (err)
+    return {};
+  return ret;
+}
+
+} // namespace nod
@@ -0,0 +1,949 @@
+#include "nod/DiscStore.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "nod/DirectoryEnumerator.hpp"
+#include "nod/IDiscIO.hpp"
+#include "nod/IFileIO.hpp"
+#include "nod/aes.hpp"
+#include "nod/Endian.hpp"
+#include "nod/sha1.h"
+#include "BlockCache.hpp"
+#include "DiscWiiHash.hpp"
+#include "Util.hpp"
+
+#include <spdlog/spdlog.h>
+
+namespace nod {
+
+/*
+ * Store layout:
+ *   packs/NNNNN.pack   chunk bytes, appended and never rewritten
+ *   chunks.idx         {u8 sha1[20], u32 pack, u64 offset, u32 size} per chunk, appended once
+ *                      the chunks it lists are on disk
+ *   images/<name>.nodm manifest of one image, written last
+ *
+ * A manifest (all little-endian) starts 'NODM', u32 version, u64 discSize, u32 chunkSize,
+ * u32 chunkCount, u32 spaceCount, followed by the chunk table {u8 sha1[20], u32 size} and
+ * the spaces. A space is a disc range: raw (kind 0) bytes as stored, or a Wii partition's
+ * data area (kind 1) kept decrypted without its hash blocks. Each space header is u32 kind,
+ * u32 extentCount, u64 discOffset, u64 size, u8 key[16], u32 exceptionCount, u32 zeroRunCount;
+ * then extents {u64 offset, u64 length} tiling [0, size), the u32 chunk-table indices of every
+ * extent (one per chunkSize bytes), hash exceptions {u32 sector, u8 hashBlock[0x400]} and runs
+ * of sectors left unencrypted and zero {u32 firstSector, u32 count}.
+ */
+
+static constexpr uint32_t ManifestVersion = 1;
+static constexpr uint32_t StoreChunkSize = 0x40000;
+static constexpr uint64_t PackLimit = 0x40000000;
+static constexpr size_t IndexRecordSize = 36;
+static constexpr size_t ManifestHeaderSize = 28;
+static constexpr size_t SpaceHeaderSize = 48;
+
+static uint32_t Get32(const uint8_t* ptr) {
+  uint32_t val;
+  memcpy(&val, ptr, 4);
+  return SLittle(val);
+}
+
+static uint64_t Get64(const uint8_t* ptr) {
+  uint64_t val;
+  memcpy(&val, ptr, 8);
+  return SLittle(val);
+}
+
+static void Put32(std::vector<uint8_t>& out, uint32_t val) {
+  val = SLittle(val);
+  out.insert(out.end(), (const uint8_t*)&val, (const uint8_t*)&val + 4);
+}
+
+static void Put64(std::vector<uint8_t>& out, uint64_t val) {
+  val = SLittle(val);
+  out.insert(out.end(), (const uint8_t*)&val, (const uint8_t*)&val + 8);
+}
+
+static std::string PackPath(std::string_view dir, uint32_t pack) {
+  return fmt::format("{}/packs/{:05}.pack", dir, pack);
+}
+
+static bool ReadWholeFile(const std::string& path, std::vector<uint8_t>& out) {
+  std::unique_ptr<IFileIO> fio = NewFileIO(path);
+  if (!fio->exists()) {
+    out.clear();
+    return true;
+  }
+  out.resize(fio->size());
+  std::unique_ptr<IFileIO::IReadStream> rs = fio->beginReadStream();
+  return rs && rs->read(out.data(), out.size()) == out.size();
+}
+
+/* Chunks of an extent are cut from its start, so the last one may be short */
+static uint64_t ExtentChunkCount(uint64_t length, uint32_t chunkSize) { return (length + chunkSize - 1) / chunkSize; }
+
+/* Splits [0, size) into the given content ranges and the gaps between them */
+static std::vector<std::pair<uint64_t, uint64_t>> TileExtents(std::vector<std::pair<uint64_t, uint64_t>> ranges,
+                                                              uint64_t size) {
+  std::sort(ranges.begin(), ranges.end());
+  std::vector<std::pair<uint64_t, uint64_t>> extents;
+  uint64_t pos = 0;
+  for (const auto& [first, last] : ranges) {
+    uint64_t begin = nod::max(first, pos);
+    uint64_t end = nod::min(last, size);
+    if (begin >= end)
+      continue;
+    if (begin > pos)
+      extents.emplace_back(pos, begin - pos);
+    extents.emplace_back(begin, end - begin);
+    pos = end;
+  }
+  if (pos < size)
+    extents.emplace_back(pos, size - pos);
+  return extents;
+}
+
+DiscStore::DiscStore(std::string_view dir, bool& err) : m_dir(dir) {
+  for (const std::string& path : {m_dir, m_dir + "/packs", m_dir + "/images"}) {
+    if (Mkdir(path.c_str(), 0755) && errno != EEXIST) {
+      spdlog::error("unable to mkdir '{}'", path);
+      err = true;
+      return;
+    }
+  }
+
+  std::vector<uint8_t> index;
+  if (!ReadWholeFile(m_dir + "/chunks.idx", index)) {
+    spdlog::error("unable to read '{}/chunks.idx'", m_dir);
+    err = true;
+    return;
+  }
+  /* A record cut short by an interrupted append is ignored; its chunk is simply stored again */
+  for (size_t pos = 0; pos + IndexRecordSize <= index.size(); pos += IndexRecordSize) {
+    const uint8_t* rec = index.data() + pos;
+    ChunkLocation loc{Get32(rec + 20), Get64(rec + 24), Get32(rec + 32)};
+    if (m_chunks.emplace(std::string((const char*)rec, 20), loc).second)
+      m_packedBytes += loc.m_size;
+    /* Appending resumes after the last indexed chunk; anything past it was never committed */
+    if (loc.m_pack > m_packIdx) {
+      m_packIdx = loc.m_pack;
+      m_packSize = loc.m_offset + loc.m_size;
+    } else if (loc.m_pack == m_packIdx) {
+      m_packSize = nod::max(m_packSize, loc.m_offset + loc.m_size);
+    }
+  }
+}
+
+std::vector<std::string> DiscStore::getImageNames() const {
+  std::vector<std::string> names;
+  for (const DirectoryEnumerator::Entry& ent :
+       DirectoryEnumerator(m_dir + "/images", DirectoryEnumerator::Mode::FilesSorted)) {
+    if (ent.m_name.size() > 5 && !ent.m_name.compare(ent.m_name.size() - 5, 5, ".nodm"))
+      names.push_back(ent.m_name.substr(0, ent.m_name.size() - 5));
+  }
+  return names;
+}
+
+std::string DiscStore::getManifestPath(std::string_view name) const {
+  return fmt::format("{}/images/{}.nodm", m_dir, name);
+}
+
+/* State of one addImage: chunks appended so far and the manifest being assembled */
+struct DiscStore::Ingest {
+  struct Space {
+    uint32_t m_kind;
+    uint64_t m_discOffset;
+    uint64_t m_size;
+    uint8_t m_key[16] = {};
+    std::vector<std::pair<uint64_t, uint64_t>> m_extents;
+    std::vector<uint32_t> m_chunks;
+    std::vector<uint8_t> m_exceptions;
+    uint32_t m_exceptionCount = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> m_zeroRuns;
+  };
+
+  DiscStore& m_store;
+  const uint32_t m_startPack;
+  const uint64_t m_startPackSize;
+  std::unique_ptr<IFileIO::IWriteStream> m_packWs;
+  std::unordered_map<std::string, ChunkLocation> m_added;
+  std::vector<std::string> m_addedOrder;
+  std::unordered_map<std::string, uint32_t> m_tableIdx;
+  std::vector<std::pair<std::string, uint32_t>> m_table;
+  std::unordered_map<uint64_t, std::string> m_fillKeys;
+
+  explicit Ingest(DiscStore& store)
+  : m_store(store), m_startPack(store.m_packIdx), m_startPackSize(store.m_packSize) {}
+
+  /* Pack appends past the last committed chunk are abandoned; the next ingest writes over them */
+  ~Ingest() {
+    if (!m_addedOrder.empty()) {
+      m_store.m_packIdx = m_startPack;
+      m_store.m_packSize = m_startPackSize;
+    }
+  }
+
+  /* Unused disc space is one fill byte throughout, so such chunks are only hashed once per size */
+  std::string hashChunk(const uint8_t* data, uint32_t size) {
+    const bool uniform = !memcmp(data, data + 1, size - 1);
+    const uint64_t fillKey = uint64_t(size) << 8 | data[0];
+    if (uniform) {
+      auto search = m_fillKeys.find(fillKey);
+      if (search != m_fillKeys.end())
+        return search->second;
+    }
+    sha1nfo s;
+    sha1_init(&s);
+    sha1_write(&s, (const char*)data, size);
+    std::string key((const char*)sha1_result(&s), 20);
+    if (uniform)
+      m_fillKeys.emplace(fillKey, key);
+    return key;
+  }
+
+  /* Returns the chunk's manifest table index, appending its bytes only if no image has them yet */
+  bool addChunk(const uint8_t* data, uint32_t size, uint32_t& idxOut) {
+    std::string key = hashChunk(data, size);
+    auto search = m_tableIdx.find(key);
+    if (search != m_tableIdx.end()) {
+      idxOut = search->second;
+      return true;
+    }
+    if (m_store.m_chunks.find(key) == m_store.m_chunks.end() && m_added.find(key) == m_added.end()) {
+      if (m_store.m_packSize && m_store.m_packSize + size > PackLimit) {
+        m_packWs.reset();
+        ++m_store.m_packIdx;
+        m_store.m_packSize = 0;
+      }
+      if (!m_packWs) {
+        m_packWs = NewFileIO(PackPath(m_store.m_dir, m_store.m_packIdx))->beginWriteStream(m_store.m_packSize);
+        if (!m_packWs) {
+          spdlog::error("unable to open '{}' for writing", PackPath(m_store.m_dir, m_store.m_packIdx));
+          return false;
+        }
+      }
+      if (m_packWs->write(data, size) != size) {
+        spdlog::error("unable to write '{}'", PackPath(m_store.m_dir, m_store.m_packIdx));
+        return false;
+      }
+      m_added.emplace(key, ChunkLocation{m_store.m_packIdx, m_store.m_packSize, size});
+      m_addedOrder.push_back(key);
+      m_store.m_packSize += size;
+    }
+    idxOut = uint32_t(m_table.size());
+    m_tableIdx.emplace(key, idxOut);
+    m_table.emplace_back(std::move(key), size);
+    return true;
+  }
+
+  /* Makes the new chunks visible to later images: pack data first, then the index records */
+  bool commitChunks() {
+    m_packWs.reset();
+    if (m_addedOrder.empty())
+      return true;
+    std::vector<uint8_t> records;
+    records.reserve(m_addedOrder.size() * IndexRecordSize);
+    for (const std::string& key : m_addedOrder) {
+      const ChunkLocation& loc = m_added[key];
+      records.insert(records.end(), key.begin(), key.end());
+      Put32(records, loc.m_pack);
+      Put64(records, loc.m_offset);
+      Put32(records, loc.m_size);
+    }
+    const std::string indexPath = m_store.m_dir + "/chunks.idx";
+    std::unique_ptr<IFileIO> fio = NewFileIO(indexPath);
+    /* Appending after a torn record would misalign every later one */
+    uint64_t indexSz = fio->exists() ? fio->size() / IndexRecordSize * IndexRecordSize : 0;
+    std::unique_ptr<IFileIO::IWriteStream> ws = fio->beginWriteStream(indexSz);
+    if (!ws || ws->write(records.data(), records.size()) != records.size()) {
+      spdlog::error("unable to write '{}'", indexPath);
+      return false;
+    }
+    for (const std::string& key : m_addedOrder) {
+      const ChunkLocation& loc = m_added[key];
+      m_store.m_chunks.emplace(key, loc);
+      m_store.m_packedBytes += loc.m_size;
+    }
+    m_addedOrder.clear();
+    return true;
+  }
+
+  std::vector<uint8_t> buildManifest(uint64_t discSize, const std::vector<Space>& spaces) const {
+    std::vector<uint8_t> out;
+    Put32(out, SBig(uint32_t('NODM')));
+    Put32(out, ManifestVersion);
+    Put64(out, discSize);
+    Put32(out, StoreChunkSize);
+    Put32(out, uint32_t(m_table.size()));
+    Put32(out, uint32_t(spaces.size()));
+    for (const auto& [key, size] : m_table) {
+      out.insert(out.end(), key.begin(), key.end());
+      Put32(out, size);
+    }
+    for (const Space& space : spaces) {
+      Put32(out, space.m_kind);
+      Put32(out, uint32_t(space.m_extents.size()));
+      Put64(out, space.m_discOffset);
+      Put64(out, space.m_size);
+      out.insert(out.end(), space.m_key, space.m_key + 16);
+      Put32(out, space.m_exceptionCount);
+      Put32(out, uint32_t(space.m_zeroRuns.size()));
+      for (const auto& [offset, length] : space.m_extents) {
+        Put64(out, offset);
+        Put64(out, length);
+      }
+      for (uint32_t idx : space.m_chunks)
+        Put32(out, idx);
+      out.insert(out.end(), space.m_exceptions.begin(), space.m_exceptions.end());
+      for (const auto& [first, count] : space.m_zeroRuns) {
+        Put32(out, first);
+        Put32(out, count);
+      }
+    }
+    return out;
+  }
+};
+
+/* Decrypts a Wii partition's data area group by group, recording the hash blocks that cannot be
+ * recomputed from the data and the sectors that were never written */
+class PartitionDecryptor {
+  std::unique_ptr<IReadStream> m_rs;
+  std::unique_ptr<IAES> m_aes;
+  uint64_t m_dataOff;
+  uint32_t m_sectorCount;
+  uint32_t m_group = UINT32_MAX;
+  uint32_t m_lastRecorded = UINT32_MAX;
+  std::unique_ptr<uint8_t[]> m_raw;
+  std::unique_ptr<uint8_t[]> m_clear;
+  bool m_ok = false;
+
+  bool decodeGroup(uint32_t group, std::vector<uint8_t>& exceptionsOut, uint32_t& exceptionCount,
+                   std::vector<std::pair<uint32_t, uint32_t>>& zeroRunsOut) {
+    const uint32_t firstSector = group * 64;
+    const uint32_t sectors = nod::min(uint32_t(64), m_sectorCount - firstSector);
+    const size_t rawSz = size_t(sectors) * 0x8000;
+    m_rs->seek(m_dataOff + uint64_t(firstSector) * 0x8000, SEEK_SET);
+    size_t got = size_t(m_rs->read(m_raw.get(), rawSz));
+    memset(m_raw.get() + got, 0, rawSz - got);
+
+    memset(m_clear.get(), 0, 0x200000);
+    bool zeroSector[64];
+    static const uint8_t ZeroIV[16] = {};
+    for (uint32_t b = 0; b < sectors; ++b) {
+      const uint8_t* raw = m_raw.get() + b * 0x8000;
+      zeroSector[b] = raw[0] == 0 && !memcmp(raw, raw + 1, 0x7FFF);
+      if (zeroSector[b])
+        continue;
+      m_aes->decrypt(ZeroIV, raw, m_clear.get() + b * 0x8000, 0x400);
+      m_aes->decrypt(raw + 0x3D0, raw + 0x400, m_clear.get() + b * 0x8000 + 0x400, 0x7C00);
+    }
+
+    /* Sectors beyond the data area and never-written sectors hash as zero data, as on rebuild */
+    std::unique_ptr<uint8_t[]> hashes(new uint8_t[size_t(sectors) * 0x400]);
+    for (uint32_t b = 0; b < sectors; ++b) {
+      memcpy(hashes.get() + b * 0x400, m_clear.get() + b * 0x8000, 0x400);
+      memset(m_clear.get() + b * 0x8000, 0, 0x400);
+    }
+    uint8_t h3[20];
+    HashGroup((char*)m_clear.get(), h3);
+
+    if (m_lastRecorded != UINT32_MAX && group <= m_lastRecorded)
+      return true;
+    m_lastRecorded = group;
+    for (uint32_t b = 0; b < sectors; ++b) {
+      uint32_t sector = firstSector + b;
+      if (zeroSector[b]) {
+        if (!zeroRunsOut.empty() && zeroRunsOut.back().first + zeroRunsOut.back().second == sector)
+          ++zeroRunsOut.back().second;
+        else
+          zeroRunsOut.emplace_back(sector, 1);
+        continue;
+      }
+      if (!memcmp(hashes.get() + b * 0x400, m_clear.get() + b * 0x8000, 0x400))
+        continue;
+      Put32(exceptionsOut, sector);
+      exceptionsOut.insert(exceptionsOut.end(), hashes.get() + b * 0x400, hashes.get() + (b + 1) * 0x400);
+      ++exceptionCount;
+    }
+    return true;
+  }
+
+public:
+  PartitionDecryptor(const IDiscIO& discIO, uint64_t dataOff, uint32_t sectorCount, const uint8_t key[16])
+  : m_rs(discIO.beginReadStream(dataOff))
+  , m_aes(NewAES())
+  , m_dataOff(dataOff)
+  , m_sectorCount(sectorCount)
+  , m_raw(new uint8_t[0x200000])
+  , m_clear(new uint8_t[0x200000]) {
+    m_aes->setKey(key);
+    m_ok = bool(m_rs);
+  }
+
+  /* Copies decrypted partition data; groups must be visited in order for the records to be complete */
+  bool read(uint64_t offset, uint8_t* dst, uint64_t length, std::vector<uint8_t>& exceptionsOut,
+            uint32_t& exceptionCount, std::vector<std::pair<uint32_t, uint32_t>>& zeroRunsOut) {
+    if (!m_ok)
+      return false;
+    while (length) {
+      uint32_t sector = uint32_t(offset / 0x7C00);
+      uint32_t group = sector / 64;
+      if (group != m_group) {
+        if (!decodeGroup(group, exceptionsOut, exceptionCount, zeroRunsOut))
+          return false;
+        m_group = group;
+      }
+      uint64_t inSector = offset % 0x7C00;
+      uint64_t thisSz = nod::min(length, 0x7C00 - inSector);
+      memcpy(dst, m_clear.get() + (sector % 64) * 0x8000 + 0x400 + inSector, thisSz);
+      dst += thisSz;
+      offset += thisSz;
+      length -= thisSz;
+    }
+    return true;
+  }
+};
+
+bool DiscStore::addImage(const DiscBase& disc, std::string_view name, const FProgress& progressCB) {
+  if (name.empty() || name.find_first_of("/\\") != std::string_view::npos) {
+    spdlog::error("'{}' is not a valid image name", name);
+    return false;
+  }
+  const std::string manifestPath = getManifestPath(name);
+  if (NewFileIO(manifestPath)->exists()) {
+    spdlog::error("the store already holds an image named '{}'", name);
+    return false;
+  }
+  if (!disc.getDiscIO().hasWiiCrypto()) {
+    spdlog::error("this image holds decrypted partitions; rebuild it with makewii or mergewii instead");
+    return false;
+  }
+
+  const uint64_t discSize = disc.getDiscCapacity();
+  std::vector<std::pair<uint64_t, uint64_t>> discRanges;
+  disc.getUsedDiscRanges(discRanges);
+
+  /* Encrypted partition data areas, in disc order; raw spaces fill the rest of the disc */
+  std::vector<Ingest::Space> spaces;
+  for (const std::unique_ptr<IPartition>& part : disc.getPartitions()) {
+    Ingest::Space space;
+    uint64_t dataSz;
+    if (!part->getDataCrypto(space.m_discOffset, dataSz, space.m_key))
+      continue;
+    space.m_kind = 1;
+    space.m_size = dataSz / 0x8000 * 0x7C00;
+    if (!space.m_size || space.m_discOffset + dataSz > discSize)
+      continue;
+    std::vector<std::pair<uint64_t, uint64_t>> dataRanges;
+    part->getUsedDataRanges(dataRanges);
+    space.m_extents = TileExtents(std::move(dataRanges), space.m_size);
+    spaces.push_back(std::move(space));
+  }
+  std::sort(spaces.begin(), spaces.end(),
+            [](const Ingest::Space& a, const Ingest::Space& b) { return a.m_discOffset < b.m_discOffset; });
+  std::vector<Ingest::Space> rawSpaces;
+  uint64_t pos = 0;
+  for (size_t i = 0; i <= spaces.size(); ++i) {
+    uint64_t end = i < spaces.size() ? spaces[i].m_discOffset : discSize;
+    if (end > pos) {
+      Ingest::Space space;
+      space.m_kind = 0;
+      space.m_discOffset = pos;
+      space.m_size = end - pos;
+      std::vector<std::pair<uint64_t, uint64_t>> ranges;
+      for (const auto& [first, last] : discRanges)
+        if (last > pos && first < end)
+          ranges.emplace_back(nod::max(first, pos) - pos, nod::min(last, end) - pos);
+      space.m_extents = TileExtents(std::move(ranges), space.m_size);
+      rawSpaces.push_back(std::move(space));
+    }
+    if (i < spaces.size())
+      pos = nod::max(pos, spaces[i].m_discOffset + spaces[i].m_size / 0x7C00 * 0x8000);
+  }
+  spaces.insert(spaces.end(), std::make_move_iterator(rawSpaces.begin()), std::make_move_iterator(rawSpaces.end()));
+  std::sort(spaces.begin(), spaces.end(),
+            [](const Ingest::Space& a, const Ingest::Space& b) { return a.m_discOffset < b.m_discOffset; });
+
+  uint64_t totalBytes = 0;
+  for (const Ingest::Space& space : spaces)
+    totalBytes += space.m_size;
+
+  Ingest ingest(*this);
+  std::unique_ptr<IReadStream> rs = disc.getDiscIO().beginReadStream(0);
+  if (!rs) {
+    spdlog::error("unable to read disc");
+    return false;
+  }
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[StoreChunkSize]);
+  uint64_t doneBytes = 0;
+  for (Ingest::Space& space : spaces) {
+    std::unique_ptr<PartitionDecryptor> decryptor;
+    if (space.m_kind == 1)
+      decryptor = std::make_unique<PartitionDecryptor>(disc.getDiscIO(), space.m_discOffset,
+                                                       uint32_t(space.m_size / 0x7C00), space.m_key);
+    for (const auto& [offset, length] : space.m_extents) {
+      for (uint64_t off = offset; off < offset + length;) {
+        uint32_t thisSz = uint32_t(nod::min(uint64_t(StoreChunkSize), offset + length - off));
+        if (decryptor) {
+          if (!decryptor->read(off, buf.get(), thisSz, space.m_exceptions, space.m_exceptionCount,
+                               space.m_zeroRuns)) {
+            spdlog::error("unable to read partition data at 0x{:X}", space.m_discOffset);
+            return false;
+          }
+        } else {
+          /* Images cut short of the full disc read as zero past their end */
+          rs->seek(space.m_discOffset + off, SEEK_SET);
+          uint64_t got = rs->read(buf.get(), thisSz);
+          memset(buf.get() + got, 0, thisSz - got);
+        }
+        uint32_t idx;
+        if (!ingest.addChunk(buf.get(), thisSz, idx))
+          return false;
+        space.m_chunks.push_back(idx);
+        off += thisSz;
+        doneBytes += thisSz;
+        if (progressCB)
+          progressCB(float(doneBytes) / float(totalBytes), name, size_t(doneBytes));
+      }
+    }
+  }
+
+  if (!ingest.commitChunks())
+    return false;
+
+  std::vector<uint8_t> manifest = ingest.buildManifest(discSize, spaces);
+  const std::string tmpPath = manifestPath + ".tmp";
+  {
+    std::unique_ptr<IFileIO::IWriteStream> ws = NewFileIO(tmpPath)->beginWriteStream();
+    if (!ws || ws->write(manifest.data(), manifest.size()) != manifest.size()) {
+      spdlog::error("unable to write '{}'", tmpPath);
+      return false;
+    }
+  }
+  if (std::rename(tmpPath.c_str(), manifestPath.c_str())) {
+    spdlog::error("unable to rename '{}' to '{}'", tmpPath, manifestPath);
+    Unlink(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+class DiscIOStore : public IDiscIO {
+  std::string m_dir;
+  uint64_t m_discSize = 0;
+  uint32_t m_chunkSize = 0;
+
+  struct ChunkRef {
+    uint8_t m_hash[20];
+    uint32_t m_size;
+    uint32_t m_pack = UINT32_MAX;
+    uint64_t m_offset = 0;
+  };
+  std::vector<ChunkRef> m_table;
+
+  struct Extent {
+    uint64_t m_offset;
+    uint64_t m_length;
+    size_t m_firstChunk; /* Index into the space's m_chunks */
+  };
+  struct HashException {
+    uint32_t m_sector;
+    const uint8_t* m_block; /* Points into m_manifest */
+  };
+  struct Space {
+    uint32_t m_kind;
+    uint64_t m_discOffset;
+    uint64_t m_size;
+    uint64_t m_discSize; /* Bytes the space covers on disc */
+    uint8_t m_key[16];
+    std::vector<Extent> m_extents;
+    std::vector<uint32_t> m_chunks;
+    std::vector<HashException> m_exceptions;
+    std::vector<std::pair<uint32_t, uint32_t>> m_zeroRuns;
+
+    bool isZeroSector(uint32_t sector) const {
+      auto it = std::upper_bound(m_zeroRuns.begin(), m_zeroRuns.end(), sector,
+                                 [](uint32_t s, const std::pair<uint32_t, uint32_t>& run) { return s < run.first; });
+      return it != m_zeroRuns.begin() && sector - std::prev(it)->first < std::prev(it)->second;
+    }
+  };
+  std::vector<uint8_t> m_manifest;
+  std::vector<Space> m_spaces;
+
+  struct Chunk {
+    std::vector<uint8_t> m_data;
+    bool m_ok = false;
+  };
+
+  /* Verified chunks shared by every read stream; declared last so its workers stop first */
+  mutable std::unique_ptr<BlockCache<Chunk>> m_cache;
+
+  std::shared_ptr<const Chunk> decodeChunk(uint32_t idx) const {
+    const ChunkRef& ref = m_table[idx];
+    auto chunk = std::make_shared<Chunk>();
+    chunk->m_data.resize(ref.m_size);
+    std::unique_ptr<IFileIO::IReadStream> rs = NewFileIO(PackPath(m_dir, ref.m_pack))->beginReadStream(ref.m_offset);
+    if (!rs || rs->read(chunk->m_data.data(), ref.m_size) != ref.m_size) {
+      spdlog::error("unable to read chunk {} from '{}'", idx, PackPath(m_dir, ref.m_pack));
+      return chunk;
+    }
+    sha1nfo s;
+    sha1_init(&s);
+    sha1_write(&s, (const char*)chunk->m_data.data(), ref.m_size);
+    if (memcmp(sha1_result(&s), ref.m_hash, 20)) {
+      spdlog::error("chunk {} in '{}' is corrupt", idx, PackPath(m_dir, ref.m_pack));
+      return chunk;
+    }
+    chunk->m_ok = true;
+    return chunk;
+  }
+
+  bool parseManifest(std::string_view path) {
+    const uint8_t* data = m_manifest.data();
+    const size_t size = m_manifest.size();
+    if (size < ManifestHeaderSize || Get32(data) != SBig(uint32_t('NODM')) || Get32(data + 4) != ManifestVersion) {
+      spdlog::error("'{}' is not a store manifest", path);
+      return false;
+    }
+    m_discSize = Get64(data + 8);
+    m_chunkSize = Get32(data + 16);
+    uint32_t chunkCount = Get32(data + 20);
+    uint32_t spaceCount = Get32(data + 24);
+    size_t pos = ManifestHeaderSize;
+    if (!m_chunkSize || (size - pos) / 24 < chunkCount) {
+      spdlog::error("'{}' has a truncated chunk table", path);
+      return false;
+    }
+    m_table.resize(chunkCount);
+    for (ChunkRef& ref : m_table) {
+      memcpy(ref.m_hash, data + pos, 20);
+      ref.m_size = Get32(data + pos + 20);
+      pos += 24;
+    }
+
+    m_spaces.resize(spaceCount);
+    uint64_t discPos = 0;
+    for (Space& space : m_spaces) {
+      if (size - pos < SpaceHeaderSize) {
+        spdlog::error("'{}' has a truncated space table", path);
+        return false;
+      }
+      space.m_kind = Get32(data + pos);
+      uint32_t extentCount = Get32(data + pos + 4);
+      space.m_discOffset = Get64(data + pos + 8);
+      space.m_size = Get64(data + pos + 16);
+      memcpy(space.m_key, data + pos + 24, 16);
+      uint32_t exceptionCount = Get32(data + pos + 40);
+      uint32_t zeroRunCount = Get32(data + pos + 44);
+      pos += SpaceHeaderSize;
+      space.m_discSize = space.m_kind == 1 ? space.m_size / 0x7C00 * 0x8000 : space.m_size;
+      if (space.m_kind > 1 || space.m_discOffset < discPos || (space.m_kind == 1 && space.m_size % 0x7C00)) {
+        spdlog::error("'{}' has a bad space at 0x{:X}", path, space.m_discOffset);
+        return false;
+      }
+      discPos = space.m_discOffset + space.m_discSize;
+
+      if ((size - pos) / 16 < extentCount)
+        return false;
+      uint64_t extentPos = 0;
+      size_t chunkTotal = 0;
+      space.m_extents.resize(extentCount);
+      for (Extent& ext : space.m_extents) {
+        ext.m_offset = Get64(data + pos);
+        ext.m_length = Get64(data + pos + 8);
+        ext.m_firstChunk = chunkTotal;
+        pos += 16;
+        if (ext.m_offset != extentPos || !ext.m_length) {
+          spdlog::error("'{}' has extents that do not tile their space", path);
+          return false;
+        }
+        extentPos += ext.m_length;
+        chunkTotal += size_t(ExtentChunkCount(ext.m_length, m_chunkSize));
+      }
+      if (extentPos != space.m_size || (size - pos) / 4 < chunkTotal) {
+        spdlog::error("'{}' has extents that do not tile their space", path);
+        return false;
+      }
+      space.m_chunks.resize(chunkTotal);
+      for (uint32_t& idx : space.m_chunks) {
+        idx = Get32(data + pos);
+        pos += 4;
+        if (idx >= chunkCount) {
+          spdlog::error("'{}' refers to a missing chunk", path);
+          return false;
+        }
+      }
+      /* Every chunk must cover its whole slice of the extent */
+      for (const Extent& ext : space.m_extents) {
+        for (uint64_t c = 0; c < ExtentChunkCount(ext.m_length, m_chunkSize); ++c) {
+          uint64_t want = nod::min(uint64_t(m_chunkSize), ext.m_length - c * m_chunkSize);
+          if (m_table[space.m_chunks[ext.m_firstChunk + c]].m_size != want) {
+            spdlog::error("'{}' has a chunk of the wrong size", path);
+            return false;
+          }
+        }
+      }
+
+      if ((size - pos) / (4 + 0x400) < exceptionCount)
+        return false;
+      space.m_exceptions.resize(exceptionCount);
+      for (HashException& exc : space.m_exceptions) {
+        exc.m_sector = Get32(data + pos);
+        exc.m_block = data + pos + 4;
+        pos += 4 + 0x400;
+      }
+      if ((size - pos) / 8 < zeroRunCount)
+        return false;
+      space.m_zeroRuns.resize(zeroRunCount);
+      for (auto& [first, count] : space.m_zeroRuns) {
+        first = Get32(data + pos);
+        count = Get32(data + pos + 4);
+        pos += 8;
+      }
+    }
+    return true;
+  }
+
+  /* Looks every chunk the manifest uses up in the store index */
+  bool resolveChunks() {
+    std::unordered_map<std::string, std::vector<uint32_t>> wanted;
+    for (uint32_t i = 0; i < m_table.size(); ++i)
+      wanted[std::string((const char*)m_table[i].m_hash, 20)].push_back(i);
+
+    std::vector<uint8_t> index;
+    if (!ReadWholeFile(m_dir + "/chunks.idx", index)) {
+      spdlog::error("unable to read '{}/chunks.idx'", m_dir);
+      return false;
+    }
+    for (size_t pos = 0; pos + IndexRecordSize <= index.size(); pos += IndexRecordSize) {
+      const uint8_t* rec = index.data() + pos;
+      auto search = wanted.find(std::string((const char*)rec, 20));
+      if (search == wanted.end())
+        continue;
+      for (uint32_t i : search->second) {
+        m_table[i].m_pack = Get32(rec + 20);
+        m_table[i].m_offset = Get64(rec + 24);
+      }
+      wanted.erase(search);
+    }
+    if (!wanted.empty()) {
+      spdlog::error("{} chunks are missing from the store in '{}'", wanted.size(), m_dir);
+      return false;
+    }
+    return true;
+  }
+
+public:
+  DiscIOStore(std::string_view manifestPath, bool& err) {
+    /* The store is the manifest's grandparent: <store>/images/<name>.nodm */
+    auto slashPos = manifestPath.find_last_of("/\\");
+    m_dir = slashPos == std::string_view::npos ? std::string(".") : std::string(manifestPath.substr(0, slashPos));
+    m_dir += "/..";
+
+    if (!ReadWholeFile(std::string(manifestPath), m_manifest)) {
+      spdlog::error("unable to read '{}'", manifestPath);
+      err = true;
+      return;
+    }
+    if (!parseManifest(manifestPath) || !resolveChunks()) {
+      err = true;
+      return;
+    }
+    m_cache = std::make_unique<BlockCache<Chunk>>(uint32_t(m_table.size()),
+                                                  [this](uint32_t idx) { return decodeChunk(idx); });
+  }
+
+  uint64_t discSize() const { return m_discSize; }
+
+  class ReadStream : public IReadStream {
+    friend class DiscIOStore;
+    const DiscIOStore& m_parent;
+    uint64_t m_offset;
+    std::unique_ptr<IAES> m_aes;
+
+    uint32_t m_chunkIdx = UINT32_MAX;
+    std::shared_ptr<const Chunk> m_chunk;
+    uint32_t m_prevChunkIdx = UINT32_MAX;
+    size_t m_groupSpace = SIZE_MAX;
+    uint32_t m_group = UINT32_MAX;
+    std::unique_ptr<char[]> m_groupBuf;
+    bool m_groupOk = false;
+
+    ReadStream(const DiscIOStore& parent, uint64_t offset) : m_parent(parent), m_offset(offset) {}
+
+    const Chunk& useChunk(uint32_t idx) {
+      if (idx != m_chunkIdx) {
+        /* Chunks are numbered in first-use order, so a forward stream keeps the pool busy ahead */
+        if (idx == m_prevChunkIdx + 1 || idx == m_chunkIdx + 1)
+          m_parent.m_cache->prefetch(idx + 1, uint32_t(m_parent.m_cache->workerCount()));
+        m_prevChunkIdx = m_chunkIdx;
+        m_chunk = m_parent.m_cache->get(idx);
+        m_chunkIdx = idx;
+      }
+      return *m_chunk;
+    }
+
+    /* Copies stored bytes of a space, which for partitions are the decrypted data */
+    bool readSpace(const Space& space, uint64_t offset, uint8_t* dst, uint64_t length) {
+      while (length) {
+        auto it = std::upper_bound(space.m_extents.begin(), space.m_extents.end(), offset,
+                                   [](uint64_t off, const Extent& ext) { return off < ext.m_offset; });
+        const Extent& ext = *std::prev(it);
+        uint64_t inExtent = offset - ext.m_offset;
+        const Chunk& chunk = useChunk(space.m_chunks[ext.m_firstChunk + inExtent / m_parent.m_chunkSize]);
+        if (!chunk.m_ok)
+          return false;
+        uint64_t inChunk = inExtent % m_parent.m_chunkSize;
+        uint64_t thisSz = nod::min(length, chunk.m_data.size() - inChunk);
+        memcpy(dst, chunk.m_data.data() + inChunk, thisSz);
+        dst += thisSz;
+        offset += thisSz;
+        length -= thisSz;
+      }
+      return true;
+    }
+
+    /* Re-hashes and re-encrypts one group of a partition's data area */
+    bool buildGroup(size_t s, uint32_t group) {
+      const Space& space = m_parent.m_spaces[s];
+      const uint32_t firstSector = group * 64;
+      const uint32_t sectors = nod::min(uint32_t(64), uint32_t(space.m_size / 0x7C00) - firstSector);
+      if (!m_groupBuf)
+        m_groupBuf.reset(new char[0x200000]);
+      memset(m_groupBuf.get(), 0, 0x200000);
+      for (uint32_t b = 0; b < sectors; ++b)
+        if (!readSpace(space, uint64_t(firstSector + b) * 0x7C00, (uint8_t*)m_groupBuf.get() + b * 0x8000 + 0x400,
+                       0x7C00))
+          return false;
+
+      uint8_t h3[20];
+      HashGroup(m_groupBuf.get(), h3);
+
+      auto it = std::lower_bound(space.m_exceptions.begin(), space.m_exceptions.end(), firstSector,
+                                 [](const HashException& exc, uint32_t sector) { return exc.m_sector < sector; });
+      for (; it != space.m_exceptions.end() && it->m_sector < firstSector + sectors; ++it)
+        memcpy(m_groupBuf.get() + (it->m_sector - firstSector) * 0x8000, it->m_block, 0x400);
+
+      if (!m_aes)
+        m_aes = NewAES();
+      m_aes->setKey(space.m_key);
+      EncryptGroup(*m_aes, m_groupBuf.get(), sectors);
+
+      for (uint32_t b = 0; b < sectors; ++b)
+        if (space.isZeroSector(firstSector + b))
+          memset(m_groupBuf.get() + b * 0x8000, 0, 0x8000);
+      return true;
+    }
+
+  public:
+    uint64_t read(void* buf, uint64_t length) override {
+      uint8_t* dst = (uint8_t*)buf;
+      uint64_t rem = nod::min(length, m_parent.m_discSize - nod::min(m_parent.m_discSize, m_offset));
+      while (rem) {
+        uint64_t thisSz = rem;
+        const auto& spaces = m_parent.m_spaces;
+        auto it = std::upper_bound(spaces.begin(), spaces.end(), m_offset,
+                                   [](uint64_t off, const Space& space) { return off < space.m_discOffset; });
+        if (it == spaces.begin() || m_offset - std::prev(it)->m_discOffset >= std::prev(it)->m_discSize) {
+          /* Nothing was stored here; it reads as zeros */
+          if (it != spaces.end())
+            thisSz = nod::min(thisSz, it->m_discOffset - m_offset);
+          memset(dst, 0, thisSz);
+        } else {
+          const size_t s = size_t(std::prev(it) - spaces.begin());
+          const Space& space = spaces[s];
+          uint64_t inSpace = m_offset - space.m_discOffset;
+          thisSz = nod::min(thisSz, space.m_discSize - inSpace);
+          if (space.m_kind == 0) {
+            if (!readSpace(space, inSpace, dst, thisSz)) {
+              spdlog::error("unable to read stored image at 0x{:X}", m_offset);
+              break;
+            }
+          } else {
+            uint32_t group = uint32_t(inSpace / 0x200000);
+            if (s != m_groupSpace || group != m_group) {
+              m_groupOk = buildGroup(s, group);
+              m_groupSpace = s;
+              m_group = group;
+            }
+            if (!m_groupOk) {
+              spdlog::error("unable to rebuild Wii group at 0x{:X}", space.m_discOffset + uint64_t(group) * 0x200000);
+              break;
+            }
+            uint64_t inGroup = inSpace % 0x200000;
+            thisSz = nod::min(thisSz, 0x200000 - inGroup);
+            memcpy(dst, m_groupBuf.get() + inGroup, thisSz);
+          }
+        }
+        dst += thisSz;
+        rem -= thisSz;
+        m_offset += thisSz;
+      }
+      return dst - (uint8_t*)buf;
+    }
+    uint64_t position() const override { return m_offset; }
+    void seek(int64_t offset, int whence) override {
+      if (whence == SEEK_SET)
+        m_offset = offset;
+      else if (whence == SEEK_CUR)
+        m_offset += offset;
+    }
+  };
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override {
+    return std::unique_ptr<IReadStream>(new ReadStream(*this, offset));
+  }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override { return {}; }
+};
+
+std::unique_ptr<IDiscIO> NewDiscIOStore(std::string_view manifestPath) {
+  bool err = false;
+  auto ret = std::make_unique<DiscIOStore>(manifestPath, err);
+  if (err)
+    return {};
+  return ret;
+}
+
+bool DiscStore::writeImage(std::string_view name, std::string_view outPath, const FProgress& progressCB) const {
+  bool err = false;
+  DiscIOStore discIO(getManifestPath(name), err);
+  if (err)
+    return false;
+
+  const uint64_t discSize = discIO.discSize();
+  std::unique_ptr<IFileIO> fio = NewFileIO(outPath, discSize);
+  std::unique_ptr<IFileIO::IWriteStream> ws = fio->beginWriteStream();
+  std::unique_ptr<IReadStream> rs = discIO.beginReadStream(0);
+  if (!ws) {
+    spdlog::error("unable to open '{}' for writing", outPath);
+    return false;
+  }
+
+  constexpr uint64_t BufSize = 0x800000;
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[BufSize]);
+  for (uint64_t pos = 0; pos < discSize;) {
+    uint64_t thisSz = nod::min(BufSize, discSize - pos);
+    if (rs->read(buf.get(), thisSz) != thisSz)
+      return false;
+    if (ws->write(buf.get(), thisSz) != thisSz) {
+      spdlog::error("unable to write '{}' at 0x{:X}", outPath, pos);
+      return false;
+    }
+    pos += thisSz;
+    if (progressCB)
+      progressCB(float(pos) / float(discSize), outPath, size_t(pos));
+  }
+  return true;
+}
+
+std::unique_ptr<DiscStore> OpenDiscStore(std::string_view dir) {
+  bool err = false;
+  auto ret = std::make_unique<DiscStore>(dir, err);
+  if (err)
+    return {};
+  return ret;
+}
+
+} // namespace nod
@@ -1,14 +1,19 @@
 #include "nod/DiscWii.hpp"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <thread>
 
 #include "nod/aes.hpp"
 #include "nod/nod.hpp"
 #include "nod/sha1.h"
+#include "DiscWiiHash.hpp"
+#include "ExtentMap.hpp"
 #include "Util.hpp"
 
 #include <spdlog/spdlog.h>
@@ -21,7 +26,116 @@ static const uint8_t COMMON_KEYS[2][16] = {
     /* Korean */
     {0x63, 0xb8, 0x2b, 0xb4, 0xf4, 0x61, 0x4e, 0x2e, 0x13, 0xf2, 0xfe, 0xfb, 0xba, 0x4c, 0x9b, 0x7e}};
 
+static const uint8_t ZEROIV[16] = {0};
+
+void HashGroup(char* buf, uint8_t h3Out[20]) {
+  sha1nfo sha;
+  uint8_t h2[8][20];
+
+  for (int s = 0; s < 8; ++s) {
+    char* ptr1 = buf + s * 0x40000;
+    uint8_t h1[8][20];
+
+    for (int c = 0; c < 8; ++c) {
+      char* ptr0 = ptr1 + c * 0x8000;
+      uint8_t h0[31][20];
+
+      for (int j = 0; j < 31; ++j) {
+        sha1_init(&sha);
+        sha1_write(&sha, ptr0 + (j + 1) * 0x400, 0x400);
+        memmove(h0[j], sha1_result(&sha), 20);
+      }
+
+      sha1_init(&sha);
+      sha1_write(&sha, (char*)h0, 0x26C);
+      memmove(h1[c], sha1_result(&sha), 20);
+
+      memmove(ptr0, h0, 0x26C);
+      memset(ptr0 + 0x26C, 0, 0x014);
+    }
+
+    sha1_init(&sha);
+    sha1_write(&sha, (char*)h1, 0x0A0);
+    memmove(h2[s], sha1_result(&sha), 20);
+
+    for (int c = 0; c < 8; ++c) {
+      char* ptr0 = ptr1 + c * 0x8000;
+      memmove(ptr0 + 0x280, h1, 0x0A0);
+      memset(ptr0 + 0x320, 0, 0x020);
+    }
+  }
+
+  sha1_init(&sha);
+  sha1_write(&sha, (char*)h2, 0x0A0);
+  memmove(h3Out, sha1_result(&sha), 20);
+
+  for (int s = 0; s < 8; ++s) {
+    char* ptr1 = buf + s * 0x40000;
+    for (int c = 0; c < 8; ++c) {
+      char* ptr0 = ptr1 + c * 0x8000;
+      memmove(ptr0 + 0x340, h2, 0x0A0);
+      memset(ptr0 + 0x3E0, 0, 0x020);
+    }
+  }
+}
+
+void EncryptGroup(IAES& aes, char* buf, size_t blockCount) {
+  for (size_t b = 0; b < blockCount; ++b) {
+    char* ptr0 = buf + b * 0x8000;
+    aes.encrypt(ZEROIV, (uint8_t*)ptr0, (uint8_t*)ptr0, 0x400);
+    aes.encrypt((uint8_t*)(ptr0 + 0x3D0), (uint8_t*)(ptr0 + 0x400), (uint8_t*)(ptr0 + 0x400), 0x7c00);
+  }
+}
+
+/* Hashes a cleartext group, then encrypts the whole group in place */
+static void HashAndEncryptGroup(IAES& aes, char* buf, uint8_t h3Out[20]) {
+  HashGroup(buf, h3Out);
+  EncryptGroup(aes, buf);
+}
+
+/* Stores the SHA-1 of the H3 table as the TMD content hash, then fakesigns the TMD:
+ * the signature is zeroed and a padding window brute-forced until the body hash starts with zero */
+static void FakesignTMD(uint8_t* tmdData, size_t tmdSz, const uint8_t* h3Table,
+                        const std::function<void(uint64_t attempts)>& progress) {
+  sha1nfo sha;
+  sha1_init(&sha);
+  sha1_write(&sha, (char*)h3Table, 0x18000);
+  memmove(tmdData + 0x1F4, sha1_result(&sha), 20);
+
+  /* Zero-out TMD signature to simplify brute-force */
+  memset(tmdData + 0x4, 0, 0x100);
+
+  /* Brute-force zero-starting hash */
+  size_t tmdCheckSz = tmdSz - 0x140;
+  struct BFWindow {
+    uint64_t word[7];
+  }* bfWindow = (BFWindow*)(tmdData + 0x19A);
+  bool good = false;
+  uint64_t attempts = 0;
+  for (int w = 0; w < 7; ++w) {
+    for (uint64_t i = 0; i < UINT64_MAX; ++i) {
+      bfWindow->word[w] = i;
+      sha1_init(&sha);
+      sha1_write(&sha, (char*)(tmdData + 0x140), tmdCheckSz);
+      uint8_t* hash = sha1_result(&sha);
+      ++attempts;
+      if (hash[0] == 0) {
+        good = true;
+        break;
+      }
+      if (progress)
+        progress(attempts);
+    }
+    if (good)
+      break;
+  }
+  if (progress)
+    progress(attempts);
+}
+
 class PartitionWii : public IPartition {
+  friend class PartitionBuilderWii;
+
   enum class SigType : uint32_t { RSA_4096 = 0x00010000, RSA_2048 = 0x00010001, ELIPTICAL_CURVE = 0x00010002 };
 
   enum class KeyType : uint32_t { RSA_4096 = 0x00000000, RSA_2048 = 0x00000001 };
@@ -240,6 +354,10 @@ class PartitionWii : public IPartition {
   std::unique_ptr<uint8_t[]> m_h3Data;
 
   uint64_t m_dataOff;
+  uint64_t m_dataSz;
+  uint64_t m_tmdOff;
+  uint64_t m_tmdSz;
+  uint64_t m_h3Off;
   uint8_t m_decKey[16];
 
 public:
@@ -278,6 +396,10 @@ public:
     uint32_t dataSize;
     s->read(&dataSize, 4);
     dataSize = SBig(dataSize) << 2;
+    m_dataSz = dataSize;
+    m_tmdOff = tmdOff;
+    m_tmdSz = tmdSize;
+    m_h3Off = globalHashTableOff;
 
     s->seek(offset + tmdOff);
     m_tmd.read(*s);
@@ -412,7 +534,189 @@ public:
     return ret;
   }
 
+  class PartPatchStream : public IPartPatchStream {
+    PartitionWii& m_parent;
+    std::unique_ptr<IAES> m_aes;
+    uint64_t m_offset;
+    size_t m_curGroup = SIZE_MAX;
+    bool m_dirty = false;
+    bool m_failed = false;
+    bool m_closed = false;
+    std::unique_ptr<uint8_t[]> m_h3;
+    std::unique_ptr<char[]> m_buf;
+
+    bool loadGroup(size_t group) {
+      std::unique_ptr<IReadStream> rs = m_parent.m_parent.getDiscIO().beginReadStream(m_parent.m_dataOff + group * 0x200000);
+      if (!rs || rs->read(m_buf.get(), 0x200000) != 0x200000) {
+        spdlog::error("unable to read full disc group");
+        return false;
+      }
+
+      /* Hash areas are regenerated on flush; only the cleartext data is needed */
+      uint8_t decBuf[0x7c00];
+      for (int b = 0; b < 64; ++b) {
+        char* ptr0 = m_buf.get() + b * 0x8000;
+        m_aes->decrypt((uint8_t*)(ptr0 + 0x3D0), (uint8_t*)(ptr0 + 0x400), decBuf, 0x7c00);
+        memmove(ptr0 + 0x400, decBuf, 0x7c00);
+      }
+      m_curGroup = group;
+      return true;
+    }
+
+    bool flushGroup() {
+      if (m_curGroup == SIZE_MAX)
+        return true;
+      HashAndEncryptGroup(*m_aes, m_buf.get(), m_h3.get() + m_curGroup * 20);
+      std::unique_ptr<IWriteStream> ws =
+          m_parent.m_parent.getDiscIO().beginWriteStream(m_parent.m_dataOff + m_curGroup * 0x200000);
+      m_curGroup = SIZE_MAX;
+      if (!ws || ws->write(m_buf.get(), 0x200000) != 0x200000) {
+        spdlog::error("unable to write full disc group");
+        return false;
+      }
+      m_dirty = true;
+      return true;
+    }
+
+  public:
+    PartPatchStream(PartitionWii& parent, uint64_t offset, bool& err)
+    : m_parent(parent), m_aes(NewAES()), m_offset(offset) {
+      if (!m_parent.m_parent.getDiscIO().hasWiiCrypto()) {
+        spdlog::error("image format does not support in-place writes");
+        err = true;
+        return;
+      }
+      m_aes->setKey(m_parent.m_decKey);
+
+      std::unique_ptr<IReadStream> rs = m_parent.m_parent.getDiscIO().beginReadStream(m_parent.m_offset + m_parent.m_h3Off);
+      if (!rs) {
+        err = true;
+        return;
+      }
+      m_h3.reset(new uint8_t[0x18000]);
+      if (rs->read(m_h3.get(), 0x18000) != 0x18000) {
+        spdlog::error("unable to read H3 table");
+        err = true;
+        return;
+      }
+      m_buf.reset(new char[0x200000]);
+    }
+    ~PartPatchStream() override { PartPatchStream::close(); }
+
+    void close() override { finish(); }
+
+    bool finish() override {
+      if (m_closed)
+        return !m_failed;
+      m_closed = true;
+      if (m_failed || !flushGroup()) {
+        m_failed = true;
+        return false;
+      }
+      if (!m_dirty)
+        return true;
+
+      /* Store updated H3 entries, then refresh the TMD content hash and fakesign */
+      m_failed = true;
+      const IDiscIO& dio = m_parent.m_parent.getDiscIO();
+      std::unique_ptr<IWriteStream> ws = dio.beginWriteStream(m_parent.m_offset + m_parent.m_h3Off);
+      if (!ws || ws->write(m_h3.get(), 0x18000) != 0x18000) {
+        spdlog::error("unable to write H3 table");
+        return false;
+      }
+
+      std::unique_ptr<uint8_t[]> tmdData(new uint8_t[m_parent.m_tmdSz]);
+      std::unique_ptr<IReadStream> rs = dio.beginReadStream(m_parent.m_offset + m_parent.m_tmdOff);
+      if (!rs || rs->read(tmdData.get(), m_parent.m_tmdSz) != m_parent.m_tmdSz) {
+        spdlog::error("unable to read TMD");
+        return false;
+      }
+      FakesignTMD(tmdData.get(), m_parent.m_tmdSz, m_h3.get(), {});
+      ws = dio.beginWriteStream(m_parent.m_offset + m_parent.m_tmdOff);
+      if (!ws || ws->write(tmdData.get(), m_parent.m_tmdSz) != m_parent.m_tmdSz) {
+        spdlog::error("unable to write TMD");
+        return false;
+      }
+      ws.reset();
+      rs->seek(m_parent.m_offset + m_parent.m_tmdOff);
+      m_parent.m_tmd.read(*rs);
+      m_failed = false;
+      return true;
+    }
+
+    /* Groups are loaded lazily by write(), so moving within or across groups needs no I/O here */
+    bool seek(uint64_t offset) override {
+      if (m_failed || m_closed)
+        return false;
+      m_offset = offset;
+      return true;
+    }
+
+    uint64_t position() const override { return m_offset; }
+
+    uint64_t write(const void* buf, uint64_t length) override {
+      const uint8_t* src = (const uint8_t*)buf;
+      uint64_t rem = length;
+      while (rem && !m_failed && !m_closed) {
+        size_t group = m_offset / 0x1F0000;
+        if (group != m_curGroup) {
+          if (group >= m_parent.m_dataSz / 0x200000) {
+            spdlog::error("patch extends past partition data");
+            m_failed = true;
+            break;
+          }
+          if (!flushGroup() || !loadGroup(group)) {
+            m_failed = true;
+            break;
+          }
+        }
+
+        uint64_t groupOff = m_offset % 0x1F0000;
+        uint64_t block = groupOff / 0x7c00;
+        uint64_t cacheOffset = groupOff % 0x7c00;
+        uint64_t cacheSize = nod::min(rem, 0x7c00 - cacheOffset);
+        memmove(m_buf.get() + block * 0x8000 + 0x400 + cacheOffset, src, cacheSize);
+        src += cacheSize;
+        rem -= cacheSize;
+        m_offset += cacheSize;
+      }
+      return length - rem;
+    }
+  };
+
+  std::unique_ptr<IPartPatchStream> beginPatchStream(uint64_t offset) override {
+    bool err = false;
+    auto ret = std::make_unique<PartPatchStream>(*this, offset, err);
+
+    if (err) {
+      return nullptr;
+    }
+
+    return ret;
+  }
+
+  uint64_t getDataEnd() const override { return m_dataSz / 0x200000 * 0x1F0000; }
+
+  bool getDataCrypto(uint64_t& dataOffOut, uint64_t& dataSzOut, uint8_t keyOut[16]) const override {
+    dataOffOut = m_dataOff;
+    dataSzOut = m_dataSz;
+    memcpy(keyOut, m_decKey, 16);
+    return true;
+  }
+
+  void getUsedDiscRanges(std::vector<std::pair<uint64_t, uint64_t>>& rangesOut) const override {
+    rangesOut.emplace_back(m_offset, m_dataOff);
+    std::vector<std::pair<uint64_t, uint64_t>> dataRanges;
+    getUsedDataRanges(dataRanges);
+    for (const auto& [begin, end] : dataRanges) {
+      if (begin >= end)
+        continue;
+      rangesOut.emplace_back(m_dataOff + begin / 0x7C00 * 0x8000, m_dataOff + (end + 0x7BFF) / 0x7C00 * 0x8000);
+    }
+  }
+
   uint64_t normalizeOffset(uint64_t anOffset) const override { return anOffset << 2; }
+  uint32_t packOffset(uint64_t anOffset) const override { return uint32_t(anOffset >> 2); }
 
   std::unique_ptr<uint8_t[]> readPartitionHeaderBuf(size_t& szOut) const {
     {
@@ -600,7 +904,133 @@ bool DiscWii::extractDiscHeaderFiles(std::string_view basePath, const Extraction
   return true;
 }
 
-static const uint8_t ZEROIV[16] = {0};
+/* Sidecar index of a previously built image. Each partition group is recorded by the SHA-1 of its
+ * decrypted content along with its H3 entry; the encrypted bytes themselves are the ones already
+ * residing in the previous output image, which is fingerprinted by its size and modification time
+ * so that an image rewritten by anything else is never trusted. */
+struct GroupCache {
+  struct Entry {
+    uint8_t contentHash[20];
+    uint8_t h3[20];
+  };
+  struct Partition {
+    uint64_t dataOffset = 0;
+    uint8_t keyHash[20] = {};
+    std::vector<Entry> groups;
+  };
+  uint64_t imageSize = 0;
+  uint64_t imageMtime = 0;
+  uint64_t filledSize = 0;
+  std::vector<Partition> partitions;
+
+  /* Fingerprint of the image file as it is now; false if it cannot be examined */
+  static bool Fingerprint(const std::string& imagePath, uint64_t& sizeOut, uint64_t& mtimeOut) {
+    Sstat theStat;
+    if (Stat(imagePath.c_str(), &theStat))
+      return false;
+    sizeOut = uint64_t(theStat.st_size);
+    mtimeOut = uint64_t(theStat.st_mtime);
+    return true;
+  }
+
+  bool read(std::string_view path) {
+    std::unique_ptr<IFileIO> fio = NewFileIO(path);
+    if (!fio->exists())
+      return false;
+    std::unique_ptr<IFileIO::IReadStream> rs = fio->beginReadStream();
+    if (!rs)
+      return false;
+    uint32_t head[2];
+    if (rs->read(head, 8) != 8 || SBig(head[0]) != 'NODG' || SBig(head[1]) != 2)
+      return false;
+    uint64_t sizes[3];
+    uint32_t partCount;
+    if (rs->read(sizes, 24) != 24 || rs->read(&partCount, 4) != 4)
+      return false;
+    imageSize = SBig(sizes[0]);
+    imageMtime = SBig(sizes[1]);
+    filledSize = SBig(sizes[2]);
+    partCount = SBig(partCount);
+    partitions.clear();
+    partitions.resize(partCount);
+    for (Partition& part : partitions) {
+      uint32_t groupCount;
+      if (rs->read(&part.dataOffset, 8) != 8 || rs->read(part.keyHash, 20) != 20 || rs->read(&groupCount, 4) != 4)
+        return false;
+      part.dataOffset = SBig(part.dataOffset);
+      groupCount = SBig(groupCount);
+      if (groupCount > 4916)
+        return false;
+      part.groups.resize(groupCount);
+      if (rs->read(part.groups.data(), groupCount * sizeof(Entry)) != groupCount * sizeof(Entry))
+        return false;
+    }
+    return true;
+  }
+
+  bool write(std::string_view path) const {
+    std::unique_ptr<IFileIO::IWriteStream> ws = NewFileIO(path)->beginWriteStream();
+    if (!ws)
+      return false;
+    uint32_t head[] = {SBig(uint32_t('NODG')), SBig(uint32_t(2))};
+    ws->write(head, 8);
+    uint64_t sizes[] = {SBig(imageSize), SBig(imageMtime), SBig(filledSize)};
+    ws->write(sizes, 24);
+    uint32_t partCount = SBig(uint32_t(partitions.size()));
+    ws->write(&partCount, 4);
+    for (const Partition& part : partitions) {
+      uint64_t dataOffset = SBig(part.dataOffset);
+      ws->write(&dataOffset, 8);
+      ws->write(part.keyHash, 20);
+      uint32_t groupCount = SBig(uint32_t(part.groups.size()));
+      ws->write(&groupCount, 4);
+      if (ws->write(part.groups.data(), part.groups.size() * sizeof(Entry)) != part.groups.size() * sizeof(Entry))
+        return false;
+    }
+    return true;
+  }
+
+  /* Invalidates the cache before the image it describes is overwritten */
+  static void Clear(std::string_view path) { NewFileIO(path)->beginWriteStream(); }
+};
+
+/* Whether a filesystem file holds the same bytes as a disc file; trailing 0xff padding on disc is ignored */
+static bool SameFileContent(const std::string& path, const Node& node) {
+  std::unique_ptr<IFileIO> fio = NewFileIO(path);
+  uint64_t sz = fio->size();
+  if (sz > node.size() || node.size() > ROUND_UP_32(sz))
+    return false;
+  std::unique_ptr<IFileIO::IReadStream> rs = fio->beginReadStream();
+  std::unique_ptr<IPartReadStream> nrs = node.beginReadStream();
+  if (!rs || !nrs)
+    return false;
+
+  uint8_t fileBuf[0x8000];
+  uint8_t nodeBuf[0x8000];
+  for (uint64_t pos = 0; pos < node.size();) {
+    uint64_t chunk = nod::min(uint64_t(0x8000), node.size() - pos);
+    if (nrs->read(nodeBuf, chunk) != chunk)
+      return false;
+    uint64_t fileChunk = pos < sz ? nod::min(chunk, sz - pos) : 0;
+    if (fileChunk && (rs->read(fileBuf, fileChunk) != fileChunk || memcmp(fileBuf, nodeBuf, fileChunk)))
+      return false;
+    for (uint64_t i = fileChunk; i < chunk; ++i)
+      if (nodeBuf[i] != 0xff)
+        return false;
+    pos += chunk;
+  }
+  return true;
+}
+
+/* Collects a partition head in memory until its H3 table and TMD are final */
+struct PartHeadWriteStream : IFileIO::IWriteStream {
+  std::vector<uint8_t> m_buf;
+  uint64_t write(const void* buf, uint64_t length) override {
+    const uint8_t* src = static_cast<const uint8_t*>(buf);
+    m_buf.insert(m_buf.end(), src, src + length);
+    return length;
+  }
+};
 
 class PartitionBuilderWii : public DiscBuilderBase::PartitionBuilderBase {
   friend class DiscBuilderWii;
@@ -612,6 +1042,20 @@ class PartitionBuilderWii : public DiscBuilderBase::PartitionBuilderBase {
   std::unique_ptr<IAES> m_aes;
   uint8_t m_h3[4916][20] = {};
 
+  /* Incremental build state; m_prevGroups describes groups already present in the output image */
+  bool m_incremental = false;
+  GroupCache::Partition m_prevGroups;
+  GroupCache::Partition m_curGroups;
+
+  /* Layout-preserving merge state; clean groups are copied from the source partition still encrypted */
+  bool m_preserveLayout = false;
+  std::vector<bool> m_dirtyGroups;
+  uint8_t m_titleKey[16];
+
+  /* Streaming state; a hashing pass fills m_h3 so the partition head can precede the groups */
+  bool m_hashOnly = false;
+  bool m_streamMismatch = false;
+
 public:
   class PartWriteStream : public IPartWriteStream {
     friend class PartitionBuilderWii;
@@ -625,61 +1069,63 @@ public:
     char m_buf[0x200000];
 
     void encryptGroup(uint8_t h3Out[20]) {
-      sha1nfo sha;
-      uint8_t h2[8][20];
-
-      for (int s = 0; s < 8; ++s) {
-        char* ptr1 = m_buf + s * 0x40000;
-        uint8_t h1[8][20];
-
-        for (int c = 0; c < 8; ++c) {
-          char* ptr0 = ptr1 + c * 0x8000;
-          uint8_t h0[31][20];
-
-          for (int j = 0; j < 31; ++j) {
-            sha1_init(&sha);
-            sha1_write(&sha, ptr0 + (j + 1) * 0x400, 0x400);
-            memmove(h0[j], sha1_result(&sha), 20);
-          }
-
-          sha1_init(&sha);
-          sha1_write(&sha, (char*)h0, 0x26C);
-          memmove(h1[c], sha1_result(&sha), 20);
+      if (m_parent.m_parent.isWiiCryptoOutput())
+        HashAndEncryptGroup(*m_parent.m_aes, m_buf, h3Out);
+      else
+        HashGroup(m_buf, h3Out);
 
-          memmove(ptr0, h0, 0x26C);
-          memset(ptr0 + 0x26C, 0, 0x014);
-        }
+      if (!m_fio)
+        m_fio = m_parent.m_parent.getFileIO().beginWriteStream(m_baseOffset + m_curGroup * 0x200000);
+      if (!m_fio || m_fio->write(m_buf, 0x200000) != 0x200000) {
+        spdlog::error("unable to write full disc group");
+        return;
+      }
+    }
 
-        sha1_init(&sha);
-        sha1_write(&sha, (char*)h1, 0x0A0);
-        memmove(h2[s], sha1_result(&sha), 20);
+    void finishGroup() {
+      if (m_parent.m_hashOnly) {
+        HashGroup(m_buf, m_parent.m_h3[m_curGroup]);
+        return;
+      }
 
-        for (int c = 0; c < 8; ++c) {
-          char* ptr0 = ptr1 + c * 0x8000;
-          memmove(ptr0 + 0x280, h1, 0x0A0);
-          memset(ptr0 + 0x320, 0, 0x020);
+      if (m_parent.m_parent.isStreaming()) {
+        /* The H3 table is already out; sources must not have changed since the hashing pass */
+        uint8_t h3[20];
+        encryptGroup(h3);
+        if (memcmp(h3, m_parent.m_h3[m_curGroup], 20)) {
+          spdlog::error("group {} changed between hashing and writing", m_curGroup);
+          m_parent.m_streamMismatch = true;
         }
+        return;
       }
 
-      sha1_init(&sha);
-      sha1_write(&sha, (char*)h2, 0x0A0);
-      memmove(h3Out, sha1_result(&sha), 20);
-
-      for (int s = 0; s < 8; ++s) {
-        char* ptr1 = m_buf + s * 0x40000;
-        for (int c = 0; c < 8; ++c) {
-          char* ptr0 = ptr1 + c * 0x8000;
-          memmove(ptr0 + 0x340, h2, 0x0A0);
-          memset(ptr0 + 0x3E0, 0, 0x020);
-          m_parent.m_aes->encrypt(ZEROIV, (uint8_t*)ptr0, (uint8_t*)ptr0, 0x400);
-          m_parent.m_aes->encrypt((uint8_t*)(ptr0 + 0x3D0), (uint8_t*)(ptr0 + 0x400), (uint8_t*)(ptr0 + 0x400), 0x7c00);
-        }
+      if (!m_parent.m_incremental) {
+        encryptGroup(m_parent.m_h3[m_curGroup]);
+        return;
       }
 
-      if (m_fio->write(m_buf, 0x200000) != 0x200000) {
-        spdlog::error("unable to write full disc group");
+      /* Hash decrypted content to see if the previous image already holds this exact group */
+      sha1nfo sha;
+      sha1_init(&sha);
+      for (int b = 0; b < 64; ++b)
+        sha1_write(&sha, m_buf + b * 0x8000 + 0x400, 0x7c00);
+      std::vector<GroupCache::Entry>& curGroups = m_parent.m_curGroups.groups;
+      if (curGroups.size() <= m_curGroup)
+        curGroups.resize(m_curGroup + 1);
+      GroupCache::Entry& entry = curGroups[m_curGroup];
+      memmove(entry.contentHash, sha1_result(&sha), 20);
+
+      const std::vector<GroupCache::Entry>& prevGroups = m_parent.m_prevGroups.groups;
+      if (m_curGroup < prevGroups.size() && !memcmp(prevGroups[m_curGroup].contentHash, entry.contentHash, 20)) {
+        memmove(entry.h3, prevGroups[m_curGroup].h3, 20);
+        memmove(m_parent.m_h3[m_curGroup], entry.h3, 20);
+        /* Next written group must reopen at its own offset */
+        m_fio.reset();
         return;
       }
+
+      encryptGroup(m_parent.m_h3[m_curGroup]);
+      memmove(entry.h3, m_parent.m_h3[m_curGroup], 20);
     }
 
   public:
@@ -691,10 +1137,12 @@ public:
         return;
       }
       size_t group = m_offset / 0x1F0000;
+      m_curGroup = group;
+      if (m_parent.m_hashOnly)
+        return;
       m_fio = m_parent.m_parent.getFileIO().beginWriteStream(m_baseOffset + group * 0x200000);
       if (!m_fio)
         err = true;
-      m_curGroup = group;
     }
     ~PartWriteStream() override { PartWriteStream::close(); }
     void close() override {
@@ -706,7 +1154,7 @@ public:
         rem = 0x1F0000 - rem;
         write(nullptr, rem);
       }
-      encryptGroup(m_parent.m_h3[m_curGroup]);
+      finishGroup();
       m_fio.reset();
     }
     uint64_t position() const override { return m_offset; }
@@ -720,7 +1168,7 @@ public:
 
       while (rem) {
         if (group != m_curGroup) {
-          encryptGroup(m_parent.m_h3[m_curGroup]);
+          finishGroup();
           m_curGroup = group;
         }
 
@@ -753,24 +1201,33 @@ public:
 
   uint64_t getCurUserEnd() const { return m_curUser; }
 
-  uint64_t userAllocate(uint64_t reqSz, IPartWriteStream& ws) override {
+  uint64_t userAllocate(uint64_t reqSz) override {
     reqSz = ROUND_UP_32(reqSz);
     if (m_curUser + reqSz >= 0x1FB450000) {
       spdlog::error("partition exceeds maximum single-partition capacity");
       return -1;
     }
     uint64_t ret = m_curUser;
+    m_curUser += reqSz;
+    return ret;
+  }
+
+  bool userSeek(IPartWriteStream& ws, uint64_t offset) override {
     PartWriteStream& cws = static_cast<PartWriteStream&>(ws);
-    if (cws.m_offset > ret) {
+    if (cws.m_offset > offset) {
       spdlog::error("partition overwrite error");
-      return -1;
+      return false;
     }
-    while (cws.m_offset < ret)
+    while (cws.m_offset < offset)
       cws.write("\xff", 1);
-    m_curUser += reqSz;
-    return ret;
+    return true;
   }
 
+  /* Each writer must own whole groups since hashes cover the entire group */
+  uint64_t writeAlignment() const override { return 0x1F0000; }
+  /* Hashing passes emit nothing and may still run in parallel */
+  bool writesSequentially() const override { return m_parent.isStreaming() && !m_hashOnly; }
+
   uint32_t packOffset(uint64_t offset) const override { return uint32_t(offset >> uint64_t(2)); }
 
   std::unique_ptr<IPartWriteStream> beginWriteStream(uint64_t offset) override {
@@ -784,23 +1241,54 @@ public:
     return ret;
   }
 
+  /* Writes group 0: boot header and BI2 with the plan's DOL and FST, then apploader and FST */
+  bool writeContentHeader(const std::function<bool(IPartWriteStream&, uint32_t, uint32_t, uint32_t)>& headerFunc,
+                          const std::function<bool(IPartWriteStream&)>& bi2Func,
+                          const std::function<bool(IPartWriteStream&, size_t&)>& apploaderFunc) {
+    std::unique_ptr<IPartWriteStream> cws = beginWriteStream(0);
+    if (!cws)
+      return false;
+
+    size_t fstOff = m_plan.m_fstOffset;
+    size_t fstSz = m_plan.m_fstSize;
+    if (!headerFunc(*cws, m_dolOffset, fstOff, fstSz))
+      return false;
+
+    if (!bi2Func(*cws))
+      return false;
+
+    size_t xferSz = 0;
+    if (!apploaderFunc(*cws, xferSz))
+      return false;
+
+    size_t fstOffRel = fstOff - 0x2440;
+    if (xferSz > fstOffRel) {
+      spdlog::error("apploader unexpectedly flows into FST");
+      return false;
+    }
+    for (size_t i = 0; i < fstOffRel - xferSz; ++i)
+      cws->write("\xff", 1);
+
+    cws->write(m_buildNodes.data(), m_buildNodes.size() * sizeof(FSTNode));
+    for (const std::string& str : m_buildNames)
+      cws->write(str.data(), str.size() + 1);
+    return true;
+  }
+
   uint64_t _build(const std::function<bool(IFileIO::IWriteStream&, uint32_t& h3Off, uint32_t& dataOff, uint8_t& ccIdx,
                                            uint8_t tkey[16], uint8_t tkeyiv[16], std::unique_ptr<uint8_t[]>& tmdData,
                                            size_t& tmdSz)>& cryptoFunc,
                   const std::function<bool(IPartWriteStream&, uint32_t, uint32_t, uint32_t)>& headerFunc,
                   const std::function<bool(IPartWriteStream&)>& bi2Func,
-                  const std::function<bool(IPartWriteStream&, size_t&)>& apploaderFunc,
-                  const std::function<bool(IPartWriteStream&)>& contentFunc, size_t apploaderSz) {
-    /* Write partition head up to H3 table */
-    std::unique_ptr<IFileIO::IWriteStream> ws = m_parent.getFileIO().beginWriteStream(m_baseOffset);
-    if (!ws)
-      return -1;
+                  const std::function<bool(IPartWriteStream&, size_t&)>& apploaderFunc) {
+    /* Partition head up to H3 table; held back until the H3 table and TMD are final */
+    PartHeadWriteStream head;
     uint32_t h3Off, dataOff;
     uint8_t tkey[16], tkeyiv[16];
     uint8_t ccIdx;
     std::unique_ptr<uint8_t[]> tmdData;
     size_t tmdSz;
-    if (!cryptoFunc(*ws, h3Off, dataOff, ccIdx, tkey, tkeyiv, tmdData, tmdSz))
+    if (!cryptoFunc(head, h3Off, dataOff, ccIdx, tkey, tkeyiv, tmdData, tmdSz))
       return -1;
 
     m_userOffset = dataOff;
@@ -809,127 +1297,409 @@ public:
     m_aes->setKey(COMMON_KEYS[ccIdx]);
     m_aes->decrypt(tkeyiv, tkey, tkey, 16);
     m_aes->setKey(tkey);
+    memmove(m_titleKey, tkey, 16);
 
-    {
-      /* Assemble partition data */
-      std::unique_ptr<IPartWriteStream> cws = beginWriteStream(0x1F0000);
-      if (!cws)
+    if (m_incremental) {
+      /* Cached groups are only valid for the same title key at the same place on disc */
+      m_curGroups.dataOffset = m_baseOffset + dataOff;
+      sha1nfo sha;
+      sha1_init(&sha);
+      sha1_write(&sha, (char*)tkey, 16);
+      memmove(m_curGroups.keyHash, sha1_result(&sha), 20);
+      m_curGroups.groups.clear();
+      m_curGroups.groups.resize(m_plan.m_groupCount);
+      if (m_prevGroups.dataOffset != m_curGroups.dataOffset || memcmp(m_prevGroups.keyHash, m_curGroups.keyHash, 20))
+        m_prevGroups.groups.clear();
+    }
+
+    const bool streaming = m_parent.isStreaming();
+    if (m_preserveLayout) {
+      /* Unchanged groups are copied verbatim; the rest are patched over their decrypted source */
+      if (!writePreservedGroups())
         return -1;
-      if (!contentFunc(*cws))
+    } else if (streaming) {
+      /* Hashing pass; nothing is emitted until the H3 table is complete */
+      m_hashOnly = true;
+      bool hashed = writePlan() && writeContentHeader(headerFunc, bi2Func, apploaderFunc);
+      m_hashOnly = false;
+      if (!hashed)
+        return -1;
+    } else {
+      /* Assemble partition data; the plan's user area already ends on a cleartext group boundary */
+      if (!writePlan())
         return -1;
-
-      /* Pad out user area to nearest cleartext sector */
-      m_curUser = cws->position();
-      uint64_t curUserRem = m_curUser % 0x1F0000;
-      if (curUserRem) {
-        curUserRem = 0x1F0000 - curUserRem;
-        for (size_t i = 0; i < curUserRem; ++i)
-          cws->write("\xff", 1);
-        m_curUser += curUserRem;
-      }
 
       /* Begin crypto write and add content header */
-      cws = beginWriteStream(0);
-      if (!cws)
+      if (!writeContentHeader(headerFunc, bi2Func, apploaderFunc))
         return -1;
+    }
 
-      /* Compute boot table members and write */
-      size_t fstOff = 0x2440 + ROUND_UP_32(apploaderSz);
-      size_t fstSz = sizeof(FSTNode) * m_buildNodes.size();
-      fstSz += m_buildNameOff;
-      fstSz = ROUND_UP_32(fstSz);
+    std::vector<uint8_t>& headBuf = head.m_buf;
+    headBuf.resize(std::max<size_t>({headBuf.size(), dataOff, h3Off + 0x18000, 0x2C0 + tmdSz}));
 
-      if (fstOff + fstSz >= 0x1F0000) {
-        spdlog::error("FST flows into user area (one or the other is too big)");
-        return -1;
-      }
+    /* Write new crypto content size */
+    uint64_t groupCount = m_plan.m_groupCount;
+    uint64_t cryptContentSize = (groupCount * 0x200000) >> uint64_t(2);
+    uint32_t cryptContentSizeBig = SBig(uint32_t(cryptContentSize));
+    memmove(&headBuf[0x2BC], &cryptContentSizeBig, 0x4);
 
-      if (!headerFunc(*cws, m_dolOffset, fstOff, fstSz))
-        return -1;
+    /* Write new H3 */
+    memmove(&headBuf[h3Off], m_h3, 0x18000);
 
-      if (!bi2Func(*cws))
-        return -1;
+    /* Same for content size */
+    uint64_t contentSize = groupCount * 0x1F0000;
+    uint64_t contentSizeBig = SBig(contentSize);
+    memmove(tmdData.get() + 0x1EC, &contentSizeBig, 8);
 
-      size_t xferSz = 0;
-      if (!apploaderFunc(*cws, xferSz))
-        return -1;
+    /* Compute content hash and fakesign */
+    std::string bfName("Brute force attempts");
+    FakesignTMD(tmdData.get(), tmdSz, &m_h3[0][0], [&](uint64_t attempts) { reportProgress(bfName, attempts); });
+    advanceProgress();
+    memmove(&headBuf[0x2C0], tmdData.get(), tmdSz);
 
-      size_t fstOffRel = fstOff - 0x2440;
-      if (xferSz > fstOffRel) {
-        spdlog::error("apploader unexpectedly flows into FST");
+    std::unique_ptr<IFileIO::IWriteStream> ws = m_parent.getFileIO().beginWriteStream(m_baseOffset);
+    if (!ws || ws->write(headBuf.data(), headBuf.size()) != headBuf.size()) {
+      spdlog::error("unable to write partition header");
+      return -1;
+    }
+    ws.reset();
+
+    if (streaming) {
+      /* Emitting pass; groups follow the partition head in disc order */
+      if (!writeContentHeader(headerFunc, bi2Func, apploaderFunc) || !writePlan() || m_streamMismatch)
         return -1;
+    }
+
+    return m_baseOffset + dataOff + groupCount * 0x200000;
+  }
+
+  bool finishPlan(uint64_t dataOff) {
+    /* Pad out user area to nearest cleartext sector */
+    uint64_t curUserRem = m_curUser % 0x1F0000;
+    if (curUserRem)
+      m_curUser += 0x1F0000 - curUserRem;
+    m_plan.m_userStart = 0x1F0000;
+    m_plan.m_userEnd = m_curUser;
+    if (m_plan.m_fstOffset + m_plan.m_fstSize >= 0x1F0000) {
+      spdlog::error("FST flows into user area (one or the other is too big)");
+      return false;
+    }
+    m_plan.m_groupCount = m_curUser / 0x1F0000;
+    m_plan.m_discSize = dataOff + m_plan.m_groupCount * 0x200000;
+    return true;
+  }
+
+  bool planFromDirectory(std::string_view dirIn) {
+    m_curUser = 0x1F0000;
+    if (!DiscBuilderBase::PartitionBuilderBase::planFromDirectory(dirIn))
+      return false;
+    return finishPlan(0x20000);
+  }
+
+  bool planFromMerge(const PartitionWii* partIn, std::string_view dirIn) {
+    if (m_preserveLayout)
+      return planPreservedMerge(partIn, dirIn);
+    m_curUser = 0x1F0000;
+    if (!DiscBuilderBase::PartitionBuilderBase::planFromMerge(partIn, dirIn))
+      return false;
+    size_t phSz;
+    std::unique_ptr<uint8_t[]> phBuf = partIn->readPartitionHeaderBuf(phSz);
+    return finishPlan(uint64_t(SBig(*reinterpret_cast<uint32_t*>(&phBuf[0x2B8]))) << 2);
+  }
+
+  /* Plans a merge over the source partition's existing layout. Unchanged files keep their offsets,
+   * overridden files stay in place when they still fit, and everything else goes to free space. */
+  bool planPreservedMerge(const PartitionWii* partIn, std::string_view dirIn) {
+    if (dirIn.empty()) {
+      spdlog::error("all arguments must be supplied to planFromMerge()");
+      return false;
+    }
+    std::string filesIn = std::string(dirIn) + "/" + getKindString(m_kind) + "/files";
+
+    resetPlan();
+    m_plan.m_sourcePartition = partIn;
+
+    ExtentMap used;
+    used.claim(0, 0x2440 + partIn->m_apploaderSz);
+
+    /* Boot DOL stays where it is */
+    {
+      PartitionBuildPlan::File file;
+      file.m_name = "<boot-dol>";
+      file.m_offset = partIn->m_dolOff;
+      file.m_size = partIn->m_dolSz;
+      file.m_dataSize = partIn->m_dolSz;
+      file.m_isExecutable = true;
+      used.claim(file.m_offset, file.m_size);
+      m_plan.m_files.push_back(std::move(file));
+    }
+
+    /* Source extents of every existing file, keyed like merge queue entries */
+    std::unordered_map<std::string, const Node*> srcFiles;
+    std::function<void(const Node&, const std::string&)> mapFiles = [&](const Node& dir, const std::string& keyPath) {
+      for (const Node& ch : dir) {
+        std::string chKeyPath = keyPath + '/' + SJISToUTF8(ch.getName()).str();
+        if (ch.getKind() == Node::Kind::Directory)
+          mapFiles(ch, chKeyPath);
+        else
+          srcFiles.emplace(std::move(chKeyPath), &ch);
       }
-      for (size_t i = 0; i < fstOffRel - xferSz; ++i)
-        cws->write("\xff", 1);
+    };
+    mapFiles(partIn->getFSTRoot(), {});
+
+    recursiveMergeNodes(true, &partIn->getFSTRoot(), filesIn, {});
+    recursiveMergeNodes(false, &partIn->getFSTRoot(), filesIn, {});
+
+    /* Overrides identical to the source (e.g. a fully extracted tree) are treated as unchanged */
+    for (PlanQueueEntry& q : m_planQueue) {
+      if (q.m_file.m_node)
+        continue;
+      auto search = srcFiles.find(q.m_key);
+      if (search != srcFiles.cend() && SameFileContent(q.m_file.m_path, *search->second)) {
+        q.m_file.m_path.clear();
+        q.m_file.m_node = search->second;
+        q.m_file.m_dataSize = search->second->size();
+      }
+    }
 
-      /* Write FST */
-      cws->write(m_buildNodes.data(), m_buildNodes.size() * sizeof(FSTNode));
-      for (const std::string& str : m_buildNames)
-        cws->write(str.data(), str.size() + 1);
+    /* Unchanged files are claimed first so overrides know which extents are shared */
+    for (PlanQueueEntry& q : m_planQueue) {
+      if (!q.m_file.m_node)
+        continue;
+      q.m_file.m_offset = q.m_file.m_node->getDiscOffset();
+      q.m_file.m_size = q.m_file.m_dataSize;
+      used.claim(q.m_file.m_offset, q.m_file.m_size);
     }
 
-    /* Write new crypto content size */
-    uint64_t groupCount = m_curUser / 0x1F0000;
-    uint64_t cryptContentSize = (groupCount * 0x200000) >> uint64_t(2);
-    uint32_t cryptContentSizeBig = SBig(uint32_t(cryptContentSize));
-    ws = m_parent.getFileIO().beginWriteStream(m_baseOffset + 0x2BC);
-    if (!ws)
-      return -1;
-    ws->write(&cryptContentSizeBig, 0x4);
+    std::vector<PlanQueueEntry*> relocated;
+    for (PlanQueueEntry& q : m_planQueue) {
+      if (q.m_file.m_node)
+        continue;
+      q.m_file.m_size = ROUND_UP_32(q.m_file.m_dataSize);
+      auto search = srcFiles.find(q.m_key);
+      if (search != srcFiles.cend()) {
+        uint64_t off = search->second->getDiscOffset();
+        if (used.isFree(off, nod::max(search->second->size(), uint64_t(1))) &&
+            used.nextUsed(off, UINT64_MAX) >= off + q.m_file.m_size) {
+          q.m_file.m_offset = off;
+          used.claim(off, q.m_file.m_size);
+          continue;
+        }
+      }
+      relocated.push_back(&q);
+    }
 
-    /* Write new H3 */
-    ws = m_parent.getFileIO().beginWriteStream(m_baseOffset + h3Off);
+    /* The old FST extent is held back from relocated files so the FST can usually stay put */
+    ExtentMap fstUsed = used;
+    used.claim(partIn->m_fstOff, partIn->m_fstSz);
+    for (PlanQueueEntry* q : relocated) {
+      q->m_file.m_offset = used.allocate(q->m_file.m_size, 0x1FB450000);
+      if (q->m_file.m_offset == UINT64_MAX) {
+        spdlog::error("partition exceeds maximum single-partition capacity");
+        return false;
+      }
+      fstUsed.claim(q->m_file.m_offset, q->m_file.m_size);
+    }
+
+    for (PlanQueueEntry& q : m_planQueue) {
+      m_fileOffsetsSizes[q.m_key] = std::make_pair(q.m_file.m_offset, q.m_file.m_size);
+      m_plan.m_files.push_back(std::move(q.m_file));
+    }
+    m_planQueue.clear();
+
+    if (!recursiveMergeFST(&partIn->getFSTRoot(), filesIn, [&]() { m_buildNodes[0].incrementLength(); }, 0, {}))
+      return false;
+    finishPlanFST(partIn->getApploaderSize());
+
+    m_plan.m_fstOffset = partIn->m_fstOff;
+    if (fstUsed.isFree(m_plan.m_fstOffset, m_plan.m_fstSize))
+      fstUsed.claim(m_plan.m_fstOffset, m_plan.m_fstSize);
+    else
+      m_plan.m_fstOffset = fstUsed.allocate(m_plan.m_fstSize, 0x1FB450000);
+    if (m_plan.m_fstOffset == UINT64_MAX) {
+      spdlog::error("partition exceeds maximum single-partition capacity");
+      return false;
+    }
+
+    /* Source groups are all kept; the partition only grows when files land past its end */
+    uint64_t srcGroups = partIn->m_dataSz / 0x200000;
+    m_plan.m_groupCount = nod::max(srcGroups, (fstUsed.end() + 0x1F0000 - 1) / 0x1F0000);
+    m_plan.m_userStart = 0x1F0000;
+    m_plan.m_userEnd = m_plan.m_groupCount * 0x1F0000;
+    m_curUser = m_plan.m_userEnd;
+    m_plan.m_discSize = partIn->m_dataOff - partIn->getDiscOffset() + m_plan.m_groupCount * 0x200000;
+
+    /* Groups holding the boot header, the FST or any new file data must be rebuilt */
+    m_dirtyGroups.assign(m_plan.m_groupCount, false);
+    auto markDirty = [&](uint64_t off, uint64_t len) {
+      for (uint64_t g = off / 0x1F0000; g < (off + nod::max(len, uint64_t(1)) + 0x1F0000 - 1) / 0x1F0000; ++g)
+        m_dirtyGroups[g] = true;
+    };
+    markDirty(0, 0x440);
+    markDirty(m_plan.m_fstOffset, m_plan.m_fstSize);
+    for (const PartitionBuildPlan::File& f : m_plan.m_files)
+      if (!f.m_path.empty() && f.m_size)
+        markDirty(f.m_offset, f.m_size);
+    for (uint64_t g = srcGroups; g < m_plan.m_groupCount; ++g)
+      m_dirtyGroups[g] = true;
+    m_plan.m_dirtyGroups = std::count(m_dirtyGroups.begin(), m_dirtyGroups.end(), true);
+    return true;
+  }
+
+  bool writePreservedRange(uint64_t beginGroup, uint64_t endGroup, const std::vector<uint8_t>& fst,
+                           const uint8_t* srcH3, std::mutex& progressLock) {
+    const PartitionWii& partIn = static_cast<const PartitionWii&>(*m_plan.m_sourcePartition);
+    const uint64_t srcGroups = partIn.m_dataSz / 0x200000;
+    std::unique_ptr<IAES> aes = NewAES();
+    aes->setKey(m_titleKey);
+
+    std::unique_ptr<IReadStream> rs;
+    if (beginGroup < srcGroups) {
+      rs = partIn.m_parent.getDiscIO().beginReadStream(partIn.m_dataOff + beginGroup * 0x200000);
+      if (!rs)
+        return false;
+    }
+    std::unique_ptr<IFileIO::IWriteStream> ws =
+        m_parent.getFileIO().beginWriteStream(m_baseOffset + m_userOffset + beginGroup * 0x200000);
     if (!ws)
-      return -1;
-    ws->write(m_h3, 0x18000);
+      return false;
 
-    /* Compute content hash and replace in TMD */
-    sha1nfo sha;
-    sha1_init(&sha);
-    sha1_write(&sha, (char*)m_h3, 0x18000);
-    memmove(tmdData.get() + 0x1F4, sha1_result(&sha), 20);
+    std::unique_ptr<char[]> buf(new char[0x200000]);
+    for (uint64_t g = beginGroup; g < endGroup; ++g) {
+      if (g < srcGroups && rs->read(buf.get(), 0x200000) != 0x200000) {
+        spdlog::error("unable to read full disc group");
+        return false;
+      }
 
-    /* Same for content size */
-    uint64_t contentSize = groupCount * 0x1F0000;
-    uint64_t contentSizeBig = SBig(contentSize);
-    memmove(tmdData.get() + 0x1EC, &contentSizeBig, 8);
+      if (!m_dirtyGroups[g]) {
+        memmove(m_h3[g], srcH3 + g * 20, 20);
+      } else {
+        if (g < srcGroups) {
+          uint8_t decBuf[0x7c00];
+          for (int b = 0; b < 64; ++b) {
+            char* ptr0 = buf.get() + b * 0x8000;
+            aes->decrypt((uint8_t*)(ptr0 + 0x3D0), (uint8_t*)(ptr0 + 0x400), decBuf, 0x7c00);
+            memmove(ptr0 + 0x400, decBuf, 0x7c00);
+          }
+        } else {
+          memset(buf.get(), 0xff, 0x200000);
+        }
+
+        /* Copies partition bytes into the cleartext group, clipped to the group's range */
+        const uint64_t groupBegin = g * 0x1F0000;
+        const uint64_t groupEnd = groupBegin + 0x1F0000;
+        auto put = [&](uint64_t off, const uint8_t* data, uint64_t len) {
+          uint64_t lo = nod::max(off, groupBegin);
+          uint64_t hi = nod::min(off + len, groupEnd);
+          for (uint64_t pos = lo; pos < hi;) {
+            uint64_t inGroup = pos - groupBegin;
+            uint64_t blockRem = 0x7c00 - inGroup % 0x7c00;
+            uint64_t sz = nod::min(blockRem, hi - pos);
+            char* dst = buf.get() + inGroup / 0x7c00 * 0x8000 + 0x400 + inGroup % 0x7c00;
+            if (data)
+              memmove(dst, data + (pos - off), sz);
+            else
+              memset(dst, 0xff, sz);
+            pos += sz;
+          }
+        };
+
+        for (const PartitionBuildPlan::File& f : m_plan.m_files) {
+          if (f.m_path.empty() || f.m_offset + f.m_size <= groupBegin || f.m_offset >= groupEnd)
+            continue;
+          uint64_t lo = nod::max(f.m_offset, groupBegin);
+          uint64_t dataHi = nod::min(f.m_offset + f.m_dataSize, groupEnd);
+          if (dataHi > lo) {
+            uint64_t winLo, winHi;
+            planFileWindow(f, lo - f.m_offset, dataHi - f.m_offset, winLo, winHi);
+            std::unique_ptr<IReadStream> frs = openPlanFile(f, winLo);
+            if (!frs)
+              return false;
+            uint64_t rem = winHi - winLo;
+            size_t patchCount;
+            bool ok = copyPlanFile(
+                f, lo - f.m_offset, dataHi - f.m_offset,
+                [&](std::vector<uint8_t>& chunk) {
+                  chunk.resize(nod::min(rem, uint64_t(0x100000)));
+                  chunk.resize(frs->read(chunk.data(), chunk.size()));
+                  rem -= chunk.size();
+                  return true;
+                },
+                [&](uint64_t off, const uint8_t* data, size_t len) { put(f.m_offset + off, data, len); }, patchCount);
+            if (!ok)
+              return false;
+          }
+          put(f.m_offset + f.m_dataSize, nullptr, f.m_size - f.m_dataSize);
+        }
 
-    /* Zero-out TMD signature to simplify brute-force */
-    memset(tmdData.get() + 0x4, 0, 0x100);
+        put(m_plan.m_fstOffset, fst.data(), fst.size());
 
-    /* Brute-force zero-starting hash */
-    size_t tmdCheckSz = tmdSz - 0x140;
-    struct BFWindow {
-      uint64_t word[7];
-    }* bfWindow = (BFWindow*)(tmdData.get() + 0x19A);
-    bool good = false;
-    uint64_t attempts = 0;
-    std::string bfName("Brute force attempts");
-    for (int w = 0; w < 7; ++w) {
-      for (uint64_t i = 0; i < UINT64_MAX; ++i) {
-        bfWindow->word[w] = i;
-        sha1_init(&sha);
-        sha1_write(&sha, (char*)(tmdData.get() + 0x140), tmdCheckSz);
-        uint8_t* hash = sha1_result(&sha);
-        ++attempts;
-        if (hash[0] == 0) {
-          good = true;
-          break;
+        if (g == 0) {
+          /* Boot header fields are only touched when the FST has moved or outgrown its size */
+          uint32_t* fields = reinterpret_cast<uint32_t*>(buf.get() + 0x400 + 0x424);
+          if (m_plan.m_fstOffset != partIn.m_fstOff || m_plan.m_fstSize > partIn.m_fstSz) {
+            fields[0] = SBig(uint32_t(m_plan.m_fstOffset >> uint64_t(2)));
+            fields[1] = SBig(uint32_t(m_plan.m_fstSize));
+            fields[2] = SBig(uint32_t(m_plan.m_fstSize));
+          }
         }
-        m_parent.m_progressCB(m_parent.getProgressFactor(), bfName, attempts);
+
+        HashAndEncryptGroup(*aes, buf.get(), m_h3[g]);
       }
-      if (good)
-        break;
+
+      if (ws->write(buf.get(), 0x200000) != 0x200000) {
+        spdlog::error("unable to write full disc group");
+        return false;
+      }
+      std::lock_guard<std::mutex> lk(progressLock);
+      m_parent.m_progressCB(m_parent.getProgressFactor(), m_dirtyGroups[g] ? "Rebuilding group" : "Copying group", g);
+      ++m_parent.m_progressIdx;
     }
-    m_parent.m_progressCB(m_parent.getProgressFactor(), bfName, attempts);
-    ++m_parent.m_progressIdx;
+    return true;
+  }
 
-    ws = m_parent.getFileIO().beginWriteStream(m_baseOffset + 0x2C0);
-    if (!ws)
-      return -1;
-    ws->write(tmdData.get(), tmdSz);
+  bool writePreservedGroups() {
+    const PartitionWii& partIn = static_cast<const PartitionWii&>(*m_plan.m_sourcePartition);
+    std::unique_ptr<uint8_t[]> srcH3(new uint8_t[0x18000]);
+    std::unique_ptr<IReadStream> rs = partIn.m_parent.getDiscIO().beginReadStream(partIn.getDiscOffset() + partIn.m_h3Off);
+    if (!rs || rs->read(srcH3.get(), 0x18000) != 0x18000) {
+      spdlog::error("unable to read source H3 table");
+      return false;
+    }
 
-    return m_baseOffset + dataOff + groupCount * 0x200000;
+    std::vector<uint8_t> fst(m_plan.m_fstSize, 0);
+    size_t fstPos = m_buildNodes.size() * sizeof(FSTNode);
+    memmove(fst.data(), m_buildNodes.data(), fstPos);
+    for (const std::string& str : m_buildNames) {
+      memmove(fst.data() + fstPos, str.data(), str.size());
+      fstPos += str.size() + 1;
+    }
+
+    m_parent.m_progressTotal += m_plan.m_groupCount;
+
+    /* Groups are independent, so contiguous runs of them are handled concurrently */
+    size_t threadCount = writeThreadCount();
+    const uint64_t groups = m_plan.m_groupCount;
+    const size_t rangeCount = size_t(nod::max(uint64_t(1), nod::min(uint64_t(threadCount), groups)));
+    std::mutex progressLock;
+    if (rangeCount == 1)
+      return writePreservedRange(0, groups, fst, srcH3.get(), progressLock);
+
+    bool failed = false;
+    std::vector<std::thread> workers;
+    workers.reserve(rangeCount);
+    for (size_t r = 0; r < rangeCount; ++r) {
+      workers.emplace_back([&, r]() {
+        if (!writePreservedRange(groups * r / rangeCount, groups * (r + 1) / rangeCount, fst, srcH3.get(),
+                                 progressLock)) {
+          std::lock_guard<std::mutex> lk(progressLock);
+          failed = true;
+        }
+      });
+    }
+    for (std::thread& worker : workers)
+      worker.join();
+    return !failed;
   }
 
   uint64_t buildFromDirectory(std::string_view dirIn) {
@@ -1076,18 +1846,14 @@ public:
               spdlog::error("apploader flows into user area (one or the other is too big)");
               return false;
             }
-            m_parent.m_progressCB(m_parent.getProgressFactor(), apploaderIn, xferSz);
+            reportProgress(apploaderIn, xferSz);
           }
-          ++m_parent.m_progressIdx;
+          advanceProgress();
           return true;
-        },
-        [this, dirIn](IPartWriteStream& cws) -> bool {
-          return DiscBuilderBase::PartitionBuilderBase::buildFromDirectory(cws, dirIn);
-        },
-        apploaderStat.st_size);
+        });
   }
 
-  uint64_t mergeFromDirectory(const PartitionWii* partIn, std::string_view dirIn) {
+  uint64_t mergeFromDirectory(const PartitionWii* partIn) {
     size_t phSz;
     std::unique_ptr<uint8_t[]> phBuf = partIn->readPartitionHeaderBuf(phSz);
 
@@ -1134,54 +1900,59 @@ public:
             spdlog::error("apploader flows into user area (one or the other is too big)");
             return false;
           }
-          m_parent.m_progressCB(m_parent.getProgressFactor(), apploaderName, xferSz);
-          ++m_parent.m_progressIdx;
+          reportProgress(apploaderName, xferSz);
+          advanceProgress();
           return true;
-        },
-        [this, partIn, dirIn](IPartWriteStream& cws) -> bool {
-          return DiscBuilderBase::PartitionBuilderBase::mergeFromDirectory(cws, partIn, dirIn);
-        },
-        partIn->getApploaderSize());
+        });
   }
 };
 
+/* Partition builders in disc order; an update partition precedes the game data as on retail discs */
+static std::vector<PartitionBuilderWii*>
+PartitionsInDiscOrder(const std::vector<std::unique_ptr<DiscBuilderBase::PartitionBuilderBase>>& partitions) {
+  std::vector<PartitionBuilderWii*> ret;
+  for (PartitionKind kind : {PartitionKind::Update, PartitionKind::Data, PartitionKind::Channel})
+    for (const auto& part : partitions)
+      if (part->getKind() == kind)
+        ret.push_back(static_cast<PartitionBuilderWii*>(part.get()));
+  return ret;
+}
+
 EBuildResult DiscBuilderWii::buildFromDirectory(std::string_view dirIn) {
   std::string dirStr(dirIn);
   std::string basePath = std::string(dirStr) + "/" + getKindString(PartitionKind::Data);
 
-  PartitionBuilderWii& pb = static_cast<PartitionBuilderWii&>(*m_partitions[0]);
-  uint64_t filledSz = pb.m_baseOffset;
-  if (!m_fileIO->beginWriteStream())
+  if (!planFromDirectory(dirIn))
+    return EBuildResult::Failed;
+  if (m_partitionsEnd >= uint64_t(m_discCapacity)) {
+    spdlog::error("partitions exceed disc capacity");
     return EBuildResult::Failed;
-
-  if (!CheckFreeSpace(m_outPath.c_str(), m_discCapacity)) {
-    spdlog::error("not enough free disk space for {}", m_outPath);
-    return EBuildResult::DiskFull;
-  }
-  m_progressCB(getProgressFactor(), "Preallocating image", -1);
-  ++m_progressIdx;
-  {
-    std::unique_ptr<IFileIO::IWriteStream> ws = m_fileIO->beginWriteStream(0);
-    if (!ws)
-      return EBuildResult::Failed;
-    char zeroBytes[1024] = {};
-    for (int64_t i = 0; i < m_discCapacity; i += 1024)
-      ws->write(zeroBytes, 1024);
   }
+  const std::vector<PartitionBuilderWii*> parts = PartitionsInDiscOrder(m_partitions);
 
-  /* Assemble image */
-  filledSz = pb.buildFromDirectory(dirIn);
-  if (filledSz == UINT64_MAX)
-    return EBuildResult::Failed;
-  else if (filledSz >= uint64_t(m_discCapacity)) {
-    spdlog::error("data partition exceeds disc capacity");
+  if ((isStreaming() || isSparseOutput()) && !m_groupCachePath.empty()) {
+    spdlog::error("incremental builds need a seekable raw output image");
     return EBuildResult::Failed;
   }
 
-  m_progressCB(getProgressFactor(), "Finishing Disc", -1);
+  uint64_t filledSz = parts.front()->m_baseOffset;
+  uint64_t prevFilledSz = 0;
+  const bool inPlace = loadGroupCache(prevFilledSz);
+  if (!inPlace) {
+    if (!m_fileIO->beginWriteStream())
+      return EBuildResult::Failed;
+
+    if (!isStreaming() && !isSparseOutput() && !CheckFreeSpace(m_outPath.c_str(), m_discCapacity)) {
+      spdlog::error("not enough free disk space for {}", m_outPath);
+      return EBuildResult::DiskFull;
+    }
+  }
+  m_progressCB(getProgressFactor(), "Preallocating image", -1);
   ++m_progressIdx;
+  if (!inPlace && !preallocateOutput())
+    return EBuildResult::Failed;
 
-  /* Populate disc header */
+  /* Populate disc header; everything ahead of the partition goes out first */
   std::unique_ptr<IFileIO::IWriteStream> ws = m_fileIO->beginWriteStream(0);
   if (!ws)
     return EBuildResult::Failed;
@@ -1197,14 +1968,17 @@ EBuildResult DiscBuilderWii::buildFromDirectory(std::string_view dirIn) {
   ws = m_fileIO->beginWriteStream(0x40000);
   if (!ws)
     return EBuildResult::Failed;
-  uint32_t vals[2] = {SBig(uint32_t(1)), SBig(uint32_t(0x40020 >> uint64_t(2)))};
+  uint32_t vals[2] = {SBig(uint32_t(parts.size())), SBig(uint32_t(0x40020 >> uint64_t(2)))};
   ws->write(vals, 8);
 
   ws = m_fileIO->beginWriteStream(0x40020);
   if (!ws)
     return EBuildResult::Failed;
-  vals[0] = SBig(uint32_t(pb.m_baseOffset >> uint64_t(2)));
-  ws->write(vals, 4);
+  for (const PartitionBuilderWii* part : parts) {
+    vals[0] = SBig(uint32_t(part->m_baseOffset >> uint64_t(2)));
+    vals[1] = SBig(uint32_t(part->getKind()));
+    ws->write(vals, 8);
+  }
 
   /* Populate region info */
   std::string regionPath = basePath + "/disc/region.bin";
@@ -1217,43 +1991,127 @@ EBuildResult DiscBuilderWii::buildFromDirectory(std::string_view dirIn) {
   if (!ws)
     return EBuildResult::Failed;
   ws->write(regionBuf, 0x20);
+  ws.reset();
+
+  /* Assemble image; partitions hash, encrypt and sign independently, so they build concurrently
+   * unless the output has to be produced front to back */
+  std::vector<uint64_t> partEnds(parts.size(), UINT64_MAX);
+  if (isStreaming() || parts.size() == 1) {
+    for (size_t p = 0; p < parts.size(); ++p)
+      if ((partEnds[p] = parts[p]->buildFromDirectory(dirIn)) == UINT64_MAX)
+        return EBuildResult::Failed;
+  } else {
+    std::vector<std::thread> workers;
+    workers.reserve(parts.size());
+    for (size_t p = 0; p < parts.size(); ++p)
+      workers.emplace_back([&, p]() { partEnds[p] = parts[p]->buildFromDirectory(dirIn); });
+    for (std::thread& worker : workers)
+      worker.join();
+    if (std::find(partEnds.begin(), partEnds.end(), UINT64_MAX) != partEnds.end())
+      return EBuildResult::Failed;
+  }
+  filledSz = partEnds.back();
+
+  m_progressCB(getProgressFactor(), "Finishing Disc", -1);
+  ++m_progressIdx;
 
-  /* Fill image to end */
+  /* Fill image to end (or just over the previous image's content when updating in place).
+   * Sparse outputs leave the fill out; the skipped blocks are simply not stored. */
+  uint64_t fillEnd = inPlace ? std::max(prevFilledSz, filledSz) : m_discCapacity;
   ws = m_fileIO->beginWriteStream(filledSz);
-  if (!ws)
+  if (!ws || !ws->skipUnused(fillEnd - filledSz, 0xff))
+    return EBuildResult::Failed;
+  ws.reset();
+  if (!m_fileIO->finish())
     return EBuildResult::Failed;
-  uint8_t fillBuf[512];
-  memset(fillBuf, 0xff, 512);
-  for (size_t i = m_discCapacity - filledSz; i > 0;) {
-    if (i >= 512) {
-      ws->write(fillBuf, 512);
-      i -= 512;
-      continue;
-    }
-    ws->write(fillBuf, i);
-    break;
-  }
 
+  storeGroupCache(filledSz);
   return EBuildResult::Success;
 }
 
-std::optional<uint64_t> DiscBuilderWii::CalculateTotalSizeRequired(std::string_view dirIn, bool& dualLayer) {
-  std::optional<uint64_t> sz = DiscBuilderBase::PartitionBuilderBase::CalculateTotalSizeBuild(dirIn, PartitionKind::Data, true);
-  if (!sz)
-    return sz;  
-  auto szDiv = nod::div(*sz, uint64_t(0x1F0000));
-  if (szDiv.rem)
-    ++szDiv.quot;
-  sz = szDiv.quot * 0x200000;
-  *sz += 0x200000;
+const PartitionBuildPlan* DiscBuilderWii::planFromDirectory(std::string_view dirIn) {
+  /* DATA is always built; UPDATE and CHANNEL partitions are added when the fsroot has their directories */
+  m_partitions.resize(1);
+  for (PartitionKind kind : {PartitionKind::Update, PartitionKind::Channel}) {
+    std::string partDir = std::string(dirIn) + "/" + getKindString(kind);
+    Sstat theStat;
+    if (!Stat(partDir.c_str(), &theStat) && S_ISDIR(theStat.st_mode))
+      m_partitions.push_back(std::make_unique<PartitionBuilderWii>(*this, kind, 0));
+  }
+
+  /* Every partition is laid out before anything is written, then placed back to back */
+  uint64_t offset = 0x200000;
+  for (PartitionBuilderWii* part : PartitionsInDiscOrder(m_partitions)) {
+    if (!part->planFromDirectory(dirIn))
+      return nullptr;
+    part->m_baseOffset = offset;
+    offset += part->getPlan().m_discSize;
+  }
+  m_partitionsEnd = offset;
+  return &m_partitions[0]->getPlan();
+}
+
+static std::optional<uint64_t> CalculateTotalSizeWii(uint64_t sz, bool& dualLayer) {
   dualLayer = (sz > UINT64_C(0x118240000));
   if (sz > UINT64_C(0x1FB4E0000)) {
-    spdlog::error("disc capacity exceeded [{} / {}]", *sz, 0x1FB4E0000);
+    spdlog::error("disc capacity exceeded [{} / {}]", sz, 0x1FB4E0000);
     return std::nullopt;
   }
   return sz;
 }
 
+std::optional<uint64_t> DiscBuilderWii::calculateTotalSizeRequired(std::string_view dirIn, bool& dualLayer) {
+  if (!planFromDirectory(dirIn))
+    return std::nullopt;
+  return CalculateTotalSizeWii(m_partitionsEnd, dualLayer);
+}
+
+std::optional<uint64_t> DiscBuilderWii::CalculateTotalSizeRequired(std::string_view dirIn, bool& dualLayer) {
+  return DiscBuilderWii({}, true, FProgress{}).calculateTotalSizeRequired(dirIn, dualLayer);
+}
+
+bool DiscBuilderWii::loadGroupCache(uint64_t& prevFilledSz) {
+  for (const auto& part : m_partitions) {
+    PartitionBuilderWii& pb = static_cast<PartitionBuilderWii&>(*part);
+    pb.m_incremental = !m_groupCachePath.empty();
+    pb.m_prevGroups = {};
+  }
+  if (m_groupCachePath.empty())
+    return false;
+
+  /* The previous image must still be present at full size, untouched since the cache was written,
+   * for its groups to be reused */
+  GroupCache cache;
+  uint64_t imageSize, imageMtime;
+  bool valid = cache.read(m_groupCachePath) && GroupCache::Fingerprint(m_outPath, imageSize, imageMtime) &&
+               imageSize == uint64_t(m_discCapacity) && cache.imageSize == imageSize && cache.imageMtime == imageMtime;
+  GroupCache::Clear(m_groupCachePath);
+  if (!valid)
+    return false;
+
+  /* Entries are matched to partitions by position; a moved or re-keyed partition discards its own */
+  for (size_t p = 0; p < m_partitions.size() && p < cache.partitions.size(); ++p)
+    static_cast<PartitionBuilderWii&>(*m_partitions[p]).m_prevGroups = std::move(cache.partitions[p]);
+  prevFilledSz = cache.filledSize;
+  return true;
+}
+
+void DiscBuilderWii::storeGroupCache(uint64_t filledSz) {
+  if (m_groupCachePath.empty())
+    return;
+
+  GroupCache cache;
+  if (!GroupCache::Fingerprint(m_outPath, cache.imageSize, cache.imageMtime)) {
+    spdlog::warn("unable to stat '{}'; not writing group cache", m_outPath);
+    return;
+  }
+  cache.filledSize = filledSz;
+  for (const auto& part : m_partitions)
+    cache.partitions.push_back(std::move(static_cast<PartitionBuilderWii&>(*part).m_curGroups));
+  if (!cache.write(m_groupCachePath))
+    spdlog::warn("unable to write group cache '{}'", m_groupCachePath);
+}
+
 DiscBuilderWii::DiscBuilderWii(std::string_view outPath, bool dualLayer, FProgress progressCB)
 : DiscBuilderBase(outPath, dualLayer ? 0x1FB4E0000 : 0x118240000, progressCB) {
   m_partitions.emplace_back(std::make_unique<PartitionBuilderWii>(*this, PartitionKind::Data, 0x200000));
@@ -1262,40 +2120,55 @@ DiscBuilderWii::DiscBuilderWii(std::string_view outPath, bool dualLayer, FProgre
 DiscMergerWii::DiscMergerWii(std::string_view outPath, DiscWii& sourceDisc, bool dualLayer, FProgress progressCB)
 : m_sourceDisc(sourceDisc), m_builder(sourceDisc.makeMergeBuilder(outPath, dualLayer, progressCB)) {}
 
+void DiscMergerWii::setPreserveLayout(bool preserve) {
+  static_cast<PartitionBuilderWii&>(*m_builder.m_partitions[0]).m_preserveLayout = preserve;
+}
+
+const PartitionBuildPlan* DiscMergerWii::planFromDirectory(std::string_view dirIn) {
+  PartitionBuilderWii& pb = static_cast<PartitionBuilderWii&>(*m_builder.m_partitions[0]);
+  return pb.planFromMerge(static_cast<PartitionWii*>(m_sourceDisc.getDataPartition()), dirIn) ? &pb.getPlan()
+                                                                                              : nullptr;
+}
+
 EBuildResult DiscMergerWii::mergeFromDirectory(std::string_view dirIn) {
   PartitionBuilderWii& pb = static_cast<PartitionBuilderWii&>(*m_builder.m_partitions[0]);
-  uint64_t filledSz = pb.m_baseOffset;
-  if (!m_builder.m_fileIO->beginWriteStream())
+  if (!planFromDirectory(dirIn))
+    return EBuildResult::Failed;
+  if (pb.m_baseOffset + pb.getPlan().m_discSize >= uint64_t(m_builder.m_discCapacity)) {
+    spdlog::error("data partition exceeds disc capacity");
     return EBuildResult::Failed;
-
-  if (!CheckFreeSpace(m_builder.m_outPath.c_str(), m_builder.m_discCapacity)) {
-    spdlog::error("not enough free disk space for {}", m_builder.m_outPath);
-    return EBuildResult::DiskFull;
-  }
-  m_builder.m_progressCB(m_builder.getProgressFactor(), "Preallocating image", -1);
-  ++m_builder.m_progressIdx;
-  {
-    std::unique_ptr<IFileIO::IWriteStream> ws = m_builder.m_fileIO->beginWriteStream(0);
-    if (!ws)
-      return EBuildResult::Failed;
-    char zeroBytes[1024] = {};
-    for (int64_t i = 0; i < m_builder.m_discCapacity; i += 1024)
-      ws->write(zeroBytes, 1024);
   }
 
-  /* Assemble image */
-  filledSz = pb.mergeFromDirectory(static_cast<PartitionWii*>(m_sourceDisc.getDataPartition()), dirIn);
-  if (filledSz == UINT64_MAX)
+  const bool streaming = m_builder.isStreaming();
+  if (streaming && (pb.m_preserveLayout || !m_builder.m_groupCachePath.empty())) {
+    spdlog::error("incremental and layout-preserving merges need a seekable output image");
     return EBuildResult::Failed;
-  else if (filledSz >= uint64_t(m_builder.m_discCapacity)) {
-    spdlog::error("data partition exceeds disc capacity");
+  }
+  if (m_builder.isSparseOutput() && !m_builder.m_groupCachePath.empty()) {
+    spdlog::error("incremental merges need a raw output image");
     return EBuildResult::Failed;
   }
 
-  m_builder.m_progressCB(m_builder.getProgressFactor(), "Finishing Disc", -1);
+  uint64_t filledSz = pb.m_baseOffset;
+  uint64_t prevFilledSz = 0;
+  /* Preserved layouts already avoid re-encrypting unchanged groups; the group cache does not apply */
+  const bool inPlace = !pb.m_preserveLayout && m_builder.loadGroupCache(prevFilledSz);
+  if (!inPlace) {
+    if (!m_builder.m_fileIO->beginWriteStream())
+      return EBuildResult::Failed;
+
+    if (!streaming && !m_builder.isSparseOutput() &&
+        !CheckFreeSpace(m_builder.m_outPath.c_str(), m_builder.m_discCapacity)) {
+      spdlog::error("not enough free disk space for {}", m_builder.m_outPath);
+      return EBuildResult::DiskFull;
+    }
+  }
+  m_builder.m_progressCB(m_builder.getProgressFactor(), "Preallocating image", -1);
   ++m_builder.m_progressIdx;
+  if (!inPlace && !m_builder.preallocateOutput())
+    return EBuildResult::Failed;
 
-  /* Populate disc header */
+  /* Populate disc header; everything ahead of the partition goes out first */
   std::unique_ptr<IFileIO::IWriteStream> ws = m_builder.m_fileIO->beginWriteStream(0);
   if (!ws)
     return EBuildResult::Failed;
@@ -1324,41 +2197,40 @@ EBuildResult DiscMergerWii::mergeFromDirectory(std::string_view dirIn) {
   if (!ws)
     return EBuildResult::Failed;
   ws->write(regionBuf, 0x20);
+  ws.reset();
+
+  /* Assemble image */
+  filledSz = pb.mergeFromDirectory(static_cast<PartitionWii*>(m_sourceDisc.getDataPartition()));
+  if (filledSz == UINT64_MAX)
+    return EBuildResult::Failed;
 
-  /* Fill image to end */
+  m_builder.m_progressCB(m_builder.getProgressFactor(), "Finishing Disc", -1);
+  ++m_builder.m_progressIdx;
+
+  /* Fill image to end (or just over the previous image's content when updating in place).
+   * Sparse outputs leave the fill out; the skipped blocks are simply not stored. */
+  uint64_t fillEnd = inPlace ? std::max(prevFilledSz, filledSz) : m_builder.m_discCapacity;
   ws = m_builder.m_fileIO->beginWriteStream(filledSz);
-  if (!ws)
+  if (!ws || !ws->skipUnused(fillEnd - filledSz, 0xff))
+    return EBuildResult::Failed;
+  ws.reset();
+  if (!m_builder.m_fileIO->finish())
     return EBuildResult::Failed;
-  uint8_t fillBuf[512];
-  memset(fillBuf, 0xff, 512);
-  for (size_t i = m_builder.m_discCapacity - filledSz; i > 0;) {
-    if (i >= 512) {
-      ws->write(fillBuf, 512);
-      i -= 512;
-      continue;
-    }
-    ws->write(fillBuf, i);
-    break;
-  }
 
+  m_builder.storeGroupCache(filledSz);
   return EBuildResult::Success;
 }
 
-std::optional<uint64_t> DiscMergerWii::CalculateTotalSizeRequired(DiscWii& sourceDisc, std::string_view dirIn, bool& dualLayer) {
-  std::optional<uint64_t> sz = DiscBuilderBase::PartitionBuilderBase::CalculateTotalSizeMerge(sourceDisc.getDataPartition(), dirIn);
-  if (!sz)
+std::optional<uint64_t> DiscMergerWii::calculateTotalSizeRequired(std::string_view dirIn, bool& dualLayer) {
+  const PartitionBuildPlan* plan = planFromDirectory(dirIn);
+  if (!plan)
     return std::nullopt;
-  auto szDiv = nod::div(*sz, uint64_t(0x1F0000));
-  if (szDiv.rem)
-    ++szDiv.quot;
-  sz = szDiv.quot * 0x200000;
-  *sz += 0x200000;
-  dualLayer = (sz > UINT64_C(0x118240000));
-  if (sz > UINT64_C(0x1FB4E0000)) {
-    spdlog::error("disc capacity exceeded [{} / {}]", *sz, 0x1FB4E0000);
-    return std::nullopt;
-  }
-  return sz;
+  return CalculateTotalSizeWii(0x200000 + plan->m_discSize, dualLayer);
+}
+
+std::optional<uint64_t> DiscMergerWii::CalculateTotalSizeRequired(DiscWii& sourceDisc, std::string_view dirIn,
+                                                                  bool& dualLayer) {
+  return DiscMergerWii({}, sourceDisc, true, FProgress{}).calculateTotalSizeRequired(dirIn, dualLayer);
 }
 
 } // namespace nod
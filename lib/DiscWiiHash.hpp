@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nod {
+class IAES;
+
+/* Fills in the H0-H2 hash areas of a cleartext group (data at +0x400 of each 0x8000 block)
+ * and reports the group's H3 entry */
+void HashGroup(char* buf, uint8_t h3Out[20]);
+
+/* Encrypts the first blockCount blocks of a hashed group in place */
+void EncryptGroup(IAES& aes, char* buf, size_t blockCount = 64);
+
+} // namespace nod
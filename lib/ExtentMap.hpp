@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+
+namespace nod {
+
+/**
+ * @brief Tracks occupied byte ranges of a partition to find room for files
+ *
+ * Claimed ranges are kept as a sorted set of disjoint [begin, end) intervals;
+ * overlapping claims (files sharing an extent) simply merge.
+ */
+class ExtentMap {
+  std::map<uint64_t, uint64_t> m_used;
+
+public:
+  void claim(uint64_t off, uint64_t len) {
+    if (!len)
+      return;
+    uint64_t end = off + len;
+    auto it = m_used.upper_bound(off);
+    if (it != m_used.begin() && std::prev(it)->second >= off)
+      --it;
+    while (it != m_used.end() && it->first <= end) {
+      off = std::min(off, it->first);
+      end = std::max(end, it->second);
+      it = m_used.erase(it);
+    }
+    m_used.emplace(off, end);
+  }
+
+  bool isFree(uint64_t off, uint64_t len) const {
+    auto it = m_used.upper_bound(off);
+    if (it != m_used.begin() && std::prev(it)->second > off)
+      return false;
+    return it == m_used.end() || it->first >= off + len;
+  }
+
+  /* Start of the first claimed range above a free offset, or limit if there is none */
+  uint64_t nextUsed(uint64_t off, uint64_t limit) const {
+    auto it = m_used.upper_bound(off);
+    return it != m_used.end() ? std::min(it->first, limit) : limit;
+  }
+
+  /* End of the highest claimed range */
+  uint64_t end() const { return m_used.empty() ? 0 : m_used.rbegin()->second; }
+
+  /* Claims the first 32-byte aligned gap of len bytes ending at or below limit.
+   * Returns UINT64_MAX when no gap is large enough. */
+  uint64_t allocate(uint64_t len, uint64_t limit) {
+    uint64_t cursor = 0;
+    for (const auto& ext : m_used) {
+      uint64_t start = (cursor + 31) & ~uint64_t(31);
+      if (ext.first >= start + len && start + len <= limit) {
+        claim(start, len);
+        return start;
+      }
+      cursor = std::max(cursor, ext.second);
+    }
+    uint64_t start = (cursor + 31) & ~uint64_t(31);
+    if (start + len > limit)
+      return UINT64_MAX;
+    claim(start, len);
+    return start;
+  }
+};
+
+} // namespace nod
@@ -3,6 +3,11 @@
 #include <cstdint>
 #include <cstdlib>
 
+#if __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "nod/IFileIO.hpp"
 #include "Util.hpp"
 
@@ -60,7 +65,10 @@ public:
       spdlog::error("unable to open '{}' for writing", path);
       err = true;
     }
-    ~WriteStream() override { fclose(fp); }
+    ~WriteStream() override {
+      if (fp)
+        fclose(fp);
+    }
     uint64_t write(const void* buf, uint64_t length) override {
       if (m_maxWriteSize >= 0) {
         if (FTell(fp) + length > m_maxWriteSize) {
@@ -70,8 +78,43 @@ public:
       }
       return fwrite(buf, 1, length, fp);
     }
+    bool seek(uint64_t offset) override { return FSeek(fp, offset, SEEK_SET) == 0; }
+#if __linux__
+    bool preallocate(uint64_t length) override {
+      if (fflush(fp))
+        return false;
+      return posix_fallocate(fileno(fp), FTell(fp), length) == 0;
+    }
+    uint64_t copyFromFile(std::string_view srcPath, uint64_t srcOffset, uint64_t length) override {
+      int64_t dstOffset = FTell(fp);
+      if (dstOffset < 0 || (m_maxWriteSize >= 0 && uint64_t(dstOffset) + length > uint64_t(m_maxWriteSize)))
+        return 0;
+      if (fflush(fp))
+        return 0;
+      int src = open(std::string(srcPath).c_str(), O_RDONLY | O_CLOEXEC);
+      if (src < 0)
+        return 0;
+      /* btrfs and XFS turn block-aligned spans into reflinks; other filesystems copy in the page cache */
+      uint64_t copied = 0;
+      while (copied < length) {
+        loff_t inOff = srcOffset + copied;
+        loff_t outOff = dstOffset + copied;
+        ssize_t ret = copy_file_range(src, &inOff, fileno(fp), &outOff, length - copied, 0);
+        if (ret <= 0)
+          break;
+        copied += ret;
+      }
+      close(src);
+      FSeek(fp, dstOffset + copied, SEEK_SET);
+      return copied;
+    }
+#endif
   };
 
+#if __linux__
+  bool supportsCopyFromFile() const override { return true; }
+#endif
+
   std::unique_ptr<IWriteStream> beginWriteStream() const override {
     bool err = false;
     auto ret = std::unique_ptr<IWriteStream>(new WriteStream(m_path, m_maxWriteSize, err));
@@ -106,7 +149,10 @@ public:
         return;
       FSeek(fp, offset, SEEK_SET);
     }
-    ~ReadStream() override { fclose(fp); }
+    ~ReadStream() override {
+      if (fp)
+        fclose(fp);
+    }
     void seek(int64_t offset, int whence) override { FSeek(fp, offset, whence); }
     uint64_t position() const override { return FTell(fp); }
     uint64_t read(void* buf, uint64_t length) override { return fread(buf, 1, length, fp); }
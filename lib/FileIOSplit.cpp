@@ -0,0 +1,251 @@
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nod/IFileIO.hpp"
+#include "Util.hpp"
+
+#include <spdlog/spdlog.h>
+
+namespace nod {
+
+/*
+ * Split images keep a disc in equally sized pieces so each stays under FAT32's 4 GiB limit;
+ * only the last piece may be shorter. Two naming schemes are in common use:
+ * "game.part0.iso", "game.part1.iso", ... and "game.wbfs", "game.wbf1", "game.wbf2", ...
+ */
+
+std::string SplitPiecePath(std::string_view firstPath, size_t idx) {
+  constexpr std::string_view partIso = ".part0.iso";
+  constexpr std::string_view wbfs = ".wbfs";
+  if (firstPath.size() > partIso.size() && firstPath.substr(firstPath.size() - partIso.size()) == partIso)
+    return fmt::format("{}.part{}.iso", firstPath.substr(0, firstPath.size() - partIso.size()), idx);
+  if (firstPath.size() > wbfs.size() && firstPath.substr(firstPath.size() - wbfs.size()) == wbfs) {
+    if (idx == 0)
+      return std::string(firstPath);
+    return fmt::format("{}.wbf{}", firstPath.substr(0, firstPath.size() - wbfs.size()), idx);
+  }
+  return {};
+}
+
+class FileIOSplit : public IFileIO {
+  std::string m_firstPath;
+  /* Every piece but the last holds exactly this many bytes, so an offset maps to its piece by
+   * division; UINT64_MAX while a read-only set has a single piece */
+  uint64_t m_pieceSize;
+  int64_t m_maxWriteSize;
+
+  mutable std::mutex m_extendLock;
+
+  std::unique_ptr<IFileIO> piece(size_t idx) const { return NewFileIO(SplitPiecePath(m_firstPath, idx)); }
+
+  /* Pieces ahead of one being written are padded to full size, so readers find a consistent set
+   * even when the data before a piece boundary has not all been written yet */
+  std::unique_ptr<IFileIO::IWriteStream> beginPieceWrite(size_t idx, uint64_t offset) const {
+    std::lock_guard<std::mutex> lk(m_extendLock);
+    for (size_t i = 0; i < idx; ++i) {
+      std::unique_ptr<IFileIO> prev = piece(i);
+      if (prev->exists() && prev->size() >= m_pieceSize)
+        continue;
+      std::unique_ptr<IFileIO::IWriteStream> ws = prev->beginWriteStream(m_pieceSize - 1);
+      const uint8_t zero = 0;
+      if (!ws || ws->write(&zero, 1) != 1)
+        return {};
+    }
+    return piece(idx)->beginWriteStream(offset);
+  }
+
+public:
+  FileIOSplit(std::string_view firstPath, uint64_t pieceSize, int64_t maxWriteSize, bool& err)
+  : m_firstPath(firstPath), m_pieceSize(pieceSize), m_maxWriteSize(maxWriteSize) {
+    if (SplitPiecePath(firstPath, 0).empty()) {
+      spdlog::error("'{}' must end in '.part0.iso' or '.wbfs' to be split", firstPath);
+      err = true;
+      return;
+    }
+    if (m_pieceSize)
+      return;
+
+    /* Reading: the first piece sets the size every piece before the last must match */
+    std::unique_ptr<IFileIO> next = piece(1);
+    if (!next->exists()) {
+      m_pieceSize = UINT64_MAX;
+      return;
+    }
+    m_pieceSize = piece(0)->size();
+    for (size_t i = 1; next->exists(); next = piece(++i)) {
+      uint64_t sz = piece(i - 1)->size();
+      if (sz != m_pieceSize || !sz) {
+        spdlog::error("'{}' is 0x{:X} bytes; every split piece before the last must be 0x{:X}",
+                      SplitPiecePath(m_firstPath, i - 1), sz, m_pieceSize);
+        err = true;
+        return;
+      }
+    }
+  }
+
+  bool exists() override { return piece(0)->exists(); }
+
+  uint64_t size() override {
+    uint64_t total = 0;
+    for (size_t i = 0;; ++i) {
+      std::unique_ptr<IFileIO> fio = piece(i);
+      if (!fio->exists())
+        return total;
+      total += fio->size();
+    }
+  }
+
+  struct WriteStream : public IFileIO::IWriteStream {
+    const FileIOSplit& m_parent;
+    uint64_t m_offset;
+    size_t m_idx = SIZE_MAX;
+    std::unique_ptr<IFileIO::IWriteStream> m_ws;
+
+    WriteStream(const FileIOSplit& parent, uint64_t offset) : m_parent(parent), m_offset(offset) {}
+
+    uint64_t write(const void* buf, uint64_t length) override {
+      if (m_parent.m_maxWriteSize >= 0 && m_offset + length > uint64_t(m_parent.m_maxWriteSize)) {
+        spdlog::error("write operation exceeds file's {}-byte limit", m_parent.m_maxWriteSize);
+        return 0;
+      }
+      const uint8_t* src = (const uint8_t*)buf;
+      while (length) {
+        auto pieceAndOff = nod::div(m_offset, m_parent.m_pieceSize);
+        if (pieceAndOff.quot != m_idx) {
+          m_ws = m_parent.beginPieceWrite(pieceAndOff.quot, pieceAndOff.rem);
+          m_idx = m_ws ? size_t(pieceAndOff.quot) : SIZE_MAX;
+          if (!m_ws)
+            break;
+        }
+        uint64_t thisSz = nod::min(length, m_parent.m_pieceSize - pieceAndOff.rem);
+        uint64_t done = m_ws->write(src, thisSz);
+        src += done;
+        length -= done;
+        m_offset += done;
+        if (done != thisSz)
+          break;
+      }
+      return src - (const uint8_t*)buf;
+    }
+
+    bool seek(uint64_t offset) override {
+      auto pieceAndOff = nod::div(offset, m_parent.m_pieceSize);
+      if (pieceAndOff.quot == m_idx && !m_ws->seek(pieceAndOff.rem))
+        return false;
+      m_offset = offset;
+      return true;
+    }
+  };
+
+  std::unique_ptr<IWriteStream> beginWriteStream() const override {
+    /* A fresh image starts from an empty first piece; stale pieces of an older, longer image go */
+    if (!piece(0)->beginWriteStream())
+      return {};
+    for (size_t i = 1;; ++i) {
+      std::string path = SplitPiecePath(m_firstPath, i);
+      if (!NewFileIO(path)->exists())
+        break;
+      Unlink(path.c_str());
+    }
+    return std::make_unique<WriteStream>(*this, 0);
+  }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override {
+    return std::make_unique<WriteStream>(*this, offset);
+  }
+
+  struct ReadStream : public IFileIO::IReadStream {
+    const FileIOSplit& m_parent;
+    uint64_t m_offset;
+    size_t m_idx = SIZE_MAX;
+    std::unique_ptr<IFileIO::IReadStream> m_rs;
+
+    ReadStream(const FileIOSplit& parent, uint64_t offset) : m_parent(parent), m_offset(offset) {}
+
+    void seek(int64_t offset, int whence) override {
+      if (whence == SEEK_SET)
+        m_offset = offset;
+      else if (whence == SEEK_CUR)
+        m_offset += offset;
+      else
+        return;
+      auto pieceAndOff = nod::div(m_offset, m_parent.m_pieceSize);
+      if (pieceAndOff.quot == m_idx)
+        m_rs->seek(pieceAndOff.rem, SEEK_SET);
+    }
+    uint64_t position() const override { return m_offset; }
+
+    uint64_t read(void* buf, uint64_t length) override {
+      uint8_t* dst = (uint8_t*)buf;
+      while (length) {
+        auto pieceAndOff = nod::div(m_offset, m_parent.m_pieceSize);
+        if (pieceAndOff.quot != m_idx) {
+          std::unique_ptr<IFileIO> fio = m_parent.piece(pieceAndOff.quot);
+          m_rs = fio->exists() ? fio->beginReadStream(pieceAndOff.rem) : nullptr;
+          m_idx = m_rs ? size_t(pieceAndOff.quot) : SIZE_MAX;
+          if (!m_rs)
+            break;
+        }
+        uint64_t thisSz = nod::min(length, m_parent.m_pieceSize - pieceAndOff.rem);
+        uint64_t done = m_rs->read(dst, thisSz);
+        dst += done;
+        length -= done;
+        m_offset += done;
+        if (done != thisSz)
+          break;
+      }
+      return dst - (uint8_t*)buf;
+    }
+
+    uint64_t copyToDisc(IPartWriteStream& discio, uint64_t length) override {
+      uint64_t written = 0;
+      uint8_t buf[0x7c00];
+      while (length) {
+        uint64_t thisSz = nod::min(uint64_t(0x7c00), length);
+        if (read(buf, thisSz) != thisSz) {
+          spdlog::error("unable to read enough from file");
+          return written;
+        }
+        if (discio.write(buf, thisSz) != thisSz) {
+          spdlog::error("unable to write enough to disc");
+          return written;
+        }
+        length -= thisSz;
+        written += thisSz;
+      }
+      return written;
+    }
+  };
+
+  std::unique_ptr<IReadStream> beginReadStream() const override { return beginReadStream(0); }
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override {
+    if (!piece(0)->exists()) {
+      spdlog::error("unable to open '{}' for reading", m_firstPath);
+      return {};
+    }
+    return std::make_unique<ReadStream>(*this, offset);
+  }
+};
+
+std::unique_ptr<IFileIO> NewSplitFileIO(std::string_view firstPath, uint64_t pieceSize, int64_t maxWriteSize) {
+  bool err = false;
+  auto ret = std::make_unique<FileIOSplit>(firstPath, pieceSize, maxWriteSize, err);
+  if (err)
+    return {};
+  return ret;
+}
+
+std::unique_ptr<IFileIO> NewImageFileIO(std::string_view path) {
+  std::string second = SplitPiecePath(path, 1);
+  if (!second.empty() && NewFileIO(second)->exists()) {
+    if (std::unique_ptr<IFileIO> split = NewSplitFileIO(path))
+      return split;
+  }
+  return NewFileIO(path);
+}
+
+} // namespace nod
@@ -0,0 +1,124 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#if _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "nod/IFileIO.hpp"
+#include "Util.hpp"
+
+#include <spdlog/spdlog.h>
+
+namespace nod {
+
+/* Output that can only be written front to back, such as a pipe or stdout.
+ * All write streams share one cursor; beginning a stream past it zero-fills the skipped bytes. */
+class FileIOStream : public IFileIO {
+  struct Sink {
+    std::string m_path;
+    FILE* m_fp = nullptr;
+    bool m_owned = false;
+    uint64_t m_pos = 0;
+  };
+  std::unique_ptr<Sink> m_sink;
+  int64_t m_maxWriteSize;
+
+  bool open() const {
+    if (m_sink->m_fp)
+      return true;
+    if (m_sink->m_path == "-") {
+#if _WIN32
+      _setmode(_fileno(stdout), _O_BINARY);
+#endif
+      m_sink->m_fp = stdout;
+      return true;
+    }
+    m_sink->m_fp = Fopen(m_sink->m_path.c_str(), "wb");
+    if (!m_sink->m_fp) {
+      spdlog::error("unable to open '{}' for writing", m_sink->m_path);
+      return false;
+    }
+    m_sink->m_owned = true;
+    return true;
+  }
+
+public:
+  FileIOStream(std::string_view path, int64_t maxWriteSize)
+  : m_sink(std::make_unique<Sink>()), m_maxWriteSize(maxWriteSize) {
+    m_sink->m_path = path;
+  }
+  ~FileIOStream() override {
+    if (m_sink->m_fp && !finish())
+      spdlog::error("unable to finish writing '{}'", m_sink->m_path);
+  }
+
+  bool exists() override { return m_sink->m_fp != nullptr; }
+  uint64_t size() override { return m_sink->m_pos; }
+  bool isSequential() const override { return true; }
+
+  bool finish() override {
+    if (!m_sink->m_fp)
+      return true;
+    bool ok = m_sink->m_owned ? fclose(m_sink->m_fp) == 0 : fflush(m_sink->m_fp) == 0;
+    m_sink->m_fp = nullptr;
+    return ok;
+  }
+
+  struct WriteStream : public IFileIO::IWriteStream {
+    Sink& m_sink;
+    int64_t m_maxWriteSize;
+    WriteStream(Sink& sink, int64_t maxWriteSize) : m_sink(sink), m_maxWriteSize(maxWriteSize) {}
+    uint64_t write(const void* buf, uint64_t length) override {
+      if (m_maxWriteSize >= 0) {
+        if (m_sink.m_pos + length > uint64_t(m_maxWriteSize)) {
+          spdlog::error("write operation exceeds file's {}-byte limit", m_maxWriteSize);
+          return 0;
+        }
+      }
+      uint64_t ret = fwrite(buf, 1, length, m_sink.m_fp);
+      m_sink.m_pos += ret;
+      return ret;
+    }
+  };
+
+  std::unique_ptr<IWriteStream> beginWriteStream() const override {
+    if (!open())
+      return {};
+    return std::make_unique<WriteStream>(*m_sink, m_maxWriteSize);
+  }
+
+  std::unique_ptr<IWriteStream> beginWriteStream(uint64_t offset) const override {
+    if (!open())
+      return {};
+    if (offset < m_sink->m_pos) {
+      spdlog::error("unable to seek '{}' back to 0x{:X}; 0x{:X} bytes were already streamed", m_sink->m_path, offset,
+                    m_sink->m_pos);
+      return {};
+    }
+    auto ret = std::make_unique<WriteStream>(*m_sink, m_maxWriteSize);
+    static const uint8_t zeroBytes[0x8000] = {};
+    while (m_sink->m_pos < offset) {
+      uint64_t thisSz = nod::min(uint64_t(0x8000), offset - m_sink->m_pos);
+      if (ret->write(zeroBytes, thisSz) != thisSz) {
+        spdlog::error("unable to write to '{}'", m_sink->m_path);
+        return {};
+      }
+    }
+    return ret;
+  }
+
+  std::unique_ptr<IReadStream> beginReadStream() const override {
+    spdlog::error("streamed output '{}' cannot be read back", m_sink->m_path);
+    return {};
+  }
+
+  std::unique_ptr<IReadStream> beginReadStream(uint64_t offset) const override { return beginReadStream(); }
+};
+
+std::unique_ptr<IFileIO> NewStreamFileIO(std::string_view path, int64_t maxWriteSize) {
+  return std::make_unique<FileIOStream>(path, maxWriteSize);
+}
+
+} // namespace nod
@@ -108,6 +108,11 @@ public:
       WriteFile(fp, buf, length, &ret, nullptr);
       return ret;
     }
+    bool seek(uint64_t offset) override {
+      LARGE_INTEGER lioffset;
+      lioffset.QuadPart = offset;
+      return SetFilePointerEx(fp, lioffset, nullptr, FILE_BEGIN) != 0;
+    }
   };
   std::unique_ptr<IWriteStream> beginWriteStream() const override {
     bool err = false;
@@ -0,0 +1,121 @@
+#include "FilePrefetcher.hpp"
+
+#include "nod/IFileIO.hpp"
+#include "Util.hpp"
+
+namespace nod {
+
+FilePrefetcher::FilePrefetcher(std::vector<Request> files, size_t lookahead, size_t maxBufferedBytes)
+: m_requests(std::move(files))
+, m_states(new FileState[m_requests.size()])
+, m_lookahead(nod::max(lookahead, size_t(1)))
+, m_maxBufferedBytes(maxBufferedBytes) {
+  size_t threadCount = nod::min(m_lookahead, m_requests.size());
+  m_workers.reserve(threadCount);
+  for (size_t i = 0; i < threadCount; ++i)
+    m_workers.emplace_back(&FilePrefetcher::workerProc, this);
+}
+
+FilePrefetcher::~FilePrefetcher() {
+  {
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_quit = true;
+  }
+  m_workerCv.notify_all();
+  for (std::thread& worker : m_workers)
+    worker.join();
+}
+
+void FilePrefetcher::workerProc() {
+  while (true) {
+    size_t idx;
+    {
+      std::unique_lock<std::mutex> lk(m_lock);
+      m_workerCv.wait(lk, [this]() {
+        return m_quit || m_nextClaim >= m_requests.size() || m_nextClaim < m_consumerIdx + m_lookahead;
+      });
+      if (m_quit || m_nextClaim >= m_requests.size())
+        return;
+      idx = m_nextClaim++;
+    }
+    readFile(idx);
+  }
+}
+
+void FilePrefetcher::readFile(size_t idx) {
+  const Request& req = m_requests[idx];
+  FileState& state = m_states[idx];
+
+  std::unique_ptr<IFileIO::IReadStream> rs;
+  if (!req.m_path.empty())
+    rs = NewFileIO(req.m_path)->beginReadStream(req.m_offset);
+  if (!rs || req.m_path.empty()) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    state.m_error = !req.m_path.empty();
+    state.m_done = true;
+    m_consumerCv.notify_all();
+    return;
+  }
+
+  uint64_t rem = req.m_size;
+  while (rem) {
+    size_t thisSz = size_t(nod::min(uint64_t(ChunkSize), rem));
+
+    /* Reserve buffer space first; the file being consumed is never held back */
+    {
+      std::unique_lock<std::mutex> lk(m_lock);
+      m_workerCv.wait(lk, [&]() {
+        return m_quit || idx <= m_consumerIdx || m_bufferedBytes + thisSz <= m_maxBufferedBytes;
+      });
+      if (m_quit)
+        return;
+      m_bufferedBytes += thisSz;
+    }
+
+    std::vector<uint8_t> chunk(thisSz);
+    size_t rdSz = size_t(rs->read(chunk.data(), thisSz));
+    chunk.resize(rdSz);
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_bufferedBytes -= thisSz - rdSz;
+    if (rdSz)
+      state.m_chunks.push_back(std::move(chunk));
+    m_consumerCv.notify_all();
+    if (!rdSz)
+      break;
+    rem -= rdSz;
+  }
+
+  std::lock_guard<std::mutex> lk(m_lock);
+  state.m_done = true;
+  m_consumerCv.notify_all();
+}
+
+bool FilePrefetcher::readChunk(size_t idx, std::vector<uint8_t>& chunkOut) {
+  std::unique_lock<std::mutex> lk(m_lock);
+  if (idx != m_consumerIdx) {
+    /* Release anything left over from files the consumer has moved past */
+    for (size_t i = m_consumerIdx; i < idx; ++i) {
+      for (const std::vector<uint8_t>& chunk : m_states[i].m_chunks)
+        m_bufferedBytes -= chunk.size();
+      m_states[i].m_chunks.clear();
+    }
+    m_consumerIdx = idx;
+    m_workerCv.notify_all();
+  }
+
+  FileState& state = m_states[idx];
+  m_consumerCv.wait(lk, [&]() { return !state.m_chunks.empty() || state.m_done; });
+  if (!state.m_chunks.empty()) {
+    chunkOut = std::move(state.m_chunks.front());
+    state.m_chunks.pop_front();
+    m_bufferedBytes -= chunkOut.size();
+    m_workerCv.notify_all();
+    return true;
+  }
+
+  chunkOut.clear();
+  return !state.m_error;
+}
+
+} // namespace nod
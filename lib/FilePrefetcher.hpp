@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nod {
+
+/**
+ * @brief Reads a list of source files ahead of a single in-order consumer
+ *
+ * A small pool of reader threads opens and reads upcoming files into a bounded set of
+ * buffers while the consumer drains them strictly in list order. Entries with an empty
+ * path are placeholders for data the consumer sources elsewhere and are skipped by readers.
+ */
+class FilePrefetcher {
+public:
+  struct Request {
+    std::string m_path;
+    uint64_t m_offset;
+    uint64_t m_size;
+  };
+
+  FilePrefetcher(std::vector<Request> files, size_t lookahead = 8, size_t maxBufferedBytes = 64 * 1024 * 1024);
+  ~FilePrefetcher();
+  FilePrefetcher(const FilePrefetcher&) = delete;
+  FilePrefetcher& operator=(const FilePrefetcher&) = delete;
+
+  /* Blocks for the next chunk of file idx (files must be consumed in order).
+   * Returns false when the file could not be read; an empty chunk marks end-of-file. */
+  bool readChunk(size_t idx, std::vector<uint8_t>& chunkOut);
+
+private:
+  static constexpr size_t ChunkSize = 1024 * 1024;
+
+  struct FileState {
+    std::deque<std::vector<uint8_t>> m_chunks;
+    bool m_done = false;
+    bool m_error = false;
+  };
+
+  void workerProc();
+  void readFile(size_t idx);
+
+  std::vector<Request> m_requests;
+  std::unique_ptr<FileState[]> m_states;
+  size_t m_lookahead;
+  size_t m_maxBufferedBytes;
+
+  std::mutex m_lock;
+  std::condition_variable m_workerCv;
+  std::condition_variable m_consumerCv;
+  size_t m_nextClaim = 0;
+  size_t m_consumerIdx = 0;
+  size_t m_bufferedBytes = 0;
+  bool m_quit = false;
+  std::vector<std::thread> m_workers;
+};
+
+} // namespace nod
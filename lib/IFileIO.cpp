@@ -1,8 +1,24 @@
+#include <cstring>
+
 #include "nod/IFileIO.hpp"
 #include "Util.hpp"
 #include <spdlog/spdlog.h>
 
 namespace nod {
+bool IFileIO::IWriteStream::skipUnused(uint64_t length, uint8_t fillByte) {
+  uint8_t buf[0x8000];
+  memset(buf, fillByte, nod::min(uint64_t(sizeof(buf)), length));
+  while (length) {
+    uint64_t thisSz = nod::min(uint64_t(sizeof(buf)), length);
+    if (write(buf, thisSz) != thisSz) {
+      spdlog::error("unable to write in file");
+      return false;
+    }
+    length -= thisSz;
+  }
+  return true;
+}
+
 uint64_t IFileIO::IWriteStream::copyFromDisc(IPartReadStream& discio, uint64_t length) {
   uint64_t read = 0;
   uint8_t buf[0x7c00];
@@ -0,0 +1,199 @@
+#include "nod/PatchEngine.hpp"
+#include "nod/IFileIO.hpp"
+#include "Util.hpp"
+
+#include <algorithm>
+#include <deque>
+
+#include <spdlog/spdlog.h>
+
+namespace nod {
+
+PatchEngine::PatchEngine() {
+  /* Patches out pesky #001 integrity check performed by game's OSInit.
+   * This is required for multi-DOL games, but doesn't harm functionality otherwise */
+  static const uint8_t Sig001[] = {0x3C, 0x03, 0xF8, 0x00, 0x28, 0x00, 0x00, 0x00, 0x40, 0x82, 0x00, 0x0C, 0x38,
+                                   0x60, 0x00, 0x01, 0x48, 0x00, 0x02, 0x44, 0x38, 0x61, 0x00, 0x18, 0x48};
+  Rule rule;
+  rule.m_name = "#001";
+  rule.m_signature.assign(std::begin(Sig001), std::end(Sig001));
+  rule.m_replacement.assign(sizeof(Sig001), -1);
+  rule.m_replacement[11] = 0x04;
+  addRule(std::move(rule));
+}
+
+bool PatchEngine::addRule(Rule rule) {
+  if (rule.m_signature.empty() || rule.m_replacement.size() != rule.m_signature.size()) {
+    spdlog::error("patch rule '{}' needs a non-empty signature and a replacement of the same length", rule.m_name);
+    return false;
+  }
+  m_rules.push_back(std::move(rule));
+  compile();
+  return true;
+}
+
+void PatchEngine::clearRules() {
+  m_rules.clear();
+  compile();
+}
+
+static int HexNibble(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Two hex digits per byte; "??" becomes -1 where wildcards are allowed */
+static bool ParseHexBytes(std::string_view str, bool allowWildcard, std::vector<int16_t>& out) {
+  if (str.size() % 2)
+    return false;
+  out.clear();
+  for (size_t i = 0; i < str.size(); i += 2) {
+    if (allowWildcard && str[i] == '?' && str[i + 1] == '?') {
+      out.push_back(-1);
+      continue;
+    }
+    int hi = HexNibble(str[i]);
+    int lo = HexNibble(str[i + 1]);
+    if (hi < 0 || lo < 0)
+      return false;
+    out.push_back(int16_t(hi << 4 | lo));
+  }
+  return true;
+}
+
+bool PatchEngine::loadRules(std::string_view path) {
+  std::unique_ptr<IFileIO> fio = NewFileIO(path);
+  std::unique_ptr<IFileIO::IReadStream> rs = fio->beginReadStream();
+  if (!rs)
+    return false;
+  uint64_t sz = fio->size();
+  std::string text(sz, '\0');
+  text.resize(rs->read(text.data(), sz));
+
+  size_t lineBegin = 0;
+  size_t lineNo = 0;
+  while (lineBegin < text.size()) {
+    size_t lineEnd = text.find('\n', lineBegin);
+    if (lineEnd == std::string::npos)
+      lineEnd = text.size();
+    std::string_view line(text.data() + lineBegin, lineEnd - lineBegin);
+    lineBegin = lineEnd + 1;
+    ++lineNo;
+
+    size_t comment = line.find('#');
+    if (comment != std::string_view::npos)
+      line = line.substr(0, comment);
+
+    std::vector<std::string_view> fields;
+    size_t pos = 0;
+    while (pos < line.size()) {
+      size_t tokBegin = line.find_first_not_of(" \t\r", pos);
+      if (tokBegin == std::string_view::npos)
+        break;
+      size_t tokEnd = line.find_first_of(" \t\r", tokBegin);
+      if (tokEnd == std::string_view::npos)
+        tokEnd = line.size();
+      fields.push_back(line.substr(tokBegin, tokEnd - tokBegin));
+      pos = tokEnd;
+    }
+    if (fields.empty())
+      continue;
+
+    Rule rule;
+    std::vector<int16_t> sig;
+    if (fields.size() != 3 || !ParseHexBytes(fields[1], false, sig) ||
+        !ParseHexBytes(fields[2], true, rule.m_replacement)) {
+      spdlog::error("{}:{}: expected '<name> <signature-hex> <replacement-hex>'", path, lineNo);
+      return false;
+    }
+    rule.m_name = fields[0];
+    rule.m_signature.assign(sig.begin(), sig.end());
+    if (!addRule(std::move(rule)))
+      return false;
+  }
+  return true;
+}
+
+void PatchEngine::compile() {
+  m_maxLength = 0;
+  m_next.assign(1, {});
+  m_outputs.assign(1, {});
+
+  /* Trie of all signatures; 0 doubles as "no edge" since nothing links back to the root */
+  for (uint32_t r = 0; r < m_rules.size(); ++r) {
+    const std::vector<uint8_t>& sig = m_rules[r].m_signature;
+    m_maxLength = nod::max(m_maxLength, sig.size());
+    int32_t state = 0;
+    for (uint8_t b : sig) {
+      if (!m_next[state][b]) {
+        m_next[state][b] = int32_t(m_next.size());
+        m_next.emplace_back();
+        m_outputs.emplace_back();
+      }
+      state = m_next[state][b];
+    }
+    m_outputs[state].push_back(r);
+  }
+
+  /* Breadth-first failure links, folded into the transition table so scanning is one lookup per byte */
+  std::vector<int32_t> fail(m_next.size(), 0);
+  std::deque<int32_t> queue;
+  for (int32_t& child : m_next[0])
+    if (child)
+      queue.push_back(child);
+  while (!queue.empty()) {
+    int32_t state = queue.front();
+    queue.pop_front();
+    std::vector<uint32_t>& outs = m_outputs[state];
+    const std::vector<uint32_t>& inherited = m_outputs[fail[state]];
+    outs.insert(outs.end(), inherited.begin(), inherited.end());
+    std::sort(outs.begin(), outs.end());
+    for (int b = 0; b < 256; ++b) {
+      int32_t& child = m_next[state][b];
+      if (child) {
+        fail[child] = m_next[fail[state]][b];
+        queue.push_back(child);
+      } else {
+        child = m_next[fail[state]][b];
+      }
+    }
+  }
+}
+
+void PatchEngine::Scanner::feed(const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+  const size_t base = m_pending.size();
+  m_pending.insert(m_pending.end(), data, data + len);
+  for (size_t i = 0; i < len; ++i) {
+    m_state = m_engine.m_next[m_state][data[i]];
+    for (uint32_t r : m_engine.m_outputs[m_state]) {
+      /* The held-back context guarantees the whole match is still pending */
+      const Rule& rule = m_engine.m_rules[r];
+      uint8_t* dst = m_pending.data() + base + i + 1 - rule.m_signature.size();
+      for (size_t j = 0; j < rule.m_replacement.size(); ++j)
+        if (rule.m_replacement[j] >= 0)
+          dst[j] = uint8_t(rule.m_replacement[j]);
+      ++m_patchCount;
+    }
+  }
+
+  const size_t emitSz = m_pending.size() - nod::min(m_pending.size(), m_engine.getContextSize());
+  m_outOffset = m_pendingOffset;
+  out.assign(m_pending.begin(), m_pending.begin() + emitSz);
+  m_pending.erase(m_pending.begin(), m_pending.begin() + emitSz);
+  m_pendingOffset += emitSz;
+}
+
+void PatchEngine::Scanner::finish(std::vector<uint8_t>& out) {
+  m_outOffset = m_pendingOffset;
+  out.swap(m_pending);
+  m_pending.clear();
+  m_pendingOffset += out.size();
+  m_state = 0;
+}
+
+} // namespace nod
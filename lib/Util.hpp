@@ -121,6 +121,15 @@ static inline int64_t FTell(FILE* fp) {
 #endif
 }
 
+static inline int Unlink(const char* path) {
+#if _WIN32
+  const nowide::wstackstring wpath(path);
+  return _wunlink(wpath.get());
+#else
+  return unlink(path);
+#endif
+}
+
 bool CheckFreeSpace(const char* path, size_t reqSz);
 
 } // namespace nod
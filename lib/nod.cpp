@@ -10,8 +10,12 @@
 
 namespace nod {
 std::unique_ptr<IDiscIO> NewDiscIOISO(std::string_view path);
+std::unique_ptr<IDiscIO> NewDiscIOCISO(std::string_view path);
+std::unique_ptr<IDiscIO> NewDiscIOGCZ(std::string_view path);
 std::unique_ptr<IDiscIO> NewDiscIOWBFS(std::string_view path);
 std::unique_ptr<IDiscIO> NewDiscIONFS(std::string_view path);
+std::unique_ptr<IDiscIO> NewDiscIOWIA(std::string_view path);
+std::unique_ptr<IDiscIO> NewDiscIOStore(std::string_view manifestPath);
 
 std::unique_ptr<DiscBase> OpenDiscFromImage(std::string_view path, bool& isWii) {
   /* Temporary file handle to determine image type */
@@ -38,6 +42,28 @@ std::unique_ptr<DiscBase> OpenDiscFromImage(std::string_view path, bool& isWii)
   if (magic == nod::SBig((uint32_t)'WBFS')) {
     discIO = NewDiscIOWBFS(path);
     isWii = true;
+  } else if (magic == nod::SBig((uint32_t)'CISO') || magic == nod::SBig((uint32_t)'WIA\x01') ||
+             magic == nod::SBig((uint32_t)'RVZ\x01') || magic == nod::SLittle(uint32_t(0xB10BC001)) ||
+             magic == nod::SBig((uint32_t)'NODM')) {
+    /* Container formats carry the disc header; check it through the container */
+    if (magic == nod::SBig((uint32_t)'CISO'))
+      discIO = NewDiscIOCISO(path);
+    else if (magic == nod::SLittle(uint32_t(0xB10BC001)))
+      discIO = NewDiscIOGCZ(path);
+    else if (magic == nod::SBig((uint32_t)'NODM'))
+      discIO = NewDiscIOStore(path);
+    else
+      discIO = NewDiscIOWIA(path);
+    if (discIO) {
+      uint32_t discMagic[2] = {};
+      std::unique_ptr<IReadStream> drs = discIO->beginReadStream(0x18);
+      if (!drs || drs->read(discMagic, 8) != 8)
+        discIO.reset();
+      else if (nod::SBig(discMagic[0]) == 0x5D1C9EA3)
+        isWii = true;
+      else if (nod::SBig(discMagic[1]) != 0xC2339F3D)
+        discIO.reset();
+    }
   } else if (path.size() > 4 && dotPos != -1 && dotPos > slashPos &&
              !path.compare(slashPos + 1, 4, "hif_") &&
              !path.compare(dotPos, path.size() - dotPos, ".nfs")) {